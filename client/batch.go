@@ -0,0 +1,186 @@
+package main
+
+import (
+	"encoding/json"
+	"net/http"
+	"net/url"
+	"regexp"
+	"strings"
+	"sync"
+	"time"
+)
+
+// Per-id lookups are batched onto the server's multi-id form: ids of one
+// collection requested within the batch window wait together, and once at
+// least batchMin distinct ids are waiting they are answered from
+// GET /api/<collection>?ids=a,b,c (at most maxBatchIDs per call). Fewer ids
+// each go upstream on their own, as do ids the answer leaves out.
+//
+// Only the server's own per-id forms are batched: /api/patients/<id>, and
+// ?id=<id> on any of the four collections.
+
+const maxBatchIDs = 100
+
+var (
+	patientPath    = regexp.MustCompile(`^/api/patients/([0-9]+)$`)
+	collectionPath = regexp.MustCompile(`^/api/(patients|doctors|appointments|medicalrecords)$`)
+	numericID      = regexp.MustCompile(`^[1-9][0-9]{0,8}$`)
+)
+
+// Whether a request is a plain JSON lookup by id
+func batchable(r *http.Request) (collection, id string, ok bool) {
+	switch r.Header.Get("Accept") {
+	case "", "*/*", "application/json":
+	default:
+		return "", "", false
+	}
+	if match := patientPath.FindStringSubmatch(r.URL.Path); match != nil && r.URL.RawQuery == "" {
+		return "patients", match[1], numericID.MatchString(match[1])
+	}
+	match := collectionPath.FindStringSubmatch(r.URL.Path)
+	if match == nil {
+		return "", "", false
+	}
+	query, err := url.ParseQuery(r.URL.RawQuery)
+	if err != nil || len(query) != 1 || len(query["id"]) != 1 || !numericID.MatchString(query.Get("id")) {
+		return "", "", false
+	}
+	return match[1], query.Get("id"), true
+}
+
+// Single-row URL of an id, in a form the server routes
+func itemURL(collection, id string) string {
+	if collection == "patients" {
+		return "/api/patients/" + id
+	}
+	return "/api/" + collection + "?id=" + id
+}
+
+type batchResult struct {
+	resp *cachedResponse
+	err  error
+}
+
+// Lookups of one collection for one origin; CORS headers differ by origin
+type batchKey struct {
+	collection string
+	origin     string
+}
+
+type pendingBatch struct {
+	waiters map[string][]chan batchResult
+}
+
+type batcher struct {
+	g       *gateway
+	window  time.Duration
+	min     int
+	mu      sync.Mutex
+	pending map[batchKey]*pendingBatch
+}
+
+func newBatcher(g *gateway, window time.Duration, min int) *batcher {
+	return &batcher{g: g, window: window, min: min, pending: make(map[batchKey]*pendingBatch)}
+}
+
+func (b *batcher) lookup(collection, id string, r *http.Request) (*cachedResponse, error) {
+	key := batchKey{collection: collection, origin: r.Header.Get("Origin")}
+	result := make(chan batchResult, 1)
+
+	b.mu.Lock()
+	batch := b.pending[key]
+	if batch == nil {
+		batch = &pendingBatch{waiters: make(map[string][]chan batchResult)}
+		b.pending[key] = batch
+		time.AfterFunc(b.window, func() { b.flush(key) })
+	}
+	batch.waiters[id] = append(batch.waiters[id], result)
+	b.mu.Unlock()
+
+	res := <-result
+	return res.resp, res.err
+}
+
+func (b *batcher) flush(key batchKey) {
+	b.mu.Lock()
+	batch := b.pending[key]
+	delete(b.pending, key)
+	b.mu.Unlock()
+
+	ids := make([]string, 0, len(batch.waiters))
+	for id := range batch.waiters {
+		ids = append(ids, id)
+	}
+	rows := map[string][]byte{}
+	var rowHeader http.Header
+	if len(ids) >= b.min {
+		for start := 0; start < len(ids); start += maxBatchIDs {
+			end := start + maxBatchIDs
+			if end > len(ids) {
+				end = len(ids)
+			}
+			if header := b.fetchRows(key, ids[start:end], rows); header != nil {
+				rowHeader = header
+			}
+		}
+	}
+	for id, waiters := range batch.waiters {
+		id, waiters := id, waiters
+		if row, ok := rows[id]; ok {
+			b.g.stats.batchedIDs.Add(1)
+			resp := &cachedResponse{status: http.StatusOK, header: rowHeader.Clone(), body: row}
+			setValidator(resp)
+			deliver(waiters, resp, nil)
+			continue
+		}
+		// Not batched, the batch call failed, or the id has no row (the
+		// server answers a single unknown id with {})
+		go func() {
+			header := http.Header{}
+			header.Set("Origin", key.origin)
+			resp, err := b.g.fetch(http.MethodGet, itemURL(key.collection, id), header)
+			deliver(waiters, resp, err)
+		}()
+	}
+}
+
+// Fetches the rows of ids as JSON with one ?ids= call and adds them to rows
+// by id. Returns the headers for row responses, nil if the call failed.
+func (b *batcher) fetchRows(key batchKey, ids []string, rows map[string][]byte) http.Header {
+	header := http.Header{}
+	header.Set("Accept", "application/json")
+	header.Set("Origin", key.origin)
+	list, err := b.g.fetch(http.MethodGet, "/api/"+key.collection+"?ids="+strings.Join(ids, ","), header)
+	if err != nil || list.status != http.StatusOK {
+		return nil
+	}
+	var items []json.RawMessage
+	if json.Unmarshal(list.body, &items) != nil {
+		return nil
+	}
+	b.g.stats.batchCalls.Add(1)
+	for _, item := range items {
+		var row struct {
+			ID json.Number `json:"id"`
+		}
+		if json.Unmarshal(item, &row) == nil && row.ID != "" {
+			rows[row.ID.String()] = item
+		}
+	}
+	// Row responses carry the batch answer's CORS and content headers, not its validator
+	list.header.Del("ETag")
+	list.header.Del("Content-Encoding")
+	return list.header
+}
+
+func deliver(waiters []chan batchResult, resp *cachedResponse, err error) {
+	for i, waiter := range waiters {
+		// Each waiter is its own flight and sets its own cache key
+		own := resp
+		if resp != nil && i > 0 {
+			clone := *resp
+			own = &clone
+		}
+		waiter <- batchResult{resp: own, err: err}
+	}
+}
@@ -0,0 +1,195 @@
+// gateway_load
+// Upstream load with and without the gateway. The same read workload, shaped
+// like the web client (patient list, lookups of a few hot patients and
+// doctors, appointment list), runs first straight against the C server and
+// then through a client started with HEALTH_GATEWAY_UPSTREAM. Upstream
+// requests come from the gateway's /gateway/stats; server executions are the
+// "read" pool admissions in the server's /admin/admission, which also covers
+// the server's own coalescing.
+//
+// Usage: go run ./bench/gateway_load [server_url] [gateway_url] [clients] [requests_per_client] [hot_ids]
+// Prints one "key value" per line for each pass and the reductions. Every
+// request must get a 200; any failure in either pass makes the run exit 1,
+// since the comparison is only meaningful when both passes served the same
+// answers.
+package main
+
+import (
+	"encoding/json"
+	"fmt"
+	"io"
+	"math/rand"
+	"net/http"
+	"os"
+	"sort"
+	"strconv"
+	"sync"
+	"time"
+)
+
+type pass struct {
+	requests   int
+	failed     int
+	upstream   uint64
+	executions uint64
+	latencies  []time.Duration
+	elapsed    time.Duration
+}
+
+func argInt(index int, fallback int) int {
+	if len(os.Args) > index {
+		if value, err := strconv.Atoi(os.Args[index]); err == nil {
+			return value
+		}
+	}
+	return fallback
+}
+
+func argString(index int, fallback string) string {
+	if len(os.Args) > index {
+		return os.Args[index]
+	}
+	return fallback
+}
+
+func getJSON(client *http.Client, url string, into interface{}) error {
+	resp, err := client.Get(url)
+	if err != nil {
+		return err
+	}
+	defer resp.Body.Close()
+	return json.NewDecoder(resp.Body).Decode(into)
+}
+
+func readExecutions(client *http.Client, server string) uint64 {
+	var stats struct {
+		Read struct {
+			Admitted uint64 `json:"admitted"`
+		} `json:"read"`
+	}
+	if getJSON(client, server+"/admin/admission", &stats) != nil {
+		return 0
+	}
+	return stats.Read.Admitted
+}
+
+func readUpstream(client *http.Client, gateway string) uint64 {
+	var stats struct {
+		Upstream uint64 `json:"upstream_requests"`
+	}
+	if getJSON(client, gateway+"/gateway/stats", &stats) != nil {
+		return 0
+	}
+	return stats.Upstream
+}
+
+func workload(rng *rand.Rand, hotIDs int) string {
+	switch n := rng.Intn(10); {
+	case n < 2:
+		return "/api/patients"
+	case n < 3:
+		return "/api/appointments"
+	case n < 7:
+		return fmt.Sprintf("/api/patients/%d", 1+rng.Intn(hotIDs))
+	default:
+		return fmt.Sprintf("/api/doctors?id=%d", 1+rng.Intn(hotIDs))
+	}
+}
+
+func run(base, server, gateway string, clients, perClient, hotIDs int) pass {
+	statsClient := &http.Client{Timeout: 10 * time.Second}
+	executionsBefore := readExecutions(statsClient, server)
+	var upstreamBefore uint64
+	if gateway != "" {
+		upstreamBefore = readUpstream(statsClient, gateway)
+	}
+
+	var mu sync.Mutex
+	var wg sync.WaitGroup
+	result := pass{}
+	start := time.Now()
+	for c := 0; c < clients; c++ {
+		wg.Add(1)
+		go func(seed int64) {
+			defer wg.Done()
+			// One keep-alive connection per simulated browser
+			client := &http.Client{Timeout: 30 * time.Second, Transport: &http.Transport{MaxIdleConnsPerHost: 1}}
+			rng := rand.New(rand.NewSource(seed))
+			latencies := make([]time.Duration, 0, perClient)
+			failed := 0
+			for i := 0; i < perClient; i++ {
+				begin := time.Now()
+				resp, err := client.Get(base + workload(rng, hotIDs))
+				if err != nil {
+					failed++
+					continue
+				}
+				io.Copy(io.Discard, resp.Body)
+				resp.Body.Close()
+				if resp.StatusCode != http.StatusOK {
+					failed++
+				}
+				latencies = append(latencies, time.Since(begin))
+			}
+			mu.Lock()
+			result.requests += perClient
+			result.failed += failed
+			result.latencies = append(result.latencies, latencies...)
+			mu.Unlock()
+		}(int64(c))
+	}
+	wg.Wait()
+	result.elapsed = time.Since(start)
+
+	result.executions = readExecutions(statsClient, server) - executionsBefore
+	if gateway != "" {
+		result.upstream = readUpstream(statsClient, gateway) - upstreamBefore
+	} else {
+		result.upstream = uint64(result.requests)
+	}
+	return result
+}
+
+func percentile(sorted []time.Duration, p float64) float64 {
+	if len(sorted) == 0 {
+		return 0
+	}
+	return float64(sorted[int(p*float64(len(sorted)-1))].Microseconds()) / 1000
+}
+
+func report(name string, p pass) {
+	sort.Slice(p.latencies, func(i, j int) bool { return p.latencies[i] < p.latencies[j] })
+	fmt.Printf("%s_requests %d\n", name, p.requests)
+	fmt.Printf("%s_failed %d\n", name, p.failed)
+	fmt.Printf("%s_upstream_requests %d\n", name, p.upstream)
+	fmt.Printf("%s_server_executions %d\n", name, p.executions)
+	fmt.Printf("%s_requests_per_second %.0f\n", name, float64(p.requests)/p.elapsed.Seconds())
+	fmt.Printf("%s_p50_ms %.3f\n", name, percentile(p.latencies, 0.50))
+	fmt.Printf("%s_p99_ms %.3f\n", name, percentile(p.latencies, 0.99))
+}
+
+func reduction(direct, gateway uint64) float64 {
+	if direct == 0 {
+		return 0
+	}
+	return 100 * (1 - float64(gateway)/float64(direct))
+}
+
+func main() {
+	server := argString(1, "http://localhost:8080")
+	gateway := argString(2, "http://localhost:8081")
+	clients := argInt(3, 32)
+	perClient := argInt(4, 500)
+	hotIDs := argInt(5, 20)
+
+	direct := run(server, server, "", clients, perClient, hotIDs)
+	report("direct", direct)
+	viaGateway := run(gateway, server, gateway, clients, perClient, hotIDs)
+	report("gateway", viaGateway)
+	fmt.Printf("upstream_reduction_percent %.1f\n", reduction(direct.upstream, viaGateway.upstream))
+	fmt.Printf("server_execution_reduction_percent %.1f\n", reduction(direct.executions, viaGateway.executions))
+	if direct.failed > 0 || viaGateway.failed > 0 {
+		fmt.Fprintf(os.Stderr, "%d direct and %d gateway requests did not get a 200\n", direct.failed, viaGateway.failed)
+		os.Exit(1)
+	}
+}
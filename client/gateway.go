@@ -0,0 +1,532 @@
+package main
+
+import (
+	"bufio"
+	"container/list"
+	"encoding/json"
+	"fmt"
+	"hash/fnv"
+	"io"
+	"log"
+	"net"
+	"net/http"
+	"net/http/httputil"
+	"net/url"
+	"os"
+	"strconv"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// Gateway mode: /api is reverse-proxied to the C server over a pooled set of
+// keep-alive connections. GET responses are cached until the server's change
+// feed (/api/changes) reports a write to a table they depend on, identical
+// in-flight GETs share one upstream request, and per-id lookups that arrive
+// together are answered from one ?ids= request (batch.go).
+
+// Settings come from HEALTH_GATEWAY_* variables, like the server's HEALTH_*
+type gatewayConfig struct {
+	upstream    *url.URL
+	maxConns    int
+	cacheBytes  int64
+	cacheTTL    time.Duration
+	batchWindow time.Duration
+	batchMin    int
+}
+
+func envInt(name string, fallback int) int {
+	value := os.Getenv(name)
+	if value == "" {
+		return fallback
+	}
+	parsed, err := strconv.Atoi(value)
+	if err != nil {
+		log.Printf("Ignoring invalid value for %s: '%s'", name, value)
+		return fallback
+	}
+	return parsed
+}
+
+func loadGatewayConfig(upstream string) (gatewayConfig, error) {
+	parsed, err := url.Parse(upstream)
+	if err != nil || parsed.Scheme == "" || parsed.Host == "" {
+		return gatewayConfig{}, fmt.Errorf("invalid HEALTH_GATEWAY_UPSTREAM '%s'", upstream)
+	}
+	return gatewayConfig{
+		upstream:    parsed,
+		maxConns:    envInt("HEALTH_GATEWAY_MAX_CONNS", 32),
+		cacheBytes:  int64(envInt("HEALTH_GATEWAY_CACHE_MB", 64)) << 20,
+		cacheTTL:    time.Duration(envInt("HEALTH_GATEWAY_CACHE_TTL_MS", 60000)) * time.Millisecond,
+		batchWindow: time.Duration(envInt("HEALTH_GATEWAY_BATCH_WINDOW_MS", 2)) * time.Millisecond,
+		batchMin:    envInt("HEALTH_GATEWAY_BATCH_MIN", 2),
+	}, nil
+}
+
+// Tables a response depends on, as a bit set in change-feed order
+type tableSet uint8
+
+const (
+	tablePatients tableSet = 1 << iota
+	tableDoctors
+	tableAppointments
+	tableMedicalRecords
+
+	allTables = tablePatients | tableDoctors | tableAppointments | tableMedicalRecords
+)
+
+var feedTables = map[string]tableSet{
+	"Patients":       tablePatients,
+	"Doctors":        tableDoctors,
+	"Appointments":   tableAppointments,
+	"MedicalRecords": tableMedicalRecords,
+}
+
+var collectionTables = map[string]tableSet{
+	"patients":       tablePatients,
+	"doctors":        tableDoctors,
+	"appointments":   tableAppointments,
+	"medicalrecords": tableMedicalRecords,
+}
+
+// Maps /api/<collection>[/<id>] to its table; anything else (summaries,
+// stats) depends on every table
+func tablesForPath(path string) tableSet {
+	parts := strings.Split(strings.Trim(strings.TrimPrefix(path, "/api"), "/"), "/")
+	if tables, ok := collectionTables[parts[0]]; ok && len(parts) <= 2 {
+		return tables
+	}
+	return allTables
+}
+
+type cachedResponse struct {
+	key    string
+	status int
+	header http.Header
+	body   []byte
+	etag   string
+	tables tableSet
+	stored time.Time
+	elem   *list.Element
+}
+
+func (e *cachedResponse) size() int64 {
+	return int64(len(e.key) + len(e.body) + 256)
+}
+
+// LRU of responses bounded by bytes. Each table has a generation that a
+// change bumps; a response is only stored if the generations of its tables
+// did not move while it was fetched, so a fetch that raced a write is not kept.
+type responseCache struct {
+	mu          sync.Mutex
+	entries     map[string]*cachedResponse
+	lru         *list.List
+	bytes       int64
+	maxBytes    int64
+	ttl         time.Duration
+	generations [4]uint64
+}
+
+func newResponseCache(maxBytes int64, ttl time.Duration) *responseCache {
+	return &responseCache{entries: make(map[string]*cachedResponse), lru: list.New(), maxBytes: maxBytes, ttl: ttl}
+}
+
+func (c *responseCache) generation(tables tableSet) uint64 {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	var sum uint64
+	for i := range c.generations {
+		if tables&(1<<i) != 0 {
+			sum += c.generations[i]
+		}
+	}
+	return sum
+}
+
+func (c *responseCache) get(key string) *cachedResponse {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	e := c.entries[key]
+	if e == nil {
+		return nil
+	}
+	if c.ttl > 0 && time.Since(e.stored) > c.ttl {
+		c.removeLocked(e)
+		return nil
+	}
+	c.lru.MoveToFront(e.elem)
+	return e
+}
+
+func (c *responseCache) put(e *cachedResponse, generation uint64) {
+	if c.maxBytes <= 0 || e.size() > c.maxBytes/8 {
+		return
+	}
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	var sum uint64
+	for i := range c.generations {
+		if e.tables&(1<<i) != 0 {
+			sum += c.generations[i]
+		}
+	}
+	if sum != generation {
+		return
+	}
+	if old := c.entries[e.key]; old != nil {
+		c.removeLocked(old)
+	}
+	e.stored = time.Now()
+	e.elem = c.lru.PushFront(e)
+	c.entries[e.key] = e
+	c.bytes += e.size()
+	for c.bytes > c.maxBytes {
+		c.removeLocked(c.lru.Back().Value.(*cachedResponse))
+	}
+}
+
+func (c *responseCache) removeLocked(e *cachedResponse) {
+	c.lru.Remove(e.elem)
+	delete(c.entries, e.key)
+	c.bytes -= e.size()
+}
+
+// Drops every response depending on one of the tables
+func (c *responseCache) invalidate(tables tableSet) {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	for i := range c.generations {
+		if tables&(1<<i) != 0 {
+			c.generations[i]++
+		}
+	}
+	for _, e := range c.entries {
+		if e.tables&tables != 0 {
+			c.removeLocked(e)
+		}
+	}
+}
+
+func (c *responseCache) usage() (entries int, bytes int64) {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	return len(c.entries), c.bytes
+}
+
+// One upstream request shared by every identical request that arrives
+// while it runs
+type flight struct {
+	done chan struct{}
+	resp *cachedResponse
+	err  error
+}
+
+type flightGroup struct {
+	mu      sync.Mutex
+	flights map[string]*flight
+}
+
+func (g *flightGroup) do(key string, fetch func() (*cachedResponse, error)) (*cachedResponse, bool, error) {
+	g.mu.Lock()
+	if f, ok := g.flights[key]; ok {
+		g.mu.Unlock()
+		<-f.done
+		return f.resp, true, f.err
+	}
+	f := &flight{done: make(chan struct{})}
+	g.flights[key] = f
+	g.mu.Unlock()
+
+	f.resp, f.err = fetch()
+
+	g.mu.Lock()
+	delete(g.flights, key)
+	g.mu.Unlock()
+	close(f.done)
+	return f.resp, false, f.err
+}
+
+type gatewayStats struct {
+	requests      atomic.Uint64
+	upstream      atomic.Uint64
+	hits          atomic.Uint64
+	misses        atomic.Uint64
+	notModified   atomic.Uint64
+	coalesced     atomic.Uint64
+	batchCalls    atomic.Uint64
+	batchedIDs    atomic.Uint64
+	invalidations atomic.Uint64
+}
+
+type gateway struct {
+	config        gatewayConfig
+	client        *http.Client
+	proxy         *httputil.ReverseProxy
+	cache         *responseCache
+	flights       flightGroup
+	batcher       *batcher
+	feedConnected atomic.Bool
+	stats         gatewayStats
+}
+
+// Headers that pick the representation; forwarded and part of the cache key
+var representationHeaders = []string{"Accept", "Accept-Encoding", "Origin"}
+
+// Connection-level headers that must not be copied between hops
+var hopHeaders = []string{"Connection", "Keep-Alive", "Proxy-Connection", "Te", "Trailer", "Transfer-Encoding", "Upgrade", "Content-Length"}
+
+func newGateway(config gatewayConfig) *gateway {
+	transport := &http.Transport{
+		Proxy:               nil,
+		DialContext:         (&net.Dialer{Timeout: 5 * time.Second, KeepAlive: 30 * time.Second}).DialContext,
+		MaxConnsPerHost:     config.maxConns,
+		MaxIdleConns:        config.maxConns,
+		MaxIdleConnsPerHost: config.maxConns,
+		IdleConnTimeout:     90 * time.Second,
+		ForceAttemptHTTP2:   true,
+		// Compressed bodies are cached and relayed as they are
+		DisableCompression: true,
+	}
+	g := &gateway{
+		config: config,
+		client: &http.Client{Transport: transport, Timeout: 30 * time.Second},
+		cache:  newResponseCache(config.cacheBytes, config.cacheTTL),
+	}
+	g.flights.flights = make(map[string]*flight)
+	if config.batchMin > 0 {
+		g.batcher = newBatcher(g, config.batchWindow, config.batchMin)
+	}
+	g.proxy = httputil.NewSingleHostReverseProxy(config.upstream)
+	g.proxy.Transport = transport
+	g.proxy.FlushInterval = -1 // Change-feed events go out as they arrive
+	return g
+}
+
+func (g *gateway) start() {
+	go g.followChanges()
+}
+
+func (g *gateway) ServeHTTP(w http.ResponseWriter, r *http.Request) {
+	g.stats.requests.Add(1)
+	if (r.Method != http.MethodGet && r.Method != http.MethodHead) || r.URL.Path == "/api/changes" {
+		g.stats.upstream.Add(1)
+		if r.URL.Path == "/api/changes" {
+			// The server redirects to its feed port on the Host it was asked
+			// for, which has to be its own rather than the gateway's
+			r.Host = g.config.upstream.Host
+		}
+		g.proxy.ServeHTTP(w, r)
+		if r.Method != http.MethodGet && r.Method != http.MethodHead && r.Method != http.MethodOptions {
+			// Read-your-writes through the gateway, ahead of the change feed
+			g.invalidate(tablesForPath(r.URL.Path))
+		}
+		return
+	}
+
+	key := cacheKey(r)
+	if g.feedConnected.Load() {
+		if e := g.cache.get(key); e != nil {
+			g.stats.hits.Add(1)
+			g.writeResponse(w, r, e, "HIT")
+			return
+		}
+	}
+	g.stats.misses.Add(1)
+
+	tables := tablesForPath(r.URL.Path)
+	resp, shared, err := g.flights.do(key, func() (*cachedResponse, error) {
+		generation := g.cache.generation(tables)
+		var e *cachedResponse
+		var err error
+		if collection, id, ok := batchable(r); ok && g.batcher != nil {
+			e, err = g.batcher.lookup(collection, id, r)
+		} else {
+			e, err = g.fetch(http.MethodGet, r.URL.RequestURI(), r.Header)
+		}
+		if err != nil {
+			return nil, err
+		}
+		e.key = key
+		e.tables = tables
+		if e.status == http.StatusOK && g.feedConnected.Load() {
+			g.cache.put(e, generation)
+		}
+		return e, nil
+	})
+	if err != nil {
+		log.Printf("Gateway: %s %s: %v", r.Method, r.URL.RequestURI(), err)
+		http.Error(w, `{"error": "Bad Gateway"}`, http.StatusBadGateway)
+		return
+	}
+	if shared {
+		g.stats.coalesced.Add(1)
+		g.writeResponse(w, r, resp, "SHARED")
+		return
+	}
+	g.writeResponse(w, r, resp, "MISS")
+}
+
+// Path, sorted query and the representation headers. HEAD shares the GET
+// entry and only leaves out the body.
+func cacheKey(r *http.Request) string {
+	var key strings.Builder
+	key.WriteString(r.URL.Path)
+	key.WriteByte('?')
+	key.WriteString(r.URL.Query().Encode())
+	for _, name := range representationHeaders {
+		key.WriteByte(0)
+		key.WriteString(r.Header.Get(name))
+	}
+	return key.String()
+}
+
+// Runs one request against the upstream. It is detached from the client's
+// context: other requests may be waiting on the same flight.
+func (g *gateway) fetch(method, requestURI string, header http.Header) (*cachedResponse, error) {
+	req, err := http.NewRequest(method, g.config.upstream.String()+requestURI, nil)
+	if err != nil {
+		return nil, err
+	}
+	for _, name := range representationHeaders {
+		if value := header.Get(name); value != "" {
+			req.Header.Set(name, value)
+		}
+	}
+	g.stats.upstream.Add(1)
+	resp, err := g.client.Do(req)
+	if err != nil {
+		return nil, err
+	}
+	defer resp.Body.Close()
+	body, err := io.ReadAll(resp.Body)
+	if err != nil {
+		return nil, err
+	}
+	e := &cachedResponse{status: resp.StatusCode, header: resp.Header.Clone(), body: body}
+	for _, name := range hopHeaders {
+		e.header.Del(name)
+	}
+	setValidator(e)
+	return e, nil
+}
+
+// Keeps the upstream ETag if there is one. The API sends no validators of
+// its own, so a body hash stands in and lets browsers revalidate.
+func setValidator(e *cachedResponse) {
+	e.etag = e.header.Get("ETag")
+	if e.etag == "" && e.status == http.StatusOK {
+		hash := fnv.New64a()
+		hash.Write(e.body)
+		e.etag = fmt.Sprintf(`"g%016x"`, hash.Sum64())
+		e.header.Set("ETag", e.etag)
+	}
+}
+
+func (g *gateway) writeResponse(w http.ResponseWriter, r *http.Request, e *cachedResponse, cacheStatus string) {
+	header := w.Header()
+	for name, values := range e.header {
+		header[name] = values
+	}
+	header.Set("X-Gateway-Cache", cacheStatus)
+	if e.etag != "" && e.status == http.StatusOK && etagMatches(r.Header.Get("If-None-Match"), e.etag) {
+		g.stats.notModified.Add(1)
+		w.WriteHeader(http.StatusNotModified)
+		return
+	}
+	header.Set("Content-Length", strconv.Itoa(len(e.body)))
+	w.WriteHeader(e.status)
+	if r.Method != http.MethodHead {
+		w.Write(e.body)
+	}
+}
+
+func etagMatches(ifNoneMatch, etag string) bool {
+	for _, candidate := range strings.Split(ifNoneMatch, ",") {
+		candidate = strings.TrimSpace(candidate)
+		if candidate == "*" || strings.TrimPrefix(candidate, "W/") == etag {
+			return true
+		}
+	}
+	return false
+}
+
+func (g *gateway) invalidate(tables tableSet) {
+	g.stats.invalidations.Add(1)
+	g.cache.invalidate(tables)
+}
+
+// Tails the server's change feed and drops cached responses of every table
+// a change touches. Caching is off while the feed is down, since writes
+// would go unnoticed; each reconnect starts from an empty cache.
+func (g *gateway) followChanges() {
+	feedURL := g.config.upstream.String() + "/api/changes"
+	// Streams stay open; only the dial and the first response are bounded
+	client := &http.Client{Transport: g.client.Transport}
+	for {
+		resp, err := client.Get(feedURL)
+		if err == nil && resp.StatusCode == http.StatusOK {
+			g.invalidate(allTables)
+			g.feedConnected.Store(true)
+			log.Printf("Gateway: following %s", feedURL)
+			g.readChanges(resp.Body)
+			g.feedConnected.Store(false)
+			g.invalidate(allTables)
+			log.Printf("Gateway: change feed closed, caching paused")
+		} else if err == nil {
+			log.Printf("Gateway: change feed answered %s", resp.Status)
+		}
+		if resp != nil {
+			resp.Body.Close()
+		}
+		time.Sleep(time.Second)
+	}
+}
+
+func (g *gateway) readChanges(body io.Reader) {
+	scanner := bufio.NewScanner(body)
+	event := ""
+	for scanner.Scan() {
+		line := scanner.Text()
+		switch {
+		case strings.HasPrefix(line, "event: "):
+			event = strings.TrimPrefix(line, "event: ")
+		case strings.HasPrefix(line, "data: ") && event == "change":
+			var change struct {
+				Table string `json:"table"`
+			}
+			tables := allTables
+			if json.Unmarshal([]byte(strings.TrimPrefix(line, "data: ")), &change) == nil {
+				if set, ok := feedTables[change.Table]; ok {
+					tables = set
+				}
+			}
+			g.invalidate(tables)
+		case strings.HasPrefix(line, "data: ") && event == "reset":
+			g.invalidate(allTables)
+		case line == "":
+			event = ""
+		}
+	}
+}
+
+func (g *gateway) serveStats(w http.ResponseWriter, r *http.Request) {
+	entries, bytes := g.cache.usage()
+	stats := map[string]interface{}{
+		"upstream":          g.config.upstream.String(),
+		"requests":          g.stats.requests.Load(),
+		"upstream_requests": g.stats.upstream.Load(),
+		"cache_hits":        g.stats.hits.Load(),
+		"cache_misses":      g.stats.misses.Load(),
+		"not_modified":      g.stats.notModified.Load(),
+		"coalesced":         g.stats.coalesced.Load(),
+		"batch_calls":       g.stats.batchCalls.Load(),
+		"batched_ids":       g.stats.batchedIDs.Load(),
+		"invalidations":     g.stats.invalidations.Load(),
+		"cache_entries":     entries,
+		"cache_bytes":       bytes,
+		"feed_connected":    g.feedConnected.Load(),
+	}
+	w.Header().Set("Content-Type", "application/json")
+	json.NewEncoder(w).Encode(stats)
+}
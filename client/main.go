@@ -3,12 +3,36 @@ package main
 import (
 	"log"
 	"net/http"
+	"os"
 )
 
 func main() {
 	// Serve static files, e.g., HTML, JS, CSS
 	fs := http.FileServer(http.Dir("./static"))
-	http.Handle("/", fs)
+
+	// Optional gateway mode: HEALTH_GATEWAY_UPSTREAM=http://localhost:8080
+	// proxies /api to the C server with pooling, caching and batching
+	upstream := os.Getenv("HEALTH_GATEWAY_UPSTREAM")
+	if upstream == "" {
+		http.Handle("/", fs)
+	} else {
+		// The cookie tells the page to call /api on this origin
+		http.HandleFunc("/", func(w http.ResponseWriter, r *http.Request) {
+			http.SetCookie(w, &http.Cookie{Name: "health_gateway", Value: "1", Path: "/"})
+			fs.ServeHTTP(w, r)
+		})
+
+		config, err := loadGatewayConfig(upstream)
+		if err != nil {
+			log.Fatal(err)
+		}
+		gw := newGateway(config)
+		gw.start()
+		http.Handle("/api", gw)
+		http.Handle("/api/", gw)
+		http.HandleFunc("/gateway/stats", gw.serveStats)
+		log.Printf("Gateway mode: /api is served by %s", upstream)
+	}
 
 	// Start HTTP server on port 8081
 	log.Println("Listening on http://localhost:8081/")
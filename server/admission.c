@@ -0,0 +1,309 @@
+#include "admission.h"
+
+#include "coalesce.h"
+#include "config.h"
+#include "cors.h"
+#include "json_response.h"
+#include "replication.h"
+#include "router.h"
+#include "startup.h"
+#include "trace.h"
+#include "util.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ADMISSION_MAX_ROUTES 64
+#define ADMISSION_BUCKET_SLOTS 1024
+
+typedef enum { ADMISSION_READ = 0, ADMISSION_WRITE = 1, ADMISSION_CLASSES = 2 } admission_class;
+
+typedef struct {
+  const char *name;
+  int max_inflight;
+  int max_queue;
+  int queue_timeout_ms;
+  int inflight;
+  int queued;
+  unsigned long admitted;
+  unsigned long rejected_queue_full;
+  unsigned long rejected_timeout;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} admission_pool;
+
+typedef struct {
+  admission_callback callback;
+  void *user_data;
+  admission_class route_class;
+} admission_route;
+
+typedef struct {
+  uint64_t client_key;
+  double tokens;
+  double last_refill;
+} token_bucket;
+
+static admission_pool pools[ADMISSION_CLASSES] = {
+  { .name = "read", .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER },
+  { .name = "write", .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER },
+};
+
+static admission_route routes[ADMISSION_MAX_ROUTES];
+static int route_count = 0;
+
+static token_bucket buckets[ADMISSION_BUCKET_SLOTS];
+static pthread_mutex_t buckets_lock = PTHREAD_MUTEX_INITIALIZER;
+static double bucket_rate = 0;   // tokens per second, 0 disables rate limiting
+static double bucket_burst = 0;
+static unsigned long rejected_rate_limited = 0;
+static int retry_after_seconds = 1;
+
+static double monotonic_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+int admission_init(void) {
+  pools[ADMISSION_READ].max_inflight = config_get_int("HEALTH_ADMISSION_MAX_READS", 64);
+  pools[ADMISSION_READ].max_queue = config_get_int("HEALTH_ADMISSION_READ_QUEUE", 256);
+  pools[ADMISSION_WRITE].max_inflight = config_get_int("HEALTH_ADMISSION_MAX_WRITES", 4);
+  pools[ADMISSION_WRITE].max_queue = config_get_int("HEALTH_ADMISSION_WRITE_QUEUE", 64);
+  const int queue_timeout_ms = config_get_int("HEALTH_ADMISSION_QUEUE_TIMEOUT_MS", 2000);
+  for (int i = 0; i < ADMISSION_CLASSES; i++) {
+    pools[i].queue_timeout_ms = queue_timeout_ms;
+    pools[i].inflight = pools[i].queued = 0;
+    pools[i].admitted = pools[i].rejected_queue_full = pools[i].rejected_timeout = 0;
+  }
+
+  bucket_rate = config_get_int("HEALTH_ADMISSION_CLIENT_RATE", 100);
+  bucket_burst = config_get_int("HEALTH_ADMISSION_CLIENT_BURST", 200);
+  retry_after_seconds = config_get_int("HEALTH_ADMISSION_RETRY_AFTER", 1);
+  memset(buckets, 0, sizeof(buckets));
+  rejected_rate_limited = 0;
+  coalesce_init();
+
+  printf("Admission control: reads %d+%d queued, writes %d+%d queued, %.0f req/s per client\n",
+         pools[ADMISSION_READ].max_inflight, pools[ADMISSION_READ].max_queue,
+         pools[ADMISSION_WRITE].max_inflight, pools[ADMISSION_WRITE].max_queue, bucket_rate);
+  return 0;
+}
+
+// Collapses the client address into a 64-bit key (FNV-1a over the IP bytes)
+static uint64_t client_key(const struct _u_request *request) {
+  const unsigned char *bytes = NULL;
+  size_t len = 0;
+  if (request->client_address && request->client_address->sa_family == AF_INET) {
+    bytes = (const unsigned char *)&((const struct sockaddr_in *)request->client_address)->sin_addr;
+    len = sizeof(struct in_addr);
+  } else if (request->client_address && request->client_address->sa_family == AF_INET6) {
+    bytes = (const unsigned char *)&((const struct sockaddr_in6 *)request->client_address)->sin6_addr;
+    len = sizeof(struct in6_addr);
+  }
+
+  return hash_bytes(bytes, len) | 1; // 0 marks an empty slot
+}
+
+// Takes one token from the client's bucket.
+// Returns 0 if allowed, otherwise the number of seconds until a token is available.
+static int take_client_token(const struct _u_request *request) {
+  if (bucket_rate <= 0) {
+    return 0;
+  }
+
+  const uint64_t key = client_key(request);
+  const double now = monotonic_seconds();
+  int wait_seconds = 0;
+
+  pthread_mutex_lock(&buckets_lock);
+  token_bucket *bucket = &buckets[key % ADMISSION_BUCKET_SLOTS];
+  if (bucket->client_key != key) {
+    // New client (or a colliding one evicting an older entry): start full
+    bucket->client_key = key;
+    bucket->tokens = bucket_burst;
+    bucket->last_refill = now;
+  }
+  bucket->tokens += (now - bucket->last_refill) * bucket_rate;
+  if (bucket->tokens > bucket_burst) {
+    bucket->tokens = bucket_burst;
+  }
+  bucket->last_refill = now;
+
+  if (bucket->tokens >= 1.0) {
+    bucket->tokens -= 1.0;
+  } else {
+    wait_seconds = (int)((1.0 - bucket->tokens) / bucket_rate) + 1;
+    rejected_rate_limited++;
+  }
+  pthread_mutex_unlock(&buckets_lock);
+  return wait_seconds;
+}
+
+// Returns 0 once a slot is held, 1 if the queue was full, 2 if the wait timed out
+static int acquire_slot(admission_pool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  if (pool->inflight < pool->max_inflight) {
+    pool->inflight++;
+    pool->admitted++;
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+  }
+  if (pool->queued >= pool->max_queue) {
+    pool->rejected_queue_full++;
+    pthread_mutex_unlock(&pool->lock);
+    return 1;
+  }
+
+  const struct timespec deadline = deadline_after_ms(pool->queue_timeout_ms);
+
+  pool->queued++;
+  int rc = 0;
+  while (pool->inflight >= pool->max_inflight && rc != ETIMEDOUT) {
+    rc = pthread_cond_timedwait(&pool->cond, &pool->lock, &deadline);
+  }
+  pool->queued--;
+
+  if (pool->inflight >= pool->max_inflight) {
+    pool->rejected_timeout++;
+    pthread_mutex_unlock(&pool->lock);
+    return 2;
+  }
+  pool->inflight++;
+  pool->admitted++;
+  pthread_mutex_unlock(&pool->lock);
+  return 0;
+}
+
+static void release_slot(admission_pool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->inflight--;
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+int admission_wait_idle(int timeout_ms) {
+  const double deadline = monotonic_seconds() + timeout_ms / 1000.0;
+  for (;;) {
+    int busy = 0;
+    for (int i = 0; i < ADMISSION_CLASSES; i++) {
+      pthread_mutex_lock(&pools[i].lock);
+      busy += pools[i].inflight + pools[i].queued;
+      pthread_mutex_unlock(&pools[i].lock);
+    }
+    if (busy == 0) {
+      return 0;
+    }
+    if (monotonic_seconds() >= deadline) {
+      return busy;
+    }
+    usleep(10000);
+  }
+}
+
+static void set_overload_response(struct _u_response *response, int status, int retry_after, const char *message) {
+  char retry_after_str[16];
+  snprintf(retry_after_str, sizeof(retry_after_str), "%d", retry_after);
+  set_json_error_response(response, status, message);
+  u_map_put(response->map_header, "Retry-After", retry_after_str);
+  set_cors_headers(response);
+}
+
+// Waits for a slot of the route's class and runs its callback
+static int run_admitted(const struct _u_request *request, struct _u_response *response, void *user_data) {
+  const admission_route *route = (const admission_route *)user_data;
+  admission_pool *pool = &pools[route->route_class];
+
+  const uint64_t span = trace_begin();
+  const int admitted = acquire_slot(pool);
+  trace_end("admission wait", span);
+  if (admitted != 0) {
+    set_overload_response(response, 503, retry_after_seconds, "Service Unavailable: server is overloaded");
+    return U_CALLBACK_COMPLETE;
+  }
+
+  const double started_at = monotonic_seconds();
+  const int result = route->callback(request, response, route->user_data);
+  release_slot(pool);
+  startup_request_served(monotonic_seconds() - started_at);
+  return result;
+}
+
+static int callback_admitted(const struct _u_request *request, struct _u_response *response, void *user_data) {
+  const admission_route *route = (const admission_route *)user_data;
+
+  // A follower only serves reads, and only while it is close to the leader
+  if (replication_is_follower()) {
+    if (route->route_class == ADMISSION_WRITE) {
+      set_json_error_response(response, 405, "Read-only follower: send writes to the leader");
+      u_map_put(response->map_header, "Allow", "GET, HEAD");
+      set_cors_headers(response);
+      return U_CALLBACK_COMPLETE;
+    }
+    if (!replication_reads_allowed()) {
+      set_overload_response(response, 503, 1, "Service Unavailable: follower is behind the leader");
+      return U_CALLBACK_COMPLETE;
+    }
+  }
+
+  const int wait_seconds = take_client_token(request);
+  if (wait_seconds > 0) {
+    set_overload_response(response, 429, wait_seconds, "Too Many Requests: client rate limit exceeded");
+    return U_CALLBACK_COMPLETE;
+  }
+
+  // Identical reads share one execution (coalesce.h); only that one takes a
+  // slot, so a burst of the same GET cannot fill the read pool
+  if (route->route_class == ADMISSION_READ) {
+    return coalesce_request(request, response, &run_admitted, (void *)route);
+  }
+  return run_admitted(request, response, (void *)route);
+}
+
+int admission_add_endpoint(const char *http_method, const char *url, admission_callback callback, void *user_data) {
+  if (route_count >= ADMISSION_MAX_ROUTES) {
+    fprintf(stderr, "Too many admission-controlled routes, cannot add %s %s\n", http_method, url);
+    return U_ERROR;
+  }
+
+  admission_route *route = &routes[route_count++];
+  route->callback = callback;
+  route->user_data = user_data;
+  route->route_class = (strcmp(http_method, "GET") == 0 || strcmp(http_method, "HEAD") == 0)
+                           ? ADMISSION_READ : ADMISSION_WRITE;
+  return router_add(http_method, url, &callback_admitted, route);
+}
+
+int callback_admission_stats(const struct _u_request *request, struct _u_response *response, void *user_data) {
+  json_t *json_stats = json_object();
+  for (int i = 0; i < ADMISSION_CLASSES; i++) {
+    admission_pool *pool = &pools[i];
+    pthread_mutex_lock(&pool->lock);
+    json_t *json_pool = json_object();
+    json_object_set_new(json_pool, "inflight", json_integer(pool->inflight));
+    json_object_set_new(json_pool, "max_inflight", json_integer(pool->max_inflight));
+    json_object_set_new(json_pool, "queued", json_integer(pool->queued));
+    json_object_set_new(json_pool, "max_queue", json_integer(pool->max_queue));
+    json_object_set_new(json_pool, "admitted", json_integer((json_int_t)pool->admitted));
+    json_object_set_new(json_pool, "rejected_queue_full", json_integer((json_int_t)pool->rejected_queue_full));
+    json_object_set_new(json_pool, "rejected_timeout", json_integer((json_int_t)pool->rejected_timeout));
+    pthread_mutex_unlock(&pool->lock);
+    json_object_set_new(json_stats, pool->name, json_pool);
+  }
+
+  pthread_mutex_lock(&buckets_lock);
+  json_object_set_new(json_stats, "rejected_rate_limited", json_integer((json_int_t)rejected_rate_limited));
+  pthread_mutex_unlock(&buckets_lock);
+  json_object_set_new(json_stats, "coalesced", json_integer((json_int_t)coalesce_shared_count()));
+
+  ulfius_set_json_body_response(response, 200, json_stats);
+  json_decref(json_stats);
+  set_cors_headers(response);
+  return U_CALLBACK_CONTINUE;
+}
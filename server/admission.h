@@ -0,0 +1,27 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <ulfius.h>
+
+// Admission control in front of the API callbacks.
+// Requests are split into read (GET/HEAD) and write classes, each with a
+// bounded number of in-flight requests and a bounded wait queue. Once the
+// queue is full the request is shed with 503 + Retry-After. A per-client
+// token bucket keeps one caller from monopolizing the database (429).
+
+typedef int (*admission_callback)(const struct _u_request *request, struct _u_response *response, void *user_data);
+
+// Reads HEALTH_ADMISSION_* settings and resets counters
+int admission_init(void);
+
+// Registers a route (router.h) whose callback runs only after the request is admitted
+int admission_add_endpoint(const char *http_method, const char *url, admission_callback callback, void *user_data);
+
+// Waits up to timeout_ms for in-flight and queued requests to finish.
+// Returns 0 once idle, otherwise the number of requests still running.
+int admission_wait_idle(int timeout_ms);
+
+// Handles GET /admin/admission: occupancy and rejection counters per class
+int callback_admission_stats(const struct _u_request *request, struct _u_response *response, void *user_data);
+
+#endif // ADMISSION_H
@@ -3,7 +3,10 @@
 #include "appointments_handlers.h"
 #include "database.h" // Include your database operations header file here
 #include "json_response.h"
+#include "list_cache.h"
+#include "body_format.h"
 #include "cors.h"
+#include "router.h"
 
 #include <string.h>
 
@@ -12,22 +15,71 @@
 // GET: Retrieve an Appointment
 int callback_appointments_get(const struct _u_request *request, struct _u_response *response, void *user_data) {
   printf("callback_appointments_get: Function called\n");
-  const char *id_str = u_map_get(request->map_url, "id");
-  printf("callback_appointments_get: Requested ID: %s\n", id_str ? id_str : "null");
-  const int id = id_str ? atoi(id_str) : -1;
-  Appointment appointment;
-  const int result = read_appointment(id, &appointment);
+  const int id = router_request_id(request);
+  printf("callback_appointments_get: Requested ID: %d\n", id);
+  unsigned int fields;
+  if (parse_fields(TABLE_APPOINTMENTS, u_map_get(request->map_url, "fields"), &fields) != 0) {
+    set_json_error_response(response, 400, "Unknown column in fields");
+    set_cors_headers(response);
+    return U_CALLBACK_CONTINUE;
+  }
+  // ?include_archived=1 adds the rows moved to AppointmentsArchive (maintenance.h)
+  const char *include_archived = u_map_get(request->map_url, "include_archived");
+  const int archived = include_archived && strcmp(include_archived, "0") != 0 && strcmp(include_archived, "false") != 0;
+
+  if (id == ROUTER_NO_ID) {
+    // ?ids=1,2,3: the rows that exist, in that order
+    int ids[ROUTER_MAX_IDS];
+    const int id_count = router_request_ids(request, ids, ROUTER_MAX_IDS);
+    if (id_count != 0) {
+      json_t *json_response;
+      if (id_count < 0) {
+        set_json_error_response(response, 400, "ids must be a comma-separated list of at most 100 ids");
+      } else if (read_rows_fields(TABLE_APPOINTMENTS, ids, id_count, fields, archived, &json_response) != 0) {
+        set_json_error_response(response, 500, "Error reading appointments");
+      } else {
+        set_negotiated_body_response(request, response, 200, json_response);
+        json_decref(json_response);
+      }
+      set_cors_headers(response);
+      return U_CALLBACK_CONTINUE;
+    }
+    if (!archived && list_cache_respond(TABLE_APPOINTMENTS, fields, request, response)) {
+      set_cors_headers(response);
+      return U_CALLBACK_CONTINUE;
+    }
+    json_t *json_response;
+    if (read_all_fields(TABLE_APPOINTMENTS, fields, &json_response) != 0 ||
+        (archived && read_all_archived_fields(TABLE_APPOINTMENTS, fields, json_response) != 0)) {
+      json_decref(json_response);
+      set_json_error_response(response, 500, "Error reading appointments");
+      set_cors_headers(response);
+      return U_CALLBACK_CONTINUE;
+    }
+    set_negotiated_body_response(request, response, 200, json_response);
+    json_decref(json_response);
+    set_cors_headers(response);
+    return U_CALLBACK_CONTINUE;
+  }
 
   json_t *json_response;
+  int result = read_row_fields(TABLE_APPOINTMENTS, id, fields, &json_response);
+  if (result == 1 && archived) {
+    result = read_archived_row_fields(TABLE_APPOINTMENTS, id, fields, &json_response);
+  }
+  if (result < 0) {
+    set_json_error_response(response, 500, "Error reading appointment");
+    set_cors_headers(response);
+    return U_CALLBACK_CONTINUE;
+  }
   if (result == 0) {
-    printf("callback_appointments_get: Appointment found for ID: %d\n", id);
-    json_response = json_pack("{sisisisi}", "id", appointment.id, "patient_id", appointment.patient_id, "doctor_id", appointment.doctor_id, "date", appointment.date);
+    printf("callback_appointments_get: Found appointment with ID: %d\n", id);
   } else {
-    printf("callback_appointments_get: Appointment not found\n");
+    printf("callback_appointments_get: No appointment with ID: %d\n", id);
     json_response = json_object();
   }
 
-  ulfius_set_json_body_response(response, 200, json_response);
+  set_negotiated_body_response(request, response, 200, json_response);
   json_decref(json_response);
   set_cors_headers(response);
   return U_CALLBACK_CONTINUE;
@@ -37,12 +89,15 @@ int callback_appointments_get(const struct _u_request *request, struct _u_respon
 // Appointments POST Callback Function
 int callback_appointments_post(const struct _u_request *request, struct _u_response *response, void *user_data) {
   printf("Appointments POST called\n");
-  json_t *json_request = ulfius_get_json_body_request(request, NULL);
+  json_t *json_request = get_negotiated_body_request(request);
   const int patient_id = json_integer_value(json_object_get(json_request, "patient_id"));
   const int doctor_id = json_integer_value(json_object_get(json_request, "doctor_id"));
   const char *date = json_string_value(json_object_get(json_request, "date"));
 
-  if (patient_id > 0 && doctor_id > 0 && date) {
+  if (patient_id > 0 && doctor_id > 0 && date && !(patient_exists(patient_id) && doctor_exists(doctor_id))) {
+    printf("Appointment references a missing patient or doctor\n");
+    set_json_error_response(response, 422, "Unknown patient_id or doctor_id");
+  } else if (patient_id > 0 && doctor_id > 0 && date) {
     printf("Creating appointment: Patient ID %d, Doctor ID %d, Date %s\n", patient_id, doctor_id, date);
     Appointment new_appointment = { .id = 0, .patient_id = patient_id, .doctor_id = doctor_id, .date = "" };
     strncpy(new_appointment.date, date, sizeof(new_appointment.date) - 1);
@@ -71,14 +126,17 @@ int callback_appointments_post(const struct _u_request *request, struct _u_respo
 // PUT: Update an Appointment
 int callback_appointments_put(const struct _u_request *request, struct _u_response *response, void *user_data) {
   printf("callback_appointments_put: Function called\n");
-  json_t *json_request = ulfius_get_json_body_request(request, NULL);
+  json_t *json_request = get_negotiated_body_request(request);
   int id = json_integer_value(json_object_get(json_request, "id"));
   int patient_id = json_integer_value(json_object_get(json_request, "patient_id"));
   int doctor_id = json_integer_value(json_object_get(json_request, "doctor_id"));
   const char *date = json_string_value(json_object_get(json_request, "date"));
   printf("callback_appointments_put: ID: %d, Patient ID: %d, Doctor ID: %d, Date: %s\n", id, patient_id, doctor_id, date);
 
-  if (id > 0 && patient_id > 0 && doctor_id > 0 && date) {
+  if (id > 0 && patient_id > 0 && doctor_id > 0 && date && !(patient_exists(patient_id) && doctor_exists(doctor_id))) {
+    printf("callback_appointments_put: Unknown patient or doctor\n");
+    set_json_error_response(response, 422, "Unknown patient_id or doctor_id");
+  } else if (id > 0 && patient_id > 0 && doctor_id > 0 && date) {
     Appointment appointment = { .id = id, .patient_id = patient_id, .doctor_id = doctor_id, .date = "" };
     strncpy(appointment.date, date, sizeof(appointment.date) - 1);
     const int result = update_appointment(&appointment);
@@ -86,6 +144,8 @@ int callback_appointments_put(const struct _u_request *request, struct _u_respon
     if (result == 0) {
       printf("callback_appointments_put: Appointment updated successfully\n");
       ulfius_set_string_body_response(response, 200, "Appointment updated");
+    } else if (result == DB_CROSS_SHARD) {
+      set_json_error_response(response, 409, "patient_id belongs to another shard; create a new appointment instead");
     } else {
       printf("callback_appointments_put: Error updating appointment\n");
       ulfius_set_string_body_response(response, 500, "Error updating appointment");
@@ -105,9 +165,8 @@ int callback_appointments_put(const struct _u_request *request, struct _u_respon
 // DELETE: Delete an Appointment
 int callback_appointments_delete(const struct _u_request *request, struct _u_response *response, void *user_data) {
   printf("callback_appointments_delete: Function called\n");
-  const char *id_str = u_map_get(request->map_url, "id");
-  printf("callback_appointments_delete: Requested ID: %s\n", id_str ? id_str : "null");
-  int id = id_str ? atoi(id_str) : -1;
+  int id = router_request_id(request);
+  printf("callback_appointments_delete: Requested ID: %d\n", id);
 
   if (id > 0) {
     const int result = delete_appointment(id);
@@ -133,22 +192,63 @@ int callback_appointments_delete(const struct _u_request *request, struct _u_res
 // GET: Retrieve a Medical Record
 int callback_medical_records_get(const struct _u_request *request, struct _u_response *response, void *user_data) {
   printf("callback_medical_records_get: Function called\n");
-  const char *id_str = u_map_get(request->map_url, "id");
-  printf("callback_medical_records_get: Requested ID: %s\n", id_str ? id_str : "null");
-  const int id = id_str ? atoi(id_str) : -1;
-  MedicalRecord record;
-  const int result = read_medical_record(id, &record);
+  const int id = router_request_id(request);
+  printf("callback_medical_records_get: Requested ID: %d\n", id);
+  unsigned int fields;
+  if (parse_fields(TABLE_MEDICAL_RECORDS, u_map_get(request->map_url, "fields"), &fields) != 0) {
+    set_json_error_response(response, 400, "Unknown column in fields");
+    set_cors_headers(response);
+    return U_CALLBACK_CONTINUE;
+  }
+
+  if (id == ROUTER_NO_ID) {
+    // ?ids=1,2,3: the rows that exist, in that order
+    int ids[ROUTER_MAX_IDS];
+    const int id_count = router_request_ids(request, ids, ROUTER_MAX_IDS);
+    if (id_count != 0) {
+      json_t *json_response;
+      if (id_count < 0) {
+        set_json_error_response(response, 400, "ids must be a comma-separated list of at most 100 ids");
+      } else if (read_rows_fields(TABLE_MEDICAL_RECORDS, ids, id_count, fields, 0, &json_response) != 0) {
+        set_json_error_response(response, 500, "Error reading medical records");
+      } else {
+        set_negotiated_body_response(request, response, 200, json_response);
+        json_decref(json_response);
+      }
+      set_cors_headers(response);
+      return U_CALLBACK_CONTINUE;
+    }
+    if (list_cache_respond(TABLE_MEDICAL_RECORDS, fields, request, response)) {
+      set_cors_headers(response);
+      return U_CALLBACK_CONTINUE;
+    }
+    json_t *json_response;
+    if (read_all_fields(TABLE_MEDICAL_RECORDS, fields, &json_response) != 0) {
+      set_json_error_response(response, 500, "Error reading medical records");
+      set_cors_headers(response);
+      return U_CALLBACK_CONTINUE;
+    }
+    set_negotiated_body_response(request, response, 200, json_response);
+    json_decref(json_response);
+    set_cors_headers(response);
+    return U_CALLBACK_CONTINUE;
+  }
 
   json_t *json_response;
-  if (result == 0) { // Record found
-    printf("callback_medical_records_get: Medical record found for ID: %d\n", id);
-    json_response = json_pack("{sisis}", "id", record.id, "patient_id", record.patient_id, "details", record.details);
-  } else { // Record not found or error
-    printf("callback_medical_records_get: Medical record not found or error\n");
-    json_response = json_object(); // Returns an empty JSON object
+  const int result = read_row_fields(TABLE_MEDICAL_RECORDS, id, fields, &json_response);
+  if (result < 0) {
+    set_json_error_response(response, 500, "Error reading medical record");
+    set_cors_headers(response);
+    return U_CALLBACK_CONTINUE;
+  }
+  if (result == 0) {
+    printf("callback_medical_records_get: Found medical record with ID: %d\n", id);
+  } else {
+    printf("callback_medical_records_get: No medical record with ID: %d\n", id);
+    json_response = json_object();
   }
 
-  ulfius_set_json_body_response(response, 200, json_response);
+  set_negotiated_body_response(request, response, 200, json_response);
   json_decref(json_response);
   set_cors_headers(response);
   return U_CALLBACK_CONTINUE;
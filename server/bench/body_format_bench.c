@@ -0,0 +1,76 @@
+// body_format_bench.c
+// Compares payload size and encode/decode time of JSON, MessagePack and CBOR
+// for list responses shaped like GET /api/appointments.
+//
+// Usage: ./body_format_bench [rows] [iterations]
+
+#include "body_format.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static double now_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+static json_t *build_rows(int rows) {
+  json_t *list = json_array();
+  for (int i = 1; i <= rows; i++) {
+    char date[16];
+    snprintf(date, sizeof(date), "2024-%02d-%02d", i % 12 + 1, i % 28 + 1);
+    json_t *row = json_object();
+    json_object_set_new(row, "id", json_integer(i));
+    json_object_set_new(row, "patient_id", json_integer(i * 7 % 100000));
+    json_object_set_new(row, "doctor_id", json_integer(i % 250 + 1));
+    json_object_set_new(row, "date", json_string(date));
+    json_object_set_new(row, "doctor_name", json_string("Dr. Gregory House"));
+    json_array_append_new(list, row);
+  }
+  return list;
+}
+
+int main(int argc, char **argv) {
+  const int rows = argc > 1 ? atoi(argv[1]) : 1000;
+  const int iterations = argc > 2 ? atoi(argv[2]) : 200;
+  const body_format formats[] = { BODY_FORMAT_JSON, BODY_FORMAT_MSGPACK, BODY_FORMAT_CBOR };
+  const char *names[] = { "json", "msgpack", "cbor" };
+
+  json_t *list = build_rows(rows);
+  printf("%d rows, %d iterations\n", rows, iterations);
+  printf("%-8s %10s %14s %14s\n", "format", "bytes", "encode us/op", "decode us/op");
+
+  for (int f = 0; f < 3; f++) {
+    char *encoded = NULL;
+    size_t encoded_len = 0;
+
+    double start = now_seconds();
+    for (int i = 0; i < iterations; i++) {
+      free(encoded);
+      if (body_format_encode(formats[f], list, &encoded, &encoded_len) != 0) {
+        fprintf(stderr, "%s: encode failed\n", names[f]);
+        return 1;
+      }
+    }
+    const double encode_us = (now_seconds() - start) * 1e6 / iterations;
+
+    start = now_seconds();
+    for (int i = 0; i < iterations; i++) {
+      json_t *decoded = body_format_decode(formats[f], encoded, encoded_len);
+      if (!decoded || json_array_size(decoded) != (size_t)rows) {
+        fprintf(stderr, "%s: decode failed\n", names[f]);
+        return 1;
+      }
+      json_decref(decoded);
+    }
+    const double decode_us = (now_seconds() - start) * 1e6 / iterations;
+
+    printf("%-8s %10zu %14.1f %14.1f\n", names[f], encoded_len, encode_us, decode_us);
+    free(encoded);
+  }
+
+  json_decref(list);
+  return 0;
+}
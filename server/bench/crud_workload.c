@@ -0,0 +1,245 @@
+// crud_workload.c
+// Representative CRUD traffic against a running server: reads by id,
+// summaries and projected lists dominate, with a steady share of creates and
+// updates. Used as the training run of tools/pgo_build.sh and to compare builds.
+//
+// Usage: ./crud_workload [base_url] [seconds] [threads]
+// Prints requests, errors, throughput and p50/p99 latency, one "key value" per line.
+
+#include <curl/curl.h>
+#include <jansson.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SEED_PATIENTS 200
+#define SEED_DOCTORS 20
+#define MAX_IDS 4096
+#define LATENCY_BUCKETS 4096 // 10 microsecond buckets up to ~41 ms, the last one catches the rest
+
+static const char *base_url = "http://localhost:8080";
+static double deadline;
+static int patient_ids[MAX_IDS], patient_count = 0;
+static int doctor_ids[MAX_IDS], doctor_count = 0;
+
+typedef struct {
+  unsigned int seed;
+  unsigned long requests;
+  unsigned long errors;
+  unsigned long latency[LATENCY_BUCKETS];
+} worker_stats;
+
+static double now_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+typedef struct {
+  char *data;
+  size_t size;
+} body_buffer;
+
+static size_t collect_body(char *data, size_t size, size_t count, void *user_data) {
+  body_buffer *body = user_data;
+  if (body == NULL) {
+    return size * count; // Discarded
+  }
+  char *grown = realloc(body->data, body->size + size * count + 1);
+  if (grown == NULL) {
+    return 0;
+  }
+  body->data = grown;
+  memcpy(body->data + body->size, data, size * count);
+  body->size += size * count;
+  body->data[body->size] = '\0';
+  return size * count;
+}
+
+// Sends one request on the thread's handle; returns the HTTP status or 0
+static long send_request(CURL *curl, const char *method, const char *path, const char *json_body, body_buffer *response) {
+  char url[512];
+  snprintf(url, sizeof(url), "%s%s", base_url, path);
+  curl_easy_setopt(curl, CURLOPT_URL, url);
+  if (json_body) {
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_body);
+  } else {
+    curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L); // Drops the previous request's body
+  }
+  curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, method);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, collect_body);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, response);
+  long status = 0;
+  if (curl_easy_perform(curl) == CURLE_OK) {
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+  }
+  return status;
+}
+
+static CURL *new_handle(struct curl_slist *headers) {
+  CURL *curl = curl_easy_init();
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+  return curl;
+}
+
+// Reads the ids of a list endpoint (fields=id) into ids
+static int load_ids(CURL *curl, const char *path, int *ids) {
+  body_buffer body = {0};
+  int count = 0;
+  if (send_request(curl, "GET", path, NULL, &body) == 200) {
+    json_t *list = json_loads(body.data, 0, NULL);
+    size_t i;
+    json_t *row;
+    json_array_foreach(list, i, row) {
+      if (count < MAX_IDS) {
+        ids[count++] = (int)json_integer_value(json_object_get(row, "id"));
+      }
+    }
+    json_decref(list);
+  }
+  free(body.data);
+  return count;
+}
+
+// Creates the patients and doctors the mix refers to
+static int seed(struct curl_slist *headers) {
+  CURL *curl = new_handle(headers);
+  char json_body[128];
+  for (int i = 0; i < SEED_PATIENTS; i++) {
+    snprintf(json_body, sizeof(json_body), "{\"name\":\"Patient %d\"}", i);
+    send_request(curl, "POST", "/api/patients", json_body, NULL);
+  }
+  static const char *const specialties[] = {"Cardiology", "Neurology", "Pediatrics", "Oncology", "Dermatology"};
+  for (int i = 0; i < SEED_DOCTORS; i++) {
+    snprintf(json_body, sizeof(json_body), "{\"name\":\"Doctor %d\",\"specialty\":\"%s\"}", i, specialties[i % 5]);
+    send_request(curl, "POST", "/api/doctors", json_body, NULL);
+  }
+  patient_count = load_ids(curl, "/api/patients?fields=id", patient_ids);
+  doctor_count = load_ids(curl, "/api/doctors?fields=id", doctor_ids);
+  curl_easy_cleanup(curl);
+  return patient_count > 0 && doctor_count > 0 ? 0 : 1;
+}
+
+static void *run_worker(void *arg) {
+  worker_stats *stats = arg;
+  struct curl_slist *headers = curl_slist_append(NULL, "Content-Type: application/json");
+  CURL *curl = new_handle(headers);
+  char path[128], json_body[256];
+
+  while (now_seconds() < deadline) {
+    const int patient_id = patient_ids[rand_r(&stats->seed) % (unsigned int)patient_count];
+    const int doctor_id = doctor_ids[rand_r(&stats->seed) % (unsigned int)doctor_count];
+    const int pick = (int)(rand_r(&stats->seed) % 100);
+    const char *method = "GET";
+    const char *body = NULL;
+    if (pick < 40) {
+      snprintf(path, sizeof(path), "/api/patients/%d", patient_id);
+    } else if (pick < 55) {
+      snprintf(path, sizeof(path), "/api/patients/%d/summary", patient_id);
+    } else if (pick < 65) {
+      snprintf(path, sizeof(path), "/api/patients?fields=id,name");
+    } else if (pick < 70) {
+      snprintf(path, sizeof(path), "/api/doctors");
+    } else if (pick < 80) {
+      method = "POST";
+      snprintf(path, sizeof(path), "/api/appointments");
+      snprintf(json_body, sizeof(json_body), "{\"patient_id\":%d,\"doctor_id\":%d,\"date\":\"2025-%02d-%02d\"}",
+               patient_id, doctor_id, pick % 12 + 1, pick % 28 + 1);
+      body = json_body;
+    } else if (pick < 90) {
+      method = "POST";
+      snprintf(path, sizeof(path), "/api/medicalrecords");
+      snprintf(json_body, sizeof(json_body), "{\"patient_id\":%d,\"details\":\"Follow-up visit, vitals normal, note %d\"}", patient_id, pick);
+      body = json_body;
+    } else if (pick < 95) {
+      method = "PUT";
+      snprintf(path, sizeof(path), "/api/patients");
+      snprintf(json_body, sizeof(json_body), "{\"id\":%d,\"name\":\"Patient %d renamed\"}", patient_id, patient_id);
+      body = json_body;
+    } else {
+      method = "POST";
+      snprintf(path, sizeof(path), "/api/patients");
+      snprintf(json_body, sizeof(json_body), "{\"name\":\"Walk-in %d\"}", pick);
+      body = json_body;
+    }
+
+    const double started = now_seconds();
+    const long status = send_request(curl, method, path, body, NULL);
+    const double elapsed_us = (now_seconds() - started) * 1e6;
+    int bucket = (int)(elapsed_us / 10);
+    stats->latency[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1]++;
+    stats->requests++;
+    if (status < 200 || status >= 300) {
+      stats->errors++;
+    }
+  }
+
+  curl_easy_cleanup(curl);
+  curl_slist_free_all(headers);
+  return NULL;
+}
+
+// Latency in ms below which fraction of the requests finished
+static double percentile(const unsigned long *latency, unsigned long total, double fraction) {
+  unsigned long seen = 0;
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += latency[i];
+    if (seen >= (unsigned long)(fraction * (double)total)) {
+      return (double)(i + 1) * 10 / 1000.0;
+    }
+  }
+  return (double)LATENCY_BUCKETS * 10 / 1000.0;
+}
+
+int main(int argc, char **argv) {
+  base_url = argc > 1 ? argv[1] : base_url;
+  const int seconds = argc > 2 ? atoi(argv[2]) : 20;
+  int threads = argc > 3 ? atoi(argv[3]) : 8;
+  if (threads < 1) {
+    threads = 1;
+  }
+
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+  struct curl_slist *headers = curl_slist_append(NULL, "Content-Type: application/json");
+  if (seed(headers) != 0) {
+    fprintf(stderr, "Cannot seed %s\n", base_url);
+    return 1;
+  }
+  curl_slist_free_all(headers);
+
+  worker_stats *stats = calloc((size_t)threads, sizeof(worker_stats));
+  pthread_t *workers = calloc((size_t)threads, sizeof(pthread_t));
+  const double started = now_seconds();
+  deadline = started + seconds;
+  for (int i = 0; i < threads; i++) {
+    stats[i].seed = (unsigned int)i * 7919u + 1;
+    pthread_create(&workers[i], NULL, run_worker, &stats[i]);
+  }
+
+  static unsigned long latency[LATENCY_BUCKETS];
+  unsigned long requests = 0, errors = 0;
+  for (int i = 0; i < threads; i++) {
+    pthread_join(workers[i], NULL);
+    requests += stats[i].requests;
+    errors += stats[i].errors;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+      latency[b] += stats[i].latency[b];
+    }
+  }
+  const double elapsed = now_seconds() - started;
+
+  printf("requests %lu\n", requests);
+  printf("errors %lu\n", errors);
+  printf("throughput_rps %.1f\n", (double)requests / elapsed);
+  printf("p50_ms %.2f\n", percentile(latency, requests, 0.50));
+  printf("p99_ms %.2f\n", percentile(latency, requests, 0.99));
+
+  free(stats);
+  free(workers);
+  curl_global_cleanup();
+  return 0;
+}
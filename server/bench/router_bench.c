@@ -0,0 +1,138 @@
+// router_bench.c
+// Measures dispatch cost per request of the compiled route table against a
+// baseline that matches the way ulfius does: split the request URL, walk the
+// endpoint list splitting each pattern, then atoi the id.
+//
+// Usage: ./router_bench [iterations]
+
+#include "router.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double now_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+static int callback_noop(const struct _u_request *request, struct _u_response *response, void *user_data) {
+  return U_CALLBACK_CONTINUE;
+}
+
+// Same method/pattern set main.c registers
+static const char *const endpoints[][2] = {
+    {"GET", "/api"},
+    {"GET", "/api/patients"},
+    {"GET", "/api/patients/:id"},
+    {"GET", "/api/patients/:id/summary"},
+    {"POST", "/api/patients"},
+    {"PUT", "/api/patients"},
+    {"DELETE", "/api/patients"},
+    {"GET", "/api/doctors"},
+    {"POST", "/api/doctors"},
+    {"PUT", "/api/doctors"},
+    {"DELETE", "/api/doctors"},
+    {"GET", "/api/appointments"},
+    {"POST", "/api/appointments"},
+    {"PUT", "/api/appointments"},
+    {"DELETE", "/api/appointments"},
+    {"GET", "/api/medicalrecords"},
+    {"POST", "/api/medicalrecords"},
+    {"PUT", "/api/medicalrecords"},
+    {"DELETE", "/api/medicalrecords"},
+    {"GET", "/api/stats"},
+    {"GET", "/api/changes"},
+    {"GET", "/admin/admission"},
+    {"GET", "/admin/startup"},
+};
+#define ENDPOINT_COUNT (sizeof(endpoints) / sizeof(endpoints[0]))
+
+static const char *const requests[][2] = {
+    {"GET", "/api/patients"},
+    {"GET", "/api/patients/4242"},
+    {"GET", "/api/patients/17/summary"},
+    {"POST", "/api/appointments"},
+    {"GET", "/api/medicalrecords"},
+    {"DELETE", "/api/doctors"},
+    {"GET", "/index.html"}, // falls through to the static files
+};
+#define REQUEST_COUNT (sizeof(requests) / sizeof(requests[0]))
+
+static int split(char *path, char **segments, int max) {
+  int count = 0;
+  for (char *save = NULL, *token = strtok_r(path, "/", &save); token && count < max;
+       token = strtok_r(NULL, "/", &save)) {
+    segments[count++] = token;
+  }
+  return count;
+}
+
+// Baseline: per request, copy and split the URL, then copy and split every
+// candidate pattern until one matches
+static int baseline_match(const char *method, const char *url) {
+  char url_copy[256];
+  char *url_segments[8];
+  strcpy(url_copy, url);
+  const int url_count = split(url_copy, url_segments, 8);
+  for (size_t i = 0; i < ENDPOINT_COUNT; i++) {
+    if (strcmp(endpoints[i][0], method) != 0) {
+      continue;
+    }
+    char pattern_copy[256];
+    char *pattern_segments[8];
+    strcpy(pattern_copy, endpoints[i][1]);
+    if (split(pattern_copy, pattern_segments, 8) != url_count) {
+      continue;
+    }
+    int matched = 1;
+    int id = -1;
+    for (int s = 0; s < url_count && matched; s++) {
+      if (pattern_segments[s][0] == ':') {
+        id = atoi(url_segments[s]);
+      } else {
+        matched = strcmp(pattern_segments[s], url_segments[s]) == 0;
+      }
+    }
+    if (matched) {
+      return (int)i + id;
+    }
+  }
+  return -1;
+}
+
+int main(int argc, char **argv) {
+  const long iterations = argc > 1 ? atol(argv[1]) : 2000000;
+  struct _u_instance instance;
+  ulfius_init_instance(&instance, 0, NULL, NULL);
+  for (size_t i = 0; i < ENDPOINT_COUNT; i++) {
+    router_add(endpoints[i][0], endpoints[i][1], &callback_noop, (void *)(intptr_t)i);
+  }
+  router_install(&instance, &callback_noop, NULL);
+
+  long checksum = 0;
+  double started = now_seconds();
+  for (long n = 0; n < iterations; n++) {
+    const char *const *request = requests[n % REQUEST_COUNT];
+    checksum += baseline_match(request[0], request[1]);
+  }
+  const double baseline_ns = (now_seconds() - started) * 1e9 / (double)iterations;
+
+  started = now_seconds();
+  for (long n = 0; n < iterations; n++) {
+    const char *const *request = requests[n % REQUEST_COUNT];
+    void *user_data = NULL;
+    int id = ROUTER_NO_ID;
+    checksum += router_match(request[0], request[1], &user_data, &id) ? (intptr_t)user_data + id : -1;
+  }
+  const double compiled_ns = (now_seconds() - started) * 1e9 / (double)iterations;
+
+  printf("%-10s %12s\n", "matcher", "ns/request");
+  printf("%-10s %12.1f\n", "baseline", baseline_ns);
+  printf("%-10s %12.1f\n", "compiled", compiled_ns);
+  printf("(checksum %ld)\n", checksum);
+  ulfius_clean_instance(&instance);
+  return 0;
+}
@@ -0,0 +1,99 @@
+// tls_handshake.c
+// Full versus resumed TLS handshake cost against a server started with
+// HEALTH_TLS_CERT/HEALTH_TLS_KEY. Every request opens a new connection; in the
+// "full" pass the client keeps no session, in the "resumed" pass the handle's
+// session cache offers the ticket (or session id) from the previous connection.
+//
+// Usage: ./tls_handshake [base_url] [connections] [cafile]
+// Certificates for a local run: tools/gen_test_cert.sh
+// Prints mean/p50/p99 handshake time per pass, one "key value" per line.
+
+#include <curl/curl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *base_url = "https://localhost:8080";
+static const char *cafile = NULL;
+
+static size_t discard_body(char *data, size_t size, size_t count, void *user_data) {
+  (void)data;
+  (void)user_data;
+  return size * count;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  const double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Opens that many fresh connections on one handle and stores the TLS part of
+// each (APPCONNECT minus CONNECT) in ms; returns the number that succeeded
+static int measure(int resume, int connections, double *handshake_ms) {
+  CURL *curl = curl_easy_init();
+  char url[512];
+  snprintf(url, sizeof(url), "%s/api", base_url);
+  curl_easy_setopt(curl, CURLOPT_URL, url);
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discard_body);
+  curl_easy_setopt(curl, CURLOPT_FORBID_REUSE, 1L); // New TCP connection every time
+  curl_easy_setopt(curl, CURLOPT_SSL_SESSIONID_CACHE, resume ? 1L : 0L);
+  if (cafile) {
+    curl_easy_setopt(curl, CURLOPT_CAINFO, cafile);
+  } else {
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+  }
+
+  if (resume) {
+    curl_easy_perform(curl); // Primes the session cache, not counted
+  }
+  int done = 0;
+  for (int i = 0; i < connections; i++) {
+    if (curl_easy_perform(curl) != CURLE_OK) {
+      continue;
+    }
+    curl_off_t connect_us = 0, appconnect_us = 0;
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect_us);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &appconnect_us);
+    handshake_ms[done++] = (double)(appconnect_us - connect_us) / 1000.0;
+  }
+  curl_easy_cleanup(curl);
+  return done;
+}
+
+static void report(const char *name, double *handshake_ms, int count) {
+  printf("%s_connections %d\n", name, count);
+  if (count == 0) {
+    return;
+  }
+  qsort(handshake_ms, (size_t)count, sizeof(double), compare_doubles);
+  double sum = 0;
+  for (int i = 0; i < count; i++) {
+    sum += handshake_ms[i];
+  }
+  printf("%s_mean_ms %.3f\n", name, sum / count);
+  printf("%s_p50_ms %.3f\n", name, handshake_ms[count / 2]);
+  printf("%s_p99_ms %.3f\n", name, handshake_ms[(int)((count - 1) * 0.99)]);
+}
+
+int main(int argc, char **argv) {
+  base_url = argc > 1 ? argv[1] : base_url;
+  int connections = argc > 2 ? atoi(argv[2]) : 500;
+  cafile = argc > 3 ? argv[3] : NULL;
+  if (connections < 1) {
+    connections = 1;
+  }
+
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+  double *handshake_ms = calloc((size_t)connections, sizeof(double));
+
+  const int full = measure(0, connections, handshake_ms);
+  report("full", handshake_ms, full);
+  const int resumed = measure(1, connections, handshake_ms);
+  report("resumed", handshake_ms, resumed);
+
+  free(handshake_ms);
+  curl_global_cleanup();
+  return full == 0 ? 1 : 0;
+}
@@ -0,0 +1,549 @@
+#include "body_format.h"
+
+#include "byte_buffer.h"
+#include "trace.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BODY_FORMAT_MAX_DEPTH 32
+
+static void buffer_put_byte(byte_buffer *buffer, unsigned char byte) {
+  byte_buffer_append(buffer, &byte, 1);
+}
+
+// Appends the low `width` bytes of value in network byte order
+static void buffer_put_be(byte_buffer *buffer, uint64_t value, int width) {
+  unsigned char bytes[8];
+  for (int i = 0; i < width; i++) {
+    bytes[i] = (unsigned char)(value >> (8 * (width - 1 - i)));
+  }
+  byte_buffer_append(buffer, bytes, (size_t)width);
+}
+
+static uint64_t double_bits(double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+// MessagePack encoder
+static void msgpack_put_length(byte_buffer *buffer, size_t len, unsigned char fix_base, size_t fix_max,
+                               unsigned char tag8, unsigned char tag16, unsigned char tag32) {
+  if (len <= fix_max) {
+    buffer_put_byte(buffer, (unsigned char)(fix_base | len));
+  } else if (tag8 && len <= 0xff) {
+    buffer_put_byte(buffer, tag8);
+    buffer_put_be(buffer, len, 1);
+  } else if (len <= 0xffff) {
+    buffer_put_byte(buffer, tag16);
+    buffer_put_be(buffer, len, 2);
+  } else {
+    buffer_put_byte(buffer, tag32);
+    buffer_put_be(buffer, len, 4);
+  }
+}
+
+static void msgpack_put_string(byte_buffer *buffer, const char *value, size_t len) {
+  msgpack_put_length(buffer, len, 0xa0, 31, 0xd9, 0xda, 0xdb);
+  byte_buffer_append(buffer, value, len);
+}
+
+static void msgpack_encode(byte_buffer *buffer, const json_t *value) {
+  switch (json_typeof(value)) {
+    case JSON_OBJECT: {
+      const char *key;
+      json_t *member;
+      msgpack_put_length(buffer, json_object_size(value), 0x80, 15, 0, 0xde, 0xdf);
+      json_object_foreach((json_t *)value, key, member) {
+        msgpack_put_string(buffer, key, strlen(key));
+        msgpack_encode(buffer, member);
+      }
+      break;
+    }
+    case JSON_ARRAY: {
+      size_t index;
+      json_t *element;
+      msgpack_put_length(buffer, json_array_size(value), 0x90, 15, 0, 0xdc, 0xdd);
+      json_array_foreach(value, index, element) {
+        msgpack_encode(buffer, element);
+      }
+      break;
+    }
+    case JSON_STRING:
+      msgpack_put_string(buffer, json_string_value(value), json_string_length(value));
+      break;
+    case JSON_INTEGER: {
+      const json_int_t number = json_integer_value(value);
+      if (number >= 0 && number <= 0x7f) {
+        buffer_put_byte(buffer, (unsigned char)number);
+      } else if (number < 0 && number >= -32) {
+        buffer_put_byte(buffer, (unsigned char)(number & 0xff));
+      } else if (number >= INT32_MIN && number <= INT32_MAX) {
+        buffer_put_byte(buffer, 0xd2);
+        buffer_put_be(buffer, (uint32_t)(int32_t)number, 4);
+      } else {
+        buffer_put_byte(buffer, 0xd3);
+        buffer_put_be(buffer, (uint64_t)number, 8);
+      }
+      break;
+    }
+    case JSON_REAL:
+      buffer_put_byte(buffer, 0xcb);
+      buffer_put_be(buffer, double_bits(json_real_value(value)), 8);
+      break;
+    case JSON_TRUE:
+      buffer_put_byte(buffer, 0xc3);
+      break;
+    case JSON_FALSE:
+      buffer_put_byte(buffer, 0xc2);
+      break;
+    default:
+      buffer_put_byte(buffer, 0xc0);
+      break;
+  }
+}
+
+// CBOR encoder (RFC 8949, definite lengths only)
+static void cbor_put_head(byte_buffer *buffer, unsigned char major, uint64_t argument) {
+  const unsigned char type = (unsigned char)(major << 5);
+  if (argument < 24) {
+    buffer_put_byte(buffer, (unsigned char)(type | argument));
+  } else if (argument <= 0xff) {
+    buffer_put_byte(buffer, type | 24);
+    buffer_put_be(buffer, argument, 1);
+  } else if (argument <= 0xffff) {
+    buffer_put_byte(buffer, type | 25);
+    buffer_put_be(buffer, argument, 2);
+  } else if (argument <= 0xffffffffULL) {
+    buffer_put_byte(buffer, type | 26);
+    buffer_put_be(buffer, argument, 4);
+  } else {
+    buffer_put_byte(buffer, type | 27);
+    buffer_put_be(buffer, argument, 8);
+  }
+}
+
+static void cbor_encode(byte_buffer *buffer, const json_t *value) {
+  switch (json_typeof(value)) {
+    case JSON_OBJECT: {
+      const char *key;
+      json_t *member;
+      cbor_put_head(buffer, 5, json_object_size(value));
+      json_object_foreach((json_t *)value, key, member) {
+        const size_t key_len = strlen(key);
+        cbor_put_head(buffer, 3, key_len);
+        byte_buffer_append(buffer, key, key_len);
+        cbor_encode(buffer, member);
+      }
+      break;
+    }
+    case JSON_ARRAY: {
+      size_t index;
+      json_t *element;
+      cbor_put_head(buffer, 4, json_array_size(value));
+      json_array_foreach(value, index, element) {
+        cbor_encode(buffer, element);
+      }
+      break;
+    }
+    case JSON_STRING:
+      cbor_put_head(buffer, 3, json_string_length(value));
+      byte_buffer_append(buffer, json_string_value(value), json_string_length(value));
+      break;
+    case JSON_INTEGER: {
+      const json_int_t number = json_integer_value(value);
+      if (number >= 0) {
+        cbor_put_head(buffer, 0, (uint64_t)number);
+      } else {
+        cbor_put_head(buffer, 1, (uint64_t)(-(number + 1)));
+      }
+      break;
+    }
+    case JSON_REAL:
+      buffer_put_byte(buffer, 0xfb);
+      buffer_put_be(buffer, double_bits(json_real_value(value)), 8);
+      break;
+    case JSON_TRUE:
+      buffer_put_byte(buffer, 0xf5);
+      break;
+    case JSON_FALSE:
+      buffer_put_byte(buffer, 0xf4);
+      break;
+    default:
+      buffer_put_byte(buffer, 0xf6);
+      break;
+  }
+}
+
+// Decoders share a bounds-checked reader
+typedef struct {
+  const unsigned char *data;
+  size_t size;
+  size_t pos;
+} byte_reader;
+
+static int reader_get_be(byte_reader *reader, int width, uint64_t *value) {
+  if (reader->size - reader->pos < (size_t)width) {
+    return 1;
+  }
+  *value = 0;
+  for (int i = 0; i < width; i++) {
+    *value = (*value << 8) | reader->data[reader->pos++];
+  }
+  return 0;
+}
+
+static json_t *reader_get_string(byte_reader *reader, uint64_t len) {
+  if (reader->size - reader->pos < len) {
+    return NULL;
+  }
+  json_t *string = json_stringn((const char *)reader->data + reader->pos, (size_t)len);
+  reader->pos += (size_t)len;
+  return string;
+}
+
+static json_t *decode_real(uint64_t bits) {
+  double value;
+  memcpy(&value, &bits, sizeof(value));
+  return json_real(value);
+}
+
+static json_t *msgpack_decode(byte_reader *reader, int depth);
+
+static json_t *msgpack_decode_container(byte_reader *reader, uint64_t count, int is_map, int depth) {
+  // Every element needs at least one byte, which bounds hostile counts
+  if (count > reader->size - reader->pos) {
+    return NULL;
+  }
+  json_t *container = is_map ? json_object() : json_array();
+  for (uint64_t i = 0; i < count; i++) {
+    if (is_map) {
+      json_t *key = msgpack_decode(reader, depth + 1);
+      json_t *member = key && json_is_string(key) ? msgpack_decode(reader, depth + 1) : NULL;
+      if (!member) {
+        json_decref(key);
+        json_decref(container);
+        return NULL;
+      }
+      json_object_set_new(container, json_string_value(key), member);
+      json_decref(key);
+    } else {
+      json_t *element = msgpack_decode(reader, depth + 1);
+      if (!element) {
+        json_decref(container);
+        return NULL;
+      }
+      json_array_append_new(container, element);
+    }
+  }
+  return container;
+}
+
+static json_t *msgpack_decode(byte_reader *reader, int depth) {
+  if (depth > BODY_FORMAT_MAX_DEPTH || reader->pos >= reader->size) {
+    return NULL;
+  }
+  const unsigned char tag = reader->data[reader->pos++];
+  uint64_t value;
+
+  if (tag <= 0x7f) return json_integer(tag);
+  if (tag >= 0xe0) return json_integer((int8_t)tag);
+  if ((tag & 0xf0) == 0x80) return msgpack_decode_container(reader, tag & 0x0f, 1, depth);
+  if ((tag & 0xf0) == 0x90) return msgpack_decode_container(reader, tag & 0x0f, 0, depth);
+  if ((tag & 0xe0) == 0xa0) return reader_get_string(reader, tag & 0x1f);
+
+  switch (tag) {
+    case 0xc0: return json_null();
+    case 0xc2: return json_false();
+    case 0xc3: return json_true();
+    case 0xca: {
+      if (reader_get_be(reader, 4, &value)) return NULL;
+      const uint32_t bits = (uint32_t)value;
+      float real;
+      memcpy(&real, &bits, sizeof(real));
+      return json_real(real);
+    }
+    case 0xcb: return reader_get_be(reader, 8, &value) ? NULL : decode_real(value);
+    case 0xcc: return reader_get_be(reader, 1, &value) ? NULL : json_integer((json_int_t)value);
+    case 0xcd: return reader_get_be(reader, 2, &value) ? NULL : json_integer((json_int_t)value);
+    case 0xce: return reader_get_be(reader, 4, &value) ? NULL : json_integer((json_int_t)value);
+    case 0xcf: return reader_get_be(reader, 8, &value) || value > INT64_MAX ? NULL : json_integer((json_int_t)value);
+    case 0xd0: return reader_get_be(reader, 1, &value) ? NULL : json_integer((int8_t)value);
+    case 0xd1: return reader_get_be(reader, 2, &value) ? NULL : json_integer((int16_t)value);
+    case 0xd2: return reader_get_be(reader, 4, &value) ? NULL : json_integer((int32_t)value);
+    case 0xd3: return reader_get_be(reader, 8, &value) ? NULL : json_integer((int64_t)value);
+    case 0xd9: return reader_get_be(reader, 1, &value) ? NULL : reader_get_string(reader, value);
+    case 0xda: return reader_get_be(reader, 2, &value) ? NULL : reader_get_string(reader, value);
+    case 0xdb: return reader_get_be(reader, 4, &value) ? NULL : reader_get_string(reader, value);
+    case 0xdc: return reader_get_be(reader, 2, &value) ? NULL : msgpack_decode_container(reader, value, 0, depth);
+    case 0xdd: return reader_get_be(reader, 4, &value) ? NULL : msgpack_decode_container(reader, value, 0, depth);
+    case 0xde: return reader_get_be(reader, 2, &value) ? NULL : msgpack_decode_container(reader, value, 1, depth);
+    case 0xdf: return reader_get_be(reader, 4, &value) ? NULL : msgpack_decode_container(reader, value, 1, depth);
+    default: return NULL; // bin, ext and reserved tags have no JSON equivalent
+  }
+}
+
+static json_t *cbor_decode(byte_reader *reader, int depth) {
+  if (depth > BODY_FORMAT_MAX_DEPTH || reader->pos >= reader->size) {
+    return NULL;
+  }
+  const unsigned char initial = reader->data[reader->pos++];
+  const unsigned char major = initial >> 5;
+  const unsigned char info = initial & 0x1f;
+
+  if (major == 7) {
+    uint64_t bits;
+    switch (info) {
+      case 20: return json_false();
+      case 21: return json_true();
+      case 22: return json_null();
+      case 26: {
+        if (reader_get_be(reader, 4, &bits)) return NULL;
+        const uint32_t bits32 = (uint32_t)bits;
+        float real;
+        memcpy(&real, &bits32, sizeof(real));
+        return json_real(real);
+      }
+      case 27: return reader_get_be(reader, 8, &bits) ? NULL : decode_real(bits);
+      default: return NULL; // half floats, undefined and break are not accepted
+    }
+  }
+
+  uint64_t argument = info;
+  if (info >= 24 && info <= 27) {
+    if (reader_get_be(reader, 1 << (info - 24), &argument)) return NULL;
+  } else if (info > 27) {
+    return NULL; // indefinite lengths are not accepted
+  }
+
+  switch (major) {
+    case 0: return argument > INT64_MAX ? NULL : json_integer((json_int_t)argument);
+    case 1: return argument > INT64_MAX ? NULL : json_integer(-1 - (json_int_t)argument);
+    case 3: return reader_get_string(reader, argument);
+    case 4:
+    case 5: {
+      if (argument > reader->size - reader->pos) {
+        return NULL;
+      }
+      json_t *container = major == 5 ? json_object() : json_array();
+      for (uint64_t i = 0; i < argument; i++) {
+        json_t *key = major == 5 ? cbor_decode(reader, depth + 1) : NULL;
+        if (major == 5 && !json_is_string(key)) {
+          json_decref(key);
+          json_decref(container);
+          return NULL;
+        }
+        json_t *element = cbor_decode(reader, depth + 1);
+        if (!element) {
+          json_decref(key);
+          json_decref(container);
+          return NULL;
+        }
+        if (major == 5) {
+          json_object_set_new(container, json_string_value(key), element);
+          json_decref(key);
+        } else {
+          json_array_append_new(container, element);
+        }
+      }
+      return container;
+    }
+    default: return NULL; // byte strings and tags have no JSON equivalent
+  }
+}
+
+// Returns 1 if the header value contains the media type as a whole token
+static int header_has_media_type(const char *header, const char *media_type) {
+  const size_t len = strlen(media_type);
+  for (const char *match = header ? strstr(header, media_type) : NULL; match; match = strstr(match + 1, media_type)) {
+    const char after = match[len];
+    if ((match == header || match[-1] == ' ' || match[-1] == ',') && (after == '\0' || after == ',' || after == ';' || after == ' ')) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Media types per format, in tie-break order (JSON wins ties)
+static const char *const format_media_types[][2] = {
+  [BODY_FORMAT_JSON] = {"application/json", NULL},
+  [BODY_FORMAT_MSGPACK] = {"application/msgpack", "application/x-msgpack"},
+  [BODY_FORMAT_CBOR] = {"application/cbor", NULL},
+};
+#define FORMAT_COUNT (sizeof(format_media_types) / sizeof(format_media_types[0]))
+
+// Quality of each format under an Accept header: the q of the most specific
+// matching range (exact type, then application/*, then */*), -1 if none matches
+static void accept_qualities(const char *accept, double quality[FORMAT_COUNT]) {
+  int specificity[FORMAT_COUNT] = {0};
+  for (size_t f = 0; f < FORMAT_COUNT; f++) {
+    quality[f] = -1;
+  }
+  for (const char *p = accept; p && *p;) {
+    while (*p == ' ' || *p == ',') p++;
+    const size_t range_len = strcspn(p, ",;");
+    size_t type_len = range_len;
+    while (type_len > 0 && p[type_len - 1] == ' ') type_len--;
+    const char *type = p;
+    p += range_len;
+
+    double q = 1;
+    while (*p == ';') { // parameters; only q is used
+      p++;
+      while (*p == ' ') p++;
+      if ((p[0] == 'q' || p[0] == 'Q') && p[1] == '=') {
+        q = strtod(p + 2, NULL);
+      }
+      p += strcspn(p, ",;");
+    }
+
+    int level = 0;
+    if (type_len == 3 && strncmp(type, "*/*", 3) == 0) {
+      level = 1;
+    } else if (type_len == 13 && strncasecmp(type, "application/*", 13) == 0) {
+      level = 2;
+    }
+    for (size_t f = 0; f < FORMAT_COUNT; f++) {
+      int match = level;
+      for (int m = 0; m < 2 && !match && format_media_types[f][m]; m++) {
+        const char *media_type = format_media_types[f][m];
+        if (strlen(media_type) == type_len && strncasecmp(type, media_type, type_len) == 0) {
+          match = 3;
+        }
+      }
+      if (match > specificity[f]) {
+        specificity[f] = match;
+        quality[f] = q;
+      }
+    }
+  }
+}
+
+body_format body_format_from_accept(const char *accept) {
+  double quality[FORMAT_COUNT];
+  accept_qualities(accept, quality);
+  // Highest q wins, q=0 means refused; JSON when nothing supported is acceptable
+  body_format best = BODY_FORMAT_JSON;
+  double best_q = 0;
+  for (size_t f = 0; f < FORMAT_COUNT; f++) {
+    if (quality[f] > best_q) {
+      best = (body_format)f;
+      best_q = quality[f];
+    }
+  }
+  return best;
+}
+
+body_format body_format_from_content_type(const char *content_type) {
+  if (header_has_media_type(content_type, "application/msgpack") || header_has_media_type(content_type, "application/x-msgpack")) {
+    return BODY_FORMAT_MSGPACK;
+  }
+  if (header_has_media_type(content_type, "application/cbor")) {
+    return BODY_FORMAT_CBOR;
+  }
+  return BODY_FORMAT_JSON;
+}
+
+const char *body_format_mime_type(body_format format) {
+  switch (format) {
+    case BODY_FORMAT_MSGPACK: return "application/msgpack";
+    case BODY_FORMAT_CBOR: return "application/cbor";
+    default: return "application/json";
+  }
+}
+
+int body_format_encode(body_format format, const json_t *value, char **out, size_t *out_len) {
+  *out = NULL;
+  *out_len = 0;
+  if (format == BODY_FORMAT_JSON) {
+    // json_dumps allocates through jansson's (counted) allocator; hand back
+    // a malloc'd copy so every format is released with free()
+    char *dumped = json_dumps(value, JSON_COMPACT);
+    if (dumped == NULL) {
+      return 1;
+    }
+    const size_t len = strlen(dumped);
+    *out = malloc(len + 1);
+    if (*out) {
+      memcpy(*out, dumped, len + 1);
+      *out_len = len;
+    }
+    json_free_t free_json;
+    json_get_alloc_funcs(NULL, &free_json);
+    free_json(dumped);
+    return *out ? 0 : 1;
+  }
+
+  byte_buffer buffer = { 0 };
+  if (format == BODY_FORMAT_MSGPACK) {
+    msgpack_encode(&buffer, value);
+  } else {
+    cbor_encode(&buffer, value);
+  }
+  if (buffer.failed) {
+    free(buffer.data);
+    return 1;
+  }
+  *out = buffer.data;
+  *out_len = buffer.size;
+  return 0;
+}
+
+json_t *body_format_decode(body_format format, const char *data, size_t len) {
+  if (format == BODY_FORMAT_JSON) {
+    return json_loadb(data, len, 0, NULL);
+  }
+
+  byte_reader reader = { .data = (const unsigned char *)data, .size = len, .pos = 0 };
+  json_t *value = format == BODY_FORMAT_MSGPACK ? msgpack_decode(&reader, 0) : cbor_decode(&reader, 0);
+  if (value && reader.pos != reader.size) {
+    json_decref(value); // Trailing bytes after the top-level value
+    return NULL;
+  }
+  return value;
+}
+
+static int set_encoded_body_response(const struct _u_request *request, struct _u_response *response, unsigned int status, const json_t *body) {
+  const body_format format = body_format_from_accept(u_map_get_case(request->map_header, "Accept"));
+  u_map_put(response->map_header, "Vary", "Accept");
+  if (format == BODY_FORMAT_JSON) {
+    return ulfius_set_json_body_response(response, status, body);
+  }
+
+  char *encoded;
+  size_t encoded_len;
+  if (body_format_encode(format, body, &encoded, &encoded_len) != 0) {
+    return U_ERROR_MEMORY;
+  }
+  const int result = ulfius_set_binary_body_response(response, status, encoded, encoded_len);
+  u_map_put(response->map_header, "Content-Type", body_format_mime_type(format));
+  free(encoded);
+  return result;
+}
+
+int set_negotiated_body_response(const struct _u_request *request, struct _u_response *response, unsigned int status, const json_t *body) {
+  const uint64_t span = trace_begin();
+  const int result = set_encoded_body_response(request, response, status, body);
+  trace_end("serialize", span);
+  return result;
+}
+
+static json_t *decode_body_request(const struct _u_request *request) {
+  const body_format format = body_format_from_content_type(u_map_get_case(request->map_header, "Content-Type"));
+  if (format == BODY_FORMAT_JSON) {
+    return ulfius_get_json_body_request(request, NULL);
+  }
+  if (!request->binary_body || request->binary_body_length == 0) {
+    return NULL;
+  }
+  return body_format_decode(format, request->binary_body, request->binary_body_length);
+}
+
+json_t *get_negotiated_body_request(const struct _u_request *request) {
+  const uint64_t span = trace_begin();
+  json_t *body = decode_body_request(request);
+  trace_end("parse", span);
+  return body;
+}
@@ -0,0 +1,35 @@
+#ifndef BODY_FORMAT_H
+#define BODY_FORMAT_H
+
+#include <jansson.h>
+#include <ulfius.h>
+
+// Content negotiation between JSON, MessagePack and CBOR.
+// Handlers keep building jansson trees; the chosen wire format is applied
+// only when the body is written out or read in.
+
+typedef enum { BODY_FORMAT_JSON = 0, BODY_FORMAT_MSGPACK = 1, BODY_FORMAT_CBOR = 2 } body_format;
+
+// Picks the response format from an Accept header (JSON when absent or unknown)
+body_format body_format_from_accept(const char *accept);
+
+// Picks the request format from a Content-Type header (JSON when absent or unknown)
+body_format body_format_from_content_type(const char *content_type);
+
+// MIME type sent in Content-Type for the format
+const char *body_format_mime_type(body_format format);
+
+// Serializes value; *out is malloc'd (for JSON too, not jansson-allocated) and must
+// be freed with free(). Returns 0 on success.
+int body_format_encode(body_format format, const json_t *value, char **out, size_t *out_len);
+
+// Parses a body in the given format, NULL if it is malformed
+json_t *body_format_decode(body_format format, const char *data, size_t len);
+
+// Sets the response body in the format requested by the Accept header
+int set_negotiated_body_response(const struct _u_request *request, struct _u_response *response, unsigned int status, const json_t *body);
+
+// Parses the request body according to its Content-Type, NULL if it is missing or malformed
+json_t *get_negotiated_body_request(const struct _u_request *request);
+
+#endif // BODY_FORMAT_H
@@ -0,0 +1,38 @@
+#include "byte_buffer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+int byte_buffer_append(byte_buffer *buffer, const void *data, size_t len) {
+  if (buffer->failed) {
+    return 1;
+  }
+  if (buffer->size + len > buffer->capacity) {
+    size_t capacity = buffer->capacity ? buffer->capacity * 2 : 256;
+    while (capacity < buffer->size + len) {
+      capacity *= 2;
+    }
+    char *grown = realloc(buffer->data, capacity);
+    if (grown == NULL) {
+      buffer->failed = 1;
+      return 1;
+    }
+    buffer->data = grown;
+    buffer->capacity = capacity;
+  }
+  if (len > 0) {
+    memcpy(buffer->data + buffer->size, data, len);
+    buffer->size += len;
+  }
+  return 0;
+}
+
+void byte_buffer_clear(byte_buffer *buffer) {
+  buffer->size = 0;
+  buffer->failed = 0;
+}
+
+void byte_buffer_free(byte_buffer *buffer) {
+  free(buffer->data);
+  memset(buffer, 0, sizeof(*buffer));
+}
@@ -0,0 +1,27 @@
+#ifndef BYTE_BUFFER_H
+#define BYTE_BUFFER_H
+
+#include <stddef.h>
+
+// Growable byte buffer shared by the encoders, journals and streams. The
+// capacity doubles as it fills. Once an allocation fails, failed stays set
+// and later appends are dropped, so a caller can append several parts and
+// check once.
+
+typedef struct {
+  char *data;
+  size_t size;
+  size_t capacity;
+  int failed;
+} byte_buffer;
+
+// Appends len bytes. Returns 0, or 1 if the buffer has failed.
+int byte_buffer_append(byte_buffer *buffer, const void *data, size_t len);
+
+// Empties the buffer for reuse, keeping its capacity
+void byte_buffer_clear(byte_buffer *buffer);
+
+// Releases the data and zeroes the buffer
+void byte_buffer_free(byte_buffer *buffer);
+
+#endif // BYTE_BUFFER_H
@@ -0,0 +1,468 @@
+#include "changes.h"
+
+#include "config.h"
+#include "cors.h"
+#include "json_response.h"
+#include "listener.h"
+
+#include <errno.h>
+#include <microhttpd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sqlite3.h>
+
+#define CHANGES_MAX_STAGED 256
+#define CHANGES_STREAM_BLOCK_SIZE 4096
+#define CHANGES_PATH "/api/changes"
+// Per-connection pool: request headers plus one stream block; kept small
+// since thousands of idle streams each hold one
+#define CHANGES_CONNECTION_MEMORY 16384
+// Connections past the subscriber cap that MHD still accepts, so they can be
+// answered 503 rather than dropped
+#define CHANGES_SPARE_CONNECTIONS 16
+#define CHANGES_MAX_OPTIONS (6 + LISTENER_TLS_OPTIONS)
+
+typedef enum { CHANGE_INSERT = 0, CHANGE_UPDATE = 1, CHANGE_DELETE = 2, CHANGE_RESET = 3 } change_op;
+
+static const char *const change_op_names[] = { "insert", "update", "delete", "reset" };
+
+// Tables that carry a version counter; index doubles as the table id in events
+static const char *const tracked_tables[] = { "Patients", "Doctors", "Appointments", "MedicalRecords" };
+#define TRACKED_TABLE_COUNT (sizeof(tracked_tables) / sizeof(tracked_tables[0]))
+
+typedef struct {
+  uint64_t id;        // global sequence, used as the SSE event id
+  uint64_t version;   // table version after this change
+  int64_t rowid;
+  unsigned char table;
+  unsigned char op;
+} change_event;
+
+typedef struct {
+  int64_t rowid;
+  unsigned char table;
+  unsigned char op;
+} staged_change;
+
+// One open stream. While it has nothing to send, its connection is suspended
+// in MHD and the subscriber sits on hub.waiting until the fan-out thread
+// resumes it.
+typedef struct changes_subscriber {
+  uint64_t last_id;
+  uint64_t heartbeat;  // hub.heartbeat when this stream last sent something
+  struct MHD_Connection *connection;
+  struct changes_subscriber *next_waiting;
+} changes_subscriber;
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t published; // waited on by the fan-out thread only
+  pthread_cond_t drained;   // subscribers reached 0
+  change_event *ring;
+  size_t capacity;
+  uint64_t next_id;   // id of the next event to publish; events [next_id - count, next_id) are in the ring
+  size_t count;
+  uint64_t table_versions[TRACKED_TABLE_COUNT];
+  staged_change staged[CHANGES_MAX_SOURCES][CHANGES_MAX_STAGED];
+  size_t staged_count[CHANGES_MAX_SOURCES];
+  int staged_overflow[CHANGES_MAX_SOURCES];
+  changes_subscriber *waiting; // suspended streams, all caught up
+  uint64_t heartbeat;          // bumped every heartbeat by the fan-out thread
+  int subscribers;
+  int max_subscribers;
+  int heartbeat_seconds;
+  int closing;
+  struct MHD_Daemon *daemon;
+  pthread_t fan_out;
+  int fan_out_started;
+  int port;
+  int tls;
+} hub = { .lock = PTHREAD_MUTEX_INITIALIZER, .published = PTHREAD_COND_INITIALIZER,
+          .drained = PTHREAD_COND_INITIALIZER, .next_id = 1 };
+
+static int table_index(const char *table) {
+  for (size_t i = 0; i < TRACKED_TABLE_COUNT; i++) {
+    if (strcmp(tracked_tables[i], table) == 0) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+int changes_init(void) {
+  const int capacity = config_get_int("HEALTH_CHANGES_RING", 4096);
+  hub.ring = calloc(capacity > 0 ? (size_t)capacity : 1, sizeof(change_event));
+  if (!hub.ring) {
+    fprintf(stderr, "Cannot allocate change ring\n");
+    return 1;
+  }
+  hub.capacity = capacity > 0 ? (size_t)capacity : 1;
+  // Idle streams cost a suspended connection and a file descriptor, no thread
+  hub.max_subscribers = config_get_int("HEALTH_CHANGES_MAX_SUBSCRIBERS", 10000);
+  hub.heartbeat_seconds = config_get_int("HEALTH_CHANGES_HEARTBEAT", 15);
+  if (hub.heartbeat_seconds < 1) {
+    hub.heartbeat_seconds = 1;
+  }
+  hub.closing = 0;
+  return 0;
+}
+
+size_t changes_memory_bytes(void) {
+  return hub.capacity * sizeof(change_event);
+}
+
+// Appends one event to the ring; caller holds hub.lock
+static void publish_locked(int table, change_op op, int64_t rowid) {
+  change_event *event = &hub.ring[hub.next_id % hub.capacity];
+  event->id = hub.next_id++;
+  event->table = (unsigned char)table;
+  event->op = (unsigned char)op;
+  event->rowid = rowid;
+  event->version = op == CHANGE_RESET ? 0 : ++hub.table_versions[table];
+  if (hub.count < hub.capacity) {
+    hub.count++;
+  }
+}
+
+void changes_stage(int source, int sqlite_op, const char *table, int64_t rowid) {
+  const int index = table_index(table);
+  if (index < 0 || source < 0 || source >= CHANGES_MAX_SOURCES) {
+    return;
+  }
+
+  pthread_mutex_lock(&hub.lock);
+  if (hub.staged_count[source] < CHANGES_MAX_STAGED) {
+    staged_change *change = &hub.staged[source][hub.staged_count[source]++];
+    change->table = (unsigned char)index;
+    change->op = sqlite_op == SQLITE_INSERT ? CHANGE_INSERT : sqlite_op == SQLITE_DELETE ? CHANGE_DELETE : CHANGE_UPDATE;
+    change->rowid = rowid;
+  } else {
+    hub.staged_overflow[source] = 1;
+  }
+  pthread_mutex_unlock(&hub.lock);
+}
+
+void changes_commit(int source) {
+  if (source < 0 || source >= CHANGES_MAX_SOURCES) {
+    return;
+  }
+  pthread_mutex_lock(&hub.lock);
+  if (hub.ring && (hub.staged_count[source] > 0 || hub.staged_overflow[source])) {
+    for (size_t i = 0; i < hub.staged_count[source]; i++) {
+      const staged_change *change = &hub.staged[source][i];
+      publish_locked(change->table, (change_op)change->op, change->rowid);
+    }
+    if (hub.staged_overflow[source]) {
+      // Too many rows in one transaction to describe individually
+      for (size_t i = 0; i < TRACKED_TABLE_COUNT; i++) {
+        hub.table_versions[i]++;
+      }
+      publish_locked(0, CHANGE_RESET, 0);
+    }
+    pthread_cond_broadcast(&hub.published);
+  }
+  hub.staged_count[source] = 0;
+  hub.staged_overflow[source] = 0;
+  pthread_mutex_unlock(&hub.lock);
+}
+
+void changes_rollback(int source) {
+  if (source < 0 || source >= CHANGES_MAX_SOURCES) {
+    return;
+  }
+  pthread_mutex_lock(&hub.lock);
+  hub.staged_count[source] = 0;
+  hub.staged_overflow[source] = 0;
+  pthread_mutex_unlock(&hub.lock);
+}
+
+uint64_t changes_table_version(const char *table) {
+  const int index = table_index(table);
+  if (index < 0) {
+    return 0;
+  }
+  pthread_mutex_lock(&hub.lock);
+  const uint64_t version = hub.table_versions[index];
+  pthread_mutex_unlock(&hub.lock);
+  return version;
+}
+
+// Resumes a detached list of suspended streams. next_waiting is read before
+// each resume: a resumed stream may park itself again right away.
+static void resume_all(changes_subscriber *waiting) {
+  while (waiting) {
+    changes_subscriber *next = waiting->next_waiting;
+    MHD_resume_connection(waiting->connection);
+    waiting = next;
+  }
+}
+
+// Fan-out thread: the only waiter on hub.published. After every publish, and
+// once per heartbeat, it resumes the suspended streams so they send what is
+// new (or a keep-alive), so writers pay one broadcast however many streams
+// are open.
+static void *fan_out_main(void *arg) {
+  pthread_mutex_lock(&hub.lock);
+  uint64_t seen = hub.next_id;
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += hub.heartbeat_seconds;
+  while (!hub.closing) {
+    int rc = 0;
+    while (hub.next_id == seen && !hub.closing && rc != ETIMEDOUT) {
+      rc = pthread_cond_timedwait(&hub.published, &hub.lock, &deadline);
+    }
+    if (rc == ETIMEDOUT) {
+      hub.heartbeat++;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += hub.heartbeat_seconds;
+    }
+    seen = hub.next_id;
+    changes_subscriber *waiting = hub.waiting;
+    hub.waiting = NULL;
+    pthread_mutex_unlock(&hub.lock);
+    resume_all(waiting);
+    pthread_mutex_lock(&hub.lock);
+  }
+  // Streams no longer park once closing is set, so this empties the list
+  changes_subscriber *waiting = hub.waiting;
+  hub.waiting = NULL;
+  pthread_mutex_unlock(&hub.lock);
+  resume_all(waiting);
+  return NULL;
+}
+
+static int format_event(const change_event *event, char *buf, size_t max) {
+  if (event->op == CHANGE_RESET) {
+    return snprintf(buf, max, "id: %llu\nevent: reset\ndata: {}\n\n", (unsigned long long)event->id);
+  }
+  return snprintf(buf, max,
+                  "id: %llu\nevent: change\ndata: {\"table\":\"%s\",\"op\":\"%s\",\"id\":%lld,\"version\":%llu}\n\n",
+                  (unsigned long long)event->id, tracked_tables[event->table], change_op_names[event->op],
+                  (long long)event->rowid, (unsigned long long)event->version);
+}
+
+// Content reader, run on the daemon's epoll thread: sends every event after
+// the subscriber's cursor, or a keep-alive comment if a heartbeat went by
+// since it last sent anything. With neither, the connection is suspended
+// and 0 returned; it is called again once the fan-out thread resumes it.
+static ssize_t changes_stream_read(void *cls, uint64_t offset, char *out_buf, size_t max) {
+  changes_subscriber *subscriber = (changes_subscriber *)cls;
+
+  pthread_mutex_lock(&hub.lock);
+  if (hub.closing) {
+    pthread_mutex_unlock(&hub.lock);
+    return MHD_CONTENT_READER_END_OF_STREAM;
+  }
+
+  if (subscriber->last_id + 1 >= hub.next_id) {
+    if (subscriber->heartbeat != hub.heartbeat) {
+      subscriber->heartbeat = hub.heartbeat;
+      pthread_mutex_unlock(&hub.lock);
+      return snprintf(out_buf, max, ": keepalive\n\n");
+    }
+    subscriber->next_waiting = hub.waiting;
+    hub.waiting = subscriber;
+    MHD_suspend_connection(subscriber->connection);
+    pthread_mutex_unlock(&hub.lock);
+    return 0;
+  }
+
+  size_t written = 0;
+  const uint64_t oldest_id = hub.next_id - hub.count;
+  if (subscriber->last_id + 1 < oldest_id) {
+    // Cursor fell off the ring: tell the client to refetch, then continue from the oldest event
+    const int len = snprintf(out_buf, max, "event: reset\ndata: {}\n\n");
+    written = len > 0 && (size_t)len < max ? (size_t)len : 0;
+    subscriber->last_id = oldest_id - 1;
+  }
+
+  while (subscriber->last_id + 1 < hub.next_id) {
+    const change_event *event = &hub.ring[(subscriber->last_id + 1) % hub.capacity];
+    const int len = format_event(event, out_buf + written, max - written);
+    if (len < 0 || (size_t)len >= max - written) {
+      break;
+    }
+    written += (size_t)len;
+    subscriber->last_id = event->id;
+  }
+  subscriber->heartbeat = hub.heartbeat;
+  pthread_mutex_unlock(&hub.lock);
+  return (ssize_t)written;
+}
+
+static void changes_stream_free(void *cls) {
+  pthread_mutex_lock(&hub.lock);
+  if (--hub.subscribers == 0) {
+    pthread_cond_broadcast(&hub.drained);
+  }
+  pthread_mutex_unlock(&hub.lock);
+  free(cls);
+}
+
+static enum MHD_Result queue_error(struct MHD_Connection *connection, unsigned int status, const char *body,
+                                   const char *origin) {
+  struct MHD_Response *response = MHD_create_response_from_buffer(strlen(body), (void *)body, MHD_RESPMEM_PERSISTENT);
+  if (response == NULL) {
+    return MHD_NO;
+  }
+  MHD_add_response_header(response, "Content-Type", "application/json");
+  if (status == 503) {
+    MHD_add_response_header(response, "Retry-After", "5");
+  }
+  set_cors_mhd_headers(response, origin);
+  const enum MHD_Result queued = MHD_queue_response(connection, status, response);
+  MHD_destroy_response(response);
+  return queued;
+}
+
+// Access handler of the feed's daemon, which serves nothing but GET /api/changes
+static enum MHD_Result on_request(void *cls, struct MHD_Connection *connection, const char *url, const char *method,
+                                  const char *version, const char *upload_data, size_t *upload_data_size,
+                                  void **con_cls) {
+  const char *origin = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Origin");
+  if (strcmp(url, CHANGES_PATH) != 0) {
+    return queue_error(connection, 404, "{\"error\":\"Not Found\"}", origin);
+  }
+  if (strcmp(method, "GET") != 0) {
+    return queue_error(connection, 405, "{\"error\":\"Method Not Allowed\"}", origin);
+  }
+  const char *last_event_id = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Last-Event-ID");
+
+  pthread_mutex_lock(&hub.lock);
+  if (hub.closing || !hub.ring || hub.subscribers >= hub.max_subscribers) {
+    pthread_mutex_unlock(&hub.lock);
+    return queue_error(connection, 503, "{\"error\":\"Service Unavailable: too many change subscribers\"}", origin);
+  }
+
+  changes_subscriber *subscriber = malloc(sizeof(changes_subscriber));
+  if (!subscriber) {
+    pthread_mutex_unlock(&hub.lock);
+    return queue_error(connection, 500, "{\"error\":\"Internal Server Error\"}", origin);
+  }
+  // Without Last-Event-ID only changes made from now on are sent
+  subscriber->last_id = last_event_id ? strtoull(last_event_id, NULL, 10) : hub.next_id - 1;
+  if (subscriber->last_id >= hub.next_id) {
+    subscriber->last_id = hub.next_id - 1;
+  }
+  // Opens with a keep-alive comment, so the headers go out before the first park
+  subscriber->heartbeat = hub.heartbeat - 1;
+  subscriber->connection = connection;
+  subscriber->next_waiting = NULL;
+  hub.subscribers++;
+  pthread_mutex_unlock(&hub.lock);
+
+  struct MHD_Response *response = MHD_create_response_from_callback(
+      MHD_SIZE_UNKNOWN, CHANGES_STREAM_BLOCK_SIZE, &changes_stream_read, subscriber, &changes_stream_free);
+  if (response == NULL) {
+    changes_stream_free(subscriber);
+    return queue_error(connection, 500, "{\"error\":\"Internal Server Error\"}", origin);
+  }
+  MHD_add_response_header(response, "Content-Type", "text/event-stream");
+  MHD_add_response_header(response, "Cache-Control", "no-cache");
+  MHD_add_response_header(response, "X-Accel-Buffering", "no");
+  set_cors_mhd_headers(response, origin);
+  const enum MHD_Result queued = MHD_queue_response(connection, 200, response);
+  MHD_destroy_response(response);
+  return queued;
+}
+
+int changes_start(int port, int reuse_port, int tls) {
+  struct MHD_OptionItem options[CHANGES_MAX_OPTIONS];
+  int n = 0;
+  options[n++] = (struct MHD_OptionItem){MHD_OPTION_CONNECTION_LIMIT, hub.max_subscribers + CHANGES_SPARE_CONNECTIONS, NULL};
+  options[n++] = (struct MHD_OptionItem){MHD_OPTION_CONNECTION_MEMORY_LIMIT, CHANGES_CONNECTION_MEMORY, NULL};
+  if (reuse_port) {
+    options[n++] = (struct MHD_OptionItem){MHD_OPTION_LISTENING_ADDRESS_REUSE, 1, NULL};
+  }
+  // One epoll thread serves every stream; idle ones are suspended, not polled
+  unsigned int flags = MHD_USE_EPOLL_INTERNAL_THREAD | MHD_ALLOW_SUSPEND_RESUME | MHD_USE_ERROR_LOG;
+  if (tls) {
+    const int added = listener_tls_options(&options[n]);
+    if (added < 0) {
+      return 1;
+    }
+    flags |= MHD_USE_TLS;
+    n += added;
+  }
+  options[n++] = (struct MHD_OptionItem){MHD_OPTION_END, 0, NULL};
+
+  if (pthread_create(&hub.fan_out, NULL, &fan_out_main, NULL) != 0) {
+    fprintf(stderr, "Cannot start the change feed fan-out thread\n");
+    return 1;
+  }
+  hub.fan_out_started = 1;
+  hub.daemon = MHD_start_daemon(flags, (uint16_t)port, NULL, NULL, &on_request, NULL, MHD_OPTION_ARRAY, options,
+                                MHD_OPTION_END);
+  if (hub.daemon == NULL) {
+    fprintf(stderr, "Cannot start the change feed on port %d\n", port);
+    return 1;
+  }
+  hub.port = port;
+  hub.tls = tls;
+  printf("Change feed on port %d, up to %d subscribers\n", port, hub.max_subscribers);
+  return 0;
+}
+
+void changes_close(void) {
+  pthread_mutex_lock(&hub.lock);
+  hub.closing = 1;
+  pthread_cond_broadcast(&hub.published);
+  pthread_mutex_unlock(&hub.lock);
+
+  // The fan-out thread resumes every parked stream on its way out; resumed
+  // streams end, and the daemon closes whatever is left
+  if (hub.fan_out_started) {
+    pthread_join(hub.fan_out, NULL);
+    hub.fan_out_started = 0;
+  }
+  if (hub.daemon) {
+    MHD_stop_daemon(hub.daemon);
+    hub.daemon = NULL;
+  }
+
+  pthread_mutex_lock(&hub.lock);
+  while (hub.subscribers > 0) {
+    pthread_cond_wait(&hub.drained, &hub.lock);
+  }
+  free(hub.ring);
+  hub.ring = NULL;
+  hub.count = 0;
+  pthread_mutex_unlock(&hub.lock);
+}
+
+// Host header without its port, as "name" or "[v6]"
+static size_t host_name_length(const char *host) {
+  if (host[0] == '[') {
+    const char *end = strchr(host, ']');
+    return end ? (size_t)(end - host) + 1 : strlen(host);
+  }
+  return strcspn(host, ":");
+}
+
+int callback_changes_redirect(const struct _u_request *request, struct _u_response *response, void *user_data) {
+  if (hub.daemon == NULL) {
+    set_json_error_response(response, 503, "Service Unavailable: change feed not running");
+    set_cors_headers(response);
+    return U_CALLBACK_CONTINUE;
+  }
+  const char *host = u_map_get_case(request->map_header, "Host");
+  if (host == NULL || *host == '\0') {
+    host = "localhost";
+  }
+  size_t length = host_name_length(host);
+  if (length > 255) {
+    length = 255;
+  }
+  char location[320];
+  snprintf(location, sizeof(location), "%s://%.*s:%d%s", hub.tls ? "https" : "http", (int)length, host, hub.port,
+           CHANGES_PATH);
+  ulfius_set_empty_body_response(response, 307);
+  u_map_put(response->map_header, "Location", location);
+  u_map_put(response->map_header, "Cache-Control", "no-cache");
+  set_cors_headers(response);
+  return U_CALLBACK_CONTINUE;
+}
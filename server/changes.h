@@ -0,0 +1,47 @@
+#ifndef CHANGES_H
+#define CHANGES_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ulfius.h>
+
+// Change feed fed by the SQLite update/commit/rollback hooks in database.c.
+// Committed row changes are appended to an in-memory ring of recent events
+// and pushed to GET /api/changes subscribers as Server-Sent Events.
+//
+// Streams are served by a daemon of their own on HEALTH_CHANGES_PORT, not by
+// the thread-per-connection listener: one epoll thread writes to every
+// stream, idle streams are suspended connections, and one fan-out thread
+// resumes them when something is published or a heartbeat is due. The main
+// port answers GET /api/changes with a redirect to it.
+
+// Allocates the ring (HEALTH_CHANGES_RING events)
+int changes_init(void);
+
+// Starts the fan-out thread and the feed's daemon on port (SO_REUSEPORT for
+// prefork workers, HTTPS with what listener_tls_init loaded). Returns 0 on
+// success.
+int changes_start(int port, int reuse_port, int tls);
+
+// Ends every stream, stops the daemon and the fan-out thread, waits for the
+// streams to be released, then frees the ring
+void changes_close(void);
+
+// Hook entry points used by database.c. Row changes are staged per source
+// connection (shard) until its transaction commits, and dropped if it rolls back.
+#define CHANGES_MAX_SOURCES 16
+void changes_stage(int source, int sqlite_op, const char *table, int64_t rowid);
+void changes_commit(int source);
+void changes_rollback(int source);
+
+// Current version of a table (bumped once per committed row change), 0 if unknown
+uint64_t changes_table_version(const char *table);
+
+// Bytes held by the event ring (memory.h)
+size_t changes_memory_bytes(void);
+
+// Handles GET /api/changes on the main port: 307 to the same host on the
+// feed's port, where the SSE stream (resumable through Last-Event-ID) is served
+int callback_changes_redirect(const struct _u_request *request, struct _u_response *response, void *user_data);
+
+#endif // CHANGES_H
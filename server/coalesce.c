@@ -0,0 +1,210 @@
+#include "coalesce.h"
+
+#include "byte_buffer.h"
+#include "changes.h"
+#include "config.h"
+#include "database.h"
+#include "trace.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define COALESCE_SLOTS 64
+
+// One execution in progress. The leader fills in the response fields and
+// sets done; the last of the leader and its waiters frees it.
+typedef struct flight {
+  char *key;
+  size_t key_size;
+  uint64_t hash;
+  int done;
+  int waiters;
+  int result;
+  long status;
+  struct _u_map headers;
+  char *body;
+  size_t body_length;
+  struct flight *next;
+} flight;
+
+static struct {
+  int enabled;
+  pthread_mutex_t lock;
+  pthread_cond_t landed;
+  flight *slots[COALESCE_SLOTS];
+  unsigned long shared;
+} coalesce = { .lock = PTHREAD_MUTEX_INITIALIZER, .landed = PTHREAD_COND_INITIALIZER };
+
+// Key parts are NUL-separated; a failed buffer (a part could not be added)
+// must not be used as a key
+static void key_append(byte_buffer *key, const char *value) {
+  byte_buffer_append(key, value ? value : "", strlen(value ? value : "") + 1);
+}
+
+static int compare_keys(const void *a, const void *b) {
+  return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// Sum of every table's change-feed version (this process's commits) and
+// PRAGMA data_version of every shard file (other processes' commits)
+static uint64_t database_version(void) {
+  uint64_t version = 0;
+  for (table_id table = TABLE_PATIENTS; table <= TABLE_MEDICAL_RECORDS; table++) {
+    version += changes_table_version(table_name(table));
+  }
+  return version + (uint64_t)table_data_version(TABLE_PATIENTS); // Patients span every shard
+}
+
+static void build_key(const struct _u_request *request, byte_buffer *key) {
+  key_append(key, request->http_verb);
+  key_append(key, request->url_path);
+
+  // Query parameters in name order, so ?a=1&b=2 and ?b=2&a=1 share a flight
+  const int count = u_map_count(request->map_url);
+  const char **names = count > 0 ? malloc((size_t)count * sizeof(char *)) : NULL;
+  if (names) {
+    const char **keys = u_map_enum_keys(request->map_url);
+    memcpy(names, keys, (size_t)count * sizeof(char *));
+    qsort(names, (size_t)count, sizeof(char *), compare_keys);
+    for (int i = 0; i < count; i++) {
+      key_append(key, names[i]);
+      key_append(key, u_map_get(request->map_url, names[i]));
+    }
+    free(names);
+  }
+
+  key_append(key, u_map_get_case(request->map_header, "Accept"));
+  key_append(key, u_map_get_case(request->map_header, "Accept-Encoding"));
+  key_append(key, u_map_get_case(request->map_header, "Origin"));
+
+  char version[32];
+  snprintf(version, sizeof(version), "%llu", (unsigned long long)database_version());
+  key_append(key, version);
+}
+
+static void free_flight(flight *f) {
+  u_map_clean(&f->headers);
+  free(f->body);
+  free(f->key);
+  free(f);
+}
+
+void coalesce_init(void) {
+  coalesce.enabled = config_get_int("HEALTH_COALESCE", 1);
+  coalesce.shared = 0;
+}
+
+// Copies the leader's response into a waiter's, keeping the waiter's own
+// X-Request-Id (trace.h)
+static void copy_response(const flight *f, struct _u_response *response) {
+  char request_id[128] = "";
+  const char *own_id = u_map_get(response->map_header, "X-Request-Id");
+  if (own_id) {
+    snprintf(request_id, sizeof(request_id), "%s", own_id);
+  }
+  u_map_copy_into(response->map_header, &f->headers);
+  if (own_id) {
+    u_map_put(response->map_header, "X-Request-Id", request_id);
+  } else {
+    u_map_remove_from_key(response->map_header, "X-Request-Id");
+  }
+  ulfius_set_binary_body_response(response, (unsigned int)f->status, f->body ? f->body : "", f->body_length);
+}
+
+int coalesce_request(const struct _u_request *request, struct _u_response *response,
+                     coalesce_callback execute, void *user_data) {
+  if (!coalesce.enabled) {
+    return execute(request, response, user_data);
+  }
+
+  byte_buffer key = {0};
+  build_key(request, &key);
+  if (key.failed) {
+    free(key.data);
+    return execute(request, response, user_data);
+  }
+  const uint64_t hash = hash_bytes(key.data, key.size);
+  flight **slot = &coalesce.slots[hash % COALESCE_SLOTS];
+
+  pthread_mutex_lock(&coalesce.lock);
+  for (flight *f = *slot; f; f = f->next) {
+    if (f->hash == hash && f->key_size == key.size && memcmp(f->key, key.data, key.size) == 0) {
+      // Same request in flight: wait for it to land
+      f->waiters++;
+      coalesce.shared++;
+      const uint64_t span = trace_begin();
+      while (!f->done) {
+        pthread_cond_wait(&coalesce.landed, &coalesce.lock);
+      }
+      trace_end("coalesce wait", span);
+      const int result = f->result;
+      pthread_mutex_unlock(&coalesce.lock);
+      copy_response(f, response);
+      // Only count this waiter out once it is done reading the flight
+      pthread_mutex_lock(&coalesce.lock);
+      const int last = --f->waiters == 0;
+      pthread_mutex_unlock(&coalesce.lock);
+      if (last) {
+        free_flight(f);
+      }
+      free(key.data);
+      return result;
+    }
+  }
+
+  flight *f = calloc(1, sizeof(flight));
+  if (f == NULL) {
+    pthread_mutex_unlock(&coalesce.lock);
+    free(key.data);
+    return execute(request, response, user_data);
+  }
+  f->key = key.data;
+  f->key_size = key.size;
+  f->hash = hash;
+  u_map_init(&f->headers);
+  f->next = *slot;
+  *slot = f;
+  pthread_mutex_unlock(&coalesce.lock);
+
+  const int result = execute(request, response, user_data);
+  f->result = result;
+  f->status = response->status;
+  u_map_copy_into(&f->headers, response->map_header);
+  if (response->binary_body_length > 0) {
+    f->body = malloc(response->binary_body_length);
+    if (f->body) {
+      memcpy(f->body, response->binary_body, response->binary_body_length);
+      f->body_length = response->binary_body_length;
+    } else {
+      f->status = 500; // Waiters must not mistake a lost body for an empty one
+    }
+  }
+
+  // Unlink first, so requests from now on start a new flight
+  pthread_mutex_lock(&coalesce.lock);
+  for (flight **link = slot; *link; link = &(*link)->next) {
+    if (*link == f) {
+      *link = f->next;
+      break;
+    }
+  }
+  f->done = 1;
+  const int waited = f->waiters > 0;
+  pthread_cond_broadcast(&coalesce.landed);
+  pthread_mutex_unlock(&coalesce.lock);
+  if (!waited) {
+    free_flight(f);
+  }
+  return result;
+}
+
+unsigned long coalesce_shared_count(void) {
+  pthread_mutex_lock(&coalesce.lock);
+  const unsigned long shared = coalesce.shared;
+  pthread_mutex_unlock(&coalesce.lock);
+  return shared;
+}
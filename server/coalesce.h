@@ -0,0 +1,28 @@
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include <ulfius.h>
+
+// Single-flight execution of identical concurrent reads. Requests are keyed
+// on method, path, sorted query parameters, the headers that select the
+// representation (Accept, Accept-Encoding, Origin) and the database version
+// (change-feed table versions plus PRAGMA data_version). The first request
+// with a key runs the handler; requests arriving while it runs wait for it
+// and get a copy of its status, headers and body. Nothing is kept once the
+// flight lands, and a write in between changes the key, so no response is
+// older than the request. HEALTH_COALESCE=0 turns it off.
+
+typedef int (*coalesce_callback)(const struct _u_request *request, struct _u_response *response, void *user_data);
+
+// Reads HEALTH_COALESCE and resets the counter
+void coalesce_init(void);
+
+// Runs execute(request, response, user_data), or waits for an identical
+// request already running it and copies its response. Returns the callback's result.
+int coalesce_request(const struct _u_request *request, struct _u_response *response,
+                     coalesce_callback execute, void *user_data);
+
+// Requests answered from another request's execution
+unsigned long coalesce_shared_count(void);
+
+#endif // COALESCE_H
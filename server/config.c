@@ -0,0 +1,26 @@
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+int config_get_int(const char *name, int fallback) {
+  const char *value = getenv(name);
+  if (!value || value[0] == '\0') {
+    return fallback;
+  }
+
+  char *end;
+  errno = 0;
+  const long parsed = strtol(value, &end, 10);
+  if (errno != 0 || *end != '\0' || parsed < -2147483647L || parsed > 2147483647L) {
+    fprintf(stderr, "Ignoring invalid value for %s: '%s'\n", name, value);
+    return fallback;
+  }
+  return (int)parsed;
+}
+
+const char *config_get_str(const char *name, const char *fallback) {
+  const char *value = getenv(name);
+  return value && value[0] != '\0' ? value : fallback;
+}
@@ -0,0 +1,13 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+// Runtime tuning knobs are read from HEALTH_* environment variables so the
+// same binary can be reconfigured from docker-compose or the run scripts.
+
+// Returns the integer value of the environment variable, or fallback if it is unset or invalid
+int config_get_int(const char *name, int fallback);
+
+// Returns the value of the environment variable, or fallback if it is unset or empty
+const char *config_get_str(const char *name, const char *fallback);
+
+#endif // CONFIG_H
@@ -1,9 +1,142 @@
 #include "cors.h"
 
+#include "config.h"
+#include "json_response.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define CORS_MAX_ORIGINS 16
+
+typedef struct {
+  int any_origin;  // "*" in HEALTH_CORS_ORIGINS
+  int credentials; // Access-Control-Allow-Credentials: true
+  int origin_count;
+  char origins[CORS_MAX_ORIGINS][128];
+  char methods[128];
+  char headers[256];
+  char max_age[16];
+} cors_policy;
+
+static cors_policy policy;
+
+// Origin header of the request being dispatched on this thread (ulfius runs
+// one thread per connection), NULL outside a request or if none was sent
+static __thread const char *request_origin = NULL;
+
+int cors_init(void) {
+  memset(&policy, 0, sizeof(policy));
+  const char *origins = config_get_str("HEALTH_CORS_ORIGINS", "*");
+  // Comma-separated list of exact origins, e.g. "http://localhost:8081,https://clinic.example"
+  for (const char *p = origins; *p && policy.origin_count < CORS_MAX_ORIGINS;) {
+    while (*p == ' ' || *p == ',') p++;
+    const size_t length = strcspn(p, ", ");
+    if (length == 1 && *p == '*') {
+      policy.any_origin = 1;
+    } else if (length > 0 && length < sizeof(policy.origins[0])) {
+      memcpy(policy.origins[policy.origin_count++], p, length);
+    }
+    p += length;
+  }
+  policy.credentials = config_get_int("HEALTH_CORS_CREDENTIALS", 1);
+  snprintf(policy.methods, sizeof(policy.methods), "%s",
+           config_get_str("HEALTH_CORS_METHODS", "GET, POST, PUT, DELETE, OPTIONS"));
+  snprintf(policy.headers, sizeof(policy.headers), "%s",
+           config_get_str("HEALTH_CORS_HEADERS", "Content-Type, Authorization, Accept, Last-Event-ID"));
+  snprintf(policy.max_age, sizeof(policy.max_age), "%d", config_get_int("HEALTH_CORS_MAX_AGE", 600));
+
+  printf("CORS: %s%d origin(s), max-age %s s\n", policy.any_origin ? "any origin, " : "", policy.origin_count,
+         policy.max_age);
+  return 0;
+}
+
+void cors_begin_request(const struct _u_request *request) {
+  request_origin = u_map_get_case(request->map_header, "Origin");
+}
+
+void cors_end_request(void) {
+  request_origin = NULL;
+}
+
+// Value for Access-Control-Allow-Origin, or NULL if the origin is not allowed.
+// Origins named in the list are echoed (credentialed requests may not use
+// "*"); any other origin allowed through "*" gets "*" and no credentials, so
+// arbitrary sites cannot make credentialed reads.
+static const char *allowed_origin_for(const char *origin) {
+  if (origin == NULL) {
+    return policy.any_origin ? "*" : NULL; // same-origin or non-browser client
+  }
+  for (int i = 0; i < policy.origin_count; i++) {
+    if (strcmp(policy.origins[i], origin) == 0) {
+      return origin;
+    }
+  }
+  return policy.any_origin ? "*" : NULL;
+}
+
+static const char *allowed_origin(void) {
+  return allowed_origin_for(request_origin);
+}
+
+// Appends Origin to the response's Vary, keeping what the body encoding
+// already varies on (Accept, Accept-Encoding)
+static void vary_on_origin(const struct _u_response *response) {
+  const char *vary = u_map_get_case(response->map_header, "Vary");
+  if (vary == NULL || *vary == '\0') {
+    u_map_put(response->map_header, "Vary", "Origin");
+  } else if (strstr(vary, "Origin") == NULL) {
+    char combined[256];
+    snprintf(combined, sizeof(combined), "%s, Origin", vary);
+    u_map_put(response->map_header, "Vary", combined);
+  }
+}
+
+// origin may be NULL (not allowed): only Vary is added then
+static void put_origin_headers(const struct _u_response *response, const char *origin) {
+  if (origin) {
+    u_map_put(response->map_header, "Access-Control-Allow-Origin", origin);
+  }
+  if (policy.credentials && origin != NULL && origin == request_origin) {
+    u_map_put(response->map_header, "Access-Control-Allow-Credentials", "true");
+  }
+  // With named origins the answer depends on Origin (echo, "*" or nothing),
+  // so shared caches must key on it
+  if (policy.origin_count > 0) {
+    vary_on_origin(response);
+  }
+}
 
 void set_cors_headers(const struct _u_response *response) {
-  u_map_put(response->map_header, "Access-Control-Allow-Origin", "*");
-  u_map_put(response->map_header, "Access-Control-Allow-Methods", "GET, POST, PUT, DELETE, OPTIONS");
-  u_map_put(response->map_header, "Access-Control-Allow-Headers", "Content-Type, Authorization");
-  u_map_put(response->map_header, "Access-Control-Allow-Credentials", "true");
+  const uint64_t span = trace_begin();
+  put_origin_headers(response, allowed_origin());
+  trace_end("cors", span);
+}
+
+void set_cors_mhd_headers(struct MHD_Response *response, const char *origin) {
+  const char *allowed = allowed_origin_for(origin);
+  if (allowed) {
+    MHD_add_response_header(response, "Access-Control-Allow-Origin", allowed);
+  }
+  if (policy.credentials && allowed != NULL && allowed == origin) {
+    MHD_add_response_header(response, "Access-Control-Allow-Credentials", "true");
+  }
+  if (policy.origin_count > 0) {
+    MHD_add_response_header(response, "Vary", "Origin");
+  }
+}
+
+int callback_cors_preflight(const struct _u_request *request, struct _u_response *response, void *user_data) {
+  const char *origin = allowed_origin();
+  if (origin == NULL) {
+    set_json_error_response(response, 403, "Origin not allowed");
+    put_origin_headers(response, NULL);
+    return U_CALLBACK_COMPLETE;
+  }
+  ulfius_set_empty_body_response(response, 204);
+  put_origin_headers(response, origin);
+  u_map_put(response->map_header, "Access-Control-Allow-Methods", policy.methods);
+  u_map_put(response->map_header, "Access-Control-Allow-Headers", policy.headers);
+  u_map_put(response->map_header, "Access-Control-Max-Age", policy.max_age);
+  return U_CALLBACK_COMPLETE;
 }
@@ -3,6 +3,28 @@
 
 #include <ulfius.h>
 
+// CORS policy, read once from HEALTH_CORS_* at startup. Header values are
+// prebuilt; ordinary responses only get the origin headers, and preflights
+// (OPTIONS) are answered by the router before any route or admission
+// control runs, with Access-Control-Max-Age so browsers cache them.
+
+// Reads the policy (allowed origins, methods, headers, max-age)
+int cors_init(void);
+
+// Remembers the Origin of the request being dispatched on this thread;
+// set_cors_headers answers for it until cors_end_request
+void cors_begin_request(const struct _u_request *request);
+void cors_end_request(void);
+
+// Adds the origin headers for the current request, if its origin is allowed
 void set_cors_headers(const struct _u_response *response);
 
-#endif // CORS_H
\ No newline at end of file
+// Same for a response built directly on MHD, outside ulfius (the change
+// feed's daemon); origin is the request's Origin header, or NULL
+void set_cors_mhd_headers(struct MHD_Response *response, const char *origin);
+
+// Answers an OPTIONS preflight: 204 with the prebuilt preflight headers, or
+// 403 if the origin is not allowed
+int callback_cors_preflight(const struct _u_request *request, struct _u_response *response, void *user_data);
+
+#endif // CORS_H
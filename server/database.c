@@ -1,115 +1,1034 @@
 // database.c
 #include "database.h"
 
+#include "changes.h"
+#include "config.h"
+#include "id_bitmap.h"
 #include "json_response.h"
+#include "memory_store.h"
+#include "replication.h"
+#include "slow_queries.h"
+#include "stats.h"
+#include "trace.h"
 
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 sqlite3 *db;
+static int memory_mode = 0;
+
+// Shard connections; shards[0] is db (health.db), which also holds Doctors
+static sqlite3 *shards[SHARD_MAX];
+static int shard_count = 1;
+static unsigned int next_patient_bucket = 0;
+
+// Counter recounts (refresh_stats_if_stale) run on one thread at a time:
+// init_db, then the maintenance thread. PRAGMA data_version per shard at
+// the last recount; stats_stale asks for one regardless (replicated
+// transactions bypass the per-row deltas).
+static int stats_data_version[SHARD_MAX];
+static int stats_stale = 1;
+
+// Live Patient and Doctor ids, so appointment and record writes can check
+// their references without a query (foreign keys are not enforced). Only
+// kept by a single-process server, where every create and delete goes
+// through this process; with several workers each would miss the others'
+// writes, so references are looked up in SQLite instead.
+static id_bitmap patient_ids = ID_BITMAP_INITIALIZER;
+static id_bitmap doctor_ids = ID_BITMAP_INITIALIZER;
+static int use_id_bitmaps = 1;
+
+// Connection owning the bucket of a patient id
+static sqlite3 *shard_for(const long long patient_id) {
+  return shards[shard_for_id(patient_id, shard_count)];
+}
+
+// Row changes are staged by the update hook and only published to the
+// change feed once the transaction commits. user_data is the shard index.
+static void on_row_change(void *user_data, int op, const char *db_name, const char *table, sqlite3_int64 rowid) {
+  changes_stage((int)(intptr_t)user_data, op, table, rowid);
+}
+
+static int on_commit(void *user_data) {
+  changes_commit((int)(intptr_t)user_data);
+  replication_on_commit((int)(intptr_t)user_data);
+  if (memory_mode) {
+    memory_store_on_commit();
+  }
+  return 0; // Non-zero would turn the commit into a rollback
+}
+
+static void on_rollback(void *user_data) {
+  changes_rollback((int)(intptr_t)user_data);
+}
+
+// Every finished statement is timed as a "step" span of the current request
+// (trace.h) and recorded in the slow-query statistics; it is also offered to
+// the replication log, and in memory mode to the journal. context is the
+// shard index.
+static int on_trace(unsigned type, void *context, void *p, void *x) {
+  if (type == SQLITE_TRACE_PROFILE) {
+    if (memory_mode) {
+      memory_store_on_statement((sqlite3_stmt *)p);
+    }
+    replication_on_statement((int)(intptr_t)context, (sqlite3_stmt *)p);
+    const uint64_t elapsed_ns = (uint64_t)*(sqlite3_int64 *)x;
+    trace_elapsed("step", elapsed_ns);
+    slow_queries_on_statement((int)(intptr_t)context, (sqlite3_stmt *)p, elapsed_ns);
+  }
+  return 0;
+}
+
+// sqlite3_prepare_v2 timed as a "prepare" span
+static int prepare_statement(sqlite3 *conn, const char *sql, sqlite3_stmt **stmt) {
+  const uint64_t span = trace_begin();
+  const int rc = sqlite3_prepare_v2(conn, sql, -1, stmt, NULL);
+  trace_end("prepare", span);
+  return rc;
+}
+
+// Schema migrations, keyed on PRAGMA user_version: a database at version N
+// has had the first N steps applied. Append new steps; never edit old ones.
+// The first steps use IF NOT EXISTS because databases created before the
+// migration table existed report version 0 but already have the schema.
+static const char *const migrations[] = {
+    // 1: base tables
+    "CREATE TABLE IF NOT EXISTS Patients ("
+    "  id INTEGER PRIMARY KEY AUTOINCREMENT, "
+    "  name TEXT NOT NULL"
+    "); "
+    "CREATE TABLE IF NOT EXISTS Doctors ("
+    "  id INTEGER PRIMARY KEY AUTOINCREMENT, "
+    "  name TEXT NOT NULL, "
+    "  specialty TEXT NOT NULL"
+    "); "
+    "CREATE TABLE IF NOT EXISTS Appointments ("
+    "  id INTEGER PRIMARY KEY AUTOINCREMENT, "
+    "  patient_id INTEGER NOT NULL, "
+    "  doctor_id INTEGER NOT NULL, "
+    "  date TEXT NOT NULL, "
+    "  FOREIGN KEY(patient_id) REFERENCES Patients(id), "
+    "  FOREIGN KEY(doctor_id) REFERENCES Doctors(id)"
+    "); "
+    "CREATE TABLE IF NOT EXISTS MedicalRecords ("
+    "  id INTEGER PRIMARY KEY AUTOINCREMENT, "
+    "  patient_id INTEGER NOT NULL, "
+    "  details TEXT NOT NULL, "
+    "  FOREIGN KEY(patient_id) REFERENCES Patients(id)"
+    ");",
+    // 2: indexes behind the patient summary
+    "CREATE INDEX IF NOT EXISTS idx_appointments_patient_date ON Appointments(patient_id, date); "
+    "CREATE INDEX IF NOT EXISTS idx_medicalrecords_patient ON MedicalRecords(patient_id, id);",
+    // 3: archive for past appointments (maintenance.h) and the index that finds them
+    "CREATE TABLE IF NOT EXISTS AppointmentsArchive ("
+    "  id INTEGER PRIMARY KEY, "
+    "  patient_id INTEGER NOT NULL, "
+    "  doctor_id INTEGER NOT NULL, "
+    "  date TEXT NOT NULL, "
+    "  archived_at TEXT NOT NULL DEFAULT CURRENT_TIMESTAMP"
+    "); "
+    "CREATE INDEX IF NOT EXISTS idx_appointments_date ON Appointments(date);",
+};
+#define MIGRATION_COUNT ((int)(sizeof(migrations) / sizeof(migrations[0])))
+
+// Single-integer PRAGMA query; -1 on error
+static int read_pragma_int(sqlite3 *conn, const char *sql) {
+  sqlite3_stmt *stmt;
+  int value = -1;
+  if (sqlite3_prepare_v2(conn, sql, -1, &stmt, NULL) == SQLITE_OK) {
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      value = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+  }
+  return value;
+}
+
+static int read_user_version(sqlite3 *conn) {
+  return read_pragma_int(conn, "PRAGMA user_version");
+}
+
+// Applies pending migrations, each in its own transaction together with the
+// version bump. Up-to-date databases cost a single PRAGMA read.
+static int migrate_connection(sqlite3 *conn, const int shard) {
+  if (read_user_version(conn) == MIGRATION_COUNT) {
+    return 0;
+  }
+
+  for (;;) {
+    // IMMEDIATE so prefork workers booting together apply each step once
+    if (sqlite3_exec(conn, "BEGIN IMMEDIATE", NULL, NULL, NULL) != SQLITE_OK) {
+      fprintf(stderr, "Cannot start migration on shard %d: %s\n", shard, sqlite3_errmsg(conn));
+      return 1;
+    }
+    const int version = read_user_version(conn);
+    if (version < 0 || version > MIGRATION_COUNT) {
+      fprintf(stderr, "Shard %d has unknown schema version %d (this build knows %d)\n", shard, version, MIGRATION_COUNT);
+      sqlite3_exec(conn, "ROLLBACK", NULL, NULL, NULL);
+      return 1;
+    }
+    if (version == MIGRATION_COUNT) {
+      sqlite3_exec(conn, "COMMIT", NULL, NULL, NULL);
+      return 0;
+    }
+
+    char version_sql[64];
+    snprintf(version_sql, sizeof(version_sql), "PRAGMA user_version = %d", version + 1);
+    char *err_msg = NULL;
+    if (sqlite3_exec(conn, migrations[version], NULL, NULL, &err_msg) != SQLITE_OK ||
+        sqlite3_exec(conn, version_sql, NULL, NULL, &err_msg) != SQLITE_OK) {
+      fprintf(stderr, "Migration %d failed on shard %d: %s\n", version + 1, shard, err_msg);
+      sqlite3_free(err_msg);
+      sqlite3_exec(conn, "ROLLBACK", NULL, NULL, NULL);
+      return 1;
+    }
+    if (sqlite3_exec(conn, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+      fprintf(stderr, "Cannot commit migration %d on shard %d: %s\n", version + 1, shard, sqlite3_errmsg(conn));
+      sqlite3_exec(conn, "ROLLBACK", NULL, NULL, NULL);
+      return 1;
+    }
+    printf("Shard %d migrated to schema version %d\n", shard, version + 1);
+  }
+}
+
+// Migrates the schema and installs the change hooks on one shard connection
+static int prepare_connection(sqlite3 *conn, const int shard) {
+  // WAL lets prefork workers read while another process writes; the busy
+  // timeout makes writers from different processes queue instead of failing
+  // with SQLITE_BUSY. In-memory databases keep journal_mode=memory.
+  sqlite3_busy_timeout(conn, config_get_int("HEALTH_DB_BUSY_TIMEOUT_MS", 5000));
+  // Only takes effect on a new, empty file, and only before the switch to
+  // WAL; an existing file keeps its mode until it is VACUUMed once
+  sqlite3_exec(conn, "PRAGMA auto_vacuum=INCREMENTAL;", 0, 0, NULL);
+  if (!memory_mode) {
+    sqlite3_exec(conn, "PRAGMA journal_mode=WAL;", 0, 0, NULL);
+  }
+
+  if (migrate_connection(conn, shard) != 0) {
+    return 1; // Failure
+  }
+
+  if (shard > 0) {
+    // Doctors only live in health.db; a temp view lets joins on the other
+    // shards keep using the unqualified table name
+    char main_path[256], attach_sql[512];
+    database_file_path(0, main_path, sizeof(main_path));
+    snprintf(attach_sql, sizeof(attach_sql),
+             "ATTACH DATABASE '%s' AS global; "
+             "CREATE TEMP VIEW Doctors AS SELECT * FROM global.Doctors;", main_path);
+    char *err_msg = NULL;
+    if (sqlite3_exec(conn, attach_sql, 0, 0, &err_msg) != SQLITE_OK) {
+      fprintf(stderr, "Cannot attach %s to shard %d: %s\n", main_path, shard, err_msg);
+      sqlite3_free(err_msg);
+      return 1;
+    }
+  }
+
+  sqlite3_update_hook(conn, on_row_change, (void *)(intptr_t)shard);
+  sqlite3_commit_hook(conn, on_commit, (void *)(intptr_t)shard);
+  sqlite3_rollback_hook(conn, on_rollback, (void *)(intptr_t)shard);
+  return 0;
+}
+
+static void close_shards(void) {
+  for (int i = 0; i < shard_count; i++) {
+    sqlite3_close(shards[i]);
+    shards[i] = NULL;
+  }
+}
+
+// Fills bitmap with every id selected by sql on the first count shards
+static int load_ids(id_bitmap *bitmap, const char *sql, const int count) {
+  for (int i = 0; i < count; i++) {
+    sqlite3_stmt *stmt;
+    if (prepare_statement(shards[i], sql, &stmt) != SQLITE_OK) {
+      fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(shards[i]));
+      return 1;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      id_bitmap_set(bitmap, sqlite3_column_int64(stmt, 0));
+    }
+    sqlite3_finalize(stmt);
+  }
+  return 0;
+}
+
+static int load_id_bitmaps(void) {
+  id_bitmap_reset(&patient_ids);
+  id_bitmap_reset(&doctor_ids);
+  if (!use_id_bitmaps) {
+    return 0;
+  }
+  return load_ids(&patient_ids, "SELECT id FROM Patients", shard_count) || load_ids(&doctor_ids, "SELECT id FROM Doctors", 1);
+}
+
+void database_file_path(const int shard, char *path, const size_t size) {
+  const char *dir = config_get_str("HEALTH_DB_DIR", NULL);
+  char name[64];
+  if (shard == 0) {
+    snprintf(name, sizeof(name), "%s", DB_PATH);
+  } else {
+    snprintf(name, sizeof(name), SHARD_PATH_FORMAT, shard);
+  }
+  snprintf(path, size, "%s%s%s", dir ? dir : "", dir ? "/" : "", name);
+}
+
+int database_shard_count(void) {
+  return shard_count;
+}
 
-// Here you will define all your functions
-// For example:
 int init_db() {
-  const char* db_path = "health.db";
-  int rc = sqlite3_open(db_path, &db);
+  char db_path[256];
+  database_file_path(0, db_path, sizeof(db_path));
+  // HEALTH_DB_SHARDS > 1 partitions patients and their rows across several files
+  shard_count = config_get_int("HEALTH_DB_SHARDS", 1);
+  if (shard_count < 1 || shard_count > SHARD_MAX) {
+    fprintf(stderr, "HEALTH_DB_SHARDS must be between 1 and %d\n", SHARD_MAX);
+    return 1;
+  }
+  // HEALTH_DB_MODE=memory serves everything from an in-memory copy of db_path
+  memory_mode = strcmp(config_get_str("HEALTH_DB_MODE", "file"), "memory") == 0;
+  use_id_bitmaps = config_get_int("HEALTH_WORKERS", 1) <= 1;
+  if (memory_mode && shard_count > 1) {
+    fprintf(stderr, "HEALTH_DB_MODE=memory does not support HEALTH_DB_SHARDS > 1\n");
+    return 1;
+  }
+  if (memory_mode) {
+    if (memory_store_open(db_path, &db) != 0) {
+      return 1;
+    }
+  }
+  int rc = memory_mode ? SQLITE_OK : sqlite3_open(db_path, &db);
 
   if (rc != SQLITE_OK) {
     fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
     sqlite3_close(db);
     return 1; // Non-zero return value indicates failure
   }
+  shards[0] = db;
 
+  if (prepare_connection(db, 0) != 0) {
+    sqlite3_close(db);
+    return 1;
+  }
 
+  for (int i = 1; i < shard_count; i++) {
+    char shard_path[256];
+    database_file_path(i, shard_path, sizeof(shard_path));
+    if (sqlite3_open(shard_path, &shards[i]) != SQLITE_OK || prepare_connection(shards[i], i) != 0) {
+      fprintf(stderr, "Cannot open shard %s: %s\n", shard_path, sqlite3_errmsg(shards[i]));
+      shard_count = i + 1;
+      close_shards();
+      return 1;
+    }
+  }
+  if (shard_count > 1) {
+    printf("Database sharded across %d files\n", shard_count);
+  }
 
-  // Example SQL to create tables (if they don't exist)
-  const char *sql =
-      "CREATE TABLE IF NOT EXISTS Patients ("
-      "  id INTEGER PRIMARY KEY AUTOINCREMENT, "
-      "  name TEXT NOT NULL"
-      "); "
-      "CREATE TABLE IF NOT EXISTS Doctors ("
-      "  id INTEGER PRIMARY KEY AUTOINCREMENT, "
-      "  name TEXT NOT NULL, "
-      "  specialty TEXT NOT NULL"
-      "); "
-      "CREATE TABLE IF NOT EXISTS Appointments ("
-      "  id INTEGER PRIMARY KEY AUTOINCREMENT, "
-      "  patient_id INTEGER NOT NULL, "
-      "  doctor_id INTEGER NOT NULL, "
-      "  date TEXT NOT NULL, "
-      "  FOREIGN KEY(patient_id) REFERENCES Patients(id), "
-      "  FOREIGN KEY(doctor_id) REFERENCES Doctors(id)"
-      "); "
-      "CREATE TABLE IF NOT EXISTS MedicalRecords ("
-      "  id INTEGER PRIMARY KEY AUTOINCREMENT, "
-      "  patient_id INTEGER NOT NULL, "
-      "  details TEXT NOT NULL, "
-      "  FOREIGN KEY(patient_id) REFERENCES Patients(id)"
-      ");";
+  if (memory_mode || trace_enabled() || slow_queries_enabled() || replication_log_enabled()) {
+    for (int i = 0; i < shard_count; i++) {
+      sqlite3_trace_v2(shards[i], SQLITE_TRACE_PROFILE, on_trace, (void *)(intptr_t)i);
+    }
+  }
+  if (memory_mode) {
+    if (memory_store_start() != 0) {
+      sqlite3_close(db);
+      return 1;
+    }
+  }
 
+  if (refresh_stats_if_stale() != 0 || load_id_bitmaps() != 0) {
+    close_db();
+    return 1;
+  }
 
-  char *err_msg = NULL;
-  rc = sqlite3_exec(db, sql, 0, 0, &err_msg);
+  return 0; // Success
+}
+
+// Runs a GROUP BY query and hands each result row to add
+static int scan_counts(sqlite3 *conn, const char *sql, json_t *stats,
+                       void (*add)(json_t *stats, sqlite3_stmt *row)) {
+  sqlite3_stmt *stmt;
+  if (prepare_statement(conn, sql, &stmt) != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(conn));
+    return 1;
+  }
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    add(stats, stmt);
+  }
+  sqlite3_finalize(stmt);
+  return 0;
+}
+
+static void add_patient_count(json_t *stats, sqlite3_stmt *row) {
+  stats_patient(stats, sqlite3_column_int64(row, 0));
+}
+
+static void add_doctor_count(json_t *stats, sqlite3_stmt *row) {
+  stats_doctor(stats, (const char *)sqlite3_column_text(row, 0), sqlite3_column_int64(row, 1));
+}
+
+static void add_appointment_count(json_t *stats, sqlite3_stmt *row) {
+  stats_appointment(stats, sqlite3_column_int(row, 0), (const char *)sqlite3_column_text(row, 1),
+                    sqlite3_column_int64(row, 2));
+}
+
+static void add_medical_record_count(json_t *stats, sqlite3_stmt *row) {
+  stats_medical_record(stats, sqlite3_column_int(row, 0), sqlite3_column_int64(row, 1));
+}
 
+int compute_stats(json_t **stats) {
+  *stats = stats_new();
+  int rc = scan_counts(db, "SELECT specialty, COUNT(*) FROM Doctors GROUP BY specialty", *stats, add_doctor_count);
+  for (int i = 0; i < shard_count && rc == 0; i++) {
+    rc = scan_counts(shards[i], "SELECT COUNT(*) FROM Patients", *stats, add_patient_count) ||
+         scan_counts(shards[i],
+                     "SELECT doctor_id, substr(date, 1, 10), COUNT(*) FROM Appointments GROUP BY 1, 2",
+                     *stats, add_appointment_count) ||
+         scan_counts(shards[i], "SELECT patient_id, COUNT(*) FROM MedicalRecords GROUP BY patient_id",
+                     *stats, add_medical_record_count);
+  }
+  if (rc != 0) {
+    json_decref(*stats);
+    *stats = NULL;
+  }
+  return rc;
+}
+
+static int read_data_version(sqlite3 *conn) {
+  sqlite3_stmt *stmt;
+  int version = -1;
+  if (sqlite3_prepare_v2(conn, "PRAGMA data_version", -1, &stmt, NULL) == SQLITE_OK) {
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      version = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+  }
+  return version;
+}
+
+// data_version only moves when another connection commits (a prefork
+// worker, the sqlite3 shell, ...), i.e. for writes whose deltas this
+// process never saw. The recount takes no lock the writers need; it is
+// kept only if no delta landed while it ran, else retried on the next call.
+int refresh_stats_if_stale(void) {
+  int stale = __atomic_exchange_n(&stats_stale, 0, __ATOMIC_ACQ_REL);
+  int versions[SHARD_MAX];
+  for (int i = 0; i < shard_count; i++) {
+    versions[i] = read_data_version(shards[i]);
+    stale |= versions[i] != stats_data_version[i];
+  }
+  if (!stale) {
+    return 0;
+  }
+  const uint64_t version = stats_version();
+  json_t *stats;
+  if (compute_stats(&stats) != 0) {
+    __atomic_store_n(&stats_stale, 1, __ATOMIC_RELEASE);
+    return 1;
+  }
+  if (stats_load_if_unchanged(stats, version) != 0) {
+    __atomic_store_n(&stats_stale, 1, __ATOMIC_RELEASE);
+    return 0;
+  }
+  memcpy(stats_data_version, versions, sizeof(int) * shard_count);
+  return 0;
+}
+
+// Full scans that pull each table and index b-tree into the page cache (and
+// the OS cache behind it). Preparing them also loads the schema into every
+// connection, which otherwise happens on the first request.
+static const char *const warm_up_queries[] = {
+    "SELECT COUNT(*), SUM(LENGTH(name)) FROM Patients",
+    "SELECT COUNT(*), SUM(LENGTH(date)) FROM Appointments",
+    "SELECT SUM(patient_id) FROM Appointments INDEXED BY idx_appointments_patient_date",
+    "SELECT COUNT(*), SUM(LENGTH(details)) FROM MedicalRecords",
+    "SELECT SUM(patient_id) FROM MedicalRecords INDEXED BY idx_medicalrecords_patient",
+};
+
+int warm_up_db(void) {
+  for (int shard = 0; shard < shard_count; shard++) {
+    for (size_t i = 0; i < sizeof(warm_up_queries) / sizeof(warm_up_queries[0]); i++) {
+      sqlite3_stmt *stmt;
+      if (sqlite3_prepare_v2(shards[shard], warm_up_queries[i], -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Warm-up query failed on shard %d: %s\n", shard, sqlite3_errmsg(shards[shard]));
+        return 1;
+      }
+      while (sqlite3_step(stmt) == SQLITE_ROW) {
+      }
+      sqlite3_finalize(stmt);
+    }
+  }
+  // Doctors only live in health.db
+  sqlite3_exec(db, "SELECT COUNT(*), SUM(LENGTH(name) + LENGTH(specialty)) FROM Doctors", NULL, NULL, NULL);
+
+  // Runs the list path once so its allocations and code are warm too
+  json_t *patients = NULL;
+  if (read_all_patients(&patients) == 0) {
+    json_decref(patients);
+  }
+  return 0;
+}
+
+size_t id_bitmaps_memory_bytes(void) {
+  return id_bitmap_bytes(&patient_ids) + id_bitmap_bytes(&doctor_ids);
+}
+
+size_t page_caches_memory_bytes(void) {
+  size_t bytes = 0;
+  for (int i = 0; i < shard_count; i++) {
+    int current = 0, highwater = 0;
+    if (shards[i] && sqlite3_db_status(shards[i], SQLITE_DBSTATUS_CACHE_USED, &current, &highwater, 0) == SQLITE_OK) {
+      bytes += (size_t)current;
+    }
+  }
+  return bytes;
+}
+
+int explain_query_plan(const int shard, const char *sql, char **plan) {
+  if (shard < 0 || shard >= shard_count) {
+    return 1;
+  }
+  char *explain = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", sql);
+  if (explain == NULL) {
+    return 1;
+  }
+  sqlite3_stmt *stmt;
+  const int rc = sqlite3_prepare_v2(shards[shard], explain, -1, &stmt, NULL);
+  sqlite3_free(explain);
   if (rc != SQLITE_OK) {
-    fprintf(stderr, "SQL error: %s\n", err_msg);
-    sqlite3_free(err_msg);
-    sqlite3_close(db);
-    return 1; // Failure
+    return 1;
   }
 
-  return 0; // Success
+  // One line per plan node, indented under its parent (columns: id, parent, notused, detail)
+  int ids[64], depths[64], nodes = 0;
+  size_t length = 0;
+  *plan = calloc(1, 1);
+  while (*plan && sqlite3_step(stmt) == SQLITE_ROW) {
+    const int id = sqlite3_column_int(stmt, 0), parent = sqlite3_column_int(stmt, 1);
+    const char *detail = (const char *)sqlite3_column_text(stmt, 3);
+    int depth = 0;
+    for (int i = 0; i < nodes; i++) {
+      if (ids[i] == parent) {
+        depth = depths[i] + 1;
+      }
+    }
+    if (nodes < 64) {
+      ids[nodes] = id;
+      depths[nodes++] = depth;
+    }
+    const size_t line = (size_t)depth * 2 + strlen(detail ? detail : "") + 2;
+    char *grown = realloc(*plan, length + line);
+    if (grown == NULL) {
+      free(*plan);
+      *plan = NULL;
+      break;
+    }
+    *plan = grown;
+    length += (size_t)snprintf(*plan + length, line, "%s%*s%s", length ? "\n" : "", depth * 2, "", detail ? detail : "");
+  }
+  sqlite3_finalize(stmt);
+  return *plan ? 0 : 1;
+}
+
+int snapshot_shard(const int shard, unsigned char **data, sqlite3_int64 *size, uint64_t *log_seq) {
+  *data = NULL;
+  if (shard < 0 || shard >= shard_count) {
+    return 1;
+  }
+  sqlite3 *conn = shards[shard];
+  sqlite3_mutex *mutex = sqlite3_db_mutex(conn);
+  // Statements run under the connection mutex, so once it is held no
+  // transaction is half-way through unless one was left open explicitly;
+  // wait for that one to finish
+  for (int attempt = 0; attempt < 500; attempt++) {
+    sqlite3_mutex_enter(mutex);
+    if (sqlite3_get_autocommit(conn)) {
+      *log_seq = replication_log_seq();
+      *data = sqlite3_serialize(conn, "main", size, 0);
+      sqlite3_mutex_leave(mutex);
+      return *data ? 0 : -1;
+    }
+    sqlite3_mutex_leave(mutex);
+    usleep(10000);
+  }
+  return -1;
+}
+
+int apply_replicated(const int shard, const char *sql) {
+  if (shard < 0 || shard >= shard_count) {
+    return 1;
+  }
+  sqlite3 *conn = shards[shard];
+  sqlite3_mutex *mutex = sqlite3_db_mutex(conn);
+  sqlite3_mutex_enter(mutex);
+  char *err_msg = NULL;
+  int rc = sqlite3_exec(conn, "BEGIN IMMEDIATE", NULL, NULL, &err_msg) == SQLITE_OK &&
+           sqlite3_exec(conn, sql, NULL, NULL, &err_msg) == SQLITE_OK &&
+           sqlite3_exec(conn, "COMMIT", NULL, NULL, &err_msg) == SQLITE_OK ? 0 : 1;
+  if (rc != 0) {
+    fprintf(stderr, "Cannot apply replicated transaction on shard %d: %s\n", shard, err_msg);
+    sqlite3_free(err_msg);
+    sqlite3_exec(conn, "ROLLBACK", NULL, NULL, NULL);
+  }
+  sqlite3_mutex_leave(mutex);
+  // The statements bypassed the per-row deltas; recount in the background
+  __atomic_store_n(&stats_stale, 1, __ATOMIC_RELEASE);
+  return rc;
 }
 
 void close_db() {
-  sqlite3_close(db);
+  if (memory_mode) {
+    memory_store_close();
+  }
+  close_shards();
+  id_bitmap_reset(&patient_ids);
+  id_bitmap_reset(&doctor_ids);
+}
+
+// 1 if conn has a row with this id in table
+static int row_exists(sqlite3 *conn, const char *sql, const int id) {
+  sqlite3_stmt *stmt;
+  if (prepare_statement(conn, sql, &stmt) != SQLITE_OK) {
+    return 0;
+  }
+  sqlite3_bind_int(stmt, 1, id);
+  const int found = sqlite3_step(stmt) == SQLITE_ROW;
+  sqlite3_finalize(stmt);
+  return found;
+}
+
+// Steps a single UPDATE/DELETE and returns the rows it changed, or -1 on
+// error. sqlite3_changes is per connection, so it is read under the
+// connection mutex before another thread's write can replace it.
+static int step_changes(sqlite3 *conn, sqlite3_stmt *stmt) {
+  sqlite3_mutex *mutex = sqlite3_db_mutex(conn);
+  sqlite3_mutex_enter(mutex);
+  const int changed = sqlite3_step(stmt) == SQLITE_DONE ? sqlite3_changes(conn) : -1;
+  sqlite3_mutex_leave(mutex);
+  return changed;
+}
+
+// Holds conn's mutex and opens an IMMEDIATE transaction, so the row a
+// mutator reads next is exactly the row its write replaces, even against
+// other processes. Only that shard's writers wait, as they would for the
+// write anyway. Returns the mutex for end_row_write, or NULL on failure.
+static sqlite3_mutex *begin_row_write(sqlite3 *conn) {
+  sqlite3_mutex *mutex = sqlite3_db_mutex(conn);
+  sqlite3_mutex_enter(mutex);
+  if (sqlite3_exec(conn, "BEGIN IMMEDIATE", NULL, NULL, NULL) != SQLITE_OK) {
+    fprintf(stderr, "Cannot begin transaction: %s\n", sqlite3_errmsg(conn));
+    sqlite3_mutex_leave(mutex);
+    return NULL;
+  }
+  return mutex;
+}
+
+// Commits, or rolls back when failed, and releases the mutex. Returns 0 if committed.
+static int end_row_write(sqlite3 *conn, sqlite3_mutex *mutex, const int failed) {
+  int rc = failed;
+  if (!failed && sqlite3_exec(conn, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+    fprintf(stderr, "Cannot commit: %s\n", sqlite3_errmsg(conn));
+    rc = 1;
+  }
+  if (rc != 0) {
+    sqlite3_exec(conn, "ROLLBACK", NULL, NULL, NULL);
+  }
+  sqlite3_mutex_leave(mutex);
+  return rc;
+}
+
+// Runs a single-row DELETE ... RETURNING (id bound first) on owner, and when
+// probe is set on the other shards until one deletes the row. copy reads
+// the deleted row's values, so counter deltas come from the row itself.
+// Returns 1 if a row was deleted, 0 if none matched, -1 on error.
+static int delete_returning(sqlite3 *owner, const int probe, const char *sql, const int id,
+                            void (*copy)(sqlite3_stmt *row, void *out), void *out) {
+  for (int i = -1; i < (probe ? shard_count : 0); i++) {
+    sqlite3 *conn = i < 0 ? owner : shards[i];
+    if (i >= 0 && conn == owner) {
+      continue;
+    }
+    sqlite3_stmt *stmt;
+    if (prepare_statement(conn, sql, &stmt) != SQLITE_OK) {
+      return -1;
+    }
+    sqlite3_bind_int(stmt, 1, id);
+    sqlite3_mutex *mutex = sqlite3_db_mutex(conn);
+    sqlite3_mutex_enter(mutex);
+    int rc = sqlite3_step(stmt);
+    const int deleted = rc == SQLITE_ROW;
+    if (deleted) {
+      copy(stmt, out);
+    }
+    while (rc == SQLITE_ROW) {
+      rc = sqlite3_step(stmt);
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_mutex_leave(mutex);
+    if (rc != SQLITE_DONE) {
+      return -1;
+    }
+    if (deleted) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// The bitmap answers on its own when it is kept; otherwise one indexed lookup
+static int id_exists(id_bitmap *bitmap, sqlite3 *conn, const char *sql, const int id) {
+  if (use_id_bitmaps) {
+    return id_bitmap_test(bitmap, id);
+  }
+  return id > 0 && row_exists(conn, sql, id);
+}
+
+int patient_exists(const int id) {
+  return id_exists(&patient_ids, shard_for(id), "SELECT 1 FROM Patients WHERE id = ?", id);
+}
+
+int doctor_exists(const int id) {
+  return id_exists(&doctor_ids, db, "SELECT 1 FROM Doctors WHERE id = ?", id);
+}
+
+// Inserts a row through stmt, whose first parameter is the row id.
+// With one shard SQLite assigns the id (AUTOINCREMENT). With several, the
+// id is the smallest one above the table's maximum that falls in bucket,
+// so id % SHARD_BUCKETS keeps routing to the shard that owns the bucket.
+// Ids in archive (when not NULL) count too, so an archived row's id is
+// never handed out again. The new id is stored in *row_id when it is not NULL.
+static int step_insert(sqlite3 *conn, const char *table, const char *archive, const int bucket, sqlite3_stmt *stmt, sqlite3_int64 *row_id) {
+  sqlite3_mutex *mutex = sqlite3_db_mutex(conn);
+  sqlite3_mutex_enter(mutex);
+  if (shard_count == 1) {
+    sqlite3_bind_null(stmt, 1);
+    const int rc = sqlite3_step(stmt);
+    if (row_id) {
+      // Read under the connection mutex so another thread's insert cannot intervene
+      *row_id = sqlite3_last_insert_rowid(conn);
+    }
+    sqlite3_mutex_leave(mutex);
+    return rc == SQLITE_DONE ? 0 : 1;
+  }
+
+
+  // IMMEDIATE takes the write lock up front so other processes cannot pick the same id
+  if (sqlite3_exec(conn, "BEGIN IMMEDIATE", NULL, NULL, NULL) != SQLITE_OK) {
+    sqlite3_mutex_leave(mutex);
+    return 1;
+  }
+
+  char sql[160];
+  if (archive) {
+    snprintf(sql, sizeof(sql), "SELECT IFNULL(MAX(id), 0) FROM (SELECT MAX(id) AS id FROM %s UNION ALL SELECT MAX(id) FROM %s)",
+             table, archive);
+  } else {
+    snprintf(sql, sizeof(sql), "SELECT IFNULL(MAX(id), 0) FROM %s", table);
+  }
+  sqlite3_stmt *max_stmt;
+  sqlite3_int64 max_id = 0;
+  if (prepare_statement(conn, sql, &max_stmt) == SQLITE_OK) {
+    if (sqlite3_step(max_stmt) == SQLITE_ROW) {
+      max_id = sqlite3_column_int64(max_stmt, 0);
+    }
+    sqlite3_finalize(max_stmt);
+  }
+  const sqlite3_int64 next_id = max_id + 1 + ((bucket - (max_id + 1)) % SHARD_BUCKETS + SHARD_BUCKETS) % SHARD_BUCKETS;
+  sqlite3_bind_int64(stmt, 1, next_id);
+
+  const int rc = sqlite3_step(stmt);
+  sqlite3_exec(conn, rc == SQLITE_DONE ? "COMMIT" : "ROLLBACK", NULL, NULL, NULL);
+  sqlite3_mutex_leave(mutex);
+  if (row_id) {
+    *row_id = next_id;
+  }
+  return rc == SQLITE_DONE ? 0 : 1;
 }
 
 // Create a new patient
 int create_patient(const Patient *patient) {
-  const char *sql = "INSERT INTO Patients (name) VALUES (?)";
+  // New patients are spread over the buckets round-robin
+  const int bucket = (int)(__atomic_fetch_add(&next_patient_bucket, 1, __ATOMIC_RELAXED) % SHARD_BUCKETS);
+  sqlite3 *conn = shards[bucket % shard_count];
+  const char *sql = "INSERT INTO Patients (id, name) VALUES (?, ?)";
   sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-  sqlite3_bind_text(stmt, 1, patient->name, -1, SQLITE_STATIC);
-  const int rc = sqlite3_step(stmt);
+  prepare_statement(conn, sql, &stmt);
+  sqlite3_bind_text(stmt, 2, patient->name, -1, SQLITE_STATIC);
+  sqlite3_int64 id = 0;
+  const int rc = step_insert(conn, "Patients", NULL, bucket, stmt, &id);
   sqlite3_finalize(stmt);
-  return rc == SQLITE_DONE ? 0 : 1;
+  if (rc == 0) {
+    stats_patient(NULL, 1);
+    if (use_id_bitmaps) {
+      id_bitmap_set(&patient_ids, id);
+    }
+  }
+  return rc;
+}
+
+// Column lists behind ?fields=. Column 0 is always the id. Patients are
+// found by shard_for(id), Doctors only live in health.db, and appointments
+// and medical records may sit on any shard (see read_appointment).
+typedef struct {
+  const char *name;
+  int is_text;
+} column_def;
+
+typedef enum { ON_MAIN, ON_OWNER, ON_ANY } row_placement;
+
+typedef struct {
+  const char *name;
+  const char *archive; // table holding archived rows with the same columns, or NULL
+  row_placement placement;
+  int column_count;
+  column_def columns[4];
+} table_def;
+
+static const table_def tables[] = {
+    [TABLE_PATIENTS] = {"Patients", NULL, ON_OWNER, 2, {{"id", 0}, {"name", 1}}},
+    [TABLE_DOCTORS] = {"Doctors", NULL, ON_MAIN, 3, {{"id", 0}, {"name", 1}, {"specialty", 1}}},
+    [TABLE_APPOINTMENTS] = {"Appointments", "AppointmentsArchive", ON_ANY, 4, {{"id", 0}, {"patient_id", 0}, {"doctor_id", 0}, {"date", 1}}},
+    [TABLE_MEDICAL_RECORDS] = {"MedicalRecords", NULL, ON_ANY, 3, {{"id", 0}, {"patient_id", 0}, {"details", 1}}},
+};
+
+int parse_fields(const table_id table, const char *fields, unsigned int *mask) {
+  const table_def *def = &tables[table];
+  *mask = 0;
+  const char *p = fields ? fields : "";
+  while (*p) {
+    const char *end = strchr(p, ',');
+    const size_t length = end ? (size_t)(end - p) : strlen(p);
+    if (length > 0) {
+      int found = 0;
+      for (int i = 0; i < def->column_count; i++) {
+        if (strlen(def->columns[i].name) == length && strncmp(def->columns[i].name, p, length) == 0) {
+          *mask |= 1u << i;
+          found = 1;
+        }
+      }
+      if (!found) {
+        return 1;
+      }
+    }
+    p += length + (end ? 1 : 0);
+  }
+  if (*mask == 0) {
+    *mask = FIELDS_ALL;
+  }
+  return 0;
+}
+
+const char *table_name(const table_id table) {
+  return tables[table].name;
+}
+
+long long table_data_version(const table_id table) {
+  const int count = tables[table].placement == ON_MAIN ? 1 : shard_count;
+  long long version = 0;
+  for (int i = 0; i < count; i++) {
+    version += read_data_version(shards[i]);
+  }
+  return version;
+}
+
+// Prepares "SELECT <projected columns> FROM <from>[ WHERE id = ?]" on conn;
+// from is the table itself or its archive
+static int prepare_projection(sqlite3 *conn, const table_def *def, const char *from, const unsigned int mask, const int by_id, sqlite3_stmt **stmt) {
+  char sql[160] = "SELECT ";
+  size_t length = strlen(sql);
+  for (int i = 0; i < def->column_count; i++) {
+    if (mask & (1u << i)) {
+      length += (size_t)snprintf(sql + length, sizeof(sql) - length, "%s%s", length > 7 ? ", " : "", def->columns[i].name);
+    }
+  }
+  snprintf(sql + length, sizeof(sql) - length, " FROM %s%s", from, by_id ? " WHERE id = ?" : "");
+  return prepare_statement(conn, sql, stmt);
 }
 
-// Function to read all patients
-int read_all_patients() {
-  const char *sql = "SELECT id, name FROM Patients";
+// Builds the JSON object for the current row of a projection
+static json_t *projected_row(const table_def *def, const unsigned int mask, sqlite3_stmt *stmt) {
+  json_t *row = json_object();
+  int column = 0;
+  for (int i = 0; i < def->column_count; i++) {
+    if (!(mask & (1u << i))) {
+      continue;
+    }
+    if (def->columns[i].is_text) {
+      json_object_set_new(row, def->columns[i].name, json_string((const char *)sqlite3_column_text(stmt, column)));
+    } else {
+      json_object_set_new(row, def->columns[i].name, json_integer(sqlite3_column_int64(stmt, column)));
+    }
+    column++;
+  }
+  return row;
+}
+
+// 0 with *row set, 1 if conn has no such row, -1 on error
+static int read_row_fields_on(sqlite3 *conn, const table_def *def, const char *from, const int id, const unsigned int mask, json_t **row) {
   sqlite3_stmt *stmt;
-  const int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-  if (rc != SQLITE_OK) {
-    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+  if (prepare_projection(conn, def, from, mask, 1, &stmt) != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(conn));
+    return -1;
+  }
+  sqlite3_bind_int(stmt, 1, id);
+  const int rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    *row = projected_row(def, mask, stmt);
+  }
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_ROW ? 0 : rc == SQLITE_DONE ? 1 : -1;
+}
+
+static int read_row_fields_from(const table_def *def, const char *from, const int id, const unsigned int mask, json_t **row) {
+  *row = NULL;
+  sqlite3 *owner = def->placement == ON_MAIN ? db : shard_for(id);
+  int rc = read_row_fields_on(owner, def, from, id, mask, row);
+  for (int i = 0; rc == 1 && def->placement == ON_ANY && i < shard_count; i++) {
+    if (shards[i] != owner) {
+      rc = read_row_fields_on(shards[i], def, from, id, mask, row);
+    }
+  }
+  return rc;
+}
+
+int read_row_fields(const table_id table, const int id, const unsigned int mask, json_t **row) {
+  return read_row_fields_from(&tables[table], tables[table].name, id, mask, row);
+}
+
+int read_archived_row_fields(const table_id table, const int id, const unsigned int mask, json_t **row) {
+  const table_def *def = &tables[table];
+  if (def->archive == NULL) {
+    *row = NULL;
     return 1;
   }
+  const int rc = read_row_fields_from(def, def->archive, id, mask, row);
+  if (rc == 0) {
+    json_object_set_new(*row, "archived", json_true());
+  }
+  return rc;
+}
 
-  printf("All Patients:\n");
-  json_t *json_response_obj = json_array(); // Create a new JSON array
-  while (sqlite3_step(stmt) == SQLITE_ROW) {
-    const int id = sqlite3_column_int(stmt, 0);
-    // Explicitly cast the result of sqlite3_column_text to const char*
-    const char *name = (const char *)sqlite3_column_text(stmt, 1);
-    // Use %s to correctly format the string in json_pack
-    json_array_append_new(json_response_obj, json_pack("{sisi}", "id", id, "name", name)); // Append to the new JSON array
+// Looks up the ids that have no row in found yet, one prepared statement per
+// shard. With owners_only each id is tried on the shard that owns it;
+// otherwise on every other shard (rows of ON_ANY tables can live anywhere).
+// Returns 0 on success, -1 on database error.
+static int find_rows_from(const table_def *def, const char *from, const int *ids, const int count,
+                          const unsigned int mask, const int archived, const int owners_only, json_t **found) {
+  const int shards_used = def->placement == ON_MAIN ? 1 : shard_count;
+  for (int s = 0; s < shards_used; s++) {
+    sqlite3 *conn = def->placement == ON_MAIN ? db : shards[s];
+    sqlite3_stmt *stmt = NULL;
+    for (int i = 0; i < count; i++) {
+      const int owned = def->placement == ON_MAIN || shard_for(ids[i]) == conn;
+      if (found[i] != NULL || owned != owners_only) {
+        continue;
+      }
+      if (stmt == NULL && prepare_projection(conn, def, from, mask, 1, &stmt) != SQLITE_OK) {
+        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(conn));
+        return -1;
+      }
+      sqlite3_bind_int(stmt, 1, ids[i]);
+      const int rc = sqlite3_step(stmt);
+      if (rc == SQLITE_ROW) {
+        found[i] = projected_row(def, mask, stmt);
+        if (archived) {
+          json_object_set_new(found[i], "archived", json_true());
+        }
+      } else if (rc != SQLITE_DONE) {
+        sqlite3_finalize(stmt);
+        return -1;
+      }
+      sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+  }
+  if (owners_only && def->placement == ON_ANY) {
+    return find_rows_from(def, from, ids, count, mask, archived, 0, found);
   }
+  return 0;
+}
 
-  sqlite3_finalize(stmt);
+int read_rows_fields(const table_id table, const int *ids, const int count, const unsigned int mask,
+                     const int archived, json_t **rows) {
+  const table_def *def = &tables[table];
+  *rows = NULL;
+  json_t **found = calloc(count > 0 ? (size_t)count : 1, sizeof(json_t *));
+  if (found == NULL) {
+    return 1;
+  }
+  int rc = find_rows_from(def, def->name, ids, count, mask, 0, 1, found);
+  if (rc == 0 && archived && def->archive != NULL) {
+    rc = find_rows_from(def, def->archive, ids, count, mask, 1, 1, found);
+  }
+  if (rc == 0) {
+    *rows = json_array();
+  }
+  for (int i = 0; i < count; i++) {
+    if (found[i] && *rows) {
+      json_array_append(*rows, found[i]);
+    }
+    json_decref(found[i]);
+  }
+  free(found);
+  return rc == 0 ? 0 : 1;
+}
+
+// Scatter-gather over every shard (only health.db for Doctors), appending to rows
+static int append_all_fields_from(const table_def *def, const char *from, const unsigned int mask, const int archived, json_t *rows) {
+  const int count = def->placement == ON_MAIN ? 1 : shard_count;
+  for (int i = 0; i < count; i++) {
+    sqlite3_stmt *stmt;
+    if (prepare_projection(shards[i], def, from, mask, 0, &stmt) != SQLITE_OK) {
+      fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(shards[i]));
+      return 1;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      json_t *row = projected_row(def, mask, stmt);
+      if (archived) {
+        json_object_set_new(row, "archived", json_true());
+      }
+      json_array_append_new(rows, row);
+    }
+    sqlite3_finalize(stmt);
+  }
   return 0;
 }
 
+int read_all_fields(const table_id table, const unsigned int mask, json_t **rows) {
+  *rows = json_array();
+  if (append_all_fields_from(&tables[table], tables[table].name, mask, 0, *rows) != 0) {
+    json_decref(*rows);
+    *rows = NULL;
+    return 1;
+  }
+  return 0;
+}
+
+int read_all_archived_fields(const table_id table, const unsigned int mask, json_t *rows) {
+  const table_def *def = &tables[table];
+  return def->archive ? append_all_fields_from(def, def->archive, mask, 1, rows) : 0;
+}
+
+int read_all_patients(json_t **patients) {
+  return read_all_fields(TABLE_PATIENTS, FIELDS_ALL, patients);
+}
+
 
 // Read a patient's details by ID
 int read_patient(const int id, Patient *patient) {
+  sqlite3 *conn = shard_for(id);
   // Initialize the patient struct
   memset(patient, 0, sizeof(Patient));
 
   const char *sql = "SELECT id, name FROM Patients WHERE id = ?";
   sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  prepare_statement(conn, sql, &stmt);
   sqlite3_bind_int(stmt, 1, id);
 
   int rc = sqlite3_step(stmt);
@@ -137,9 +1056,10 @@ int read_patient(const int id, Patient *patient) {
 
 // Update a patient's details
 int update_patient(const Patient *patient) {
+  sqlite3 *conn = shard_for(patient->id);
   const char *sql = "UPDATE Patients SET name = ? WHERE id = ?";
   sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  prepare_statement(conn, sql, &stmt);
   sqlite3_bind_text(stmt, 1, patient->name, -1, SQLITE_STATIC);
   sqlite3_bind_int(stmt, 2, patient->id);
   const int rc = sqlite3_step(stmt);
@@ -149,13 +1069,20 @@ int update_patient(const Patient *patient) {
 
 // Delete a patient by ID
 int delete_patient(const int id) {
+  sqlite3 *conn = shard_for(id);
   const char *sql = "DELETE FROM Patients WHERE id = ?";
   sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  prepare_statement(conn, sql, &stmt);
   sqlite3_bind_int(stmt, 1, id);
-  const int rc = sqlite3_step(stmt);
+  const int changed = step_changes(conn, stmt);
+  if (changed > 0) {
+    stats_patient(NULL, -1);
+  }
+  if (changed >= 0 && use_id_bitmaps) {
+    id_bitmap_clear(&patient_ids, id);
+  }
   sqlite3_finalize(stmt);
-  return rc == SQLITE_DONE ? 0 : 1;
+  return changed >= 0 ? 0 : 1;
 }
 
 
@@ -163,11 +1090,25 @@ int delete_patient(const int id) {
 int create_doctor(const Doctor *doctor) {
   const char *sql = "INSERT INTO Doctors (id, name, specialty) VALUES (?, ?, ?)";
   sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-  sqlite3_bind_int(stmt, 1, doctor->id);
+  prepare_statement(db, sql, &stmt);
+  if (doctor->id > 0) {
+    sqlite3_bind_int(stmt, 1, doctor->id);
+  } else {
+    sqlite3_bind_null(stmt, 1); // Let AUTOINCREMENT pick the id
+  }
   sqlite3_bind_text(stmt, 2, doctor->name, -1, SQLITE_STATIC);
   sqlite3_bind_text(stmt, 3, doctor->specialty, -1, SQLITE_STATIC);
-  sqlite3_step(stmt);
+  sqlite3_mutex *mutex = sqlite3_db_mutex(db);
+  sqlite3_mutex_enter(mutex);
+  const int rc = sqlite3_step(stmt);
+  const sqlite3_int64 id = doctor->id > 0 ? doctor->id : sqlite3_last_insert_rowid(db);
+  sqlite3_mutex_leave(mutex);
+  if (rc == SQLITE_DONE) {
+    stats_doctor(NULL, doctor->specialty, 1);
+    if (use_id_bitmaps) {
+      id_bitmap_set(&doctor_ids, id);
+    }
+  }
   sqlite3_finalize(stmt);
   return 0;
 }
@@ -175,7 +1116,7 @@ int create_doctor(const Doctor *doctor) {
 int read_doctor(const int id, Doctor *doctor) {
   const char *sql = "SELECT id, name, specialty FROM Doctors WHERE id = ?";
   sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  prepare_statement(db, sql, &stmt);
   sqlite3_bind_int(stmt, 1, id);
   if (sqlite3_step(stmt) == SQLITE_ROW) {
     doctor->id = sqlite3_column_int(stmt, 0);
@@ -187,45 +1128,76 @@ int read_doctor(const int id, Doctor *doctor) {
 }
 
 int update_doctor(const Doctor *doctor) {
+  sqlite3_mutex *mutex = begin_row_write(db);
+  if (mutex == NULL) {
+    return 1;
+  }
+  Doctor before = {0};
+  read_doctor(doctor->id, &before);
+
   const char *sql = "UPDATE Doctors SET name = ?, specialty = ? WHERE id = ?";
   sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  prepare_statement(db, sql, &stmt);
   sqlite3_bind_text(stmt, 1, doctor->name, -1, SQLITE_STATIC);
   sqlite3_bind_text(stmt, 2, doctor->specialty, -1, SQLITE_STATIC);
   sqlite3_bind_int(stmt, 3, doctor->id);
-  sqlite3_step(stmt);
+  const int changed = step_changes(db, stmt);
   sqlite3_finalize(stmt);
+  if (end_row_write(db, mutex, changed < 0) != 0) {
+    return 1;
+  }
+  if (changed > 0) {
+    stats_doctor(NULL, before.specialty, -1);
+    stats_doctor(NULL, doctor->specialty, 1);
+  }
   return 0;
 }
 
+static void copy_deleted_doctor(sqlite3_stmt *row, void *out) {
+  Doctor *doctor = out;
+  const char *specialty = (const char *)sqlite3_column_text(row, 0);
+  snprintf(doctor->specialty, sizeof(doctor->specialty), "%s", specialty ? specialty : "");
+}
+
 int delete_doctor(const int id) {
-  const char *sql = "DELETE FROM Doctors WHERE id = ?";
-  sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-  sqlite3_bind_int(stmt, 1, id);
-  sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
+  Doctor before = {0};
+  const int deleted = delete_returning(db, 0, "DELETE FROM Doctors WHERE id = ? RETURNING specialty", id,
+                                       copy_deleted_doctor, &before);
+  if (deleted > 0) {
+    stats_doctor(NULL, before.specialty, -1);
+  }
+  if (deleted >= 0 && use_id_bitmaps) {
+    id_bitmap_clear(&doctor_ids, id);
+  }
   return 0;
 }
 
+// Appointments and medical records live on their patient's shard, and new
+// ids are allocated in the patient's bucket, so lookups by id go straight
+// to shard_for(id). Rows written before a reshard may sit elsewhere; the
+// other shards are only probed on a miss.
+
 // Appointment CRUD operations
 int create_appointment(const Appointment *appointment) {
+  sqlite3 *conn = shard_for(appointment->patient_id);
   const char *sql = "INSERT INTO Appointments (id, patient_id, doctor_id, date) VALUES (?, ?, ?, ?)";
   sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-  sqlite3_bind_int(stmt, 1, appointment->id);
+  prepare_statement(conn, sql, &stmt);
   sqlite3_bind_int(stmt, 2, appointment->patient_id);
   sqlite3_bind_int(stmt, 3, appointment->doctor_id);
   sqlite3_bind_text(stmt, 4, appointment->date, -1, SQLITE_STATIC);
-  sqlite3_step(stmt);
+  const int rc = step_insert(conn, "Appointments", "AppointmentsArchive", shard_bucket(appointment->patient_id), stmt, NULL);
   sqlite3_finalize(stmt);
-  return 0;
+  if (rc == 0) {
+    stats_appointment(NULL, appointment->doctor_id, appointment->date, 1);
+  }
+  return rc;
 }
 
-int read_appointment(const int id, Appointment *appointment) {
+static int read_appointment_on(sqlite3 *conn, const int id, Appointment *appointment) {
   const char *sql = "SELECT id, patient_id, doctor_id, date FROM Appointments WHERE id = ?";
   sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  prepare_statement(conn, sql, &stmt);
   sqlite3_bind_int(stmt, 1, id);
 
   const int rc = sqlite3_step(stmt);
@@ -244,75 +1216,401 @@ int read_appointment(const int id, Appointment *appointment) {
   return rc == SQLITE_ROW ? 0 : 1;
 }
 
+int read_appointment(const int id, Appointment *appointment) {
+  sqlite3 *owner = shard_for(id);
+  if (read_appointment_on(owner, id, appointment) == 0) {
+    return 0;
+  }
+  for (int i = 0; i < shard_count; i++) {
+    if (shards[i] != owner && read_appointment_on(shards[i], id, appointment) == 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Shard connection that holds row id of table (appointments and medical
+// records), or NULL if none does
+static sqlite3 *shard_holding(const char *table, const int id) {
+  char sql[96];
+  snprintf(sql, sizeof(sql), "SELECT 1 FROM %s WHERE id = ?", table);
+  sqlite3 *owner = shard_for(id);
+  if (row_exists(owner, sql, id)) {
+    return owner;
+  }
+  for (int i = 0; i < shard_count; i++) {
+    if (shards[i] != owner && row_exists(shards[i], sql, id)) {
+      return shards[i];
+    }
+  }
+  return NULL;
+}
+
+// Rows stay on the shard they were created on, and two shard files cannot
+// share one atomic transaction in WAL mode, so a new patient_id that lives
+// on another shard than the row is refused rather than left unreachable
+// from that patient's shard
+static int moves_shard(sqlite3 *holder, const int old_patient_id, const int new_patient_id) {
+  return shard_count > 1 && old_patient_id != new_patient_id && holder != shard_for(new_patient_id);
+}
 
 int update_appointment(const Appointment *appointment) {
+  sqlite3 *conn = shard_holding("Appointments", appointment->id);
+  if (conn == NULL) {
+    return 0;
+  }
+  sqlite3_mutex *mutex = begin_row_write(conn);
+  if (mutex == NULL) {
+    return 1;
+  }
+  Appointment before;
+  if (read_appointment_on(conn, appointment->id, &before) != 0) {
+    end_row_write(conn, mutex, 1);
+    return 0; // Deleted meanwhile
+  }
+  if (moves_shard(conn, before.patient_id, appointment->patient_id)) {
+    end_row_write(conn, mutex, 1);
+    return DB_CROSS_SHARD;
+  }
   const char *sql = "UPDATE Appointments SET patient_id = ?, doctor_id = ?, date = ? WHERE id = ?";
   sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  prepare_statement(conn, sql, &stmt);
   sqlite3_bind_int(stmt, 1, appointment->patient_id);
   sqlite3_bind_int(stmt, 2, appointment->doctor_id);
   sqlite3_bind_text(stmt, 3, appointment->date, -1, SQLITE_STATIC);
   sqlite3_bind_int(stmt, 4, appointment->id);
-  sqlite3_step(stmt);
+  const int failed = sqlite3_step(stmt) != SQLITE_DONE;
   sqlite3_finalize(stmt);
+  if (end_row_write(conn, mutex, failed) != 0) {
+    return 1;
+  }
+  stats_appointment(NULL, before.doctor_id, before.date, -1);
+  stats_appointment(NULL, appointment->doctor_id, appointment->date, 1);
   return 0;
 }
 
+static void copy_deleted_appointment(sqlite3_stmt *row, void *out) {
+  Appointment *appointment = out;
+  appointment->doctor_id = sqlite3_column_int(row, 0);
+  const char *date = (const char *)sqlite3_column_text(row, 1);
+  snprintf(appointment->date, sizeof(appointment->date), "%s", date ? date : "");
+}
+
 int delete_appointment(int id) {
-  const char *sql = "DELETE FROM Appointments WHERE id = ?";
-  sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-  sqlite3_bind_int(stmt, 1, id);
-  sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
-  return 0;
+  Appointment before;
+  const char *sql = "DELETE FROM Appointments WHERE id = ? RETURNING doctor_id, date";
+  const int deleted = delete_returning(shard_for(id), 1, sql, id, copy_deleted_appointment, &before);
+  if (deleted > 0) {
+    stats_appointment(NULL, before.doctor_id, before.date, -1);
+  }
+  return deleted >= 0 ? 0 : 1;
+}
+
+// Moves up to batch appointments of one shard, oldest first, in a single
+// IMMEDIATE transaction. The rows are read first so the counters can drop
+// them once the move has committed.
+static int archive_appointments_on(sqlite3 *conn, const char *age, const int batch) {
+  Appointment *rows = malloc((size_t)batch * sizeof(Appointment));
+  if (rows == NULL) {
+    return -1;
+  }
+  int count = 0, failed = 0;
+
+  sqlite3_mutex *mutex = sqlite3_db_mutex(conn);
+  sqlite3_mutex_enter(mutex);
+  if (sqlite3_exec(conn, "BEGIN IMMEDIATE", NULL, NULL, NULL) != SQLITE_OK) {
+    sqlite3_mutex_leave(mutex);
+    free(rows);
+    return -1;
+  }
+
+  sqlite3_stmt *select, *insert, *delete;
+  failed = prepare_statement(conn,
+                             "SELECT id, patient_id, doctor_id, date FROM Appointments "
+                             "WHERE date < date('now', ?) ORDER BY date, id LIMIT ?", &select) != SQLITE_OK;
+  if (!failed) {
+    sqlite3_bind_text(select, 1, age, -1, SQLITE_STATIC);
+    sqlite3_bind_int(select, 2, batch);
+    while (count < batch && sqlite3_step(select) == SQLITE_ROW) {
+      Appointment *row = &rows[count++];
+      row->id = sqlite3_column_int(select, 0);
+      row->patient_id = sqlite3_column_int(select, 1);
+      row->doctor_id = sqlite3_column_int(select, 2);
+      snprintf(row->date, sizeof(row->date), "%s", (const char *)sqlite3_column_text(select, 3));
+    }
+    sqlite3_finalize(select);
+  }
+
+  if (!failed && count > 0) {
+    failed = prepare_statement(conn, "INSERT INTO AppointmentsArchive (id, patient_id, doctor_id, date) VALUES (?, ?, ?, ?)", &insert) != SQLITE_OK;
+    if (!failed) {
+      failed = prepare_statement(conn, "DELETE FROM Appointments WHERE id = ?", &delete) != SQLITE_OK;
+      for (int i = 0; i < count && !failed; i++) {
+        sqlite3_bind_int(insert, 1, rows[i].id);
+        sqlite3_bind_int(insert, 2, rows[i].patient_id);
+        sqlite3_bind_int(insert, 3, rows[i].doctor_id);
+        sqlite3_bind_text(insert, 4, rows[i].date, -1, SQLITE_STATIC);
+        sqlite3_bind_int(delete, 1, rows[i].id);
+        failed = sqlite3_step(insert) != SQLITE_DONE || sqlite3_step(delete) != SQLITE_DONE;
+        sqlite3_reset(insert);
+        sqlite3_reset(delete);
+      }
+      sqlite3_finalize(delete);
+      sqlite3_finalize(insert);
+    }
+  }
+
+  if (failed) {
+    fprintf(stderr, "Archiving appointments failed: %s\n", sqlite3_errmsg(conn));
+    sqlite3_exec(conn, "ROLLBACK", NULL, NULL, NULL);
+  } else if (sqlite3_exec(conn, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+    sqlite3_exec(conn, "ROLLBACK", NULL, NULL, NULL);
+    failed = 1;
+  }
+  sqlite3_mutex_leave(mutex);
+
+  for (int i = 0; i < count && !failed; i++) {
+    stats_appointment(NULL, rows[i].doctor_id, rows[i].date, -1);
+  }
+  free(rows);
+  return failed ? -1 : count;
+}
+
+int archive_appointments(const int days, const int batch) {
+  char age[32];
+  snprintf(age, sizeof(age), "-%d days", days);
+  int moved = 0;
+  for (int i = 0; i < shard_count; i++) {
+    const int count = archive_appointments_on(shards[i], age, batch);
+    if (count < 0) {
+      return -1;
+    }
+    moved += count;
+  }
+  return moved;
+}
+
+int incremental_vacuum(const int pages) {
+  int free_pages = 0;
+  for (int i = 0; i < shard_count; i++) {
+    if (read_pragma_int(shards[i], "PRAGMA auto_vacuum") != 2) {
+      continue; // NONE or FULL; a file created before migration 3 needs one VACUUM
+    }
+    char sql[64];
+    snprintf(sql, sizeof(sql), "PRAGMA incremental_vacuum(%d)", pages);
+    if (sqlite3_exec(shards[i], sql, NULL, NULL, NULL) != SQLITE_OK) {
+      fprintf(stderr, "Incremental vacuum failed on shard %d: %s\n", i, sqlite3_errmsg(shards[i]));
+      return -1;
+    }
+    const int remaining = read_pragma_int(shards[i], "PRAGMA freelist_count");
+    free_pages += remaining > 0 ? remaining : 0;
+  }
+  return free_pages;
 }
 
 // MedicalRecord CRUD operations
 int create_medical_record(const MedicalRecord *medical_record) {
+  sqlite3 *conn = shard_for(medical_record->patient_id);
   const char *sql = "INSERT INTO MedicalRecords (id, patient_id, details) VALUES (?, ?, ?)";
   sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-  sqlite3_bind_int(stmt, 1, medical_record->id);
+  prepare_statement(conn, sql, &stmt);
   sqlite3_bind_int(stmt, 2, medical_record->patient_id);
   sqlite3_bind_text(stmt, 3, medical_record->details, -1, SQLITE_STATIC);
-  sqlite3_step(stmt);
+  const int rc = step_insert(conn, "MedicalRecords", NULL, shard_bucket(medical_record->patient_id), stmt, NULL);
   sqlite3_finalize(stmt);
-  return 0;
+  if (rc == 0) {
+    stats_medical_record(NULL, medical_record->patient_id, 1);
+  }
+  return rc;
 }
 
-int read_medical_record(int id, MedicalRecord *medical_record) {
+static int read_medical_record_on(sqlite3 *conn, int id, MedicalRecord *medical_record) {
   const char *sql = "SELECT id, patient_id, details FROM MedicalRecords WHERE id = ?";
   sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  prepare_statement(conn, sql, &stmt);
   sqlite3_bind_int(stmt, 1, id);
-  if (sqlite3_step(stmt) == SQLITE_ROW) {
+  const int rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
     medical_record->id = sqlite3_column_int(stmt, 0);
     medical_record->patient_id = sqlite3_column_int(stmt, 1);
     strcpy(medical_record->details, (char *)sqlite3_column_text(stmt, 2));
   }
   sqlite3_finalize(stmt);
-  return 0;
+  return rc == SQLITE_ROW ? 0 : 1;
+}
+
+int read_medical_record(int id, MedicalRecord *medical_record) {
+  sqlite3 *owner = shard_for(id);
+  if (read_medical_record_on(owner, id, medical_record) == 0) {
+    return 0;
+  }
+  for (int i = 0; i < shard_count; i++) {
+    if (shards[i] != owner && read_medical_record_on(shards[i], id, medical_record) == 0) {
+      return 0;
+    }
+  }
+  return 1;
 }
 
 int update_medical_record(const MedicalRecord *medical_record) {
+  sqlite3 *conn = shard_holding("MedicalRecords", medical_record->id);
+  if (conn == NULL) {
+    return 0;
+  }
+  sqlite3_mutex *mutex = begin_row_write(conn);
+  if (mutex == NULL) {
+    return 1;
+  }
+  MedicalRecord before;
+  if (read_medical_record_on(conn, medical_record->id, &before) != 0) {
+    end_row_write(conn, mutex, 1);
+    return 0; // Deleted meanwhile
+  }
+  if (moves_shard(conn, before.patient_id, medical_record->patient_id)) {
+    end_row_write(conn, mutex, 1);
+    return DB_CROSS_SHARD;
+  }
   const char *sql = "UPDATE MedicalRecords SET patient_id = ?, details = ? WHERE id = ?";
   sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  prepare_statement(conn, sql, &stmt);
   sqlite3_bind_int(stmt, 1, medical_record->patient_id);
   sqlite3_bind_text(stmt, 2, medical_record->details, -1, SQLITE_STATIC);
   sqlite3_bind_int(stmt, 3, medical_record->id);
-  sqlite3_step(stmt);
+  const int failed = sqlite3_step(stmt) != SQLITE_DONE;
   sqlite3_finalize(stmt);
+  if (end_row_write(conn, mutex, failed) != 0) {
+    return 1;
+  }
+  stats_medical_record(NULL, before.patient_id, -1);
+  stats_medical_record(NULL, medical_record->patient_id, 1);
   return 0;
 }
 
+static void copy_deleted_medical_record(sqlite3_stmt *row, void *out) {
+  ((MedicalRecord *)out)->patient_id = sqlite3_column_int(row, 0);
+}
+
 int delete_medical_record(const int id) {
-  const char *sql = "DELETE FROM MedicalRecords WHERE id = ?";
+  MedicalRecord before;
+  const char *sql = "DELETE FROM MedicalRecords WHERE id = ? RETURNING patient_id";
+  const int deleted = delete_returning(shard_for(id), 1, sql, id, copy_deleted_medical_record, &before);
+  if (deleted > 0) {
+    stats_medical_record(NULL, before.patient_id, -1);
+  }
+  return deleted >= 0 ? 0 : 1;
+}
+
+// Patient summary (patient + upcoming appointments + recent records)
+static int append_summary_appointments(sqlite3 *conn, const int patient_id, const int limit, json_t *summary) {
+  const char *sql =
+      "SELECT a.id, a.doctor_id, d.name, a.date "
+      "FROM Appointments a LEFT JOIN Doctors d ON d.id = a.doctor_id "
+      "WHERE a.patient_id = ? AND a.date >= date('now') "
+      "ORDER BY a.date LIMIT ?";
   sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-  sqlite3_bind_int(stmt, 1, id);
-  sqlite3_step(stmt);
+  if (prepare_statement(conn, sql, &stmt) != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(conn));
+    return -1;
+  }
+  sqlite3_bind_int(stmt, 1, patient_id);
+  sqlite3_bind_int(stmt, 2, limit);
+
+  json_t *appointments = json_array();
+  int rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    const char *doctor_name = (const char *)sqlite3_column_text(stmt, 2);
+    json_t *json_appointment = json_object();
+    json_object_set_new(json_appointment, "id", json_integer(sqlite3_column_int(stmt, 0)));
+    json_object_set_new(json_appointment, "doctor_id", json_integer(sqlite3_column_int(stmt, 1)));
+    json_object_set_new(json_appointment, "doctor_name", doctor_name ? json_string(doctor_name) : json_null());
+    json_object_set_new(json_appointment, "date", json_string((const char *)sqlite3_column_text(stmt, 3)));
+    json_array_append_new(appointments, json_appointment);
+  }
   sqlite3_finalize(stmt);
-  return 0;
+
+  json_object_set_new(summary, "appointments", appointments);
+  return rc == SQLITE_DONE ? 0 : -1;
+}
+
+static int append_summary_records(sqlite3 *conn, const int patient_id, const int limit, json_t *summary) {
+  const char *sql =
+      "SELECT id, details FROM MedicalRecords "
+      "WHERE patient_id = ? ORDER BY id DESC LIMIT ?";
+  sqlite3_stmt *stmt;
+  if (prepare_statement(conn, sql, &stmt) != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(conn));
+    return -1;
+  }
+  sqlite3_bind_int(stmt, 1, patient_id);
+  sqlite3_bind_int(stmt, 2, limit);
+
+  json_t *records = json_array();
+  int rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    json_t *json_record = json_object();
+    json_object_set_new(json_record, "id", json_integer(sqlite3_column_int(stmt, 0)));
+    json_object_set_new(json_record, "details", json_string((const char *)sqlite3_column_text(stmt, 1)));
+    json_array_append_new(records, json_record);
+  }
+  sqlite3_finalize(stmt);
+
+  json_object_set_new(summary, "medical_records", records);
+  return rc == SQLITE_DONE ? 0 : -1;
+}
+
+int read_patient_summary(const int id, const int include, const int limit, json_t **summary) {
+  *summary = NULL;
+  sqlite3 *conn = shard_for(id);
+
+  // The connection is shared between worker threads; holding its mutex keeps
+  // other threads' statements out of our transaction so every section sees
+  // the same snapshot.
+  sqlite3_mutex *mutex = sqlite3_db_mutex(conn);
+  sqlite3_mutex_enter(mutex);
+
+  if (sqlite3_exec(conn, "BEGIN", NULL, NULL, NULL) != SQLITE_OK) {
+    fprintf(stderr, "Failed to begin summary transaction: %s\n", sqlite3_errmsg(conn));
+    sqlite3_mutex_leave(mutex);
+    return -1;
+  }
+
+  int result = 1;
+  json_t *json_summary = NULL;
+  const char *sql = "SELECT id, name FROM Patients WHERE id = ?";
+  sqlite3_stmt *stmt;
+  if (prepare_statement(conn, sql, &stmt) != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(conn));
+    result = -1;
+  } else {
+    sqlite3_bind_int(stmt, 1, id);
+    const int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+      json_t *json_patient = json_object();
+      json_object_set_new(json_patient, "id", json_integer(sqlite3_column_int(stmt, 0)));
+      json_object_set_new(json_patient, "name", json_string((const char *)sqlite3_column_text(stmt, 1)));
+      json_summary = json_object();
+      json_object_set_new(json_summary, "patient", json_patient);
+      result = 0;
+    } else if (rc != SQLITE_DONE) {
+      result = -1;
+    }
+    sqlite3_finalize(stmt);
+  }
+
+  if (result == 0 && (include & SUMMARY_INCLUDE_APPOINTMENTS)) {
+    result = append_summary_appointments(conn, id, limit, json_summary);
+  }
+  if (result == 0 && (include & SUMMARY_INCLUDE_RECORDS)) {
+    result = append_summary_records(conn, id, limit, json_summary);
+  }
+
+  sqlite3_exec(conn, "COMMIT", NULL, NULL, NULL);
+  sqlite3_mutex_leave(mutex);
+
+  if (result == 0) {
+    *summary = json_summary;
+  } else if (json_summary) {
+    json_decref(json_summary);
+  }
+  return result;
 }
@@ -1,9 +1,29 @@
 #ifndef DATABASE_H
 #define DATABASE_H
 #include <sqlite3.h>
+#include <jansson.h>
+#include <stdint.h>
 
 extern sqlite3 *db;
 
+#define DB_PATH "health.db"
+
+// Sharding (HEALTH_DB_SHARDS). Patient ids hash into SHARD_BUCKETS buckets
+// and bucket b lives in shard b % shard_count; appointments and medical
+// records follow their patient. Shard 0 is DB_PATH and also holds Doctors,
+// shard i > 0 is SHARD_PATH_FORMAT.
+#define SHARD_PATH_FORMAT "health.shard%d.db"
+#define SHARD_MAX 16
+#define SHARD_BUCKETS 256
+
+static inline int shard_bucket(const long long id) {
+  return (int)(((id % SHARD_BUCKETS) + SHARD_BUCKETS) % SHARD_BUCKETS);
+}
+
+static inline int shard_for_id(const long long id, const int shard_count) {
+  return shard_bucket(id) % shard_count;
+}
+
 
 
 typedef struct {
@@ -30,12 +50,116 @@ typedef struct {
   char details[255];
 } MedicalRecord;
 
+// Tables served by the GET endpoints, for column projections (?fields=)
+typedef enum {
+  TABLE_PATIENTS,
+  TABLE_DOCTORS,
+  TABLE_APPOINTMENTS,
+  TABLE_MEDICAL_RECORDS,
+} table_id;
+
+// Projection selecting every column of a table
+#define FIELDS_ALL (~0u)
+
 int init_db();
 void close_db();
 
+// Path of a shard's file: DB_PATH or SHARD_PATH_FORMAT, inside HEALTH_DB_DIR
+// when that is set
+void database_file_path(const int shard, char *path, const size_t size);
+
+// Number of shard connections opened by init_db
+int database_shard_count(void);
+
+// Recomputes the aggregate counters (stats.h) with GROUP BY queries
+int compute_stats(json_t **stats);
+
+// Recounts the live counters when another connection has committed since
+// the last recount (PRAGMA data_version) or replicated transactions were
+// applied; seeds them on the first call. Called from init_db and then only
+// from the maintenance thread.
+int refresh_stats_if_stale(void);
+
+// Pages tables and indexes into the cache and loads the schema on every
+// connection so the first requests after boot do not pay for it
+int warm_up_db(void);
+
+// Bytes held by the live-id bitmaps, and by the page caches of all shard
+// connections (part of SQLite's heap), for memory.h
+size_t id_bitmaps_memory_bytes(void);
+size_t page_caches_memory_bytes(void);
+
+// Runs EXPLAIN QUERY PLAN for sql on a shard connection. On success *plan is
+// a malloc'd, newline-separated plan the caller frees. Returns 0 on success.
+int explain_query_plan(const int shard, const char *sql, char **plan);
+
 
 
+// Replication (replication.h). snapshot_shard serializes one shard file at a
+// transaction boundary and stores the replication log sequence it includes;
+// *data is freed with sqlite3_free. apply_replicated runs a transaction
+// received from the leader on a follower's shard. Both return 0 on success,
+// 1 for an unknown shard, -1 (snapshot) or 1 (apply) on database error.
+int snapshot_shard(const int shard, unsigned char **data, sqlite3_int64 *size, uint64_t *log_seq);
+int apply_replicated(const int shard, const char *sql);
+
+// Parses a comma-separated column list into a projection mask (bit i is the
+// table's i-th column). NULL or "" selects every column. Returns 0 on
+// success, 1 if a name is not a column of the table.
+int parse_fields(const table_id table, const char *fields, unsigned int *mask);
+
+// SQL name of a table, e.g. "MedicalRecords"
+const char *table_name(const table_id table);
+
+// Sum of PRAGMA data_version over the connections holding the table. It
+// changes when another process commits to one of them (this process's own
+// commits are reported by changes_table_version instead).
+long long table_data_version(const table_id table);
+
+// Reads one row as a JSON object holding only the projected columns; the
+// SELECT itself names only those columns, so unrequested text is never read.
+// Returns 0 on success, 1 if the row does not exist, -1 on database error.
+int read_row_fields(const table_id table, const int id, const unsigned int mask, json_t **row);
+
+// Reads the rows with the given ids into a new JSON array of projected
+// objects, in the order asked; ids without a row are left out. Each shard
+// prepares its lookup once for all the ids it owns. With archived, ids with
+// no live row are also looked up in the table's archive. Returns 0 on
+// success, 1 on database error.
+int read_rows_fields(const table_id table, const int *ids, const int count, const unsigned int mask,
+                     const int archived, json_t **rows);
+
+// Reads every row of a table from every shard that holds it into a new JSON
+// array of projected objects. Returns 0 on success, 1 on database error.
+int read_all_fields(const table_id table, const unsigned int mask, json_t **rows);
+
+// Tables with an archive (TABLE_APPOINTMENTS, see maintenance.h) also serve
+// archived rows, each with "archived": true. read_archived_row_fields has
+// the return values of read_row_fields; read_all_archived_fields appends to
+// rows and returns 0 on success, 1 on database error. Tables without an
+// archive have no archived rows.
+int read_archived_row_fields(const table_id table, const int id, const unsigned int mask, json_t **row);
+int read_all_archived_fields(const table_id table, const unsigned int mask, json_t *rows);
+
+// Moves up to batch appointments dated more than days ago from each shard
+// into AppointmentsArchive, one transaction per shard. Returns the number of
+// rows moved, or -1 on database error.
+int archive_appointments(const int days, const int batch);
+
+// Returns up to pages free pages of every shard file to the filesystem
+// (PRAGMA incremental_vacuum). Files not in incremental auto-vacuum mode are
+// skipped. Returns the free pages left, or -1 on database error.
+int incremental_vacuum(const int pages);
+
+// Referential checks for appointment and record writes. Answered from
+// in-memory bitmaps of live ids; only a miss queries SQLite, to pick up
+// rows inserted by another process.
+int patient_exists(const int id);
+int doctor_exists(const int id);
+
 int create_patient(const Patient *patient);
+// Reads every patient from every shard into a new JSON array
+int read_all_patients(json_t **patients);
 int read_patient(const int id, Patient *patient);
 int update_patient(const Patient *patient);
 int delete_patient(const int id);
@@ -45,6 +169,10 @@ int update_doctor(const Doctor *doctor);
 int delete_doctor(const int id);
 int create_appointment(const Appointment *appointment);
 int read_appointment(const int id, Appointment *appointment);
+// update_appointment and update_medical_record return DB_CROSS_SHARD when
+// the new patient_id lives on another shard than the row (rows do not move
+// between shards)
+#define DB_CROSS_SHARD 2
 int update_appointment(const Appointment *appointment);
 int delete_appointment(int id);
 int create_medical_record(const MedicalRecord *medical_record);
@@ -52,4 +180,14 @@ int read_medical_record(int id, MedicalRecord *medical_record);
 int update_medical_record(const MedicalRecord *medical_record);
 int delete_medical_record(const int id);
 
+// Sections returned by read_patient_summary
+#define SUMMARY_INCLUDE_APPOINTMENTS 0x1
+#define SUMMARY_INCLUDE_RECORDS 0x2
+#define SUMMARY_INCLUDE_ALL (SUMMARY_INCLUDE_APPOINTMENTS | SUMMARY_INCLUDE_RECORDS)
+
+// Reads a patient, their upcoming appointments (with doctor names) and most
+// recent medical records inside one read transaction.
+// Returns 0 on success, 1 if the patient does not exist, -1 on database error.
+int read_patient_summary(const int id, const int include, const int limit, json_t **summary);
+
 #endif // DATABASE_H
@@ -2,9 +2,12 @@
 
 #include "doctors_handlers.h"
 
+#include "body_format.h"
 #include "cors.h"
 #include "database.h" // Include your database operations header file here
 #include "json_response.h"
+#include "list_cache.h"
+#include "router.h"
 
 #include <string.h>
 // #include "utils.h" // Include if you have utility functions (like error handling, CORS setting, etc.)
@@ -14,22 +17,63 @@
 
 int callback_doctors_get(const struct _u_request *request, struct _u_response *response, void *user_data) {
   printf("callback_doctors_get: Function called\n");
-  const char *id_str = u_map_get(request->map_url, "id");
-  printf("callback_doctors_get: Requested ID: %s\n", id_str ? id_str : "null");
-  int id = id_str ? atoi(id_str) : -1;
-  Doctor doctor;
-  int result = read_doctor(id, &doctor);
+  const int id = router_request_id(request);
+  printf("callback_doctors_get: Requested ID: %d\n", id);
+  unsigned int fields;
+  if (parse_fields(TABLE_DOCTORS, u_map_get(request->map_url, "fields"), &fields) != 0) {
+    set_json_error_response(response, 400, "Unknown column in fields");
+    set_cors_headers(response);
+    return U_CALLBACK_CONTINUE;
+  }
+
+  if (id == ROUTER_NO_ID) {
+    // ?ids=1,2,3: the rows that exist, in that order
+    int ids[ROUTER_MAX_IDS];
+    const int id_count = router_request_ids(request, ids, ROUTER_MAX_IDS);
+    if (id_count != 0) {
+      json_t *json_response;
+      if (id_count < 0) {
+        set_json_error_response(response, 400, "ids must be a comma-separated list of at most 100 ids");
+      } else if (read_rows_fields(TABLE_DOCTORS, ids, id_count, fields, 0, &json_response) != 0) {
+        set_json_error_response(response, 500, "Error reading doctors");
+      } else {
+        set_negotiated_body_response(request, response, 200, json_response);
+        json_decref(json_response);
+      }
+      set_cors_headers(response);
+      return U_CALLBACK_CONTINUE;
+    }
+    if (list_cache_respond(TABLE_DOCTORS, fields, request, response)) {
+      set_cors_headers(response);
+      return U_CALLBACK_CONTINUE;
+    }
+    json_t *json_response;
+    if (read_all_fields(TABLE_DOCTORS, fields, &json_response) != 0) {
+      set_json_error_response(response, 500, "Error reading doctors");
+      set_cors_headers(response);
+      return U_CALLBACK_CONTINUE;
+    }
+    set_negotiated_body_response(request, response, 200, json_response);
+    json_decref(json_response);
+    set_cors_headers(response);
+    return U_CALLBACK_CONTINUE;
+  }
 
   json_t *json_response;
+  const int result = read_row_fields(TABLE_DOCTORS, id, fields, &json_response);
+  if (result < 0) {
+    set_json_error_response(response, 500, "Error reading doctor");
+    set_cors_headers(response);
+    return U_CALLBACK_CONTINUE;
+  }
   if (result == 0) {
-    printf("callback_doctors_get: Doctor found with ID: %d\n", id);
-    json_response = json_pack("{sisi}", "id", doctor.id, "name", doctor.name, "specialty", doctor.specialty);
+    printf("callback_doctors_get: Found doctor with ID: %d\n", id);
   } else {
-    printf("callback_doctors_get: Doctor not found\n");
+    printf("callback_doctors_get: No doctor with ID: %d\n", id);
     json_response = json_object();
   }
 
-  ulfius_set_json_body_response(response, 200, json_response);
+  set_negotiated_body_response(request, response, 200, json_response);
   json_decref(json_response);
   set_cors_headers(response);
   return U_CALLBACK_CONTINUE;
@@ -38,7 +82,7 @@ int callback_doctors_get(const struct _u_request *request, struct _u_response *r
 // Doctors POST Callback Function
 int callback_doctors_post(const struct _u_request *request, struct _u_response *response, void *user_data) {
   printf("Doctors POST called\n");
-  json_t *json_request = ulfius_get_json_body_request(request, NULL);
+  json_t *json_request = get_negotiated_body_request(request);
   const char *name = json_string_value(json_object_get(json_request, "name"));
   const char *specialty = json_string_value(json_object_get(json_request, "specialty"));
 
@@ -70,7 +114,7 @@ int callback_doctors_post(const struct _u_request *request, struct _u_response *
 
 int callback_doctors_put(const struct _u_request *request, struct _u_response *response, void *user_data) {
   printf("callback_doctors_put: Function called\n");
-  json_t *json_request = ulfius_get_json_body_request(request, NULL);
+  json_t *json_request = get_negotiated_body_request(request);
   int id = json_integer_value(json_object_get(json_request, "id"));
   const char *name = json_string_value(json_object_get(json_request, "name"));
   const char *specialty = json_string_value(json_object_get(json_request, "specialty"));
@@ -103,9 +147,8 @@ int callback_doctors_put(const struct _u_request *request, struct _u_response *r
 
 int callback_doctors_delete(const struct _u_request *request, struct _u_response *response, void *user_data) {
   printf("callback_doctors_delete: Function called\n");
-  const char *id_str = u_map_get(request->map_url, "id");
-  printf("callback_doctors_delete: Doctor ID: %s\n", id_str ? id_str : "null");
-  int id = id_str ? atoi(id_str) : -1;
+  int id = router_request_id(request);
+  printf("callback_doctors_delete: Doctor ID: %d\n", id);
 
   if (id > 0) {
     int result = delete_doctor(id);
@@ -0,0 +1,66 @@
+#include "id_bitmap.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+int id_bitmap_set(id_bitmap *bitmap, long long id) {
+  if (id <= 0) {
+    return 1;
+  }
+  const size_t word = (size_t)id / 64;
+  pthread_rwlock_wrlock(&bitmap->lock);
+  if (word >= bitmap->word_count) {
+    // Double so a run of sequential inserts grows the bitmap O(log n) times
+    size_t word_count = bitmap->word_count ? bitmap->word_count : 16;
+    while (word_count <= word) {
+      word_count *= 2;
+    }
+    uint64_t *words = realloc(bitmap->words, word_count * sizeof(uint64_t));
+    if (words == NULL) {
+      pthread_rwlock_unlock(&bitmap->lock);
+      return 1;
+    }
+    memset(words + bitmap->word_count, 0, (word_count - bitmap->word_count) * sizeof(uint64_t));
+    bitmap->words = words;
+    bitmap->word_count = word_count;
+  }
+  bitmap->words[word] |= 1ull << (id % 64);
+  pthread_rwlock_unlock(&bitmap->lock);
+  return 0;
+}
+
+void id_bitmap_clear(id_bitmap *bitmap, long long id) {
+  if (id <= 0) {
+    return;
+  }
+  pthread_rwlock_wrlock(&bitmap->lock);
+  if ((size_t)id / 64 < bitmap->word_count) {
+    bitmap->words[(size_t)id / 64] &= ~(1ull << (id % 64));
+  }
+  pthread_rwlock_unlock(&bitmap->lock);
+}
+
+int id_bitmap_test(id_bitmap *bitmap, long long id) {
+  if (id <= 0) {
+    return 0;
+  }
+  pthread_rwlock_rdlock(&bitmap->lock);
+  const int live = (size_t)id / 64 < bitmap->word_count && (bitmap->words[(size_t)id / 64] >> (id % 64)) & 1;
+  pthread_rwlock_unlock(&bitmap->lock);
+  return live;
+}
+
+void id_bitmap_reset(id_bitmap *bitmap) {
+  pthread_rwlock_wrlock(&bitmap->lock);
+  free(bitmap->words);
+  bitmap->words = NULL;
+  bitmap->word_count = 0;
+  pthread_rwlock_unlock(&bitmap->lock);
+}
+
+size_t id_bitmap_bytes(id_bitmap *bitmap) {
+  pthread_rwlock_rdlock(&bitmap->lock);
+  const size_t bytes = bitmap->word_count * sizeof(uint64_t);
+  pthread_rwlock_unlock(&bitmap->lock);
+  return bytes;
+}
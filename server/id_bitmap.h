@@ -0,0 +1,35 @@
+#ifndef ID_BITMAP_H
+#define ID_BITMAP_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Growable bitmap of row ids, one bit per id. database.c keeps one for live
+// Patients and one for live Doctors so writes can check references without
+// a query. Readers take the read lock; set/clear take the write lock.
+
+typedef struct {
+  pthread_rwlock_t lock;
+  uint64_t *words;
+  size_t word_count;
+} id_bitmap;
+
+#define ID_BITMAP_INITIALIZER {PTHREAD_RWLOCK_INITIALIZER, NULL, 0}
+
+// Marks id as live, growing the bitmap if needed. Returns 0, or 1 if the
+// id is not positive or memory ran out (the bitmap then simply misses it).
+int id_bitmap_set(id_bitmap *bitmap, long long id);
+
+void id_bitmap_clear(id_bitmap *bitmap, long long id);
+
+// 1 if id is marked live
+int id_bitmap_test(id_bitmap *bitmap, long long id);
+
+// Clears every id and releases the words
+void id_bitmap_reset(id_bitmap *bitmap);
+
+// Bytes held by the words
+size_t id_bitmap_bytes(id_bitmap *bitmap);
+
+#endif // ID_BITMAP_H
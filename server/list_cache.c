@@ -0,0 +1,199 @@
+#include "list_cache.h"
+
+#include "body_format.h"
+#include "changes.h"
+#include "config.h"
+#include "static_files.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#define LIST_CACHE_TABLES (TABLE_MEDICAL_RECORDS + 1)
+
+typedef struct {
+  pthread_rwlock_t lock;
+  pthread_mutex_t build_lock; // one rebuild at a time; other readers wait for it
+  int valid;
+  int too_large;              // the last build exceeded the cutoff; stamps still apply
+  uint64_t change_version;
+  long long data_version;
+  char *json;
+  size_t json_size;
+  char *gzip;                 // NULL if compression did not pay off
+  size_t gzip_size;
+} list_entry;
+
+static list_entry entries[LIST_CACHE_TABLES];
+static size_t max_bytes = 0;
+
+int list_cache_init(void) {
+  const int configured = config_get_int("HEALTH_LIST_CACHE_MAX_BYTES", 256 * 1024);
+  max_bytes = configured > 0 ? (size_t)configured : 0;
+  for (int i = 0; i < LIST_CACHE_TABLES; i++) {
+    pthread_rwlock_init(&entries[i].lock, NULL);
+    pthread_mutex_init(&entries[i].build_lock, NULL);
+  }
+  return 0;
+}
+
+static void clear_entry(list_entry *entry) {
+  free(entry->json);
+  free(entry->gzip);
+  entry->json = NULL;
+  entry->gzip = NULL;
+  entry->json_size = 0;
+  entry->gzip_size = 0;
+  entry->valid = 0;
+}
+
+void list_cache_close(void) {
+  for (int i = 0; i < LIST_CACHE_TABLES; i++) {
+    pthread_rwlock_wrlock(&entries[i].lock);
+    clear_entry(&entries[i]);
+    pthread_rwlock_unlock(&entries[i].lock);
+  }
+  max_bytes = 0;
+}
+
+// gzip at the default level: entries are rebuilt after writes, so this sits
+// on the request path, unlike the static files' best-compression variants
+static char *gzip_body(const char *data, const size_t size, size_t *out_size) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    return NULL;
+  }
+  const uLong bound = deflateBound(&stream, (uLong)size);
+  char *out = malloc(bound);
+  if (out) {
+    stream.next_in = (Bytef *)data;
+    stream.avail_in = (uInt)size;
+    stream.next_out = (Bytef *)out;
+    stream.avail_out = (uInt)bound;
+    if (deflate(&stream, Z_FINISH) == Z_STREAM_END && stream.total_out < size) {
+      *out_size = stream.total_out;
+    } else {
+      free(out);
+      out = NULL;
+    }
+  }
+  deflateEnd(&stream);
+  return out;
+}
+
+static int is_fresh(const list_entry *entry, const uint64_t change_version, const long long data_version) {
+  return (entry->valid || entry->too_large) && entry->change_version == change_version && entry->data_version == data_version;
+}
+
+// Copies the cached body into the response; caller holds the read lock
+static void respond_from_entry(const list_entry *entry, const struct _u_request *request, struct _u_response *response) {
+  u_map_put(response->map_header, "Vary", "Accept, Accept-Encoding");
+  if (entry->gzip && accepts_encoding(u_map_get_case(request->map_header, "Accept-Encoding"), "gzip")) {
+    ulfius_set_binary_body_response(response, 200, entry->gzip, entry->gzip_size);
+    u_map_put(response->map_header, "Content-Encoding", "gzip");
+  } else {
+    ulfius_set_binary_body_response(response, 200, entry->json, entry->json_size);
+  }
+  u_map_put(response->map_header, "Content-Type", "application/json");
+}
+
+// Reads and serializes the full list, stores it unless it is over the
+// cutoff, and answers the request with it either way. Returns 0, or 1 on
+// database error.
+static int rebuild(list_entry *entry, const table_id table, const uint64_t change_version, const long long data_version,
+                   const struct _u_request *request, struct _u_response *response) {
+  json_t *rows;
+  if (read_all_fields(table, FIELDS_ALL, &rows) != 0) {
+    return 1;
+  }
+  char *json = json_dumps(rows, JSON_COMPACT);
+  json_decref(rows);
+  if (json == NULL) {
+    return 1;
+  }
+  const size_t json_size = strlen(json);
+  size_t gzip_size = 0;
+  char *gzip = json_size <= max_bytes ? gzip_body(json, json_size, &gzip_size) : NULL;
+
+  pthread_rwlock_wrlock(&entry->lock);
+  clear_entry(entry);
+  // json_dumps allocates through jansson, so copy into a plain buffer the cache owns
+  entry->json = json_size <= max_bytes ? malloc(json_size) : NULL;
+  if (entry->json) {
+    memcpy(entry->json, json, json_size);
+    entry->json_size = json_size;
+    entry->gzip = gzip;
+    entry->gzip_size = gzip_size;
+    entry->valid = 1;
+    gzip = NULL;
+  }
+  entry->too_large = !entry->valid;
+  entry->change_version = change_version;
+  entry->data_version = data_version;
+  if (entry->valid) {
+    respond_from_entry(entry, request, response);
+  } else {
+    ulfius_set_binary_body_response(response, 200, json, json_size);
+    u_map_put(response->map_header, "Content-Type", "application/json");
+    u_map_put(response->map_header, "Vary", "Accept");
+  }
+  pthread_rwlock_unlock(&entry->lock);
+
+  free(gzip);
+  json_free_t free_json;
+  json_get_alloc_funcs(NULL, &free_json);
+  free_json(json);
+  return 0;
+}
+
+int list_cache_respond(const table_id table, const unsigned int fields,
+                       const struct _u_request *request, struct _u_response *response) {
+  if (max_bytes == 0 || fields != FIELDS_ALL ||
+      body_format_from_accept(u_map_get_case(request->map_header, "Accept")) != BODY_FORMAT_JSON) {
+    return 0;
+  }
+  list_entry *entry = &entries[table];
+  // Read the stamps before the rows: a write landing in between only makes
+  // the next request rebuild again
+  const uint64_t change_version = changes_table_version(table_name(table));
+  const long long data_version = table_data_version(table);
+
+  pthread_rwlock_rdlock(&entry->lock);
+  if (is_fresh(entry, change_version, data_version)) {
+    const int served = entry->valid;
+    if (served) {
+      respond_from_entry(entry, request, response);
+    }
+    pthread_rwlock_unlock(&entry->lock);
+    return served;
+  }
+  pthread_rwlock_unlock(&entry->lock);
+
+  // Concurrent misses wait for one rebuild instead of each reading the table
+  pthread_mutex_lock(&entry->build_lock);
+  pthread_rwlock_rdlock(&entry->lock);
+  int served = 0;
+  const int fresh = is_fresh(entry, change_version, data_version);
+  if (fresh && entry->valid) {
+    respond_from_entry(entry, request, response);
+    served = 1;
+  }
+  pthread_rwlock_unlock(&entry->lock);
+  if (!fresh) {
+    served = rebuild(entry, table, change_version, data_version, request, response) == 0;
+  }
+  pthread_mutex_unlock(&entry->build_lock);
+  return served;
+}
+
+size_t list_cache_memory_bytes(void) {
+  size_t bytes = 0;
+  for (int i = 0; i < LIST_CACHE_TABLES; i++) {
+    pthread_rwlock_rdlock(&entries[i].lock);
+    bytes += entries[i].json_size + entries[i].gzip_size;
+    pthread_rwlock_unlock(&entries[i].lock);
+  }
+  return bytes;
+}
@@ -0,0 +1,27 @@
+#ifndef LIST_CACHE_H
+#define LIST_CACHE_H
+
+#include "database.h"
+
+#include <stddef.h>
+#include <ulfius.h>
+
+// Materialized responses for the full lists of small tables. Each entry
+// holds the serialized JSON of every row (all columns) and its gzip variant.
+// An entry is stamped with the table's version from the change feed and its
+// PRAGMA data_version, and is rebuilt on the first read after either moves.
+// A list that serializes to more than HEALTH_LIST_CACHE_MAX_BYTES is not
+// kept; 0 disables the cache.
+
+int list_cache_init(void);
+void list_cache_close(void);
+
+// Answers a full-list GET from the cache: only without fields= and for JSON. Returns 1 if the response was set, 0 if the
+// caller should build it as usual.
+int list_cache_respond(const table_id table, const unsigned int fields,
+                       const struct _u_request *request, struct _u_response *response);
+
+// Bytes held by the cached bodies (memory.h)
+size_t list_cache_memory_bytes(void);
+
+#endif // LIST_CACHE_H
@@ -0,0 +1,245 @@
+#include "listener.h"
+
+#include "admission.h"
+#include "config.h"
+#include "trace.h"
+#include "util.h"
+
+#include <gnutls/gnutls.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Ulfius' own MHD callbacks (exported by libulfius, declared in its
+// u_private.h). ulfius_start_framework installs them itself; they must be
+// passed again when the MHD option list is built here.
+void mhd_request_completed(void *cls, struct MHD_Connection *connection, void **con_cls,
+                           enum MHD_RequestTerminationCode toe);
+void *ulfius_uri_logger(void *cls, const char *uri);
+
+#define LISTENER_MAX_OPTIONS 12
+#define TLS_SESSION_ID_MAX 64
+
+// AEAD ciphers only, TLS 1.2 and 1.3, server order (forward secrecy comes
+// with the TLS 1.2 ECDHE/DHE exchanges NORMAL already prefers)
+#define TLS_DEFAULT_PRIORITIES "NORMAL:-VERS-ALL:+VERS-TLS1.3:+VERS-TLS1.2:-CIPHER-ALL:+CHACHA20-POLY1305:+AES-256-GCM:+AES-128-GCM:-MAC-ALL:+AEAD:%SERVER_PRECEDENCE"
+
+static MHD_socket quiesced_socket = MHD_INVALID_SOCKET;
+
+static struct {
+  char *cert_pem;
+  char *key_pem;
+  const char *priorities;
+  gnutls_datum_t ticket_key; // empty when tickets are disabled
+} tls;
+
+// TLS 1.2 session-ID cache, for clients that do not use tickets. Shared by
+// the connection threads of this process; slots are picked by a hash of the
+// session id and simply overwritten on collision.
+typedef struct {
+  unsigned char id[TLS_SESSION_ID_MAX];
+  unsigned int id_size;
+  unsigned char *data;
+  unsigned int data_size;
+} tls_cached_session;
+
+static tls_cached_session *session_cache = NULL;
+static size_t session_cache_size = 0;
+static pthread_mutex_t session_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *read_file(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    return NULL;
+  }
+  fseek(file, 0, SEEK_END);
+  const long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  char *data = size >= 0 ? malloc((size_t)size + 1) : NULL;
+  if (data && fread(data, 1, (size_t)size, file) != (size_t)size) {
+    free(data);
+    data = NULL;
+  }
+  if (data) {
+    data[size] = '\0';
+  }
+  fclose(file);
+  return data;
+}
+
+static tls_cached_session *session_slot(const gnutls_datum_t key) {
+  return &session_cache[hash_bytes(key.data, key.size) % session_cache_size];
+}
+
+static int session_store(void *ptr, gnutls_datum_t key, gnutls_datum_t data) {
+  if (key.size > TLS_SESSION_ID_MAX) {
+    return -1;
+  }
+  unsigned char *copy = malloc(data.size);
+  if (copy == NULL) {
+    return -1;
+  }
+  memcpy(copy, data.data, data.size);
+  pthread_mutex_lock(&session_cache_lock);
+  tls_cached_session *slot = session_slot(key);
+  free(slot->data);
+  memcpy(slot->id, key.data, key.size);
+  slot->id_size = key.size;
+  slot->data = copy;
+  slot->data_size = data.size;
+  pthread_mutex_unlock(&session_cache_lock);
+  return 0;
+}
+
+// GnuTLS frees the returned copy itself, so it is allocated with gnutls_malloc
+static gnutls_datum_t session_retrieve(void *ptr, gnutls_datum_t key) {
+  gnutls_datum_t found = {NULL, 0};
+  pthread_mutex_lock(&session_cache_lock);
+  const tls_cached_session *slot = session_slot(key);
+  if (slot->data && slot->id_size == key.size && memcmp(slot->id, key.data, key.size) == 0) {
+    found.data = gnutls_malloc(slot->data_size);
+    if (found.data) {
+      memcpy(found.data, slot->data, slot->data_size);
+      found.size = slot->data_size;
+    }
+  }
+  pthread_mutex_unlock(&session_cache_lock);
+  return found;
+}
+
+static int session_remove(void *ptr, gnutls_datum_t key) {
+  pthread_mutex_lock(&session_cache_lock);
+  tls_cached_session *slot = session_slot(key);
+  const int found = slot->data && slot->id_size == key.size && memcmp(slot->id, key.data, key.size) == 0;
+  if (found) {
+    free(slot->data);
+    slot->data = NULL;
+    slot->id_size = 0;
+  }
+  pthread_mutex_unlock(&session_cache_lock);
+  return found ? 0 : -1;
+}
+
+int listener_tls_init(void) {
+  const char *cert_path = config_get_str("HEALTH_TLS_CERT", NULL);
+  const char *key_path = config_get_str("HEALTH_TLS_KEY", NULL);
+  if (cert_path == NULL && key_path == NULL) {
+    return 0;
+  }
+  tls.cert_pem = cert_path ? read_file(cert_path) : NULL;
+  tls.key_pem = key_path ? read_file(key_path) : NULL;
+  if (tls.cert_pem == NULL || tls.key_pem == NULL) {
+    fprintf(stderr, "Cannot read HEALTH_TLS_CERT '%s' and HEALTH_TLS_KEY '%s'\n",
+            cert_path ? cert_path : "", key_path ? key_path : "");
+    return -1;
+  }
+  tls.priorities = config_get_str("HEALTH_TLS_PRIORITIES", TLS_DEFAULT_PRIORITIES);
+
+  // One ticket key for every thread and every forked worker; GnuTLS rotates
+  // the keys it derives from it
+  if (config_get_int("HEALTH_TLS_TICKETS", 1) && gnutls_session_ticket_key_generate(&tls.ticket_key) < 0) {
+    fprintf(stderr, "Cannot generate the TLS session ticket key\n");
+    return -1;
+  }
+  const int cache_size = config_get_int("HEALTH_TLS_SESSION_CACHE", 1024);
+  if (cache_size > 0) {
+    session_cache = calloc((size_t)cache_size, sizeof(tls_cached_session));
+    session_cache_size = session_cache ? (size_t)cache_size : 0;
+  }
+  printf("TLS enabled (tickets %s, session cache %zu)\n", tls.ticket_key.size ? "on" : "off", session_cache_size);
+  return 1;
+}
+
+// Runs when MHD has set up a new connection's GnuTLS session, before the
+// handshake starts on the connection's thread. MHD has no options for
+// resumption, so it is switched on here.
+static void on_connection(void *cls, struct MHD_Connection *connection, void **socket_context,
+                          enum MHD_ConnectionNotificationCode code) {
+  if (code != MHD_CONNECTION_NOTIFY_STARTED) {
+    return;
+  }
+  const union MHD_ConnectionInfo *info = MHD_get_connection_info(connection, MHD_CONNECTION_INFO_GNUTLS_SESSION);
+  if (info == NULL || info->tls_session == NULL) {
+    return;
+  }
+  gnutls_session_t session = (gnutls_session_t)info->tls_session;
+  if (tls.ticket_key.size > 0) {
+    gnutls_session_ticket_enable_server(session, &tls.ticket_key);
+  }
+  if (session_cache_size > 0) {
+    gnutls_db_set_retrieve_function(session, session_retrieve);
+    gnutls_db_set_store_function(session, session_store);
+    gnutls_db_set_remove_function(session, session_remove);
+    gnutls_db_set_ptr(session, NULL);
+  }
+}
+
+// Runs on the connection's thread once the response has been sent
+static void on_request_completed(void *cls, struct MHD_Connection *connection, void **con_cls,
+                                 enum MHD_RequestTerminationCode toe) {
+  mhd_request_completed(cls, connection, con_cls, toe);
+  trace_request_completed();
+}
+
+int listener_tls_options(struct MHD_OptionItem *options) {
+  if (tls.cert_pem == NULL) {
+    fprintf(stderr, "listener_tls_init has not loaded a certificate\n");
+    return -1;
+  }
+  int n = 0;
+  options[n++] = (struct MHD_OptionItem){MHD_OPTION_HTTPS_MEM_KEY, 0, tls.key_pem};
+  options[n++] = (struct MHD_OptionItem){MHD_OPTION_HTTPS_MEM_CERT, 0, tls.cert_pem};
+  options[n++] = (struct MHD_OptionItem){MHD_OPTION_HTTPS_PRIORITIES, 0, (void *)tls.priorities};
+  options[n++] = (struct MHD_OptionItem){MHD_OPTION_NOTIFY_CONNECTION, (intptr_t)on_connection, NULL};
+  return n;
+}
+
+int listener_start(struct _u_instance *instance, const listener_options *options) {
+  struct MHD_OptionItem mhd_options[LISTENER_MAX_OPTIONS];
+  int n = 0;
+
+  mhd_options[n++] = (struct MHD_OptionItem){MHD_OPTION_NOTIFY_COMPLETED, (intptr_t)on_request_completed, NULL};
+  mhd_options[n++] = (struct MHD_OptionItem){MHD_OPTION_URI_LOG_CALLBACK, (intptr_t)ulfius_uri_logger, NULL};
+  mhd_options[n++] = (struct MHD_OptionItem){MHD_OPTION_CONNECTION_TIMEOUT, instance->timeout, NULL};
+  if (instance->bind_address != NULL) {
+    mhd_options[n++] = (struct MHD_OptionItem){MHD_OPTION_SOCK_ADDR, 0, instance->bind_address};
+  }
+  if (options != NULL && options->reuse_port) {
+    mhd_options[n++] = (struct MHD_OptionItem){MHD_OPTION_LISTENING_ADDRESS_REUSE, 1, NULL};
+  }
+  unsigned int flags = MHD_USE_THREAD_PER_CONNECTION | MHD_USE_INTERNAL_POLLING_THREAD | MHD_USE_ERROR_LOG | MHD_USE_ITC;
+  if (options != NULL && options->tls) {
+    // The options ulfius_start_secure_framework would pass, plus ours
+    const int added = listener_tls_options(&mhd_options[n]);
+    if (added < 0) {
+      return U_ERROR;
+    }
+    flags |= MHD_USE_TLS;
+    n += added;
+  }
+  mhd_options[n++] = (struct MHD_OptionItem){MHD_OPTION_END, 0, NULL};
+
+  // MHD_USE_ITC lets MHD_quiesce_daemon close the listener while connection
+  // threads keep running
+  return ulfius_start_framework_with_mhd_options(instance, flags, mhd_options);
+}
+
+void listener_stop(struct _u_instance *instance, int drain_ms) {
+  if (instance->mhd_daemon != NULL) {
+    // With SO_REUSEPORT the kernel routes new connections to the other workers
+    quiesced_socket = MHD_quiesce_daemon(instance->mhd_daemon);
+  }
+
+  const int still_running = admission_wait_idle(drain_ms);
+  if (still_running > 0) {
+    fprintf(stderr, "Drain timed out with %d request(s) still running\n", still_running);
+  }
+
+  ulfius_stop_framework(instance);
+  if (quiesced_socket != MHD_INVALID_SOCKET) {
+    close(quiesced_socket); // MHD hands the quiesced socket over to the caller
+    quiesced_socket = MHD_INVALID_SOCKET;
+  }
+}
@@ -0,0 +1,38 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include <ulfius.h>
+
+// Starts the ulfius instance on top of libmicrohttpd with the same defaults as
+// ulfius_start_framework (thread per connection), plus the listener options
+// the server needs: SO_REUSEPORT for prefork workers and a quiescable listen
+// socket so shutdown can stop accepting before in-flight requests finish.
+// With HEALTH_TLS_CERT/HEALTH_TLS_KEY set it serves HTTPS through GnuTLS,
+// with session tickets and a session-ID cache for resumed handshakes.
+
+typedef struct {
+  int reuse_port; // 1 to bind with SO_REUSEPORT so several processes share the port
+  int tls;        // 1 to serve HTTPS with what listener_tls_init loaded
+} listener_options;
+
+// Loads the certificate and key named by HEALTH_TLS_CERT / HEALTH_TLS_KEY and
+// generates the session ticket key. Call it before prefork workers are
+// forked so they all share the ticket key and resume each other's sessions.
+// Returns 1 if TLS is configured, 0 if not, -1 on error.
+int listener_tls_init(void);
+
+// Writes the MHD options that serve HTTPS with what listener_tls_init loaded
+// (certificate, key, priorities, session resumption) into options, which
+// needs room for LISTENER_TLS_OPTIONS items. Returns how many were written,
+// -1 if nothing is loaded. Used by daemons started outside ulfius as well.
+#define LISTENER_TLS_OPTIONS 4
+int listener_tls_options(struct MHD_OptionItem *options);
+
+// Returns U_OK on success, U_ERROR otherwise
+int listener_start(struct _u_instance *instance, const listener_options *options);
+
+// Stops accepting connections, waits up to drain_ms for admitted requests to
+// finish, then stops the framework
+void listener_stop(struct _u_instance *instance, int drain_ms);
+
+#endif // LISTENER_H
@@ -1,68 +1,36 @@
+#include "admission.h"
 #include "appointments_handlers.h"
+#include "changes.h"
+#include "config.h"
+#include "cors.h"
 #include "database.h"
 #include "doctors_handlers.h"
+#include "list_cache.h"
+#include "listener.h"
+#include "maintenance.h"
 #include "medical_records_handlers.h"
+#include "memory.h"
+#include "memory_store.h"
 #include "patient_handlers.h"
+#include "prefork.h"
+#include "replication.h"
+#include "router.h"
+#include "slow_queries.h"
+#include "startup.h"
+#include "static_files.h"
+#include "stats.h"
+#include "trace.h"
 
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ulfius.h>
+#include <unistd.h>
 
 #define PORT 8080
 #define BASE_URL "/api"
 
-int request_handler(void *cls, struct MHD_Connection *connection,
-                    const char *url, const char *method,
-                    const char *version, const char *upload_data,
-                    size_t *upload_data_size, void **con_cls) {
-
-    // Global CORS headers for all responses
-    struct MHD_Response *response = MHD_create_response_from_buffer(0, "", MHD_RESPMEM_PERSISTENT);
-    MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
-    MHD_add_response_header(response, "Access-Control-Allow-Methods", "GET, POST, PUT, DELETE, OPTIONS");
-    MHD_add_response_header(response, "Access-Control-Allow-Headers", "Content-Type, Authorization");
-
-    // Handle preflight (OPTIONS) requests
-    if (strcmp(method, "OPTIONS") == 0) {
-      const int ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
-        MHD_destroy_response(response);
-        return ret;
-    }
-
-    // Check if the request is for an endpoint that is already handled by a specific callback.
-    // If so, no action is needed here as the callback will take care of it.
-    if (strncmp(url, BASE_URL, strlen(BASE_URL)) == 0) {
-        MHD_destroy_response(response); // Destroy the response as it's not needed for callback-handled endpoints
-        return MHD_YES;
-    }
-
-    // Handling of other endpoints that do not have specific callbacks
-    // (example for illustrative purposes)
-    if (strcmp(url, "/other-endpoint") == 0) {
-        const char *response_page = "<html><body>Response for other endpoint</body></html>";
-        MHD_add_response_header(response, "Content-Type", "text/html");
-        MHD_destroy_response(response); // Destroy the initial empty response
-        response = MHD_create_response_from_buffer(strlen(response_page), (void *)response_page, MHD_RESPMEM_PERSISTENT); // Create a new response with content
-        const int ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
-        MHD_destroy_response(response);
-        return ret;
-    }
-
-    // Default response for unhandled endpoints
-    const char *response_page = "<html><body>404 Not Found</body></html>";
-    MHD_add_response_header(response, "Content-Type", "text/html");
-    MHD_destroy_response(response); // Destroy the initial empty response
-    response = MHD_create_response_from_buffer(strlen(response_page), (void *)response_page, MHD_RESPMEM_PERSISTENT); // Create a new response with content
-    const int ret = MHD_queue_response(connection, MHD_HTTP_NOT_FOUND, response);
-    MHD_destroy_response(response);
-    return ret;
-}
-
-
-
-
 int callback_api_home(const struct _u_request *request, struct _u_response *response, void *user_data) {
     const char *response_page =
     "<html>"
@@ -81,21 +49,29 @@ int callback_api_home(const struct _u_request *request, struct _u_response *resp
     "<h2>Available Endpoints:</h2>"
     "<ul>"
     "<li>GET /api/patients - Retrieves all patients</li>"
+    "<li>GET /api/patients?ids=1,2,3 - Retrieves the patients with those IDs</li>"
     "<li>GET /api/patients/(patientID) - Retrieves a specific patient</li>"
+    "<li>GET /api/patients/(patientID)/summary - Retrieves a patient with upcoming appointments and recent records (include=, limit=)</li>"
     "<li>POST /api/patients - Creates a new patient</li>"
     "<li>PUT /api/patients/(patientID) - Updates a specific patient</li>"
     "<li>DELETE /api/patients/(patientID) - Deletes a specific patient</li>"
     "<li>GET /api/doctors - Retrieves all doctors</li>"
+    "<li>GET /api/doctors?ids=1,2,3 - Retrieves the doctors with those IDs</li>"
     "<li>GET /api/doctors/(doctorID) - Retrieves a specific doctor</li>"
     "<li>POST /api/doctors - Creates a new doctor</li>"
     "<li>PUT /api/doctors/(doctorID) - Updates a specific doctor</li>"
     "<li>DELETE /api/doctors/(doctorID) - Deletes a specific doctor</li>"
     "<li>GET /api/appointments - Retrieves all appointments</li>"
+    "<li>GET /api/appointments?ids=1,2,3 - Retrieves the appointments with those IDs</li>"
     "<li>GET /api/appointments/(appointmentID) - Retrieves a specific appointment</li>"
     "<li>POST /api/appointments - Creates a new appointment</li>"
     "<li>PUT /api/appointments/(appointmentID) - Updates a specific appointment</li>"
     "<li>DELETE /api/appointments/(appointmentID) - Deletes a specific appointment</li>"
+    "<li>GET /api/stats - Aggregate counts per specialty, day, doctor and patient (verify=1 checks them against SQL)</li>"
+    "<li>GET /api/changes - Server-Sent Events stream of row changes (resumable with Last-Event-ID), redirected to HEALTH_CHANGES_PORT</li>"
+    "<li>GET /api/replication/status, /snapshot?shard=, /log?after= - Replication log for read-only followers</li>"
     "<li>GET /api/medicalrecords - Retrieves all medical records</li>"
+    "<li>GET /api/medicalrecords?ids=1,2,3 - Retrieves the medical records with those IDs</li>"
     "<li>GET /api/medicalrecords/(medicalRecordID) - Retrieves a specific medical record</li>"
     "<li>POST /api/medicalrecords - Creates a new medical record</li>"
     "<li>PUT /api/medicalrecords/(medicalRecordID) - Updates a specific medical record</li>"
@@ -114,69 +90,258 @@ int callback_api_home(const struct _u_request *request, struct _u_response *resp
 
 
 
-int main() {
-  // Initialize Yder-ULFIUS logs at DEBUG level
-  y_init_logs("Ulfius", Y_LOG_MODE_CONSOLE, Y_LOG_LEVEL_DEBUG, NULL, "Starting Ulfius Framework");
+// Set in main() before workers are forked (listener_tls_init)
+static int tls_enabled = 0;
+
+// --follow <url>: run as a read-only follower of that leader
+static const char *follow_url = NULL;
+
+// Runs one server process: in prefork mode every worker calls this after fork,
+// so it owns its own SQLite connections, change feed and admission counters
+static int run_server(void) {
+  const int workers = config_get_int("HEALTH_WORKERS", 1);
+  const int port = config_get_int("HEALTH_PORT", PORT);
+  startup_begin();
+
+  if (changes_init() != 0) {
+    fprintf(stderr, "Change feed initialization failed\n");
+    return 1;
+  }
+
+  // Before init_db, which only installs the SQLite profile hook when tracing
+  // or the slow-query log is on
+  trace_init();
+  if (slow_queries_init() != 0) {
+    fprintf(stderr, "Slow-query log initialization failed\n");
+    return 1;
+  }
+
+  // Also before init_db: the log needs the profile hook, and a follower
+  // copies the leader's shard files into place first
+  if (replication_init(follow_url) != 0) {
+    return 1;
+  }
+  if (follow_url) {
+    if (replication_bootstrap() != 0) {
+      fprintf(stderr, "Cannot copy the database from %s\n", follow_url);
+      return 1;
+    }
+    startup_phase("replication bootstrap");
+  }
 
   if (init_db() != 0) {
     fprintf(stderr, "Database initialization failed\n");
     return 1;
   }
+  startup_phase("database");
+
+  if (follow_url && replication_follow_start() != 0) {
+    close_db();
+    return 1;
+  }
+
+  // Optional: pay the cold-cache cost before the listener opens
+  if (config_get_int("HEALTH_WARMUP", 0)) {
+    if (warm_up_db() != 0) {
+      close_db();
+      return 1;
+    }
+    startup_phase("warm-up");
+  }
+
+  admission_init();
+
+  // Archival, incremental vacuum and stats recounts in the background; a
+  // follower gets the leader's archival through the log
+  if (maintenance_start(follow_url == NULL) != 0) {
+    replication_close();
+    close_db();
+    return 1;
+  }
+
+  cors_init();
+
+  list_cache_init();
+
+  static_files_init();
+  startup_phase("static files");
+
+  memory_add_cache("static_files", &static_files_memory_bytes);
+  memory_add_cache("sqlite_page_caches", &page_caches_memory_bytes);
+  memory_add_cache("id_bitmaps", &id_bitmaps_memory_bytes);
+  memory_add_cache("list_cache", &list_cache_memory_bytes);
+  memory_add_cache("memory_store_journal", &memory_store_memory_bytes);
+  memory_add_cache("change_ring", &changes_memory_bytes);
+  memory_add_cache("trace_ring", &trace_memory_bytes);
+  memory_add_cache("slow_queries", &slow_queries_memory_bytes);
+  memory_add_cache("replication_log", &replication_memory_bytes);
 
   struct _u_instance instance;
 
-  if (ulfius_init_instance(&instance, PORT, NULL, NULL) != U_OK) {
+  if (ulfius_init_instance(&instance, port, NULL, NULL) != U_OK) {
     fprintf(stderr, "Error initializing Ulfius instance\n");
+    maintenance_stop();
+    replication_close();
     close_db();
     return 1;
   }
 
   // Add API home/documentation endpoint
-  ulfius_add_endpoint_by_val(&instance, "GET", BASE_URL, NULL, 0, &callback_api_home, NULL);
-  ulfius_add_endpoint_by_val(&instance, "GET", BASE_URL "/", NULL, 0, &callback_api_home, NULL);
+  router_add("GET", BASE_URL, &callback_api_home, NULL); // also serves BASE_URL "/"
 
 
   // Patients endpoints
   // Endpoint for fetching all patients
-  ulfius_add_endpoint_by_val(&instance, "GET", BASE_URL "/patients", NULL, 0, &callback_patients_get_all, NULL);
+  admission_add_endpoint("GET", BASE_URL "/patients", &callback_patients_get_all, NULL);
 
   // Endpoint for fetching a single patient by ID
-  ulfius_add_endpoint_by_val(&instance, "GET", BASE_URL "/patients/:id", NULL, 0, &callback_patients_get, NULL);
+  admission_add_endpoint("GET", BASE_URL "/patients/:id", &callback_patients_get, NULL);
+
+  // Endpoint for fetching a patient with their appointments and records in one call
+  admission_add_endpoint("GET", BASE_URL "/patients/:id/summary", &callback_patients_summary, NULL);
 
-  ulfius_add_endpoint_by_val(&instance, "POST", BASE_URL "/patients", NULL, 0, &callback_patients_post, NULL);
-  ulfius_add_endpoint_by_val(&instance, "PUT", BASE_URL "/patients", NULL, 0, &callback_patients_put, NULL);
-  ulfius_add_endpoint_by_val(&instance, "DELETE", BASE_URL "/patients", NULL, 0, &callback_patients_delete, NULL);
+  admission_add_endpoint("POST", BASE_URL "/patients", &callback_patients_post, NULL);
+  admission_add_endpoint("PUT", BASE_URL "/patients", &callback_patients_put, NULL);
+  admission_add_endpoint("DELETE", BASE_URL "/patients", &callback_patients_delete, NULL);
 
   // Doctors endpoints
-  ulfius_add_endpoint_by_val(&instance, "GET", BASE_URL "/doctors", NULL, 0, &callback_doctors_get, NULL);
-  ulfius_add_endpoint_by_val(&instance, "POST", BASE_URL "/doctors", NULL, 0, &callback_doctors_post, NULL);
-  ulfius_add_endpoint_by_val(&instance, "PUT", BASE_URL "/doctors", NULL, 0, &callback_doctors_put, NULL);
-  ulfius_add_endpoint_by_val(&instance, "DELETE", BASE_URL "/doctors", NULL, 0, &callback_doctors_delete, NULL);
+  admission_add_endpoint("GET", BASE_URL "/doctors", &callback_doctors_get, NULL);
+  admission_add_endpoint("POST", BASE_URL "/doctors", &callback_doctors_post, NULL);
+  admission_add_endpoint("PUT", BASE_URL "/doctors", &callback_doctors_put, NULL);
+  admission_add_endpoint("DELETE", BASE_URL "/doctors", &callback_doctors_delete, NULL);
 
   // Appointments endpoints
-  ulfius_add_endpoint_by_val(&instance, "GET", BASE_URL "/appointments", NULL, 0, &callback_appointments_get, NULL);
-  ulfius_add_endpoint_by_val(&instance, "POST", BASE_URL "/appointments", NULL, 0, &callback_appointments_post, NULL);
-  ulfius_add_endpoint_by_val(&instance, "PUT", BASE_URL "/appointments", NULL, 0, &callback_appointments_put, NULL);
-  ulfius_add_endpoint_by_val(&instance, "DELETE", BASE_URL "/appointments", NULL, 0, &callback_appointments_delete, NULL);
+  admission_add_endpoint("GET", BASE_URL "/appointments", &callback_appointments_get, NULL);
+  admission_add_endpoint("POST", BASE_URL "/appointments", &callback_appointments_post, NULL);
+  admission_add_endpoint("PUT", BASE_URL "/appointments", &callback_appointments_put, NULL);
+  admission_add_endpoint("DELETE", BASE_URL "/appointments", &callback_appointments_delete, NULL);
 
   // Medical Records endpoints
-  ulfius_add_endpoint_by_val(&instance, "GET", BASE_URL "/medicalrecords", NULL, 0, &callback_medical_records_get, NULL);
-  ulfius_add_endpoint_by_val(&instance, "POST", BASE_URL "/medicalrecords", NULL, 0, &callback_medical_records_post, NULL);
-  ulfius_add_endpoint_by_val(&instance, "PUT", BASE_URL "/medicalrecords", NULL, 0, &callback_medical_records_put, NULL);
-  ulfius_add_endpoint_by_val(&instance, "DELETE", BASE_URL "/medicalrecords", NULL, 0, &callback_medical_records_delete, NULL);
-
-  if (ulfius_start_framework(&instance) == U_OK) {
-    printf("Server running on port %d\n", PORT);
-    while (1) {
-      sleep(1);  // Keep the program running
-    }
+  admission_add_endpoint("GET", BASE_URL "/medicalrecords", &callback_medical_records_get, NULL);
+  admission_add_endpoint("POST", BASE_URL "/medicalrecords", &callback_medical_records_post, NULL);
+  admission_add_endpoint("PUT", BASE_URL "/medicalrecords", &callback_medical_records_put, NULL);
+  admission_add_endpoint("DELETE", BASE_URL "/medicalrecords", &callback_medical_records_delete, NULL);
+
+  // Aggregate statistics (maintained in memory; verify=1 recounts with SQL)
+  admission_add_endpoint("GET", BASE_URL "/stats", &callback_stats_get, NULL);
+
+  // Change feed (Server-Sent Events). Streams are long-lived and served by the
+  // feed's own daemon (changes_start); this only redirects there.
+  router_add("GET", BASE_URL "/changes", &callback_changes_redirect, NULL);
+
+  // Replication log for followers: snapshots and a long-lived transaction
+  // stream, capped by HEALTH_REPLICATION_MAX_FOLLOWERS rather than admission
+  router_add("GET", BASE_URL "/replication/status", &callback_replication_status, NULL);
+  router_add("GET", BASE_URL "/replication/snapshot", &callback_replication_snapshot, NULL);
+  router_add("GET", BASE_URL "/replication/log", &callback_replication_log, NULL);
+
+  // Admission control counters
+  router_add("GET", "/admin/admission", &callback_admission_stats, NULL);
+
+  // Replication role, log position and follower lag
+  router_add("GET", "/admin/replication", &callback_replication_stats, NULL);
+
+  // Boot timing and first-request latency
+  router_add("GET", "/admin/startup", &callback_startup_stats, NULL);
+
+  // Sampled request spans as Chrome trace-event JSON
+  router_add("GET", "/admin/trace", &callback_trace_dump, NULL);
+
+  // Per-statement timings and the slow-query log with query plans
+  router_add("GET", "/admin/slow-queries", &callback_slow_queries, NULL);
+
+  // Allocation accounting by subsystem and per-request peaks
+  router_add("GET", "/admin/memory", &callback_memory_stats, NULL);
+
+  // Compile the routes; anything they do not match is the web client
+  if (router_install(&instance, &callback_static_file, NULL) != U_OK) {
+    ulfius_clean_instance(&instance);
+    maintenance_stop();
+    replication_close();
+    close_db();
+    return 1;
+  }
+
+  if (changes_start(config_get_int("HEALTH_CHANGES_PORT", port + 10), workers > 1, tls_enabled) != 0) {
+    changes_close();
+    ulfius_clean_instance(&instance);
+    maintenance_stop();
+    replication_close();
+    close_db();
+    return 1;
+  }
+
+  listener_options listener = {.reuse_port = workers > 1, .tls = tls_enabled};
+  int status = 0;
+  if (listener_start(&instance, &listener) == U_OK) {
+    startup_listening();
+    printf("Server running on port %d, %s (pid %d)\n", port, tls_enabled ? "HTTPS" : "HTTP", (int)getpid());
+    const int sig = prefork_wait_for_shutdown();
+    printf("Received signal %d, draining\n", sig);
+    // End change and replication streams first; they are long-lived and
+    // never go idle on their own
+    changes_close();
+    replication_close();
+    listener_stop(&instance, config_get_int("HEALTH_DRAIN_MS", 10000));
   } else {
     fprintf(stderr, "Error starting Ulfius framework\n");
+    changes_close();
+    replication_close();
+    status = 1;
+  }
+  if (replication_failed()) {
+    status = 1;
   }
 
-  ulfius_stop_framework(&instance);
   ulfius_clean_instance(&instance);
+  maintenance_stop();
+  list_cache_close();
+  static_files_close();
   close_db();
-  return 0;
+  slow_queries_close();
+  trace_close();
+  return status;
 }
 
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--follow") == 0 && i + 1 < argc) {
+      follow_url = argv[++i];
+    } else {
+      fprintf(stderr, "Usage: %s [--follow <leader url>]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  // Counting allocators go in before anything allocates through jansson or orcania
+  memory_init();
+
+  // Initialize Yder-ULFIUS logs at DEBUG level
+  y_init_logs("Ulfius", Y_LOG_MODE_CONSOLE, Y_LOG_LEVEL_DEBUG, NULL, "Starting Ulfius Framework");
+
+  // Before any thread exists, so shutdown signals are only consumed by sigwait
+  prefork_block_signals();
+
+  tls_enabled = listener_tls_init();
+  if (tls_enabled < 0) {
+    return 1;
+  }
+
+  const int workers = config_get_int("HEALTH_WORKERS", 1);
+  if (follow_url) {
+    if (workers > 1 || strcmp(config_get_str("HEALTH_DB_MODE", "file"), "memory") == 0) {
+      fprintf(stderr, "--follow needs HEALTH_WORKERS=1 and HEALTH_DB_MODE=file\n");
+      return 1;
+    }
+    // Keep the copy apart from a leader's files in the same directory
+    setenv("HEALTH_DB_DIR", "replica", 0);
+  }
+  if (workers > 1) {
+    if (strcmp(config_get_str("HEALTH_DB_MODE", "file"), "memory") == 0) {
+      fprintf(stderr, "HEALTH_DB_MODE=memory keeps the database in one process and cannot be used with HEALTH_WORKERS > 1\n");
+      return 1;
+    }
+    return prefork_run(workers, &run_server);
+  }
+  return run_server();
+}
@@ -0,0 +1,109 @@
+#include "maintenance.h"
+
+#include "admission.h"
+#include "config.h"
+#include "database.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#define MAINTENANCE_BATCH_PAUSE_MS 50
+
+static struct {
+  int days;
+  int batch;
+  int interval_seconds;
+  int vacuum_pages;
+  int archive; // archival and vacuum passes; off on a follower
+  int stats_refresh_ms;
+
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_t thread;
+  int running;
+} maintenance = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+// Sleeps for ms unless stopped first; returns whether the thread should go on
+static int pause_ms(const int ms) {
+  const struct timespec deadline = deadline_after_ms(ms);
+  pthread_mutex_lock(&maintenance.lock);
+  if (maintenance.running) {
+    pthread_cond_timedwait(&maintenance.wake, &maintenance.lock, &deadline);
+  }
+  const int running = maintenance.running;
+  pthread_mutex_unlock(&maintenance.lock);
+  return running;
+}
+
+static void run_pass(void) {
+  // A full batch means more rows may be due; keep going, one short
+  // transaction at a time
+  int total = 0, moved = 0;
+  while (maintenance.days > 0 && (moved = archive_appointments(maintenance.days, maintenance.batch)) >= 0) {
+    total += moved;
+    if (moved < maintenance.batch || !pause_ms(MAINTENANCE_BATCH_PAUSE_MS)) {
+      break;
+    }
+  }
+  if (total > 0) {
+    printf("Archived %d appointments older than %d days\n", total, maintenance.days);
+  }
+
+  while (maintenance.vacuum_pages > 0 && admission_wait_idle(0) == 0 && incremental_vacuum(maintenance.vacuum_pages) > 0 &&
+         pause_ms(MAINTENANCE_BATCH_PAUSE_MS)) {
+  }
+}
+
+static void *maintenance_thread(void *arg) {
+  const int tick_ms = maintenance.stats_refresh_ms > 0 ? maintenance.stats_refresh_ms : maintenance.interval_seconds * 1000;
+  time_t last_pass = time(NULL);
+  while (pause_ms(tick_ms)) {
+    if (maintenance.stats_refresh_ms > 0) {
+      refresh_stats_if_stale();
+    }
+    if (maintenance.archive && time(NULL) - last_pass >= maintenance.interval_seconds) {
+      run_pass();
+      last_pass = time(NULL);
+    }
+  }
+  return NULL;
+}
+
+int maintenance_start(const int archive) {
+  maintenance.days = config_get_int("HEALTH_ARCHIVE_DAYS", 0);
+  maintenance.batch = config_get_int("HEALTH_ARCHIVE_BATCH", 200);
+  maintenance.interval_seconds = config_get_int("HEALTH_ARCHIVE_INTERVAL_SECONDS", 300);
+  maintenance.vacuum_pages = config_get_int("HEALTH_VACUUM_PAGES", 256);
+  maintenance.stats_refresh_ms = config_get_int("HEALTH_STATS_REFRESH_MS", 1000);
+  maintenance.archive = archive && (maintenance.days > 0 || maintenance.vacuum_pages > 0);
+  if (!maintenance.archive && maintenance.stats_refresh_ms <= 0) {
+    return 0;
+  }
+  if (maintenance.batch < 1) {
+    maintenance.batch = 1;
+  }
+  if (maintenance.interval_seconds < 1) {
+    maintenance.interval_seconds = 1;
+  }
+
+  maintenance.running = 1;
+  if (pthread_create(&maintenance.thread, NULL, maintenance_thread, NULL) != 0) {
+    fprintf(stderr, "Cannot start maintenance thread\n");
+    maintenance.running = 0;
+    return 1;
+  }
+  return 0;
+}
+
+void maintenance_stop(void) {
+  pthread_mutex_lock(&maintenance.lock);
+  const int was_running = maintenance.running;
+  maintenance.running = 0;
+  pthread_cond_signal(&maintenance.wake);
+  pthread_mutex_unlock(&maintenance.lock);
+  if (was_running) {
+    pthread_join(maintenance.thread, NULL);
+  }
+}
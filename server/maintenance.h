@@ -0,0 +1,24 @@
+#ifndef MAINTENANCE_H
+#define MAINTENANCE_H
+
+// Background database maintenance. Every HEALTH_ARCHIVE_INTERVAL_SECONDS a
+// thread moves appointments dated more than HEALTH_ARCHIVE_DAYS ago into
+// AppointmentsArchive, HEALTH_ARCHIVE_BATCH rows per shard and transaction,
+// pausing between batches so request writers get the lock in between. When
+// no request is in flight (admission.h) it then runs incremental vacuum in
+// steps of HEALTH_VACUUM_PAGES pages until the files have no free pages
+// left or traffic resumes. HEALTH_ARCHIVE_DAYS=0 (the default) leaves the
+// rows where they are.
+//
+// Every HEALTH_STATS_REFRESH_MS (default 1000, 0 = never) the same thread
+// recounts the /api/stats counters if another process has written
+// (refresh_stats_if_stale), so the recount never runs on a request.
+
+// Starts the thread; call after init_db and admission_init. archive is 0
+// on a follower, which gets the leader's archival through the log.
+int maintenance_start(int archive);
+
+// Stops the thread, waiting for the batch in progress
+void maintenance_stop(void);
+
+#endif // MAINTENANCE_H
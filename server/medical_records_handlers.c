@@ -2,9 +2,11 @@
 
 
 #include "medical_records_handlers.h"
+#include "body_format.h"
 #include "database.h"
 #include "cors.h"
 #include "json_response.h"
+#include "router.h"
 #include <ulfius.h>
 #include <string.h>
 
@@ -12,7 +14,7 @@
 // POST: Create a Medical Record
 int callback_medical_records_post(const struct _u_request *request, struct _u_response *response, void *user_data) {
     printf("MedicalRecords POST called\n");
-    json_t *json_request = ulfius_get_json_body_request(request, NULL);
+    json_t *json_request = get_negotiated_body_request(request);
     if (json_request == NULL) {
         set_json_error_response(response, 400, "Invalid JSON");
         return U_CALLBACK_COMPLETE;
@@ -21,7 +23,9 @@ int callback_medical_records_post(const struct _u_request *request, struct _u_re
     const int patient_id = json_integer_value(json_object_get(json_request, "patient_id"));
     const char *details = json_string_value(json_object_get(json_request, "details"));
 
-    if (patient_id > 0 && details && strlen(details) < sizeof(((MedicalRecord*)0)->details)) {
+    if (patient_id > 0 && !patient_exists(patient_id)) {
+        set_json_error_response(response, 422, "Unknown patient_id");
+    } else if (patient_id > 0 && details && strlen(details) < sizeof(((MedicalRecord*)0)->details)) {
         MedicalRecord new_record;
         memset(&new_record, 0, sizeof(MedicalRecord)); // Initialize the structure
         new_record.patient_id = patient_id;
@@ -44,7 +48,7 @@ int callback_medical_records_post(const struct _u_request *request, struct _u_re
 // PUT: Update a Medical Record
 int callback_medical_records_put(const struct _u_request *request, struct _u_response *response, void *user_data) {
     printf("MedicalRecords PUT called\n");
-    json_t *json_request = ulfius_get_json_body_request(request, NULL);
+    json_t *json_request = get_negotiated_body_request(request);
     if (json_request == NULL) {
         set_json_error_response(response, 400, "Invalid JSON");
         return U_CALLBACK_COMPLETE;
@@ -54,15 +58,20 @@ int callback_medical_records_put(const struct _u_request *request, struct _u_res
     const int patient_id = json_integer_value(json_object_get(json_request, "patient_id"));
     const char *details = json_string_value(json_object_get(json_request, "details"));
 
-    if (id > 0 && patient_id > 0 && details && strlen(details) < sizeof(((MedicalRecord*)0)->details)) {
+    if (id > 0 && patient_id > 0 && !patient_exists(patient_id)) {
+        set_json_error_response(response, 422, "Unknown patient_id");
+    } else if (id > 0 && patient_id > 0 && details && strlen(details) < sizeof(((MedicalRecord*)0)->details)) {
         MedicalRecord record;
         memset(&record, 0, sizeof(MedicalRecord)); // Initialize the structure
         record.id = id;
         record.patient_id = patient_id;
         strncpy(record.details, details, sizeof(record.details) - 1);
 
-        if (update_medical_record(&record) == 0) {
+        const int result = update_medical_record(&record);
+        if (result == 0) {
             ulfius_set_string_body_response(response, 200, "Medical record updated successfully");
+        } else if (result == DB_CROSS_SHARD) {
+            set_json_error_response(response, 409, "patient_id belongs to another shard; create a new medical record instead");
         } else {
             set_json_error_response(response, 500, "Failed to update medical record");
         }
@@ -78,13 +87,12 @@ int callback_medical_records_put(const struct _u_request *request, struct _u_res
 // DELETE: Delete a Medical Record
 int callback_medical_records_delete(const struct _u_request *request, struct _u_response *response, void *user_data) {
     printf("MedicalRecords DELETE called\n");
-    const char *id_str = u_map_get(request->map_url, "id");
-    if (id_str == NULL) {
+    const int id = router_request_id(request);
+    if (id == ROUTER_NO_ID) {
         set_json_error_response(response, 400, "No ID provided");
         return U_CALLBACK_COMPLETE;
     }
 
-    int id = atoi(id_str);
     if (id > 0) {
         if (delete_medical_record(id) == 0) {
             ulfius_set_string_body_response(response, 200, "Medical record deleted successfully");
@@ -0,0 +1,268 @@
+#include "memory.h"
+
+#include "config.h"
+#include "cors.h"
+
+#include <jansson.h>
+#include <orcania.h>
+#include <sqlite3.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#define MEMORY_MAX_CACHES 16
+#define ALLOC_MAGIC 0x6d656d61u // Marks blocks from these wrappers; anything else is passed to free() as is
+
+// Prepended to every counted block; 16 bytes keeps malloc's alignment
+typedef struct {
+  _Alignas(16) size_t size;
+  uint32_t subsystem;
+  uint32_t magic;
+} alloc_header;
+
+enum { SUBSYSTEM_JSON, SUBSYSTEM_HTTP, SUBSYSTEM_COUNT };
+static const char *const subsystem_names[SUBSYSTEM_COUNT] = {"json", "http"};
+
+typedef struct {
+  int64_t live;
+  int64_t peak;
+  uint64_t allocations;
+  uint64_t failures; // refused by a limit or by malloc
+} subsystem_counters;
+
+static subsystem_counters counters[SUBSYSTEM_COUNT];
+static int64_t json_limit = 0; // bytes, 0 = unlimited
+static int64_t request_limit = 0;
+
+static struct {
+  const char *name;
+  size_t (*bytes)(void);
+} caches[MEMORY_MAX_CACHES];
+static int cache_count = 0;
+
+// Requests run on their own thread (one per connection), so the request
+// being served is thread state
+static __thread int in_request = 0;
+static __thread int64_t request_live = 0;
+static __thread int64_t request_peak = 0;
+static __thread int request_refused = 0;
+
+static struct {
+  uint64_t count;
+  uint64_t refused;
+  int64_t peak_sum;
+  int64_t peak_max;
+  uint64_t response_bytes;
+  size_t response_max;
+} requests;
+
+static void account(const int subsystem, const int64_t delta) {
+  subsystem_counters *c = &counters[subsystem];
+  const int64_t live = __atomic_add_fetch(&c->live, delta, __ATOMIC_RELAXED);
+  int64_t peak = __atomic_load_n(&c->peak, __ATOMIC_RELAXED);
+  while (live > peak && !__atomic_compare_exchange_n(&c->peak, &peak, live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+  if (in_request) {
+    request_live += delta;
+    if (request_live > request_peak) {
+      request_peak = request_live;
+    }
+  }
+}
+
+static void *counted_malloc(const int subsystem, const size_t size) {
+  if (subsystem == SUBSYSTEM_JSON) {
+    // Only JSON allocations are capped: jansson reports NULL as an error,
+    // while ulfius internals are not all prepared for it
+    const int over_total = json_limit > 0 && __atomic_load_n(&counters[subsystem].live, __ATOMIC_RELAXED) + (int64_t)size > json_limit;
+    const int over_request = in_request && request_limit > 0 && request_live + (int64_t)size > request_limit;
+    if (over_total || over_request) {
+      __atomic_add_fetch(&counters[subsystem].failures, 1, __ATOMIC_RELAXED);
+      request_refused |= over_request;
+      return NULL;
+    }
+  }
+  alloc_header *header = malloc(sizeof(alloc_header) + size);
+  if (header == NULL) {
+    __atomic_add_fetch(&counters[subsystem].failures, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  header->size = size;
+  header->subsystem = (uint32_t)subsystem;
+  header->magic = ALLOC_MAGIC;
+  __atomic_add_fetch(&counters[subsystem].allocations, 1, __ATOMIC_RELAXED);
+  account(subsystem, (int64_t)size);
+  return header + 1;
+}
+
+// Frees with whichever subsystem allocated the block, so a jansson buffer
+// released by ulfius (json_dumps bodies) is still debited from "json"
+static void counted_free(void *ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+  alloc_header *header = (alloc_header *)ptr - 1;
+  if (header->magic != ALLOC_MAGIC) {
+    free(ptr); // Allocated before memory_init or by plain malloc
+    return;
+  }
+  header->magic = 0;
+  account((int)header->subsystem, -(int64_t)header->size);
+  free(header);
+}
+
+static void *json_malloc(size_t size) {
+  return counted_malloc(SUBSYSTEM_JSON, size);
+}
+
+static void *http_malloc(size_t size) {
+  return counted_malloc(SUBSYSTEM_HTTP, size);
+}
+
+static void *http_realloc(void *ptr, size_t size) {
+  if (ptr == NULL) {
+    return http_malloc(size);
+  }
+  alloc_header *header = (alloc_header *)ptr - 1;
+  if (header->magic != ALLOC_MAGIC) {
+    return realloc(ptr, size);
+  }
+  const int subsystem = (int)header->subsystem;
+  const size_t old_size = header->size;
+  alloc_header *grown = realloc(header, sizeof(alloc_header) + size);
+  if (grown == NULL) {
+    __atomic_add_fetch(&counters[subsystem].failures, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  grown->size = size;
+  account(subsystem, (int64_t)size - (int64_t)old_size);
+  return grown + 1;
+}
+
+int memory_init(void) {
+  json_limit = (int64_t)config_get_int("HEALTH_MEMORY_JSON_LIMIT_MB", 0) << 20;
+  request_limit = (int64_t)config_get_int("HEALTH_MEMORY_REQUEST_LIMIT_MB", 0) << 20;
+  json_set_alloc_funcs(&json_malloc, &counted_free);
+  o_set_alloc_funcs(&http_malloc, &http_realloc, &counted_free);
+
+  // The soft limit makes SQLite shrink its page caches; the hard limit makes
+  // allocations past it fail with SQLITE_NOMEM
+  const int soft_mb = config_get_int("HEALTH_MEMORY_SQLITE_SOFT_LIMIT_MB", 0);
+  const int hard_mb = config_get_int("HEALTH_MEMORY_SQLITE_HARD_LIMIT_MB", 0);
+  if (soft_mb > 0) {
+    sqlite3_soft_heap_limit64((sqlite3_int64)soft_mb << 20);
+  }
+  if (hard_mb > 0) {
+    sqlite3_hard_heap_limit64((sqlite3_int64)hard_mb << 20);
+  }
+  return 0;
+}
+
+void memory_add_cache(const char *name, size_t (*bytes)(void)) {
+  if (cache_count < MEMORY_MAX_CACHES) {
+    caches[cache_count].name = name;
+    caches[cache_count].bytes = bytes;
+    cache_count++;
+  }
+}
+
+void memory_request_begin(void) {
+  in_request = 1;
+  request_live = 0;
+  request_peak = 0;
+  request_refused = 0;
+}
+
+int memory_request_end(size_t response_bytes) {
+  in_request = 0;
+  __atomic_add_fetch(&requests.count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&requests.peak_sum, request_peak, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&requests.response_bytes, (uint64_t)response_bytes, __ATOMIC_RELAXED);
+  int64_t peak_max = __atomic_load_n(&requests.peak_max, __ATOMIC_RELAXED);
+  while (request_peak > peak_max && !__atomic_compare_exchange_n(&requests.peak_max, &peak_max, request_peak, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+  size_t response_max = __atomic_load_n(&requests.response_max, __ATOMIC_RELAXED);
+  while (response_bytes > response_max && !__atomic_compare_exchange_n(&requests.response_max, &response_max, response_bytes, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+  if (request_refused) {
+    __atomic_add_fetch(&requests.refused, 1, __ATOMIC_RELAXED);
+  }
+  return request_refused;
+}
+
+// Resident and peak resident set size of this process
+static void process_memory(json_t *json_process) {
+  long pages = 0, resident = 0;
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (statm) {
+    if (fscanf(statm, "%ld %ld", &pages, &resident) != 2) {
+      resident = 0;
+    }
+    fclose(statm);
+  }
+  json_object_set_new(json_process, "rss_bytes", json_integer((json_int_t)resident * sysconf(_SC_PAGESIZE)));
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    json_object_set_new(json_process, "peak_rss_bytes", json_integer((json_int_t)usage.ru_maxrss * 1024));
+  }
+}
+
+static json_t *sqlite_status(const int op) {
+  sqlite3_int64 current = 0, highwater = 0;
+  sqlite3_status64(op, &current, &highwater, 0);
+  return json_pack("{sIsI}", "current", (json_int_t)current, "highwater", (json_int_t)highwater);
+}
+
+int callback_memory_stats(const struct _u_request *request, struct _u_response *response, void *user_data) {
+  json_t *json_stats = json_object();
+
+  json_t *json_process = json_object();
+  process_memory(json_process);
+  json_object_set_new(json_stats, "process", json_process);
+
+  for (int i = 0; i < SUBSYSTEM_COUNT; i++) {
+    const subsystem_counters *c = &counters[i];
+    json_t *json_subsystem = json_pack("{sIsIsIsI}",
+                                       "live_bytes", (json_int_t)__atomic_load_n(&c->live, __ATOMIC_RELAXED),
+                                       "peak_bytes", (json_int_t)__atomic_load_n(&c->peak, __ATOMIC_RELAXED),
+                                       "allocations", (json_int_t)__atomic_load_n(&c->allocations, __ATOMIC_RELAXED),
+                                       "failures", (json_int_t)__atomic_load_n(&c->failures, __ATOMIC_RELAXED));
+    if (i == SUBSYSTEM_JSON) {
+      json_object_set_new(json_subsystem, "limit_bytes", json_integer((json_int_t)json_limit));
+    }
+    json_object_set_new(json_stats, subsystem_names[i], json_subsystem);
+  }
+
+  json_t *json_sqlite = json_object();
+  json_object_set_new(json_sqlite, "memory_used", sqlite_status(SQLITE_STATUS_MEMORY_USED));
+  json_object_set_new(json_sqlite, "malloc_count", sqlite_status(SQLITE_STATUS_MALLOC_COUNT));
+  json_object_set_new(json_sqlite, "pagecache_overflow", sqlite_status(SQLITE_STATUS_PAGECACHE_OVERFLOW));
+  json_object_set_new(json_sqlite, "soft_limit_bytes", json_integer((json_int_t)sqlite3_soft_heap_limit64(-1)));
+  json_object_set_new(json_sqlite, "hard_limit_bytes", json_integer((json_int_t)sqlite3_hard_heap_limit64(-1)));
+  json_object_set_new(json_stats, "sqlite", json_sqlite);
+
+  json_t *json_caches = json_object();
+  for (int i = 0; i < cache_count; i++) {
+    json_object_set_new(json_caches, caches[i].name, json_integer((json_int_t)caches[i].bytes()));
+  }
+  json_object_set_new(json_stats, "caches", json_caches);
+
+  const uint64_t count = __atomic_load_n(&requests.count, __ATOMIC_RELAXED);
+  json_t *json_requests = json_object();
+  json_object_set_new(json_requests, "count", json_integer((json_int_t)count));
+  json_object_set_new(json_requests, "peak_bytes_mean", json_integer(count ? (json_int_t)(__atomic_load_n(&requests.peak_sum, __ATOMIC_RELAXED) / (int64_t)count) : 0));
+  json_object_set_new(json_requests, "peak_bytes_max", json_integer((json_int_t)__atomic_load_n(&requests.peak_max, __ATOMIC_RELAXED)));
+  json_object_set_new(json_requests, "response_bytes_total", json_integer((json_int_t)__atomic_load_n(&requests.response_bytes, __ATOMIC_RELAXED)));
+  json_object_set_new(json_requests, "response_bytes_max", json_integer((json_int_t)__atomic_load_n(&requests.response_max, __ATOMIC_RELAXED)));
+  json_object_set_new(json_requests, "limit_bytes", json_integer((json_int_t)request_limit));
+  json_object_set_new(json_requests, "refused", json_integer((json_int_t)__atomic_load_n(&requests.refused, __ATOMIC_RELAXED)));
+  json_object_set_new(json_stats, "requests", json_requests);
+
+  ulfius_set_json_body_response(response, 200, json_stats);
+  json_decref(json_stats);
+  set_cors_headers(response);
+  return U_CALLBACK_CONTINUE;
+}
@@ -0,0 +1,29 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stddef.h>
+#include <ulfius.h>
+
+// Memory accounting. jansson (json_set_alloc_funcs) and ulfius/orcania
+// (o_set_alloc_funcs) allocate through counting wrappers, so live bytes can
+// be attributed to JSON values vs HTTP buffers. SQLite reports its own heap
+// through sqlite3_status. Modules with fixed caches register a byte counter.
+// Everything is reported at GET /admin/memory.
+
+// Installs the allocators and SQLite heap limits. Must run before anything
+// allocates through jansson or orcania, i.e. first thing in main().
+int memory_init(void);
+
+// Registers a cache whose current size is reported under "caches"
+void memory_add_cache(const char *name, size_t (*bytes)(void));
+
+// Brackets one request on the calling thread (router.c). Tracks the peak of
+// bytes allocated by the request and enforces HEALTH_MEMORY_REQUEST_LIMIT_MB
+// on JSON allocations; memory_request_end returns 1 if that limit was hit.
+void memory_request_begin(void);
+int memory_request_end(size_t response_bytes);
+
+// Handles GET /admin/memory
+int callback_memory_stats(const struct _u_request *request, struct _u_response *response, void *user_data);
+
+#endif // MEMORY_H
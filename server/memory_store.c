@@ -0,0 +1,316 @@
+#include "memory_store.h"
+
+#include "byte_buffer.h"
+#include "config.h"
+#include "txn_capture.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static struct {
+  sqlite3 *db;
+  char db_path[256];
+  char journal_path[256];
+  unsigned long long last_snapshot_seq;
+  int journal_fd;
+  unsigned long long next_seq;
+  int flush_ms;
+  int snapshot_seconds;
+
+  // Statements of the transaction in progress; only touched under the connection mutex
+  txn_capture pending;
+  int capturing;
+
+  // Committed records waiting to be written by the background thread
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  byte_buffer queue;
+  pthread_t thread;
+  int running;
+} store = { .journal_fd = -1, .next_seq = 1, .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+static int write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    const ssize_t written = write(fd, data, len);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 1;
+    }
+    data += written;
+    len -= (size_t)written;
+  }
+  return 0;
+}
+
+// Copies the whole main database of src into dst
+static int copy_database(sqlite3 *dst, sqlite3 *src) {
+  sqlite3_backup *backup = sqlite3_backup_init(dst, "main", src, "main");
+  if (!backup) {
+    fprintf(stderr, "Cannot start backup: %s\n", sqlite3_errmsg(dst));
+    return 1;
+  }
+  const int rc = sqlite3_backup_step(backup, -1);
+  sqlite3_backup_finish(backup);
+  return rc == SQLITE_DONE ? 0 : 1;
+}
+
+// Journal records are "<seq> <length>\n<sql>\n", one per committed
+// transaction with its statements separated by ";\n". Each record is
+// replayed in its own transaction, so a record applies whole or not at all.
+// A torn record at the end of the file (crash during a write) ends the
+// replay and is cut off; a record that fails to apply stops the start, as
+// going on would serve a database that lost a committed transaction.
+static int replay_journal(const char *journal_path, unsigned long long last_snapshot_seq) {
+  FILE *journal = fopen(journal_path, "r");
+  if (!journal) {
+    return 0; // Nothing to replay
+  }
+
+  unsigned long long seq;
+  size_t len;
+  long good_offset = 0;
+  int replayed = 0;
+  char *sql = NULL;
+  size_t sql_capacity = 0;
+  while (fscanf(journal, "%llu %zu", &seq, &len) == 2 && fgetc(journal) == '\n') {
+    if (len + 1 > sql_capacity) {
+      char *grown = realloc(sql, len + 1);
+      if (!grown) {
+        break;
+      }
+      sql = grown;
+      sql_capacity = len + 1;
+    }
+    if (fread(sql, 1, len, journal) != len || fgetc(journal) != '\n') {
+      break;
+    }
+    sql[len] = '\0';
+    good_offset = ftell(journal);
+
+    if (seq > last_snapshot_seq) {
+      char *err_msg = NULL;
+      if (sqlite3_exec(store.db, "BEGIN", NULL, NULL, &err_msg) != SQLITE_OK ||
+          sqlite3_exec(store.db, sql, NULL, NULL, &err_msg) != SQLITE_OK ||
+          sqlite3_exec(store.db, "COMMIT", NULL, NULL, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "Journal replay of record %llu failed: %s\n", seq, err_msg);
+        sqlite3_free(err_msg);
+        sqlite3_exec(store.db, "ROLLBACK", NULL, NULL, NULL);
+        free(sql);
+        fclose(journal);
+        return 1;
+      }
+      replayed++;
+    }
+    if (seq >= store.next_seq) {
+      store.next_seq = seq + 1;
+    }
+  }
+  free(sql);
+  fclose(journal);
+
+  if (truncate(journal_path, good_offset) != 0) {
+    fprintf(stderr, "Cannot trim torn journal tail: %s\n", strerror(errno));
+  }
+  printf("Replayed %d journal records\n", replayed);
+  return 0;
+}
+
+int memory_store_open(const char *db_path, sqlite3 **memory_db) {
+  snprintf(store.db_path, sizeof(store.db_path), "%s", db_path);
+  store.flush_ms = config_get_int("HEALTH_JOURNAL_FLUSH_MS", 5);
+  store.snapshot_seconds = config_get_int("HEALTH_SNAPSHOT_SECONDS", 60);
+  snprintf(store.journal_path, sizeof(store.journal_path), "%s", config_get_str("HEALTH_JOURNAL_PATH", "health.journal"));
+
+  if (sqlite3_open(":memory:", &store.db) != SQLITE_OK) {
+    fprintf(stderr, "Cannot open in-memory database: %s\n", sqlite3_errmsg(store.db));
+    sqlite3_close(store.db);
+    return 1;
+  }
+
+  sqlite3 *file_db;
+  if (sqlite3_open(db_path, &file_db) != SQLITE_OK || copy_database(store.db, file_db) != 0) {
+    fprintf(stderr, "Cannot load %s into memory: %s\n", db_path, sqlite3_errmsg(file_db));
+    sqlite3_close(file_db);
+    sqlite3_close(store.db);
+    return 1;
+  }
+  sqlite3_close(file_db);
+
+  // Sequence number of the last journal record contained in the snapshot
+  sqlite3_exec(store.db,
+               "CREATE TABLE IF NOT EXISTS JournalState (last_seq INTEGER NOT NULL); "
+               "INSERT INTO JournalState (last_seq) SELECT 0 WHERE NOT EXISTS (SELECT 1 FROM JournalState);",
+               NULL, NULL, NULL);
+  store.last_snapshot_seq = 0;
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(store.db, "SELECT last_seq FROM JournalState", -1, &stmt, NULL) == SQLITE_OK) {
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      store.last_snapshot_seq = (unsigned long long)sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+  }
+  store.next_seq = store.last_snapshot_seq + 1;
+
+  *memory_db = store.db;
+  return 0;
+}
+
+void memory_store_on_statement(sqlite3_stmt *stmt) {
+  if (!txn_capture_statement(&store.pending, stmt, store.capturing)) {
+    return;
+  }
+  // One record per transaction, so replay cannot apply part of it
+  pthread_mutex_lock(&store.lock);
+  char header[48];
+  const int header_len = snprintf(header, sizeof(header), "%llu %zu\n", store.next_seq++, store.pending.sql.size);
+  byte_buffer_append(&store.queue, header, (size_t)header_len);
+  byte_buffer_append(&store.queue, store.pending.sql.data, store.pending.sql.size);
+  if (byte_buffer_append(&store.queue, "\n", 1) != 0) {
+    fprintf(stderr, "Cannot queue journal record %llu: out of memory\n", store.next_seq - 1);
+  }
+  pthread_cond_signal(&store.wake);
+  pthread_mutex_unlock(&store.lock);
+}
+
+void memory_store_on_commit(void) {
+  txn_capture_commit(&store.pending);
+}
+
+// Writes queued records to the journal; caller holds store.lock
+static void flush_queue_locked(void) {
+  if (store.queue.size == 0) {
+    return;
+  }
+  if (write_all(store.journal_fd, store.queue.data, store.queue.size) != 0 || fdatasync(store.journal_fd) != 0) {
+    fprintf(stderr, "Journal write failed: %s\n", strerror(errno));
+    return; // Keep the records queued and retry on the next flush
+  }
+  byte_buffer_clear(&store.queue);
+}
+
+// Copies the in-memory database back to the file and truncates the journal
+static void write_snapshot(void) {
+  sqlite3_mutex *mutex = sqlite3_db_mutex(store.db);
+  sqlite3_mutex_enter(mutex);
+  if (!sqlite3_get_autocommit(store.db)) {
+    sqlite3_mutex_leave(mutex); // A transaction is open; try again next interval
+    return;
+  }
+
+  pthread_mutex_lock(&store.lock);
+  char sql[96];
+  snprintf(sql, sizeof(sql), "UPDATE JournalState SET last_seq = %llu", store.next_seq - 1);
+  store.capturing = 0;
+  sqlite3_exec(store.db, sql, NULL, NULL, NULL);
+  store.capturing = 1;
+
+  sqlite3 *file_db;
+  int rc = sqlite3_open(store.db_path, &file_db);
+  if (rc == SQLITE_OK) {
+    rc = copy_database(file_db, store.db);
+  }
+  sqlite3_close(file_db);
+
+  if (rc == SQLITE_OK) {
+    // Everything queued so far is in the snapshot
+    byte_buffer_clear(&store.queue);
+    if (ftruncate(store.journal_fd, 0) != 0) {
+      fprintf(stderr, "Cannot truncate journal: %s\n", strerror(errno));
+    }
+  } else {
+    fprintf(stderr, "Snapshot of in-memory database failed\n");
+  }
+  pthread_mutex_unlock(&store.lock);
+  sqlite3_mutex_leave(mutex);
+}
+
+static void *journal_thread(void *arg) {
+  time_t last_snapshot = time(NULL);
+
+  pthread_mutex_lock(&store.lock);
+  while (store.running) {
+    if (store.queue.size == 0) {
+      const struct timespec deadline = deadline_after_ms(1000);
+      pthread_cond_timedwait(&store.wake, &store.lock, &deadline);
+    }
+    if (store.queue.size > 0 && store.flush_ms > 0) {
+      // Let the batch grow so one fdatasync covers several commits
+      pthread_mutex_unlock(&store.lock);
+      usleep((useconds_t)store.flush_ms * 1000);
+      pthread_mutex_lock(&store.lock);
+    }
+    flush_queue_locked();
+
+    if (store.snapshot_seconds > 0 && time(NULL) - last_snapshot >= store.snapshot_seconds) {
+      pthread_mutex_unlock(&store.lock);
+      write_snapshot();
+      last_snapshot = time(NULL);
+      pthread_mutex_lock(&store.lock);
+    }
+  }
+  flush_queue_locked();
+  pthread_mutex_unlock(&store.lock);
+  return NULL;
+}
+
+int memory_store_start(void) {
+  // Replay runs after init_db has created the schema, so records made
+  // against tables that never reached a snapshot still apply
+  if (replay_journal(store.journal_path, store.last_snapshot_seq) != 0) {
+    fprintf(stderr, "Cannot replay journal %s\n", store.journal_path);
+    return 1;
+  }
+
+  store.journal_fd = open(store.journal_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (store.journal_fd < 0) {
+    fprintf(stderr, "Cannot open journal %s: %s\n", store.journal_path, strerror(errno));
+    return 1;
+  }
+
+  store.capturing = 1;
+  store.running = 1;
+  if (pthread_create(&store.thread, NULL, journal_thread, NULL) != 0) {
+    fprintf(stderr, "Cannot start journal thread\n");
+    store.running = 0;
+    return 1;
+  }
+  printf("In-memory store active: journal flush %d ms, snapshot every %d s\n", store.flush_ms, store.snapshot_seconds);
+  return 0;
+}
+
+size_t memory_store_memory_bytes(void) {
+  pthread_mutex_lock(&store.lock);
+  const size_t bytes = store.pending.sql.capacity + store.queue.capacity;
+  pthread_mutex_unlock(&store.lock);
+  return bytes;
+}
+
+void memory_store_close(void) {
+  pthread_mutex_lock(&store.lock);
+  const int was_running = store.running;
+  store.running = 0;
+  pthread_cond_signal(&store.wake);
+  pthread_mutex_unlock(&store.lock);
+  if (was_running) {
+    pthread_join(store.thread, NULL);
+  }
+
+  if (store.journal_fd >= 0) {
+    write_snapshot();
+    close(store.journal_fd);
+    store.journal_fd = -1;
+  }
+  store.capturing = 0;
+  txn_capture_free(&store.pending);
+  byte_buffer_free(&store.queue);
+}
@@ -0,0 +1,33 @@
+#ifndef MEMORY_STORE_H
+#define MEMORY_STORE_H
+
+#include <sqlite3.h>
+#include <stddef.h>
+
+// In-memory primary store (HEALTH_DB_MODE=memory).
+// The database file is copied into an in-memory SQLite database at startup
+// and all traffic is served from memory. Committed mutations are appended
+// to a journal by a background thread, and the whole database is copied
+// back to the file periodically, after which the journal is truncated.
+// On boot, journal entries newer than the last snapshot are replayed.
+
+// Loads the last snapshot (db_path) into a new in-memory connection
+int memory_store_open(const char *db_path, sqlite3 **memory_db);
+
+// Replays the journal, then starts capturing mutations and launches the
+// journal/snapshot thread. Call once the schema exists.
+int memory_store_start(void);
+
+// Called from the connection's trace (profile) hook for every finished statement
+void memory_store_on_statement(sqlite3_stmt *stmt);
+
+// Called from the connection's commit hook
+void memory_store_on_commit(void);
+
+// Bytes held by the journal buffers (memory.h)
+size_t memory_store_memory_bytes(void);
+
+// Stops the background thread, writes a final snapshot and closes the journal
+void memory_store_close(void);
+
+#endif // MEMORY_STORE_H
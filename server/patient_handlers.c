@@ -1,43 +1,57 @@
 #include "patient_handlers.h"
 
 #include "database.h"
+#include "body_format.h"
 #include "cors.h"
 #include "json_response.h"
+#include "list_cache.h"
+#include "router.h"
+#include <stdlib.h>
 #include <string.h>
 
+#define SUMMARY_DEFAULT_LIMIT 10
+#define SUMMARY_MAX_LIMIT 100
+
 
 // Patients CRUD Callback Functions
 int callback_patients_get_all(const struct _u_request *request, struct _u_response *response, void *user_data) {
   printf("callback_patients_get_all: Starting to fetch all patients\n");
-  const char *sql = "SELECT id, name FROM Patients";
-  sqlite3_stmt *stmt;
-  const int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-  if (rc != SQLITE_OK) {
-    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
-    return U_CALLBACK_ERROR;
-  }
-
-  json_t *json_response = json_array();
-  while (sqlite3_step(stmt) == SQLITE_ROW) {
-    const int id = sqlite3_column_int(stmt, 0);
-    const char *name = (const char *)sqlite3_column_text(stmt, 1);
-    printf("Found patient - ID: %d, Name: %s\n", id, name);
-
-    // Manually creating a JSON object and setting its key-value pairs
-    json_t *json_patient = json_object();
-    if (json_patient) {
-      json_object_set_new(json_patient, "id", json_integer(id));
-      json_object_set_new(json_patient, "name", json_string(name));
-      json_array_append_new(json_response, json_patient);
+  unsigned int fields;
+  if (parse_fields(TABLE_PATIENTS, u_map_get(request->map_url, "fields"), &fields) != 0) {
+    set_json_error_response(response, 400, "Unknown column in fields");
+    set_cors_headers(response);
+    return U_CALLBACK_CONTINUE;
+  }
+  // ?ids=1,2,3: the rows that exist, in that order
+  int ids[ROUTER_MAX_IDS];
+  const int id_count = router_request_ids(request, ids, ROUTER_MAX_IDS);
+  if (id_count != 0) {
+    json_t *json_response;
+    if (id_count < 0) {
+      set_json_error_response(response, 400, "ids must be a comma-separated list of at most 100 ids");
+    } else if (read_rows_fields(TABLE_PATIENTS, ids, id_count, fields, 0, &json_response) != 0) {
+      set_json_error_response(response, 500, "Error reading patients");
     } else {
-      printf("Failed to create JSON object for patient - ID: %d, Name: %s\n", id, name);
+      set_negotiated_body_response(request, response, 200, json_response);
+      json_decref(json_response);
     }
+    set_cors_headers(response);
+    return U_CALLBACK_CONTINUE;
+  }
+  if (list_cache_respond(TABLE_PATIENTS, fields, request, response)) {
+    set_cors_headers(response);
+    return U_CALLBACK_CONTINUE;
+  }
+  json_t *json_response;
+  if (read_all_fields(TABLE_PATIENTS, fields, &json_response) != 0) {
+    set_json_error_response(response, 500, "Error reading patients");
+    set_cors_headers(response);
+    return U_CALLBACK_CONTINUE;
   }
-  sqlite3_finalize(stmt);
 
   printf("Finished fetching patients. Total found: %zu\n", json_array_size(json_response));
 
-  ulfius_set_json_body_response(response, 200, json_response);
+  set_negotiated_body_response(request, response, 200, json_response);
   json_decref(json_response);
   set_cors_headers(response);
 
@@ -47,22 +61,30 @@ int callback_patients_get_all(const struct _u_request *request, struct _u_respon
 
 int callback_patients_get(const struct _u_request *request, struct _u_response *response, void *user_data) {
   printf("callback_patients_get: Function called\n");
-  const char *id_str = u_map_get(request->map_url, "id");
-  printf("callback_patients_get: Requested ID: %s\n", id_str ? id_str : "null");
-  const int id = id_str ? atoi(id_str) : -1;
-  Patient patient;
-  const int result = read_patient(id, &patient);
+  const int id = router_request_id(request);
+  printf("callback_patients_get: Requested ID: %d\n", id);
+  unsigned int fields;
+  if (parse_fields(TABLE_PATIENTS, u_map_get(request->map_url, "fields"), &fields) != 0) {
+    set_json_error_response(response, 400, "Unknown column in fields");
+    set_cors_headers(response);
+    return U_CALLBACK_CONTINUE;
+  }
 
   json_t *json_response;
+  const int result = read_row_fields(TABLE_PATIENTS, id, fields, &json_response);
+  if (result < 0) {
+    set_json_error_response(response, 500, "Error reading patient");
+    set_cors_headers(response);
+    return U_CALLBACK_CONTINUE;
+  }
   if (result == 0) {
-    printf("callback_patients_get: Patient found with ID: %d\n", id);
-    json_response = json_pack("{sisi}", "id", patient.id, "name", patient.name);
+    printf("callback_patients_get: Found patient with ID: %d\n", id);
   } else {
-    printf("callback_patients_get: Patient not found\n");
+    printf("callback_patients_get: No patient with ID: %d\n", id);
     json_response = json_object();
   }
 
-  ulfius_set_json_body_response(response, 200, json_response);
+  set_negotiated_body_response(request, response, 200, json_response);
   json_decref(json_response);
   set_cors_headers(response);
   return U_CALLBACK_CONTINUE;
@@ -72,7 +94,7 @@ int callback_patients_post(const struct _u_request *request, struct _u_response
   printf("Patients POST called - Starting\n");
 
   // Attempt to parse the JSON body of the request
-  json_t *json_request = ulfius_get_json_body_request(request, NULL);
+  json_t *json_request = get_negotiated_body_request(request);
   if (!json_request) {
     printf("Failed to parse JSON request body\n");
     set_json_error_response(response, 400, "Bad Request: Unable to parse JSON body");
@@ -120,7 +142,7 @@ int callback_patients_post(const struct _u_request *request, struct _u_response
 
 int callback_patients_put(const struct _u_request *request, struct _u_response *response, void *user_data) {
   printf("callback_patients_put: Function called\n");
-  json_t *json_request = ulfius_get_json_body_request(request, NULL);
+  json_t *json_request = get_negotiated_body_request(request);
   const int id = json_integer_value(json_object_get(json_request, "id"));
   const char *name = json_string_value(json_object_get(json_request, "name"));
   printf("callback_patients_put: Patient ID: %d, Name: %s\n", id, name);
@@ -151,8 +173,7 @@ int callback_patients_put(const struct _u_request *request, struct _u_response *
 
 int callback_patients_delete(const struct _u_request *request, struct _u_response *response, void *user_data) {
   printf("callback_patients_delete: Function called\n");
-  const char *id_str = u_map_get(request->map_url, "id");
-  const int id = id_str ? atoi(id_str) : -1;
+  const int id = router_request_id(request);
   printf("callback_patients_delete: Patient ID: %d\n", id);
 
   if (id > 0) {
@@ -171,3 +192,63 @@ int callback_patients_delete(const struct _u_request *request, struct _u_respons
   set_cors_headers(response);
   return U_CALLBACK_CONTINUE;
 }
+
+// Parses include=appointments,records into SUMMARY_INCLUDE_* flags.
+// Returns -1 if an unknown section is requested.
+static int parse_summary_include(const char *include_str) {
+  if (!include_str || include_str[0] == '\0') {
+    return SUMMARY_INCLUDE_ALL;
+  }
+
+  int include = 0;
+  const char *cursor = include_str;
+  while (*cursor) {
+    const size_t len = strcspn(cursor, ",");
+    if (len == strlen("appointments") && strncmp(cursor, "appointments", len) == 0) {
+      include |= SUMMARY_INCLUDE_APPOINTMENTS;
+    } else if (len == strlen("records") && strncmp(cursor, "records", len) == 0) {
+      include |= SUMMARY_INCLUDE_RECORDS;
+    } else if (len > 0) {
+      return -1;
+    }
+    cursor += len;
+    if (*cursor == ',') {
+      cursor++;
+    }
+  }
+  return include;
+}
+
+int callback_patients_summary(const struct _u_request *request, struct _u_response *response, void *user_data) {
+  printf("callback_patients_summary: Function called\n");
+  const int id = router_request_id(request);
+  const int include = parse_summary_include(u_map_get(request->map_url, "include"));
+  const char *limit_str = u_map_get(request->map_url, "limit");
+  int limit = limit_str ? atoi(limit_str) : SUMMARY_DEFAULT_LIMIT;
+
+  if (id <= 0 || include < 0 || limit <= 0) {
+    printf("callback_patients_summary: Invalid parameters\n");
+    set_json_error_response(response, 400, "Invalid parameters");
+    set_cors_headers(response);
+    return U_CALLBACK_CONTINUE;
+  }
+  if (limit > SUMMARY_MAX_LIMIT) {
+    limit = SUMMARY_MAX_LIMIT;
+  }
+
+  json_t *summary;
+  const int result = read_patient_summary(id, include, limit, &summary);
+  if (result == 0) {
+    printf("callback_patients_summary: Summary built for patient ID: %d\n", id);
+    set_negotiated_body_response(request, response, 200, summary);
+    json_decref(summary);
+  } else if (result == 1) {
+    printf("callback_patients_summary: Patient not found\n");
+    set_json_error_response(response, 404, "Patient not found");
+  } else {
+    printf("callback_patients_summary: Error reading summary\n");
+    set_json_error_response(response, 500, "Error reading patient summary");
+  }
+  set_cors_headers(response);
+  return U_CALLBACK_CONTINUE;
+}
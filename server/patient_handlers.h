@@ -25,4 +25,9 @@ int callback_patients_put(const struct _u_request *request, struct _u_response *
 // Deletes an existing patient based on the request parameters
 int callback_patients_delete(const struct _u_request *request, struct _u_response *response, void *user_data);
 
+// Declaration of the function to handle GET requests for a patient summary
+// Returns the patient with upcoming appointments and recent medical records,
+// optionally narrowed with include=appointments,records and limit=N
+int callback_patients_summary(const struct _u_request *request, struct _u_response *response, void *user_data);
+
 #endif // PATIENT_HANDLERS_H
@@ -0,0 +1,157 @@
+#include "prefork.h"
+
+#include "config.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PREFORK_MAX_WORKERS 64
+#define PREFORK_MIN_UPTIME_SECONDS 1 // workers dying faster than this are restarted with a delay
+
+typedef struct {
+  pid_t pid;
+  time_t started_at;
+} worker_slot;
+
+static worker_slot slots[PREFORK_MAX_WORKERS];
+
+void prefork_block_signals(void) {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGCHLD);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+int prefork_wait_for_shutdown(void) {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGINT);
+  int sig = 0;
+  while (sigwait(&set, &sig) != 0) {
+  }
+  return sig;
+}
+
+static pid_t spawn_worker(int index, int (*worker)(void)) {
+  const pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return -1;
+  }
+  if (pid == 0) {
+    // The signal mask is inherited, so the worker waits for SIGTERM the same
+    // way a single-process server does
+    exit(worker());
+  }
+  slots[index].pid = pid;
+  slots[index].started_at = time(NULL);
+  printf("Started worker %d (pid %d)\n", index, (int)pid);
+  return pid;
+}
+
+static int find_slot(pid_t pid, int workers) {
+  for (int i = 0; i < workers; i++) {
+    if (slots[i].pid == pid) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Reaps every exited worker; restarts them unless shutting down.
+// Returns the number of workers still alive.
+static int reap_workers(int workers, int (*worker)(void), int restart) {
+  int status;
+  pid_t pid;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    const int index = find_slot(pid, workers);
+    if (index < 0) {
+      continue;
+    }
+    if (WIFSIGNALED(status)) {
+      fprintf(stderr, "Worker %d (pid %d) killed by signal %d\n", index, (int)pid, WTERMSIG(status));
+    } else {
+      fprintf(stderr, "Worker %d (pid %d) exited with status %d\n", index, (int)pid, WEXITSTATUS(status));
+    }
+    slots[index].pid = 0;
+    if (restart) {
+      if (time(NULL) - slots[index].started_at < PREFORK_MIN_UPTIME_SECONDS) {
+        sleep(PREFORK_MIN_UPTIME_SECONDS); // keep a crash loop from spinning
+      }
+      spawn_worker(index, worker);
+    }
+  }
+
+  int alive = 0;
+  for (int i = 0; i < workers; i++) {
+    alive += slots[i].pid > 0;
+  }
+  return alive;
+}
+
+int prefork_run(int workers, int (*worker)(void)) {
+  if (workers > PREFORK_MAX_WORKERS) {
+    workers = PREFORK_MAX_WORKERS;
+  }
+  // Workers drain for HEALTH_DRAIN_MS; give them a grace period on top before SIGKILL
+  const int kill_after_seconds = config_get_int("HEALTH_DRAIN_MS", 10000) / 1000 + 5;
+
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGCHLD);
+
+  printf("Supervisor %d starting %d workers\n", (int)getpid(), workers);
+  for (int i = 0; i < workers; i++) {
+    if (spawn_worker(i, worker) < 0) {
+      return 1;
+    }
+  }
+
+  int sig = 0;
+  for (;;) {
+    if (sigwait(&set, &sig) != 0) {
+      continue;
+    }
+    if (sig == SIGCHLD) {
+      reap_workers(workers, worker, 1);
+    } else {
+      break;
+    }
+  }
+
+  printf("Supervisor received signal %d, draining workers\n", sig);
+  for (int i = 0; i < workers; i++) {
+    if (slots[i].pid > 0) {
+      kill(slots[i].pid, SIGTERM);
+    }
+  }
+
+  // SIGCHLD stays blocked, so poll for exits until the grace period runs out
+  const time_t kill_at = time(NULL) + kill_after_seconds;
+  while (reap_workers(workers, worker, 0) > 0) {
+    if (time(NULL) >= kill_at) {
+      for (int i = 0; i < workers; i++) {
+        if (slots[i].pid > 0) {
+          fprintf(stderr, "Worker %d (pid %d) did not drain in time, killing it\n", i, (int)slots[i].pid);
+          kill(slots[i].pid, SIGKILL);
+        }
+      }
+      while (waitpid(-1, NULL, 0) > 0 || errno == EINTR) {
+      }
+      break;
+    }
+    usleep(50000);
+  }
+  return 0;
+}
@@ -0,0 +1,21 @@
+#ifndef PREFORK_H
+#define PREFORK_H
+
+// Process model. In prefork mode (HEALTH_WORKERS > 1) a supervisor forks the
+// workers, each of which binds the API port with SO_REUSEPORT and opens its
+// own connections to the shared WAL-mode database. Crashed workers are
+// restarted; SIGTERM/SIGINT is forwarded so every worker drains and exits.
+
+// Blocks SIGTERM/SIGINT/SIGCHLD in the calling thread. Must run before any
+// thread is created so every later thread inherits the mask and the signals
+// are only consumed by prefork_wait_for_shutdown / the supervisor.
+void prefork_block_signals(void);
+
+// Blocks until SIGTERM or SIGINT arrives, returns the signal number
+int prefork_wait_for_shutdown(void);
+
+// Supervises `workers` forked processes running worker(); returns once all
+// of them have exited after a shutdown signal
+int prefork_run(int workers, int (*worker)(void));
+
+#endif // PREFORK_H
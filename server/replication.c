@@ -0,0 +1,665 @@
+#include "replication.h"
+
+#include "byte_buffer.h"
+#include "config.h"
+#include "cors.h"
+#include "database.h"
+#include "json_response.h"
+#include "txn_capture.h"
+#include "util.h"
+
+#include <curl/curl.h>
+#include <errno.h>
+#include <jansson.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REPLICATION_STREAM_BLOCK_SIZE 65536
+#define REPLICATION_SHARD_HEARTBEAT (-1)
+#define REPLICATION_SHARD_RESET (-2)
+
+typedef struct {
+  uint64_t seq;
+  int shard;
+  int64_t commit_ms;
+  char *sql;
+  size_t length;
+} log_record;
+
+typedef struct {
+  uint64_t last_seq;
+  byte_buffer buffer; // formatted records not yet handed to the stream
+  size_t offset;
+  int ended;
+} log_subscriber;
+
+static struct {
+  // Leader: the log
+  pthread_mutex_t lock;
+  pthread_cond_t published;
+  pthread_cond_t drained; // signalled as streams end, for replication_close
+  log_record *ring;
+  size_t capacity;
+  size_t count;
+  uint64_t next_seq; // records [next_seq - count, next_seq) are in the ring
+  size_t ring_bytes;
+  txn_capture pending[SHARD_MAX]; // per shard connection
+  int subscribers;
+  int max_subscribers;
+  int heartbeat_ms;
+  int closing;
+
+  // Follower: position and lag, under lock
+  const char *leader_url;
+  int max_lag_ms;
+  pthread_t thread;
+  int started;
+  int running;
+  int failed;
+  uint64_t snapshot_seq[SHARD_MAX];
+  uint64_t applied_seq;
+  uint64_t leader_seq;
+  int64_t lag_ms;          // commit-to-apply delay of the last transaction, 0 once caught up
+  int64_t last_contact_ms; // last record or heartbeat received
+  int connected;
+} repl = { .lock = PTHREAD_MUTEX_INITIALIZER, .published = PTHREAD_COND_INITIALIZER,
+          .drained = PTHREAD_COND_INITIALIZER, .next_seq = 1 };
+
+static int64_t now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+int replication_init(const char *leader_url) {
+  repl.leader_url = leader_url;
+  repl.max_lag_ms = config_get_int("HEALTH_FOLLOWER_MAX_LAG_MS", 5000);
+  repl.heartbeat_ms = config_get_int("HEALTH_REPLICATION_HEARTBEAT_MS", 1000);
+  repl.max_subscribers = config_get_int("HEALTH_REPLICATION_MAX_FOLLOWERS", 16);
+  if (repl.heartbeat_ms < 10) {
+    repl.heartbeat_ms = 10;
+  }
+  repl.closing = 0;
+
+  const int capacity = config_get_int("HEALTH_REPLICATION_LOG", 4096);
+  if (capacity <= 0) {
+    return 0;
+  }
+  // Each worker would keep its own log of only its own writes
+  if (config_get_int("HEALTH_WORKERS", 1) > 1) {
+    printf("Replication log disabled: it needs HEALTH_WORKERS=1\n");
+    return 0;
+  }
+  repl.ring = calloc((size_t)capacity, sizeof(log_record));
+  if (repl.ring == NULL) {
+    fprintf(stderr, "Cannot allocate replication log\n");
+    return 1;
+  }
+  repl.capacity = (size_t)capacity;
+  return 0;
+}
+
+int replication_log_enabled(void) {
+  return repl.capacity > 0;
+}
+
+int replication_is_follower(void) {
+  return repl.leader_url != NULL;
+}
+
+// Leader side ---------------------------------------------------------------
+
+static void publish(int shard, const byte_buffer *txn) {
+  char *sql = malloc(txn->size + 1);
+  if (sql == NULL) {
+    fprintf(stderr, "Cannot record transaction for replication\n");
+    return;
+  }
+  memcpy(sql, txn->data, txn->size);
+  sql[txn->size] = '\0';
+
+  pthread_mutex_lock(&repl.lock);
+  if (repl.ring) {
+    log_record *record = &repl.ring[repl.next_seq % repl.capacity];
+    if (repl.count == repl.capacity) {
+      repl.ring_bytes -= record->length;
+      free(record->sql);
+    }
+    record->seq = repl.next_seq++;
+    record->shard = shard;
+    record->commit_ms = now_ms();
+    record->sql = sql;
+    record->length = txn->size;
+    repl.ring_bytes += txn->size;
+    if (repl.count < repl.capacity) {
+      repl.count++;
+    }
+    pthread_cond_broadcast(&repl.published);
+    sql = NULL;
+  }
+  pthread_mutex_unlock(&repl.lock);
+  free(sql);
+}
+
+void replication_on_statement(int shard, sqlite3_stmt *stmt) {
+  if (repl.capacity > 0 && shard >= 0 && shard < SHARD_MAX && txn_capture_statement(&repl.pending[shard], stmt, 1)) {
+    publish(shard, &repl.pending[shard].sql);
+  }
+}
+
+void replication_on_commit(int shard) {
+  if (repl.capacity > 0 && shard >= 0 && shard < SHARD_MAX) {
+    txn_capture_commit(&repl.pending[shard]);
+  }
+}
+
+uint64_t replication_log_seq(void) {
+  pthread_mutex_lock(&repl.lock);
+  const uint64_t seq = repl.next_seq - 1;
+  pthread_mutex_unlock(&repl.lock);
+  return seq;
+}
+
+size_t replication_memory_bytes(void) {
+  pthread_mutex_lock(&repl.lock);
+  size_t bytes = (repl.ring ? repl.capacity * sizeof(log_record) : 0) + repl.ring_bytes;
+  for (int i = 0; i < SHARD_MAX; i++) {
+    bytes += repl.pending[i].sql.capacity;
+  }
+  pthread_mutex_unlock(&repl.lock);
+  return bytes;
+}
+
+// Formats one record header plus body into the subscriber's buffer
+static int append_record(log_subscriber *subscriber, uint64_t seq, int shard, int64_t ms,
+                         const char *sql, size_t length) {
+  char header[96];
+  const int header_length = snprintf(header, sizeof(header), "%llu %d %lld %zu\n",
+                                     (unsigned long long)seq, shard, (long long)ms, length);
+  byte_buffer_append(&subscriber->buffer, header, (size_t)header_length);
+  byte_buffer_append(&subscriber->buffer, sql, length);
+  return byte_buffer_append(&subscriber->buffer, "\n", 1);
+}
+
+// Stream callback: hands out what is left of the formatted records, then
+// waits up to one heartbeat for new transactions. A subscriber that falls
+// off the ring gets a reset record and the stream ends.
+static ssize_t log_stream_read(void *stream_user_data, uint64_t offset, char *out_buf, size_t max) {
+  log_subscriber *subscriber = (log_subscriber *)stream_user_data;
+
+  if (subscriber->offset == subscriber->buffer.size) {
+    if (subscriber->ended) {
+      return U_STREAM_END;
+    }
+    byte_buffer_clear(&subscriber->buffer);
+    subscriber->offset = 0;
+
+    pthread_mutex_lock(&repl.lock);
+    if (subscriber->last_seq + 1 >= repl.next_seq && !repl.closing) {
+      const struct timespec deadline = deadline_after_ms(repl.heartbeat_ms);
+      int rc = 0;
+      while (subscriber->last_seq + 1 >= repl.next_seq && !repl.closing && rc != ETIMEDOUT) {
+        rc = pthread_cond_timedwait(&repl.published, &repl.lock, &deadline);
+      }
+    }
+    if (repl.closing || repl.ring == NULL) {
+      pthread_mutex_unlock(&repl.lock);
+      return U_STREAM_END;
+    }
+
+    const uint64_t oldest = repl.next_seq - repl.count;
+    int failed = 0;
+    if (subscriber->last_seq + 1 < oldest) {
+      failed = append_record(subscriber, subscriber->last_seq, REPLICATION_SHARD_RESET, now_ms(), "", 0);
+      subscriber->ended = 1;
+    } else if (subscriber->last_seq + 1 >= repl.next_seq) {
+      failed = append_record(subscriber, repl.next_seq - 1, REPLICATION_SHARD_HEARTBEAT, now_ms(), "", 0);
+    }
+    // Batch up to one block; a single larger transaction still goes out whole
+    while (!failed && !subscriber->ended && subscriber->last_seq + 1 < repl.next_seq &&
+           subscriber->buffer.size < REPLICATION_STREAM_BLOCK_SIZE) {
+      const log_record *record = &repl.ring[(subscriber->last_seq + 1) % repl.capacity];
+      failed = append_record(subscriber, record->seq, record->shard, record->commit_ms, record->sql, record->length);
+      subscriber->last_seq = record->seq;
+    }
+    pthread_mutex_unlock(&repl.lock);
+    if (failed) {
+      return U_STREAM_ERROR;
+    }
+  }
+
+  size_t length = subscriber->buffer.size - subscriber->offset;
+  if (length > max) {
+    length = max;
+  }
+  memcpy(out_buf, subscriber->buffer.data + subscriber->offset, length);
+  subscriber->offset += length;
+  return (ssize_t)length;
+}
+
+static void log_stream_free(void *stream_user_data) {
+  log_subscriber *subscriber = (log_subscriber *)stream_user_data;
+  pthread_mutex_lock(&repl.lock);
+  repl.subscribers--;
+  pthread_cond_broadcast(&repl.drained);
+  pthread_mutex_unlock(&repl.lock);
+  byte_buffer_free(&subscriber->buffer);
+  free(subscriber);
+}
+
+int callback_replication_status(const struct _u_request *request, struct _u_response *response, void *user_data) {
+  if (!replication_log_enabled()) {
+    set_json_error_response(response, 503, "Replication log is disabled");
+    set_cors_headers(response);
+    return U_CALLBACK_CONTINUE;
+  }
+  json_t *json_status = json_object();
+  json_object_set_new(json_status, "shards", json_integer(database_shard_count()));
+  json_object_set_new(json_status, "seq", json_integer((json_int_t)replication_log_seq()));
+  ulfius_set_json_body_response(response, 200, json_status);
+  json_decref(json_status);
+  set_cors_headers(response);
+  return U_CALLBACK_CONTINUE;
+}
+
+int callback_replication_snapshot(const struct _u_request *request, struct _u_response *response, void *user_data) {
+  const char *shard_param = u_map_get(request->map_url, "shard");
+  unsigned char *data = NULL;
+  sqlite3_int64 size = 0;
+  uint64_t seq = 0;
+  const int rc = replication_log_enabled() ? snapshot_shard(shard_param ? atoi(shard_param) : 0, &data, &size, &seq) : -1;
+  if (rc != 0) {
+    set_json_error_response(response, rc > 0 ? 404 : 503, rc > 0 ? "Unknown shard" : "Snapshot unavailable");
+    set_cors_headers(response);
+    return U_CALLBACK_CONTINUE;
+  }
+  char seq_header[32];
+  snprintf(seq_header, sizeof(seq_header), "%llu", (unsigned long long)seq);
+  ulfius_set_binary_body_response(response, 200, (const char *)data, (size_t)size);
+  sqlite3_free(data);
+  u_map_put(response->map_header, "Content-Type", "application/vnd.sqlite3");
+  u_map_put(response->map_header, "X-Replication-Seq", seq_header);
+  set_cors_headers(response);
+  return U_CALLBACK_CONTINUE;
+}
+
+int callback_replication_log(const struct _u_request *request, struct _u_response *response, void *user_data) {
+  const char *after = u_map_get(request->map_url, "after");
+
+  pthread_mutex_lock(&repl.lock);
+  if (repl.ring == NULL || repl.closing || repl.subscribers >= repl.max_subscribers) {
+    pthread_mutex_unlock(&repl.lock);
+    set_json_error_response(response, 503, "Replication log unavailable");
+    u_map_put(response->map_header, "Retry-After", "5");
+    set_cors_headers(response);
+    return U_CALLBACK_CONTINUE;
+  }
+  uint64_t last_seq = after ? strtoull(after, NULL, 10) : repl.next_seq - 1;
+  if (last_seq + 1 < repl.next_seq - repl.count) {
+    pthread_mutex_unlock(&repl.lock);
+    set_json_error_response(response, 410, "Position is no longer in the replication log; bootstrap again");
+    set_cors_headers(response);
+    return U_CALLBACK_CONTINUE;
+  }
+  if (last_seq >= repl.next_seq) {
+    last_seq = repl.next_seq - 1;
+  }
+  log_subscriber *subscriber = calloc(1, sizeof(log_subscriber));
+  if (subscriber == NULL) {
+    pthread_mutex_unlock(&repl.lock);
+    set_json_error_response(response, 500, "Internal Server Error");
+    set_cors_headers(response);
+    return U_CALLBACK_CONTINUE;
+  }
+  subscriber->last_seq = last_seq;
+  repl.subscribers++;
+  pthread_mutex_unlock(&repl.lock);
+
+  if (ulfius_set_stream_response(response, 200, &log_stream_read, &log_stream_free,
+                                 U_STREAM_SIZE_UNKNOWN, REPLICATION_STREAM_BLOCK_SIZE, subscriber) != U_OK) {
+    log_stream_free(subscriber);
+    set_json_error_response(response, 500, "Internal Server Error");
+    set_cors_headers(response);
+    return U_CALLBACK_CONTINUE;
+  }
+  u_map_put(response->map_header, "Content-Type", "application/x-replication-log");
+  u_map_put(response->map_header, "Cache-Control", "no-cache");
+  u_map_put(response->map_header, "X-Accel-Buffering", "no");
+  set_cors_headers(response);
+  return U_CALLBACK_CONTINUE;
+}
+
+// Follower side -------------------------------------------------------------
+
+// Appends a received chunk, keeping the data NUL-terminated past its size
+static size_t collect_download(char *data, size_t size, size_t count, void *user_data) {
+  byte_buffer *download = user_data;
+  if (byte_buffer_append(download, data, size * count) != 0 || byte_buffer_append(download, "", 1) != 0) {
+    return 0;
+  }
+  download->size--;
+  return size * count;
+}
+
+static size_t read_seq_header(char *data, size_t size, size_t count, void *user_data) {
+  static const char name[] = "X-Replication-Seq:";
+  if (size * count > sizeof(name) && strncasecmp(data, name, sizeof(name) - 1) == 0) {
+    *(uint64_t *)user_data = strtoull(data + sizeof(name) - 1, NULL, 10);
+  }
+  return size * count;
+}
+
+static CURL *new_handle(const char *path, byte_buffer *download) {
+  CURL *curl = curl_easy_init();
+  if (curl == NULL) {
+    return NULL;
+  }
+  char url[1024];
+  snprintf(url, sizeof(url), "%s%s", repl.leader_url, path);
+  curl_easy_setopt(curl, CURLOPT_URL, url);
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, collect_download);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, download);
+  const char *cafile = config_get_str("HEALTH_FOLLOW_CAFILE", NULL);
+  if (cafile) {
+    curl_easy_setopt(curl, CURLOPT_CAINFO, cafile);
+  }
+  return curl;
+}
+
+static int write_file(const char *path, const char *data, size_t size) {
+  char side_path[300];
+  snprintf(side_path, sizeof(side_path), "%s-wal", path);
+  remove(side_path);
+  snprintf(side_path, sizeof(side_path), "%s-shm", path);
+  remove(side_path);
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) {
+    return 1;
+  }
+  const int failed = fwrite(data, 1, size, file) != size;
+  return fclose(file) != 0 || failed;
+}
+
+int replication_bootstrap(void) {
+  const char *dir = config_get_str("HEALTH_DB_DIR", NULL);
+  if (dir && mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Cannot create %s: %s\n", dir, strerror(errno));
+    return 1;
+  }
+
+  byte_buffer status = {0};
+  CURL *curl = new_handle("/api/replication/status", &status);
+  const CURLcode rc = curl ? curl_easy_perform(curl) : CURLE_FAILED_INIT;
+  curl_easy_cleanup(curl);
+  json_t *json_status = rc == CURLE_OK ? json_loads(status.data, 0, NULL) : NULL;
+  byte_buffer_free(&status);
+  const int shards = (int)json_integer_value(json_object_get(json_status, "shards"));
+  json_decref(json_status);
+  if (shards < 1 || shards > SHARD_MAX) {
+    fprintf(stderr, "Cannot read replication status from %s: %s\n", repl.leader_url, curl_easy_strerror(rc));
+    return 1;
+  }
+
+  for (int shard = 0; shard < shards; shard++) {
+    char path[64], file_path[256];
+    snprintf(path, sizeof(path), "/api/replication/snapshot?shard=%d", shard);
+    byte_buffer snapshot = {0};
+    uint64_t seq = 0;
+    curl = new_handle(path, &snapshot);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, read_seq_header);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &seq);
+    const CURLcode snapshot_rc = curl_easy_perform(curl);
+    curl_easy_cleanup(curl);
+    database_file_path(shard, file_path, sizeof(file_path));
+    if (snapshot_rc != CURLE_OK || write_file(file_path, snapshot.data, snapshot.size) != 0) {
+      fprintf(stderr, "Cannot copy shard %d from %s to %s\n", shard, repl.leader_url, file_path);
+      byte_buffer_free(&snapshot);
+      return 1;
+    }
+    byte_buffer_free(&snapshot);
+    repl.snapshot_seq[shard] = seq;
+    printf("Copied shard %d from %s at replication sequence %llu\n", shard, repl.leader_url, (unsigned long long)seq);
+  }
+
+  // The leader's layout wins over the local setting
+  char shard_count[8];
+  snprintf(shard_count, sizeof(shard_count), "%d", shards);
+  setenv("HEALTH_DB_SHARDS", shard_count, 1);
+
+  repl.applied_seq = repl.snapshot_seq[0];
+  for (int shard = 1; shard < shards; shard++) {
+    if (repl.snapshot_seq[shard] < repl.applied_seq) {
+      repl.applied_seq = repl.snapshot_seq[shard];
+    }
+  }
+  repl.leader_seq = repl.applied_seq;
+  repl.last_contact_ms = now_ms();
+  return 0;
+}
+
+// Stops following after a divergence or a gap: the process shuts down so it
+// is restarted and bootstraps again
+static void fail_follower(const char *reason) {
+  fprintf(stderr, "Replication stopped: %s; restart the follower to copy the leader again\n", reason);
+  pthread_mutex_lock(&repl.lock);
+  repl.failed = 1;
+  repl.running = 0;
+  pthread_mutex_unlock(&repl.lock);
+  kill(getpid(), SIGTERM);
+}
+
+// Applies one record; returns 0 to continue
+static int apply_record(uint64_t seq, int shard, int64_t commit_ms, char *sql) {
+  if (shard == REPLICATION_SHARD_RESET) {
+    fail_follower("the follower fell behind the leader's log");
+    return 1;
+  }
+  int rc = 0;
+  pthread_mutex_lock(&repl.lock);
+  const uint64_t applied = repl.applied_seq;
+  pthread_mutex_unlock(&repl.lock);
+  if (shard >= 0 && seq > applied && seq > repl.snapshot_seq[shard]) {
+    rc = apply_replicated(shard, sql);
+  }
+  if (rc != 0) {
+    fail_follower("a transaction from the leader did not apply");
+    return 1;
+  }
+
+  const int64_t now = now_ms();
+  pthread_mutex_lock(&repl.lock);
+  if (shard >= 0) {
+    if (seq > repl.applied_seq) {
+      repl.applied_seq = seq;
+    }
+    repl.lag_ms = now - commit_ms > 0 ? now - commit_ms : 0;
+  } else if (seq <= repl.applied_seq) {
+    repl.lag_ms = 0; // Heartbeat: nothing left to apply
+  }
+  if (seq > repl.leader_seq) {
+    repl.leader_seq = seq;
+  }
+  repl.last_contact_ms = now;
+  pthread_mutex_unlock(&repl.lock);
+  return 0;
+}
+
+// Splits the stream into records and applies every complete one
+static size_t tail_log(char *data, size_t size, size_t count, void *user_data) {
+  byte_buffer *stream = user_data;
+  if (collect_download(data, size, count, stream) == 0) {
+    return 0;
+  }
+  size_t consumed = 0;
+  for (;;) {
+    char *header = stream->data + consumed;
+    char *newline = memchr(header, '\n', stream->size - consumed);
+    if (newline == NULL) {
+      break;
+    }
+    unsigned long long seq;
+    int shard;
+    long long commit_ms;
+    size_t length;
+    if (sscanf(header, "%llu %d %lld %zu", &seq, &shard, &commit_ms, &length) != 4) {
+      fail_follower("malformed replication log");
+      return 0;
+    }
+    char *sql = newline + 1;
+    if ((size_t)(sql - stream->data) + length + 1 > stream->size) {
+      break; // Body not complete yet
+    }
+    sql[length] = '\0'; // Replaces the record's trailing newline
+    if (apply_record(seq, shard, commit_ms, sql) != 0) {
+      return 0;
+    }
+    consumed = (size_t)(sql - stream->data) + length + 1;
+  }
+  memmove(stream->data, stream->data + consumed, stream->size - consumed);
+  stream->size -= consumed;
+  return size * count;
+}
+
+// Aborts the transfer once the follower is stopped
+static int check_running(void *user_data, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+  pthread_mutex_lock(&repl.lock);
+  const int running = repl.running;
+  pthread_mutex_unlock(&repl.lock);
+  return running ? 0 : 1;
+}
+
+static void *follow_thread(void *arg) {
+  for (;;) {
+    pthread_mutex_lock(&repl.lock);
+    const int running = repl.running;
+    const uint64_t after = repl.applied_seq;
+    pthread_mutex_unlock(&repl.lock);
+    if (!running) {
+      break;
+    }
+
+    char path[64];
+    snprintf(path, sizeof(path), "/api/replication/log?after=%llu", (unsigned long long)after);
+    byte_buffer stream = {0};
+    CURL *curl = new_handle(path, &stream);
+    if (curl) {
+      curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, tail_log);
+      curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+      curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, check_running);
+      // Heartbeats arrive every HEALTH_REPLICATION_HEARTBEAT_MS; a silent leader is gone
+      curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+      curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 10L);
+      pthread_mutex_lock(&repl.lock);
+      repl.connected = 1;
+      pthread_mutex_unlock(&repl.lock);
+      const CURLcode rc = curl_easy_perform(curl);
+      long status = 0;
+      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+      curl_easy_cleanup(curl);
+      pthread_mutex_lock(&repl.lock);
+      repl.connected = 0;
+      pthread_mutex_unlock(&repl.lock);
+      if (status == 410) {
+        fail_follower("the follower's position left the leader's log");
+      } else if (rc != CURLE_OK && repl.running) {
+        fprintf(stderr, "Replication stream from %s ended: %s\n", repl.leader_url, curl_easy_strerror(rc));
+      }
+    }
+    byte_buffer_free(&stream);
+
+    // Reconnect after a second, sooner if stopped
+    const struct timespec deadline = deadline_after_ms(1000);
+    pthread_mutex_lock(&repl.lock);
+    if (repl.running) {
+      pthread_cond_timedwait(&repl.published, &repl.lock, &deadline);
+    }
+    pthread_mutex_unlock(&repl.lock);
+  }
+  return NULL;
+}
+
+int replication_follow_start(void) {
+  pthread_mutex_lock(&repl.lock);
+  repl.running = 1;
+  pthread_mutex_unlock(&repl.lock);
+  if (pthread_create(&repl.thread, NULL, follow_thread, NULL) != 0) {
+    fprintf(stderr, "Cannot start replication thread\n");
+    repl.running = 0;
+    return 1;
+  }
+  repl.started = 1;
+  printf("Following %s from replication sequence %llu\n", repl.leader_url, (unsigned long long)repl.applied_seq);
+  return 0;
+}
+
+int replication_reads_allowed(void) {
+  if (!replication_is_follower() || repl.max_lag_ms <= 0) {
+    return 1;
+  }
+  const int64_t now = now_ms();
+  pthread_mutex_lock(&repl.lock);
+  const int allowed = !repl.failed && repl.lag_ms <= repl.max_lag_ms && now - repl.last_contact_ms <= repl.max_lag_ms;
+  pthread_mutex_unlock(&repl.lock);
+  return allowed;
+}
+
+void replication_close(void) {
+  pthread_mutex_lock(&repl.lock);
+  repl.closing = 1;
+  pthread_cond_broadcast(&repl.published);
+  repl.running = 0;
+  while (repl.subscribers > 0) {
+    pthread_cond_wait(&repl.drained, &repl.lock);
+  }
+  free(repl.ring);
+  repl.ring = NULL;
+  repl.count = 0;
+  repl.ring_bytes = 0;
+  pthread_mutex_unlock(&repl.lock);
+  if (repl.started) {
+    pthread_join(repl.thread, NULL);
+    repl.started = 0;
+  }
+}
+
+int replication_failed(void) {
+  pthread_mutex_lock(&repl.lock);
+  const int failed = repl.failed;
+  pthread_mutex_unlock(&repl.lock);
+  return failed;
+}
+
+int callback_replication_stats(const struct _u_request *request, struct _u_response *response, void *user_data) {
+  json_t *json_stats = json_object();
+  const int64_t now = now_ms();
+  pthread_mutex_lock(&repl.lock);
+  json_object_set_new(json_stats, "role", json_string(replication_is_follower() ? "follower" : "leader"));
+  json_object_set_new(json_stats, "log_enabled", json_boolean(repl.capacity > 0));
+  json_object_set_new(json_stats, "log_seq", json_integer((json_int_t)(repl.next_seq - 1)));
+  json_object_set_new(json_stats, "log_transactions", json_integer((json_int_t)repl.count));
+  json_object_set_new(json_stats, "log_bytes", json_integer((json_int_t)repl.ring_bytes));
+  json_object_set_new(json_stats, "followers", json_integer(repl.subscribers));
+  if (replication_is_follower()) {
+    json_object_set_new(json_stats, "leader", json_string(repl.leader_url));
+    json_object_set_new(json_stats, "state", json_string(repl.failed ? "failed" : repl.connected ? "streaming" : "connecting"));
+    json_object_set_new(json_stats, "applied_seq", json_integer((json_int_t)repl.applied_seq));
+    json_object_set_new(json_stats, "leader_seq", json_integer((json_int_t)repl.leader_seq));
+    json_object_set_new(json_stats, "lag_transactions", json_integer((json_int_t)(repl.leader_seq - repl.applied_seq)));
+    json_object_set_new(json_stats, "lag_ms", json_integer((json_int_t)repl.lag_ms));
+    json_object_set_new(json_stats, "last_contact_ms", json_integer((json_int_t)(now - repl.last_contact_ms)));
+    json_object_set_new(json_stats, "max_lag_ms", json_integer(repl.max_lag_ms));
+  }
+  pthread_mutex_unlock(&repl.lock);
+  ulfius_set_json_body_response(response, 200, json_stats);
+  json_decref(json_stats);
+  set_cors_headers(response);
+  return U_CALLBACK_CONTINUE;
+}
@@ -0,0 +1,71 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <sqlite3.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <ulfius.h>
+
+// Leader/follower replication over a statement log.
+//
+// Leader: every committed write transaction is recorded from the SQLite
+// trace and commit hooks (database.c) as the expanded SQL of its statements,
+// tagged with a global sequence number, the shard and the commit time, in a
+// ring of HEALTH_REPLICATION_LOG transactions. Followers fetch:
+//   GET /api/replication/status            {"shards", "seq"}
+//   GET /api/replication/snapshot?shard=N  the shard file, X-Replication-Seq: its sequence
+//   GET /api/replication/log?after=SEQ     stream of transactions after SEQ
+// The log stream is a sequence of records "<seq> <shard> <unix_ms> <length>\n"
+// followed by length bytes of SQL and "\n". Shard -1 is a heartbeat carrying
+// the leader's latest sequence; shard -2 means the requested position has
+// left the ring and the follower must bootstrap again.
+//
+// Follower (--follow <url>): downloads every shard snapshot into
+// HEALTH_DB_DIR before init_db, then a thread tails the log from the oldest
+// snapshot sequence and applies each transaction to its shard. Writes are
+// refused, and reads are refused while the follower is more than
+// HEALTH_FOLLOWER_MAX_LAG_MS behind.
+
+// Reads the settings and allocates the ring; call before init_db.
+// leader_url is NULL on a leader.
+int replication_init(const char *leader_url);
+
+// Whether database.c should install the trace hook for the log
+int replication_log_enabled(void);
+
+// Hook entry points used by database.c, under the connection mutex
+void replication_on_statement(int shard, sqlite3_stmt *stmt);
+void replication_on_commit(int shard);
+
+// Sequence of the last recorded transaction
+uint64_t replication_log_seq(void);
+
+// Follower: fetches the snapshots; call after replication_init, before init_db
+int replication_bootstrap(void);
+
+// Follower: starts the tailing thread; call after init_db
+int replication_follow_start(void);
+
+int replication_is_follower(void);
+
+// Follower: whether reads may be served (connected and within the lag bound)
+int replication_reads_allowed(void);
+
+// Ends log streams and stops the follower thread
+void replication_close(void);
+
+// Follower: whether replication stopped on a gap or a failed transaction
+// (the follower then shuts itself down so it can be bootstrapped again)
+int replication_failed(void);
+
+// Bytes held by the log ring (memory.h)
+size_t replication_memory_bytes(void);
+
+int callback_replication_status(const struct _u_request *request, struct _u_response *response, void *user_data);
+int callback_replication_snapshot(const struct _u_request *request, struct _u_response *response, void *user_data);
+int callback_replication_log(const struct _u_request *request, struct _u_response *response, void *user_data);
+
+// Handles GET /admin/replication: role, sequence and, on a follower, the lag
+int callback_replication_stats(const struct _u_request *request, struct _u_response *response, void *user_data);
+
+#endif // REPLICATION_H
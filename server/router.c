@@ -0,0 +1,324 @@
+#include "router.h"
+
+#include "cors.h"
+#include "json_response.h"
+#include "memory.h"
+#include "trace.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ROUTER_MAX_ROUTES 64
+#define ROUTER_MAX_SEGMENTS 8
+#define ROUTER_TABLE_SIZE 256 // power of two, at least 2x the number of distinct keys
+#define ROUTER_SEGMENT_ID ((unsigned short)0xffff)
+
+typedef enum {
+  METHOD_GET = 0,
+  METHOD_POST,
+  METHOD_PUT,
+  METHOD_DELETE,
+  METHOD_HEAD,
+  METHOD_OPTIONS,
+  METHOD_PATCH,
+  METHOD_UNKNOWN
+} router_method;
+
+typedef struct {
+  const char *text;
+  unsigned short length; // ROUTER_SEGMENT_ID for ":id"
+} router_segment;
+
+typedef struct router_route {
+  router_method method;
+  int segment_count;
+  int id_segment; // index of ":id", -1 if none
+  router_segment segments[ROUTER_MAX_SEGMENTS];
+  char pattern[128]; // segments point into this copy
+  router_callback callback;
+  void *user_data;
+  struct router_route *next; // next route with the same key
+} router_route;
+
+// One slot per distinct (method, segment 0, segment 1) key
+typedef struct {
+  const router_route *first;
+} router_slot;
+
+static router_route routes[ROUTER_MAX_ROUTES];
+static int route_count = 0;
+static router_slot table[ROUTER_TABLE_SIZE];
+static uint32_t table_seed = 0;
+static router_callback fallback_callback = NULL;
+static void *fallback_user_data = NULL;
+
+// Match state of the request running on this thread (one thread per connection)
+typedef struct {
+  const struct _u_request *request;
+  int id;
+  int has_path_id;
+} router_current;
+static __thread router_current current;
+
+static router_method parse_method(const char *method) {
+  switch (method[0]) {
+    case 'G':
+      return strcmp(method, "GET") == 0 ? METHOD_GET : METHOD_UNKNOWN;
+    case 'P':
+      if (strcmp(method, "POST") == 0) return METHOD_POST;
+      if (strcmp(method, "PUT") == 0) return METHOD_PUT;
+      return strcmp(method, "PATCH") == 0 ? METHOD_PATCH : METHOD_UNKNOWN;
+    case 'D':
+      return strcmp(method, "DELETE") == 0 ? METHOD_DELETE : METHOD_UNKNOWN;
+    case 'H':
+      return strcmp(method, "HEAD") == 0 ? METHOD_HEAD : METHOD_UNKNOWN;
+    case 'O':
+      return strcmp(method, "OPTIONS") == 0 ? METHOD_OPTIONS : METHOD_UNKNOWN;
+    default:
+      return METHOD_UNKNOWN;
+  }
+}
+
+// Splits path into segments without copying; empty segments (double or
+// trailing slashes) are skipped. Stops at '?'. Returns -1 if there are too many.
+static int split_path(const char *path, router_segment *segments) {
+  int count = 0;
+  const char *p = path;
+  while (*p && *p != '?') {
+    while (*p == '/') p++;
+    if (!*p || *p == '?') break;
+    const char *start = p;
+    while (*p && *p != '/' && *p != '?') p++;
+    if (count == ROUTER_MAX_SEGMENTS) {
+      return -1;
+    }
+    segments[count].text = start;
+    segments[count].length = (unsigned short)(p - start);
+    count++;
+  }
+  return count;
+}
+
+static uint32_t hash_bytes(uint32_t hash, const char *data, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (unsigned char)data[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// FNV-1a over the key, salted with the seed picked by router_install
+static uint32_t key_slot(uint32_t seed, router_method method, const router_segment *segments, int count) {
+  uint32_t hash = 2166136261u ^ seed;
+  hash = (hash ^ (uint32_t)method) * 16777619u;
+  for (int i = 0; i < 2; i++) {
+    const size_t length = i < count ? segments[i].length : 0;
+    hash = hash_bytes(hash, i < count ? segments[i].text : "", length);
+    hash = (hash ^ '/') * 16777619u;
+  }
+  return hash & (ROUTER_TABLE_SIZE - 1);
+}
+
+static int same_key(const router_route *a, const router_route *b) {
+  if (a->method != b->method) return 0;
+  for (int i = 0; i < 2; i++) {
+    const int a_has = i < a->segment_count, b_has = i < b->segment_count;
+    if (a_has != b_has) return 0;
+    if (a_has && (a->segments[i].length != b->segments[i].length ||
+                  memcmp(a->segments[i].text, b->segments[i].text, a->segments[i].length) != 0)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int router_add(const char *http_method, const char *url, router_callback callback, void *user_data) {
+  if (route_count >= ROUTER_MAX_ROUTES || strlen(url) >= sizeof(routes[0].pattern)) {
+    fprintf(stderr, "Cannot add route %s %s\n", http_method, url);
+    return U_ERROR;
+  }
+  router_route *route = &routes[route_count];
+  route->method = parse_method(http_method);
+  strcpy(route->pattern, url);
+  route->segment_count = split_path(route->pattern, route->segments);
+  route->id_segment = -1;
+  if (route->method == METHOD_UNKNOWN || route->segment_count < 0) {
+    fprintf(stderr, "Cannot add route %s %s\n", http_method, url);
+    return U_ERROR;
+  }
+  for (int i = 0; i < route->segment_count; i++) {
+    if (route->segments[i].length == 3 && memcmp(route->segments[i].text, ":id", 3) == 0) {
+      // The key segments must be literals so a request can be hashed before matching
+      if (i < 2 || route->id_segment >= 0) {
+        fprintf(stderr, "Route %s %s: \":id\" must appear once, after the first two segments\n", http_method, url);
+        return U_ERROR;
+      }
+      route->segments[i].length = ROUTER_SEGMENT_ID;
+      route->id_segment = i;
+    }
+  }
+  route->callback = callback;
+  route->user_data = user_data;
+  route->next = NULL;
+  route_count++;
+  return U_OK;
+}
+
+// Places every key with the given seed; fails on the first slot collision
+static int try_seed(uint32_t seed) {
+  memset(table, 0, sizeof(table));
+  for (int i = 0; i < route_count; i++) {
+    routes[i].next = NULL;
+  }
+  for (int i = 0; i < route_count; i++) {
+    router_route *route = &routes[i];
+    router_slot *slot = &table[key_slot(seed, route->method, route->segments, route->segment_count)];
+    if (slot->first == NULL) {
+      slot->first = route;
+      continue;
+    }
+    if (!same_key(slot->first, route)) {
+      return 0;
+    }
+    // Same key: append so registration order decides between overlapping patterns
+    router_route *last = (router_route *)slot->first;
+    while (last->next) last = last->next;
+    last->next = route;
+  }
+  return 1;
+}
+
+// Parses a path segment as a non-negative id; 0 if it is not a number (like atoi)
+static int parse_id(const char *text, unsigned short length) {
+  int id = 0;
+  for (unsigned short i = 0; i < length; i++) {
+    const unsigned digit = (unsigned)(text[i] - '0');
+    if (digit > 9 || id > (INT32_MAX - 9) / 10) {
+      return 0;
+    }
+    id = id * 10 + (int)digit;
+  }
+  return id;
+}
+
+router_callback router_match(const char *http_method, const char *path, void **user_data, int *id) {
+  const router_method method = parse_method(http_method);
+  router_segment segments[ROUTER_MAX_SEGMENTS];
+  const int count = path ? split_path(path, segments) : -1;
+  if (method == METHOD_UNKNOWN || count < 0) {
+    return NULL;
+  }
+
+  const router_slot *slot = &table[key_slot(table_seed, method, segments, count)];
+  for (const router_route *route = slot->first; route; route = route->next) {
+    if (route->segment_count != count || route->method != method) {
+      continue;
+    }
+    int matched = 1;
+    for (int i = 0; i < count && matched; i++) {
+      const router_segment *expected = &route->segments[i];
+      matched = expected->length == ROUTER_SEGMENT_ID ||
+                (expected->length == segments[i].length &&
+                 memcmp(expected->text, segments[i].text, expected->length) == 0);
+    }
+    if (matched) {
+      *user_data = route->user_data;
+      *id = route->id_segment >= 0
+                ? parse_id(segments[route->id_segment].text, segments[route->id_segment].length)
+                : ROUTER_NO_ID;
+      return route->callback;
+    }
+  }
+  return NULL;
+}
+
+static int callback_router_dispatch(const struct _u_request *request, struct _u_response *response, void *user_data) {
+  memory_request_begin();
+  cors_begin_request(request);
+  trace_request_begin(request, response);
+  // Preflights never reach a route or admission control
+  if (request->http_verb[0] == 'O' && strcmp(request->http_verb, "OPTIONS") == 0) {
+    const int result = callback_cors_preflight(request, response, NULL);
+    trace_request_handled();
+    cors_end_request();
+    memory_request_end(response->binary_body_length);
+    return result;
+  }
+
+  void *route_data = NULL;
+  int id = ROUTER_NO_ID;
+  const router_callback callback = router_match(request->http_verb, request->url_path, &route_data, &id);
+  int result;
+  if (callback == NULL) {
+    result = fallback_callback(request, response, fallback_user_data);
+  } else {
+    current.request = request;
+    current.id = id;
+    current.has_path_id = id != ROUTER_NO_ID;
+    result = callback(request, response, route_data);
+    current.request = NULL;
+  }
+  trace_request_handled();
+  if (memory_request_end(response->binary_body_length)) {
+    // Some JSON allocation was refused, so the body may be missing parts
+    set_json_error_response(response, 503, "Request exceeded its memory limit");
+    set_cors_headers(response);
+  }
+  cors_end_request();
+  return result;
+}
+
+int router_request_id(const struct _u_request *request) {
+  if (current.request == request && current.has_path_id) {
+    return current.id;
+  }
+  const char *id_str = u_map_get(request->map_url, "id");
+  return id_str ? parse_id(id_str, (unsigned short)strlen(id_str)) : ROUTER_NO_ID;
+}
+
+int router_request_ids(const struct _u_request *request, int *ids, const int max) {
+  const char *list = u_map_get(request->map_url, "ids");
+  if (list == NULL) {
+    return 0;
+  }
+  int count = 0;
+  for (const char *p = list;; p++) {
+    const size_t length = strcspn(p, ",");
+    const int id = length > 0 && length <= 10 ? parse_id(p, (unsigned short)length) : 0;
+    if (id <= 0) {
+      return -1;
+    }
+    int seen = 0;
+    for (int i = 0; i < count && !seen; i++) {
+      seen = ids[i] == id;
+    }
+    if (!seen) {
+      if (count == max) {
+        return -1;
+      }
+      ids[count++] = id;
+    }
+    p += length;
+    if (*p == '\0') {
+      return count;
+    }
+  }
+}
+
+int router_install(struct _u_instance *instance, router_callback fallback, void *fallback_data) {
+  // Search for a seed under which every distinct key gets its own slot
+  uint32_t seed = 0;
+  while (!try_seed(seed)) {
+    if (++seed == 1u << 16) {
+      fprintf(stderr, "Router: no collision-free seed for %d routes\n", route_count);
+      return U_ERROR;
+    }
+  }
+  table_seed = seed;
+  fallback_callback = fallback;
+  fallback_user_data = fallback_data;
+  printf("Router compiled %d routes (seed %u)\n", route_count, (unsigned)seed);
+  return ulfius_set_default_endpoint(instance, &callback_router_dispatch, NULL);
+}
@@ -0,0 +1,42 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <ulfius.h>
+
+// Route dispatch compiled at startup. Patterns are split into segments once,
+// then indexed by a perfect hash on (method, first two path segments), e.g.
+// (GET, "api", "patients"). A request is matched by splitting its path in
+// place, one table probe, and comparing the remaining segments; ":id"
+// segments are parsed to integers while matching. Ulfius only sees a single
+// default endpoint, so its own per-request pattern walk is skipped. OPTIONS
+// requests are answered by the CORS preflight handler (cors.h) before matching.
+
+#define ROUTER_NO_ID (-1)
+
+typedef int (*router_callback)(const struct _u_request *request, struct _u_response *response, void *user_data);
+
+// Registers a route. url is a pattern such as "/api/patients/:id/summary";
+// ":id" is the only parameter and must be an integer. Call before router_install.
+int router_add(const char *http_method, const char *url, router_callback callback, void *user_data);
+
+// Builds the dispatch table and makes it the instance's default endpoint.
+// Requests that match no route go to fallback (the static file handler).
+int router_install(struct _u_instance *instance, router_callback fallback, void *fallback_data);
+
+// Id of the request being handled: the ":id" path segment when the route has
+// one, otherwise the "id" query parameter. ROUTER_NO_ID if absent; 0 if not a
+// number (the same as atoi, which the handlers used before).
+int router_request_id(const struct _u_request *request);
+
+// Ids of a multi-id lookup, the "ids" query parameter ("ids=1,2,3"), into
+// ids. Repeated ids are kept once. Returns how many were stored, 0 if the
+// parameter is absent, -1 if it is not a list of positive integers or holds
+// more than max.
+#define ROUTER_MAX_IDS 100
+int router_request_ids(const struct _u_request *request, int *ids, const int max);
+
+// Matching without a ulfius request (used by bench/router_bench.c).
+// Returns the route's callback or NULL; stores user_data and the path id.
+router_callback router_match(const char *http_method, const char *path, void **user_data, int *id);
+
+#endif // ROUTER_H
@@ -2,4 +2,4 @@ mkdir build
 cd build
 cmake ..
 make
-./server
+HEALTH_STATIC_DIR=../../client/static ./server
@@ -0,0 +1,276 @@
+#include "slow_queries.h"
+
+#include "config.h"
+#include "cors.h"
+#include "database.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SLOW_MAX_STATEMENTS 256 // distinct SQL texts tracked; the rest count as "(other)"
+#define SLOW_HISTOGRAM_BUCKETS 32 // bucket i holds durations in [2^i, 2^(i+1)) microseconds
+
+typedef struct {
+  char *sql; // NULL for an empty slot
+  uint64_t hash;
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t histogram[SLOW_HISTOGRAM_BUCKETS];
+} statement_stats;
+
+typedef struct {
+  time_t at;
+  uint64_t elapsed_ns;
+  int shard;
+  char *sql;  // bound SQL (sqlite3_expanded_sql)
+  char *plan; // EXPLAIN QUERY PLAN, filled in on first read
+} slow_entry;
+
+static statement_stats statements[SLOW_MAX_STATEMENTS];
+static statement_stats other = {.sql = "(other)"};
+static slow_entry *slow_log = NULL;
+static int slow_log_capacity = 0;
+static uint64_t slow_log_next = 0;
+static int64_t threshold_ns = 0;
+static int enabled = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+int slow_queries_init(void) {
+  const int threshold_ms = config_get_int("HEALTH_SLOW_QUERY_MS", 50);
+  slow_log_capacity = config_get_int("HEALTH_SLOW_QUERY_LOG", 128);
+  if (threshold_ms < 0) {
+    return 0;
+  }
+  if (slow_log_capacity < 1) {
+    slow_log_capacity = 1;
+  }
+  slow_log = calloc((size_t)slow_log_capacity, sizeof(slow_entry));
+  if (slow_log == NULL) {
+    return 1;
+  }
+  threshold_ns = (int64_t)threshold_ms * 1000000;
+  enabled = 1;
+  return 0;
+}
+
+void slow_queries_close(void) {
+  pthread_mutex_lock(&lock);
+  enabled = 0;
+  for (int i = 0; i < SLOW_MAX_STATEMENTS; i++) {
+    free(statements[i].sql);
+  }
+  memset(statements, 0, sizeof(statements));
+  for (int i = 0; i < slow_log_capacity && slow_log; i++) {
+    sqlite3_free(slow_log[i].sql);
+    free(slow_log[i].plan);
+  }
+  free(slow_log);
+  slow_log = NULL;
+  pthread_mutex_unlock(&lock);
+}
+
+int slow_queries_enabled(void) {
+  return enabled;
+}
+
+// Open addressing on the SQL hash; caller holds lock
+static statement_stats *find_statement(const char *sql) {
+  const uint64_t hash = hash_bytes(sql, strlen(sql));
+  for (int probe = 0; probe < SLOW_MAX_STATEMENTS; probe++) {
+    statement_stats *entry = &statements[(hash + (uint64_t)probe) % SLOW_MAX_STATEMENTS];
+    if (entry->sql == NULL) {
+      entry->sql = strdup(sql);
+      entry->hash = hash;
+      return entry->sql ? entry : &other;
+    }
+    if (entry->hash == hash && strcmp(entry->sql, sql) == 0) {
+      return entry;
+    }
+  }
+  return &other;
+}
+
+static int histogram_bucket(uint64_t elapsed_ns) {
+  uint64_t micros = elapsed_ns / 1000;
+  int bucket = 0;
+  while (micros > 1 && bucket < SLOW_HISTOGRAM_BUCKETS - 1) {
+    micros >>= 1;
+    bucket++;
+  }
+  return bucket;
+}
+
+void slow_queries_on_statement(int shard, sqlite3_stmt *stmt, uint64_t elapsed_ns) {
+  const char *sql = sqlite3_sql(stmt);
+  if (!enabled || sql == NULL || strncmp(sql, "EXPLAIN", 7) == 0) {
+    return; // our own EXPLAIN QUERY PLAN runs also pass through the hook
+  }
+  // Expand outside the lock; it allocates and formats every bound value
+  char *expanded = (int64_t)elapsed_ns >= threshold_ns ? sqlite3_expanded_sql(stmt) : NULL;
+
+  pthread_mutex_lock(&lock);
+  if (!enabled) {
+    pthread_mutex_unlock(&lock);
+    sqlite3_free(expanded);
+    return;
+  }
+  statement_stats *entry = find_statement(sql);
+  entry->count++;
+  entry->total_ns += elapsed_ns;
+  if (elapsed_ns > entry->max_ns) {
+    entry->max_ns = elapsed_ns;
+  }
+  entry->histogram[histogram_bucket(elapsed_ns)]++;
+
+  if (expanded) {
+    slow_entry *slow = &slow_log[slow_log_next++ % (uint64_t)slow_log_capacity];
+    sqlite3_free(slow->sql);
+    free(slow->plan);
+    slow->at = time(NULL);
+    slow->elapsed_ns = elapsed_ns;
+    slow->shard = shard;
+    slow->sql = expanded;
+    slow->plan = NULL;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+size_t slow_queries_memory_bytes(void) {
+  pthread_mutex_lock(&lock);
+  size_t bytes = sizeof(statements) + (size_t)slow_log_capacity * sizeof(slow_entry);
+  for (int i = 0; i < SLOW_MAX_STATEMENTS; i++) {
+    bytes += statements[i].sql ? strlen(statements[i].sql) + 1 : 0;
+  }
+  for (int i = 0; i < slow_log_capacity && slow_log; i++) {
+    bytes += slow_log[i].sql ? strlen(slow_log[i].sql) + 1 : 0;
+    bytes += slow_log[i].plan ? strlen(slow_log[i].plan) + 1 : 0;
+  }
+  pthread_mutex_unlock(&lock);
+  return bytes;
+}
+
+// Upper bound of the histogram bucket holding the 99th percentile, in ms
+static double p99_ms(const statement_stats *entry) {
+  const uint64_t target = entry->count - entry->count / 100;
+  uint64_t seen = 0;
+  for (int i = 0; i < SLOW_HISTOGRAM_BUCKETS; i++) {
+    seen += entry->histogram[i];
+    if (seen >= target) {
+      const double upper_ms = (double)(2ull << i) / 1000.0;
+      const double max_ms = (double)entry->max_ns / 1e6;
+      return upper_ms < max_ms ? upper_ms : max_ms;
+    }
+  }
+  return (double)entry->max_ns / 1e6;
+}
+
+typedef struct {
+  const statement_stats *entry;
+  double key;
+} ranked_statement;
+
+static int compare_ranked(const void *a, const void *b) {
+  const double ka = ((const ranked_statement *)a)->key, kb = ((const ranked_statement *)b)->key;
+  return ka < kb ? 1 : ka > kb ? -1 : 0;
+}
+
+// Fills in missing plans. Plans are computed without the lock held (they run
+// SQL), then stored if the slot still holds the same statement.
+static void capture_plans(void) {
+  for (int i = 0; i < slow_log_capacity; i++) {
+    pthread_mutex_lock(&lock);
+    slow_entry *slow = &slow_log[i];
+    char *sql = slow->sql && slow->plan == NULL ? strdup(slow->sql) : NULL;
+    const int shard = slow->shard;
+    pthread_mutex_unlock(&lock);
+    if (sql == NULL) {
+      continue;
+    }
+
+    char *plan = NULL;
+    if (explain_query_plan(shard, sql, &plan) != 0) {
+      plan = strdup("(plan unavailable)");
+    }
+    pthread_mutex_lock(&lock);
+    if (slow->sql && slow->plan == NULL && strcmp(slow->sql, sql) == 0) {
+      slow->plan = plan;
+      plan = NULL;
+    }
+    pthread_mutex_unlock(&lock);
+    free(plan);
+    free(sql);
+  }
+}
+
+int callback_slow_queries(const struct _u_request *request, struct _u_response *response, void *user_data) {
+  const char *sort = u_map_get(request->map_url, "sort");
+  const int by_p99 = sort && strcmp(sort, "p99") == 0;
+  const char *limit_str = u_map_get(request->map_url, "limit");
+  int limit = limit_str ? atoi(limit_str) : 20;
+  if (limit <= 0 || limit > SLOW_MAX_STATEMENTS + 1) {
+    limit = 20;
+  }
+
+  if (enabled) {
+    capture_plans();
+  }
+
+  json_t *json_result = json_object();
+  json_object_set_new(json_result, "threshold_ms", json_integer(threshold_ns / 1000000));
+  json_object_set_new(json_result, "sort", json_string(by_p99 ? "p99" : "total"));
+
+  pthread_mutex_lock(&lock);
+  ranked_statement ranked[SLOW_MAX_STATEMENTS + 1];
+  int ranked_count = 0;
+  for (int i = 0; i <= SLOW_MAX_STATEMENTS; i++) {
+    const statement_stats *entry = i < SLOW_MAX_STATEMENTS ? &statements[i] : &other;
+    if (entry->sql && entry->count > 0) {
+      ranked[ranked_count].entry = entry;
+      ranked[ranked_count].key = by_p99 ? p99_ms(entry) : (double)entry->total_ns;
+      ranked_count++;
+    }
+  }
+  qsort(ranked, (size_t)ranked_count, sizeof(ranked[0]), compare_ranked);
+
+  json_t *json_statements = json_array();
+  for (int i = 0; i < ranked_count && i < limit; i++) {
+    const statement_stats *entry = ranked[i].entry;
+    json_t *json_statement = json_object();
+    json_object_set_new(json_statement, "sql", json_string(entry->sql));
+    json_object_set_new(json_statement, "count", json_integer((json_int_t)entry->count));
+    json_object_set_new(json_statement, "total_ms", json_real((double)entry->total_ns / 1e6));
+    json_object_set_new(json_statement, "mean_ms", json_real((double)entry->total_ns / 1e6 / (double)entry->count));
+    json_object_set_new(json_statement, "p99_ms", json_real(p99_ms(entry)));
+    json_object_set_new(json_statement, "max_ms", json_real((double)entry->max_ns / 1e6));
+    json_array_append_new(json_statements, json_statement);
+  }
+  json_object_set_new(json_result, "statements", json_statements);
+
+  // Slow log, newest first
+  json_t *json_slow = json_array();
+  for (int i = 0; i < slow_log_capacity && slow_log; i++) {
+    const slow_entry *slow = &slow_log[(slow_log_next - 1 - (uint64_t)i) % (uint64_t)slow_log_capacity];
+    if ((uint64_t)i >= slow_log_next || slow->sql == NULL) {
+      break;
+    }
+    json_t *json_entry = json_object();
+    json_object_set_new(json_entry, "at", json_integer((json_int_t)slow->at));
+    json_object_set_new(json_entry, "ms", json_real((double)slow->elapsed_ns / 1e6));
+    json_object_set_new(json_entry, "shard", json_integer(slow->shard));
+    json_object_set_new(json_entry, "sql", json_string(slow->sql));
+    json_object_set_new(json_entry, "plan", slow->plan ? json_string(slow->plan) : json_null());
+    json_array_append_new(json_slow, json_entry);
+  }
+  pthread_mutex_unlock(&lock);
+  json_object_set_new(json_result, "slow_log", json_slow);
+
+  ulfius_set_json_body_response(response, 200, json_result);
+  json_decref(json_result);
+  set_cors_headers(response);
+  return U_CALLBACK_CONTINUE;
+}
@@ -0,0 +1,31 @@
+#ifndef SLOW_QUERIES_H
+#define SLOW_QUERIES_H
+
+#include <sqlite3.h>
+#include <stdint.h>
+#include <ulfius.h>
+
+// Per-statement timings from the SQLite profile hook in database.c.
+// Statements are aggregated by their SQL text (count, total, max and a
+// latency histogram for p99). Executions slower than HEALTH_SLOW_QUERY_MS
+// are also kept in a rotating log with their bound SQL; their EXPLAIN QUERY
+// PLAN is captured the first time the log is read.
+
+// Reads HEALTH_SLOW_QUERY_* and allocates the log
+int slow_queries_init(void);
+void slow_queries_close(void);
+
+// 1 unless disabled with HEALTH_SLOW_QUERY_MS < 0
+int slow_queries_enabled(void);
+
+// Profile hook entry point: stmt has just finished on the given shard
+void slow_queries_on_statement(int shard, sqlite3_stmt *stmt, uint64_t elapsed_ns);
+
+// Bytes held by the statement table and the slow log (memory.h)
+size_t slow_queries_memory_bytes(void);
+
+// Handles GET /admin/slow-queries: top statements by total or p99 time
+// (sort=total|p99, limit=N) and the slow log with query plans
+int callback_slow_queries(const struct _u_request *request, struct _u_response *response, void *user_data);
+
+#endif // SLOW_QUERIES_H
@@ -0,0 +1,90 @@
+#include "startup.h"
+
+#include "cors.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#define STARTUP_MAX_PHASES 8
+
+typedef struct {
+  const char *name;
+  double seconds;
+} startup_phase_time;
+
+static startup_phase_time phases[STARTUP_MAX_PHASES];
+static int phase_count = 0;
+static double boot_started_at = 0;
+static double phase_started_at = 0;
+static double listening_at = 0;
+static int first_request_claimed = 0;
+static int first_request_recorded = 0;
+static double first_request_after_listen = 0; // listener open -> first response, seconds
+static double first_request_handler = 0;
+
+static double monotonic_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+void startup_begin(void) {
+  boot_started_at = phase_started_at = monotonic_seconds();
+  phase_count = 0;
+}
+
+void startup_phase(const char *name) {
+  const double now = monotonic_seconds();
+  if (phase_count < STARTUP_MAX_PHASES) {
+    phases[phase_count].name = name;
+    phases[phase_count].seconds = now - phase_started_at;
+    phase_count++;
+  }
+  phase_started_at = now;
+}
+
+void startup_listening(void) {
+  listening_at = monotonic_seconds();
+  printf("Boot completed in %.1f ms (", (listening_at - boot_started_at) * 1000.0);
+  for (int i = 0; i < phase_count; i++) {
+    printf("%s%s %.1f ms", i > 0 ? ", " : "", phases[i].name, phases[i].seconds * 1000.0);
+  }
+  printf(")\n");
+}
+
+void startup_request_served(double handler_seconds) {
+  // Requests run on many threads; the flag makes sure only one records
+  if (listening_at == 0 || __atomic_load_n(&first_request_claimed, __ATOMIC_RELAXED) ||
+      __atomic_exchange_n(&first_request_claimed, 1, __ATOMIC_ACQ_REL)) {
+    return;
+  }
+  first_request_after_listen = monotonic_seconds() - listening_at;
+  first_request_handler = handler_seconds;
+  __atomic_store_n(&first_request_recorded, 1, __ATOMIC_RELEASE);
+  printf("First request served %.1f ms after the listener opened (handler %.2f ms)\n",
+         first_request_after_listen * 1000.0, first_request_handler * 1000.0);
+}
+
+int callback_startup_stats(const struct _u_request *request, struct _u_response *response, void *user_data) {
+  json_t *json_stats = json_object();
+  json_t *json_phases = json_array();
+  for (int i = 0; i < phase_count; i++) {
+    json_t *json_phase = json_object();
+    json_object_set_new(json_phase, "name", json_string(phases[i].name));
+    json_object_set_new(json_phase, "ms", json_real(phases[i].seconds * 1000.0));
+    json_array_append_new(json_phases, json_phase);
+  }
+  json_object_set_new(json_stats, "boot_ms", json_real((listening_at - boot_started_at) * 1000.0));
+  json_object_set_new(json_stats, "phases", json_phases);
+  if (__atomic_load_n(&first_request_recorded, __ATOMIC_ACQUIRE)) {
+    json_object_set_new(json_stats, "first_request_ms", json_real(first_request_after_listen * 1000.0));
+    json_object_set_new(json_stats, "first_request_handler_ms", json_real(first_request_handler * 1000.0));
+  } else {
+    json_object_set_new(json_stats, "first_request_ms", json_null());
+    json_object_set_new(json_stats, "first_request_handler_ms", json_null());
+  }
+  ulfius_set_json_body_response(response, 200, json_stats);
+  json_decref(json_stats);
+  set_cors_headers(response);
+  return U_CALLBACK_CONTINUE;
+}
@@ -0,0 +1,26 @@
+#ifndef STARTUP_H
+#define STARTUP_H
+
+#include <ulfius.h>
+
+// Boot timing. Records how long each startup phase (database open and
+// migrations, warm-up, ...) took until the listener opened, and how long the
+// first request after that took, so deploys can see cold-start cost.
+
+// Starts the boot clock
+void startup_begin(void);
+
+// Ends the current phase under the given name and starts the next one
+void startup_phase(const char *name);
+
+// Marks the listener as open and logs the boot breakdown
+void startup_listening(void);
+
+// Called after every admitted request with its handler time; only the first
+// one after the listener opened is recorded
+void startup_request_served(double handler_seconds);
+
+// Handles GET /admin/startup: boot phases and first-request latency
+int callback_startup_stats(const struct _u_request *request, struct _u_response *response, void *user_data);
+
+#endif // STARTUP_H
@@ -0,0 +1,290 @@
+#include "static_files.h"
+
+#include "config.h"
+#include "json_response.h"
+#include "util.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define STATIC_MAX_FILES 256
+#define STATIC_MAX_DEPTH 4
+#define STATIC_MIN_COMPRESS_SIZE 256
+#define STATIC_PATH_MAX 1024
+
+typedef struct {
+  char *data;
+  size_t size;
+  int mapped; // 1 if data is an mmap'd file, 0 if malloc'd
+} static_body;
+
+typedef struct {
+  char path[256];          // URL path, e.g. "/index.html"
+  const char *content_type;
+  char etag[24];
+  const char *cache_control;
+  static_body identity;
+  static_body gzip;
+  static_body brotli;
+} static_file;
+
+static static_file files[STATIC_MAX_FILES];
+static int file_count = 0;
+
+static const struct {
+  const char *extension;
+  const char *content_type;
+  int compressible;
+} content_types[] = {
+  { ".html", "text/html; charset=utf-8", 1 },
+  { ".css", "text/css; charset=utf-8", 1 },
+  { ".js", "application/javascript; charset=utf-8", 1 },
+  { ".json", "application/json", 1 },
+  { ".svg", "image/svg+xml", 1 },
+  { ".txt", "text/plain; charset=utf-8", 1 },
+  { ".png", "image/png", 0 },
+  { ".jpg", "image/jpeg", 0 },
+  { ".ico", "image/x-icon", 0 },
+  { ".woff2", "font/woff2", 0 },
+};
+
+static int lookup_content_type(const char *path, const char **content_type) {
+  const char *extension = strrchr(path, '.');
+  for (size_t i = 0; extension && i < sizeof(content_types) / sizeof(content_types[0]); i++) {
+    if (strcmp(extension, content_types[i].extension) == 0) {
+      *content_type = content_types[i].content_type;
+      return content_types[i].compressible;
+    }
+  }
+  *content_type = "application/octet-stream";
+  return 0;
+}
+
+static int map_file(const char *fs_path, static_body *body) {
+  const int fd = open(fs_path, O_RDONLY);
+  if (fd < 0) {
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return 1;
+  }
+  void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return 1;
+  }
+  body->data = data;
+  body->size = (size_t)st.st_size;
+  body->mapped = 1;
+  return 0;
+}
+
+static void free_body(static_body *body) {
+  if (body->data) {
+    if (body->mapped) {
+      munmap(body->data, body->size);
+    } else {
+      free(body->data);
+    }
+  }
+  memset(body, 0, sizeof(static_body));
+}
+
+// gzip-compresses the identity body; keeps the result only if it is smaller
+static void build_gzip_variant(static_file *file) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+    return;
+  }
+
+  const uLong bound = deflateBound(&stream, (uLong)file->identity.size);
+  char *out = malloc(bound);
+  if (out) {
+    stream.next_in = (Bytef *)file->identity.data;
+    stream.avail_in = (uInt)file->identity.size;
+    stream.next_out = (Bytef *)out;
+    stream.avail_out = (uInt)bound;
+    if (deflate(&stream, Z_FINISH) == Z_STREAM_END && stream.total_out < file->identity.size) {
+      file->gzip.data = out;
+      file->gzip.size = stream.total_out;
+      file->gzip.mapped = 0;
+      out = NULL;
+    }
+    free(out);
+  }
+  deflateEnd(&stream);
+}
+
+static void add_file(const char *fs_path, const char *url_path) {
+  const size_t len = strlen(url_path);
+  if (file_count >= STATIC_MAX_FILES || len >= sizeof(files[0].path)) {
+    fprintf(stderr, "Static file table full, skipping %s\n", fs_path);
+    return;
+  }
+  // Precompressed variants are attached to their source file, not served directly
+  if ((len > 3 && strcmp(url_path + len - 3, ".gz") == 0) || (len > 3 && strcmp(url_path + len - 3, ".br") == 0)) {
+    return;
+  }
+
+  static_file *file = &files[file_count];
+  memset(file, 0, sizeof(static_file));
+  if (map_file(fs_path, &file->identity) != 0) {
+    return;
+  }
+  strcpy(file->path, url_path);
+  const int compressible = lookup_content_type(url_path, &file->content_type);
+  // HTML is revalidated on every load so deploys show up at once; assets are cached
+  file->cache_control = strstr(file->content_type, "text/html") ? "no-cache" : "public, max-age=3600";
+
+  const uint64_t hash = hash_bytes(file->identity.data, file->identity.size);
+  snprintf(file->etag, sizeof(file->etag), "\"%016llx\"", (unsigned long long)hash);
+
+  char variant_path[STATIC_PATH_MAX + 3]; // fs_path plus ".br"/".gz"
+  snprintf(variant_path, sizeof(variant_path), "%s.br", fs_path);
+  map_file(variant_path, &file->brotli);
+  snprintf(variant_path, sizeof(variant_path), "%s.gz", fs_path);
+  if (map_file(variant_path, &file->gzip) != 0 && compressible && file->identity.size >= STATIC_MIN_COMPRESS_SIZE) {
+    build_gzip_variant(file);
+  }
+
+  printf("Static file %s: %zu bytes, gzip %zu, br %zu\n", file->path, file->identity.size, file->gzip.size, file->brotli.size);
+  file_count++;
+}
+
+static void scan_directory(const char *fs_dir, const char *url_dir, int depth) {
+  DIR *dir = opendir(fs_dir);
+  if (!dir) {
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.') {
+      continue; // Skips ".", ".." and hidden files
+    }
+    char fs_path[STATIC_PATH_MAX], url_path[512];
+    snprintf(fs_path, sizeof(fs_path), "%s/%s", fs_dir, entry->d_name);
+    snprintf(url_path, sizeof(url_path), "%s/%s", url_dir, entry->d_name);
+
+    struct stat st;
+    if (stat(fs_path, &st) != 0) {
+      continue;
+    }
+    if (S_ISDIR(st.st_mode) && depth < STATIC_MAX_DEPTH) {
+      scan_directory(fs_path, url_path, depth + 1);
+    } else if (S_ISREG(st.st_mode)) {
+      add_file(fs_path, url_path);
+    }
+  }
+  closedir(dir);
+}
+
+static int compare_files(const void *a, const void *b) {
+  return strcmp(((const static_file *)a)->path, ((const static_file *)b)->path);
+}
+
+int static_files_init(void) {
+  const char *static_dir = config_get_str("HEALTH_STATIC_DIR", "static");
+  file_count = 0;
+  scan_directory(static_dir, "", 0);
+  qsort(files, (size_t)file_count, sizeof(static_file), compare_files);
+  if (file_count == 0) {
+    printf("No static files found in '%s', static serving disabled\n", static_dir);
+  }
+  return 0;
+}
+
+void static_files_close(void) {
+  for (int i = 0; i < file_count; i++) {
+    free_body(&files[i].identity);
+    free_body(&files[i].gzip);
+    free_body(&files[i].brotli);
+  }
+  file_count = 0;
+}
+
+size_t static_files_memory_bytes(void) {
+  size_t bytes = 0;
+  for (int i = 0; i < file_count; i++) {
+    bytes += files[i].identity.size + files[i].gzip.size + files[i].brotli.size;
+  }
+  return bytes;
+}
+
+int accepts_encoding(const char *accept_encoding, const char *coding) {
+  const size_t coding_len = strlen(coding);
+  const char *cursor = accept_encoding;
+  while (cursor && *cursor) {
+    while (*cursor == ' ' || *cursor == ',') {
+      cursor++;
+    }
+    const size_t token_len = strcspn(cursor, ",;");
+    if (token_len == coding_len && strncmp(cursor, coding, coding_len) == 0) {
+      const char *quality = strstr(cursor + token_len, "q=");
+      const char *next = strchr(cursor, ',');
+      return !(quality && (!next || quality < next) && strtod(quality + 2, NULL) <= 0);
+    }
+    cursor = strchr(cursor, ',');
+  }
+  return 0;
+}
+
+int callback_static_file(const struct _u_request *request, struct _u_response *response, void *user_data) {
+  // MHD drops the body of HEAD responses itself
+  if (strcmp(request->http_verb, "GET") != 0 && strcmp(request->http_verb, "HEAD") != 0) {
+    set_json_error_response(response, 404, "Not Found");
+    return U_CALLBACK_CONTINUE;
+  }
+
+  static_file key;
+  const char *path = request->url_path ? request->url_path : "/";
+  snprintf(key.path, sizeof(key.path), "%s", strcmp(path, "/") == 0 ? "/index.html" : path);
+  const static_file *file = bsearch(&key, files, (size_t)file_count, sizeof(static_file), compare_files);
+  if (!file) {
+    set_json_error_response(response, 404, "Not Found");
+    return U_CALLBACK_CONTINUE;
+  }
+
+  // Each encoding has its own bytes, so its own strong ETag: "<hash>-br", "<hash>-gz"
+  const char *accept_encoding = u_map_get_case(request->map_header, "Accept-Encoding");
+  const static_body *body = &file->identity;
+  const char *encoding = NULL, *suffix = "";
+  if (file->brotli.data && accepts_encoding(accept_encoding, "br")) {
+    body = &file->brotli;
+    encoding = "br";
+    suffix = "-br";
+  } else if (file->gzip.data && accepts_encoding(accept_encoding, "gzip")) {
+    body = &file->gzip;
+    encoding = "gzip";
+    suffix = "-gz";
+  }
+  char etag[sizeof(file->etag) + 4];
+  snprintf(etag, sizeof(etag), "%.*s%s\"", (int)strlen(file->etag) - 1, file->etag, suffix);
+
+  u_map_put(response->map_header, "ETag", etag);
+  u_map_put(response->map_header, "Cache-Control", file->cache_control);
+  u_map_put(response->map_header, "Vary", "Accept-Encoding");
+
+  const char *if_none_match = u_map_get_case(request->map_header, "If-None-Match");
+  if (if_none_match && (strstr(if_none_match, etag) || strcmp(if_none_match, "*") == 0)) {
+    ulfius_set_empty_body_response(response, 304);
+    return U_CALLBACK_CONTINUE;
+  }
+
+  if (encoding) {
+    u_map_put(response->map_header, "Content-Encoding", encoding);
+  }
+  u_map_put(response->map_header, "Content-Type", file->content_type);
+
+  ulfius_set_binary_body_response(response, 200, body->data, body->size);
+  return U_CALLBACK_CONTINUE;
+}
@@ -0,0 +1,27 @@
+#ifndef STATIC_FILES_H
+#define STATIC_FILES_H
+
+#include <stddef.h>
+#include <ulfius.h>
+
+// Serves the web client from the API listener so UI and API share one origin.
+// Files under HEALTH_STATIC_DIR are mapped into memory at startup together
+// with a gzip variant (or a precompressed .gz/.br file found next to them)
+// and a content-hash ETag.
+
+// Loads the static file table; a missing directory only disables static serving
+int static_files_init(void);
+
+// Unmaps and frees the file table
+void static_files_close(void);
+
+// Bytes of file bodies held in memory, mapped or compressed (memory.h)
+size_t static_files_memory_bytes(void);
+
+// Returns 1 if the Accept-Encoding header lists the coding with a non-zero q value
+int accepts_encoding(const char *accept_encoding, const char *coding);
+
+// Default endpoint: serves GET/HEAD for files in the table, 404 otherwise
+int callback_static_file(const struct _u_request *request, struct _u_response *response, void *user_data);
+
+#endif // STATIC_FILES_H
@@ -0,0 +1,260 @@
+#include "stats.h"
+
+#include "body_format.h"
+#include "cors.h"
+#include "database.h"
+#include "json_response.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static json_t *live = NULL;
+static uint64_t live_version = 0; // bumped by every delta and load
+static pthread_mutex_t live_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Serialized GET /api/stats bodies per format, rebuilt once per live_version
+typedef struct {
+  char *data;
+  size_t size;
+  uint64_t version;
+} cached_body;
+
+static cached_body cached[3];
+static pthread_rwlock_t cached_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static const char *const total_names[] = {"patients", "doctors", "appointments", "medical_records"};
+static const char *const map_names[] = {"doctors_per_specialty", "appointments_per_day", "appointments_per_doctor",
+                                        "records_per_patient"};
+#define STATS_TOTALS (sizeof(total_names) / sizeof(total_names[0]))
+#define STATS_MAPS (sizeof(map_names) / sizeof(map_names[0]))
+
+json_t *stats_new(void) {
+  json_t *stats = json_object();
+  for (size_t i = 0; i < STATS_TOTALS; i++) {
+    json_object_set_new(stats, total_names[i], json_integer(0));
+  }
+  for (size_t i = 0; i < STATS_MAPS; i++) {
+    json_object_set_new(stats, map_names[i], json_object());
+  }
+  return stats;
+}
+
+void stats_load(json_t *stats) {
+  pthread_mutex_lock(&live_lock);
+  json_decref(live);
+  live = stats;
+  live_version++;
+  pthread_mutex_unlock(&live_lock);
+}
+
+uint64_t stats_version(void) {
+  pthread_mutex_lock(&live_lock);
+  const uint64_t version = live_version;
+  pthread_mutex_unlock(&live_lock);
+  return version;
+}
+
+int stats_load_if_unchanged(json_t *stats, uint64_t version) {
+  pthread_mutex_lock(&live_lock);
+  const int unchanged = live_version == version;
+  if (unchanged) {
+    json_decref(live);
+    live = stats;
+    live_version++;
+  }
+  pthread_mutex_unlock(&live_lock);
+  if (!unchanged) {
+    json_decref(stats);
+  }
+  return unchanged ? 0 : 1;
+}
+
+json_t *stats_snapshot(void) {
+  pthread_mutex_lock(&live_lock);
+  json_t *copy = live ? json_deep_copy(live) : stats_new();
+  pthread_mutex_unlock(&live_lock);
+  return copy;
+}
+
+static void add_total(json_t *stats, const char *name, json_int_t delta) {
+  json_t *value = json_object_get(stats, name);
+  json_integer_set(value, json_integer_value(value) + delta);
+}
+
+// Adds delta to map[key]; keys that drop to zero are removed so the maps
+// match what GROUP BY returns
+static void add_keyed(json_t *stats, const char *map_name, const char *key, json_int_t delta) {
+  json_t *map = json_object_get(stats, map_name);
+  json_t *value = json_object_get(map, key);
+  const json_int_t count = json_integer_value(value) + delta;
+  if (count == 0) {
+    json_object_del(map, key);
+  } else if (value) {
+    json_integer_set(value, count);
+  } else {
+    json_object_set_new(map, key, json_integer(count));
+  }
+}
+
+// Returns stats, or the live counters with their lock held (NULL before seeding)
+static json_t *acquire_target(json_t *stats) {
+  if (stats) {
+    return stats;
+  }
+  pthread_mutex_lock(&live_lock);
+  return live;
+}
+
+static void release_target(json_t *stats) {
+  if (!stats) {
+    live_version++;
+    pthread_mutex_unlock(&live_lock);
+  }
+}
+
+void stats_patient(json_t *stats, json_int_t delta) {
+  json_t *target = acquire_target(stats);
+  if (target) {
+    add_total(target, "patients", delta);
+  }
+  release_target(stats);
+}
+
+void stats_doctor(json_t *stats, const char *specialty, json_int_t delta) {
+  json_t *target = acquire_target(stats);
+  if (target) {
+    add_total(target, "doctors", delta);
+    add_keyed(target, "doctors_per_specialty", specialty ? specialty : "", delta);
+  }
+  release_target(stats);
+}
+
+void stats_appointment(json_t *stats, int doctor_id, const char *date, json_int_t delta) {
+  char day[11] = "";
+  if (date) {
+    strncpy(day, date, sizeof(day) - 1); // "YYYY-MM-DD", any time part is dropped
+  }
+  char doctor[16];
+  snprintf(doctor, sizeof(doctor), "%d", doctor_id);
+  json_t *target = acquire_target(stats);
+  if (target) {
+    add_total(target, "appointments", delta);
+    add_keyed(target, "appointments_per_day", day, delta);
+    add_keyed(target, "appointments_per_doctor", doctor, delta);
+  }
+  release_target(stats);
+}
+
+void stats_medical_record(json_t *stats, int patient_id, json_int_t delta) {
+  char patient[16];
+  snprintf(patient, sizeof(patient), "%d", patient_id);
+  json_t *target = acquire_target(stats);
+  if (target) {
+    add_total(target, "medical_records", delta);
+    add_keyed(target, "records_per_patient", patient, delta);
+  }
+  release_target(stats);
+}
+
+static void append_mismatch(json_t *mismatches, const char *counter, const char *key, json_t *expected, json_t *actual) {
+  json_t *mismatch = json_object();
+  json_object_set_new(mismatch, "counter", json_string(counter));
+  if (key) {
+    json_object_set_new(mismatch, "key", json_string(key));
+  }
+  json_object_set_new(mismatch, "expected", json_integer(json_integer_value(expected)));
+  json_object_set_new(mismatch, "actual", json_integer(json_integer_value(actual)));
+  json_array_append_new(mismatches, mismatch);
+}
+
+// Lists every counter where actual differs from expected (missing keys count as 0)
+static json_t *diff_stats(json_t *expected, json_t *actual) {
+  json_t *mismatches = json_array();
+  for (size_t i = 0; i < STATS_TOTALS; i++) {
+    json_t *e = json_object_get(expected, total_names[i]);
+    json_t *a = json_object_get(actual, total_names[i]);
+    if (json_integer_value(e) != json_integer_value(a)) {
+      append_mismatch(mismatches, total_names[i], NULL, e, a);
+    }
+  }
+  for (size_t i = 0; i < STATS_MAPS; i++) {
+    json_t *expected_map = json_object_get(expected, map_names[i]);
+    json_t *actual_map = json_object_get(actual, map_names[i]);
+    const char *key;
+    json_t *value;
+    json_object_foreach(expected_map, key, value) {
+      json_t *a = json_object_get(actual_map, key);
+      if (json_integer_value(value) != json_integer_value(a)) {
+        append_mismatch(mismatches, map_names[i], key, value, a);
+      }
+    }
+    json_object_foreach(actual_map, key, value) {
+      if (!json_object_get(expected_map, key)) {
+        append_mismatch(mismatches, map_names[i], key, NULL, value);
+      }
+    }
+  }
+  return mismatches;
+}
+
+int callback_stats_get(const struct _u_request *request, struct _u_response *response, void *user_data) {
+  const char *verify = u_map_get(request->map_url, "verify");
+
+  if (verify && strcmp(verify, "1") == 0) {
+    // Consistency check: a full recount, so keep it off the dashboard path
+    json_t *expected;
+    if (compute_stats(&expected) != 0) {
+      set_json_error_response(response, 500, "Error computing statistics");
+      set_cors_headers(response);
+      return U_CALLBACK_CONTINUE;
+    }
+    json_t *actual = stats_snapshot();
+    json_t *mismatches = diff_stats(expected, actual);
+    json_t *report = json_object();
+    json_object_set_new(report, "consistent", json_boolean(json_array_size(mismatches) == 0));
+    json_object_set_new(report, "mismatches", mismatches);
+    set_negotiated_body_response(request, response, 200, report);
+    json_decref(report);
+    json_decref(actual);
+    json_decref(expected);
+    set_cors_headers(response);
+    return U_CALLBACK_CONTINUE;
+  }
+
+  // Counters other processes' writes moved are recounted in the background
+  // (maintenance.h); the request only serializes, once per change
+  const body_format format = body_format_from_accept(u_map_get_case(request->map_header, "Accept"));
+  cached_body *body = &cached[format];
+  const uint64_t version = stats_version();
+  pthread_rwlock_rdlock(&cached_lock);
+  if (body->data == NULL || body->version != version) {
+    pthread_rwlock_unlock(&cached_lock);
+    pthread_rwlock_wrlock(&cached_lock);
+    if (body->data == NULL || body->version != version) {
+      char *data;
+      size_t size;
+      pthread_mutex_lock(&live_lock);
+      const uint64_t encoded_version = live_version;
+      const int failed = live ? body_format_encode(format, live, &data, &size) : 1;
+      pthread_mutex_unlock(&live_lock);
+      if (failed) {
+        pthread_rwlock_unlock(&cached_lock);
+        set_json_error_response(response, 500, "Error serializing statistics");
+        set_cors_headers(response);
+        return U_CALLBACK_CONTINUE;
+      }
+      free(body->data);
+      body->data = data;
+      body->size = size;
+      body->version = encoded_version;
+    }
+  }
+  ulfius_set_binary_body_response(response, 200, body->data, body->size);
+  pthread_rwlock_unlock(&cached_lock);
+  u_map_put(response->map_header, "Content-Type", body_format_mime_type(format));
+  u_map_put(response->map_header, "Vary", "Accept");
+  set_cors_headers(response);
+  return U_CALLBACK_CONTINUE;
+}
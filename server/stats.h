@@ -0,0 +1,48 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <jansson.h>
+#include <stdint.h>
+#include <ulfius.h>
+
+// Aggregate counters for dashboards, kept in memory so GET /api/stats never
+// scans the tables. database.c seeds them with GROUP BY queries at startup
+// and applies a delta after every committed create/update/delete; the
+// maintenance thread recounts when another process has written. GET
+// /api/stats serves a body serialized once per counter version.
+//
+// Counters are a jansson object:
+//   patients, doctors, appointments, medical_records        totals
+//   doctors_per_specialty     { specialty: count }
+//   appointments_per_day      { "YYYY-MM-DD": count }
+//   appointments_per_doctor   { doctor_id: count }
+//   records_per_patient       { patient_id: count }
+
+// Returns an empty counter set
+json_t *stats_new(void);
+
+// Replaces the live counters with a freshly computed set (takes the reference)
+void stats_load(json_t *stats);
+
+// Version of the live counters, bumped by every delta and load
+uint64_t stats_version(void);
+
+// Like stats_load, but only if no delta was applied since version was read,
+// so a recount cannot lose or double a write that raced it. Returns 0 if
+// loaded, 1 if the set was dropped (takes the reference either way).
+int stats_load_if_unchanged(json_t *stats, uint64_t version);
+
+// Deep copy of the live counters
+json_t *stats_snapshot(void);
+
+// Apply a delta to stats, or to the live counters when stats is NULL
+void stats_patient(json_t *stats, json_int_t delta);
+void stats_doctor(json_t *stats, const char *specialty, json_int_t delta);
+void stats_appointment(json_t *stats, int doctor_id, const char *date, json_int_t delta);
+void stats_medical_record(json_t *stats, int patient_id, json_int_t delta);
+
+// Handles GET /api/stats. With verify=1 the counters are recomputed with SQL
+// and the response lists every counter that disagrees.
+int callback_stats_get(const struct _u_request *request, struct _u_response *response, void *user_data);
+
+#endif // STATS_H
@@ -0,0 +1,20 @@
+#!/bin/bash
+# Generates a self-signed ECDSA P-256 certificate for local HTTPS runs and
+# benchmarks. Not for production use.
+#
+# Usage: tools/gen_test_cert.sh [dir] [host]
+# Writes dir/server.key and dir/server.crt (default dir: ./tls, host: localhost).
+# Start the server with HEALTH_TLS_CERT=dir/server.crt HEALTH_TLS_KEY=dir/server.key
+# and pass dir/server.crt as the cafile of bench/tls_handshake.
+
+set -e
+
+DIR=${1:-tls}
+HOST=${2:-localhost}
+mkdir -p "$DIR"
+
+openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes \
+  -keyout "$DIR/server.key" -out "$DIR/server.crt" -days 30 \
+  -subj "/CN=$HOST" -addext "subjectAltName=DNS:$HOST,IP:127.0.0.1" 2>/dev/null
+chmod 600 "$DIR/server.key"
+echo "Wrote $DIR/server.key and $DIR/server.crt for $HOST"
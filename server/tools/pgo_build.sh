@@ -0,0 +1,76 @@
+#!/bin/bash
+# Builds a release server with LTO and profile-guided optimization:
+#   1. instrumented build (HEALTH_PGO=GENERATE)
+#   2. training run: bench/crud_workload against a server on a temporary database
+#   3. rebuild in the same directory with the profile (HEALTH_PGO=USE)
+# With --compare, the plain build (no build type) and the Release build
+# without PGO are benchmarked too, and the results written to pgo-report.txt.
+#
+# Usage: tools/pgo_build.sh [--compare] [training_seconds] [benchmark_seconds]
+# Run from server/. The optimized binary is build-pgo/server.
+
+set -e
+
+COMPARE=0
+if [ "$1" = "--compare" ]; then
+  COMPARE=1
+  shift
+fi
+TRAIN_SECONDS=${1:-30}
+BENCH_SECONDS=${2:-20}
+THREADS=${HEALTH_BENCH_THREADS:-8}
+SERVER_DIR=$(pwd)
+PROFILE_DIR="$SERVER_DIR/build-pgo/pgo-profile"
+
+configure_and_build() { # dir, cmake args...
+  local dir=$1
+  shift
+  cmake -S "$SERVER_DIR" -B "$dir" -DBUILD_BENCHMARKS=ON "$@" >/dev/null
+  cmake --build "$dir" -j"$(nproc)" >/dev/null
+}
+
+# Runs the workload against the server binary $1 on a fresh database in a
+# temporary directory; prints the workload's "key value" lines
+run_workload() { # server, seconds
+  local work_dir
+  work_dir=$(mktemp -d)
+  (cd "$work_dir" && HEALTH_DRAIN_MS=1000 HEALTH_TRACE_SAMPLE=0 exec "$1" >"$work_dir/server.log" 2>&1) &
+  local server_pid=$!
+  for _ in $(seq 1 50); do
+    curl -s -o /dev/null http://localhost:8080/api && break
+    sleep 0.1
+  done
+  "$SERVER_DIR/build-pgo/crud_workload" http://localhost:8080 "$2" "$THREADS"
+  # A clean exit is what writes the profile of an instrumented binary
+  kill -TERM "$server_pid" || true
+  wait "$server_pid" || true
+  rm -rf "$work_dir"
+}
+
+echo "== Instrumented build"
+rm -rf "$PROFILE_DIR"
+configure_and_build build-pgo -DCMAKE_BUILD_TYPE=Release -DHEALTH_PGO=GENERATE -DHEALTH_PGO_DIR="$PROFILE_DIR"
+
+echo "== Training (${TRAIN_SECONDS}s)"
+run_workload "$SERVER_DIR/build-pgo/server" "$TRAIN_SECONDS"
+if [ -z "$(find "$PROFILE_DIR" -name '*.gcda' 2>/dev/null)" ]; then
+  echo "No profile written to $PROFILE_DIR" >&2
+  exit 1
+fi
+
+echo "== Optimized build"
+configure_and_build build-pgo -DCMAKE_BUILD_TYPE=Release -DHEALTH_PGO=USE -DHEALTH_PGO_DIR="$PROFILE_DIR"
+echo "Built build-pgo/server"
+
+if [ "$COMPARE" = 1 ]; then
+  configure_and_build build-plain -DCMAKE_BUILD_TYPE= -DHEALTH_PGO=OFF
+  configure_and_build build-release -DCMAKE_BUILD_TYPE=Release -DHEALTH_PGO=OFF
+  {
+    echo "CRUD workload, ${BENCH_SECONDS}s, ${THREADS} threads, $(date -u +%Y-%m-%dT%H:%MZ), $(uname -m)"
+    for build in build-plain build-release build-pgo; do
+      echo
+      echo "[$build]"
+      run_workload "$SERVER_DIR/$build/server" "$BENCH_SECONDS"
+    done
+  } | tee pgo-report.txt
+fi
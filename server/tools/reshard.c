@@ -0,0 +1,164 @@
+// reshard.c
+// Rewrites the database files for a different HEALTH_DB_SHARDS value.
+//
+// Usage: ./reshard <old_shards> <new_shards> <output_dir>
+//
+// Run it in the directory that holds health.db (and health.shardN.db) while
+// the server is stopped. The new files are written to output_dir; move them
+// into place and restart with HEALTH_DB_SHARDS=<new_shards>. Patients are
+// placed by their id bucket, appointments and medical records by their
+// patient's bucket, and ids are preserved.
+
+#include "database.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static void shard_path(char *buf, size_t size, const char *dir, int shard) {
+  char name[64];
+  if (shard == 0) {
+    snprintf(name, sizeof(name), "%s", DB_PATH);
+  } else {
+    snprintf(name, sizeof(name), SHARD_PATH_FORMAT, shard);
+  }
+  snprintf(buf, size, "%s%s%s", dir ? dir : "", dir ? "/" : "", name);
+}
+
+static int exec_sql(sqlite3 *conn, const char *sql) {
+  char *err_msg = NULL;
+  if (sqlite3_exec(conn, sql, NULL, NULL, &err_msg) != SQLITE_OK) {
+    fprintf(stderr, "SQL error: %s\n  in: %s\n", err_msg, sql);
+    sqlite3_free(err_msg);
+    return 1;
+  }
+  return 0;
+}
+
+// Copies the table and index definitions and the schema version of the old shard 0 into conn
+static int copy_schema(sqlite3 *source, sqlite3 *conn) {
+  const char *sql = "SELECT sql FROM sqlite_master WHERE sql IS NOT NULL AND name NOT LIKE 'sqlite_%' "
+                    "ORDER BY type = 'index'";
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(source, sql, -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "Cannot read schema: %s\n", sqlite3_errmsg(source));
+    return 1;
+  }
+  int rc = 0;
+  while (rc == 0 && sqlite3_step(stmt) == SQLITE_ROW) {
+    rc = exec_sql(conn, (const char *)sqlite3_column_text(stmt, 0));
+  }
+  sqlite3_finalize(stmt);
+
+  // Carry the migration version over so the server does not re-run migrations
+  if (rc == 0 && sqlite3_prepare_v2(source, "PRAGMA user_version", -1, &stmt, NULL) == SQLITE_OK) {
+    char version_sql[64];
+    snprintf(version_sql, sizeof(version_sql), "PRAGMA user_version = %d",
+             sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : 0);
+    sqlite3_finalize(stmt);
+    rc = exec_sql(conn, version_sql);
+  }
+  return rc;
+}
+
+static long long count_rows(sqlite3 *conn, const char *table) {
+  char sql[128];
+  snprintf(sql, sizeof(sql), "SELECT COUNT(*) FROM %s", table);
+  sqlite3_stmt *stmt;
+  long long count = -1;
+  if (sqlite3_prepare_v2(conn, sql, -1, &stmt, NULL) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+    count = sqlite3_column_int64(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+  return count;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 4) {
+    fprintf(stderr, "Usage: %s <old_shards> <new_shards> <output_dir>\n", argv[0]);
+    return 1;
+  }
+  const int old_shards = atoi(argv[1]);
+  const int new_shards = atoi(argv[2]);
+  const char *output_dir = argv[3];
+  if (old_shards < 1 || old_shards > SHARD_MAX || new_shards < 1 || new_shards > SHARD_MAX) {
+    fprintf(stderr, "Shard counts must be between 1 and %d\n", SHARD_MAX);
+    return 1;
+  }
+  if (mkdir(output_dir, 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Cannot create %s: %s\n", output_dir, strerror(errno));
+    return 1;
+  }
+
+  char path[512];
+  sqlite3 *schema_source;
+  shard_path(path, sizeof(path), NULL, 0);
+  if (sqlite3_open_v2(path, &schema_source, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+    fprintf(stderr, "Cannot open %s: %s\n", path, sqlite3_errmsg(schema_source));
+    return 1;
+  }
+
+  static const struct {
+    const char *table;
+    const char *key; // column that decides the bucket
+  } partitioned[] = {
+    { "Patients", "id" },
+    { "Appointments", "patient_id" },
+    { "AppointmentsArchive", "patient_id" },
+    { "MedicalRecords", "patient_id" },
+  };
+
+  int failed = 0;
+  for (int target = 0; target < new_shards && !failed; target++) {
+    shard_path(path, sizeof(path), output_dir, target);
+    remove(path);
+    sqlite3 *conn;
+    if (sqlite3_open(path, &conn) != SQLITE_OK) {
+      fprintf(stderr, "Cannot create %s: %s\n", path, sqlite3_errmsg(conn));
+      sqlite3_close(conn);
+      failed = 1;
+      break;
+    }
+    // Before the first table, so the new files support incremental vacuum
+    failed = exec_sql(conn, "PRAGMA auto_vacuum=INCREMENTAL") || copy_schema(schema_source, conn);
+
+    for (int source = 0; source < old_shards && !failed; source++) {
+      char source_path[512], sql[1024];
+      shard_path(source_path, sizeof(source_path), NULL, source);
+      snprintf(sql, sizeof(sql), "ATTACH DATABASE '%s' AS src", source_path);
+      // One transaction per source file; an attached database cannot be detached mid-transaction
+      failed = exec_sql(conn, sql) || exec_sql(conn, "BEGIN");
+
+      for (size_t i = 0; i < sizeof(partitioned) / sizeof(partitioned[0]) && !failed; i++) {
+        snprintf(sql, sizeof(sql),
+                 "INSERT INTO main.%s SELECT * FROM src.%s WHERE ((%s %% %d) + %d) %% %d %% %d = %d",
+                 partitioned[i].table, partitioned[i].table, partitioned[i].key,
+                 SHARD_BUCKETS, SHARD_BUCKETS, SHARD_BUCKETS, new_shards, target);
+        failed = exec_sql(conn, sql);
+      }
+      // Doctors are not partitioned and stay in shard 0
+      if (!failed && target == 0 && source == 0) {
+        failed = exec_sql(conn, "INSERT INTO main.Doctors SELECT * FROM src.Doctors");
+      }
+      if (!failed) {
+        failed = exec_sql(conn, "COMMIT") || exec_sql(conn, "DETACH DATABASE src");
+      }
+    }
+
+    if (!failed) {
+      printf("%s: %lld patients, %lld appointments, %lld medical records\n", path,
+             count_rows(conn, "Patients"), count_rows(conn, "Appointments"), count_rows(conn, "MedicalRecords"));
+    }
+    sqlite3_close(conn);
+  }
+
+  sqlite3_close(schema_source);
+  if (failed) {
+    fprintf(stderr, "Resharding failed; the original files are unchanged\n");
+    return 1;
+  }
+  printf("Resharded %d -> %d shards into %s\n", old_shards, new_shards, output_dir);
+  return 0;
+}
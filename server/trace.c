@@ -0,0 +1,202 @@
+#include "trace.h"
+
+#include "config.h"
+#include "cors.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_REQUEST_ID_SIZE 40
+
+// One span. seq is written last (release) and re-checked by the reader, so
+// a slot being overwritten while it is dumped is skipped, never torn.
+typedef struct {
+  uint64_t seq; // index + 1 of the span stored here, 0 while empty or being written
+  const char *name;
+  uint64_t start_ns;
+  uint64_t duration_ns;
+  uint32_t tid;
+  char request_id[TRACE_REQUEST_ID_SIZE];
+} trace_span;
+
+typedef struct {
+  int active;  // inside a dispatched request
+  int sampled;
+  uint64_t started_ns;
+  uint64_t handled_ns;
+  char request_id[TRACE_REQUEST_ID_SIZE];
+} trace_context;
+
+static trace_span *ring = NULL;
+static uint64_t capacity = 0;
+static uint64_t next_index = 0;
+static int sample_every = 0; // 0 disables sampling
+static uint64_t request_counter = 0;
+static uint32_t next_tid = 0;
+
+static __thread trace_context context;
+static __thread uint32_t thread_id = 0;
+
+static uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+// Small stable ids for the "tid" column, in order of first use
+static uint32_t current_tid(void) {
+  if (thread_id == 0) {
+    thread_id = __atomic_add_fetch(&next_tid, 1, __ATOMIC_RELAXED);
+  }
+  return thread_id;
+}
+
+int trace_init(void) {
+  sample_every = config_get_int("HEALTH_TRACE_SAMPLE", 100);
+  const int size = config_get_int("HEALTH_TRACE_BUFFER", 16384);
+  if (sample_every <= 0 || size <= 0) {
+    sample_every = 0;
+    return 0;
+  }
+  ring = calloc((size_t)size, sizeof(trace_span));
+  if (ring == NULL) {
+    sample_every = 0;
+    return 1;
+  }
+  capacity = (uint64_t)size;
+  printf("Tracing 1 in %d requests into %d spans\n", sample_every, size);
+  return 0;
+}
+
+void trace_close(void) {
+  sample_every = 0;
+  free(ring);
+  ring = NULL;
+  capacity = 0;
+}
+
+size_t trace_memory_bytes(void) {
+  return (size_t)capacity * sizeof(trace_span);
+}
+
+int trace_enabled(void) {
+  return sample_every > 0;
+}
+
+static void record(const char *name, uint64_t start_ns, uint64_t duration_ns) {
+  const uint64_t index = __atomic_fetch_add(&next_index, 1, __ATOMIC_RELAXED);
+  trace_span *span = &ring[index % capacity];
+  __atomic_store_n(&span->seq, 0, __ATOMIC_RELEASE);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  span->name = name;
+  span->start_ns = start_ns;
+  span->duration_ns = duration_ns;
+  span->tid = current_tid();
+  memcpy(span->request_id, context.request_id, TRACE_REQUEST_ID_SIZE);
+  __atomic_store_n(&span->seq, index + 1, __ATOMIC_RELEASE);
+}
+
+// Keeps caller-supplied ids printable and bounded
+static void copy_request_id(char *out, const char *in) {
+  size_t n = 0;
+  for (; in[n] && n < TRACE_REQUEST_ID_SIZE - 1; n++) {
+    const char c = in[n];
+    out[n] = (c > ' ' && c < 127 && c != '"' && c != '\\') ? c : '_';
+  }
+  out[n] = '\0';
+}
+
+void trace_request_begin(const struct _u_request *request, struct _u_response *response) {
+  const uint64_t sequence = __atomic_add_fetch(&request_counter, 1, __ATOMIC_RELAXED);
+  const char *incoming = u_map_get_case(request->map_header, "X-Request-Id");
+  if (incoming && *incoming) {
+    copy_request_id(context.request_id, incoming);
+  } else {
+    snprintf(context.request_id, sizeof(context.request_id), "%x-%llx", (unsigned)getpid(),
+             (unsigned long long)sequence);
+  }
+  u_map_put(response->map_header, "X-Request-Id", context.request_id);
+
+  context.active = 1;
+  context.sampled = sample_every > 0 && sequence % (uint64_t)sample_every == 0;
+  context.started_ns = context.sampled ? now_ns() : 0;
+  context.handled_ns = 0;
+}
+
+void trace_request_handled(void) {
+  if (context.sampled) {
+    context.handled_ns = now_ns();
+    record("handler", context.started_ns, context.handled_ns - context.started_ns);
+  }
+}
+
+void trace_request_completed(void) {
+  if (context.active && context.sampled && context.handled_ns) {
+    const uint64_t finished = now_ns();
+    record("send", context.handled_ns, finished - context.handled_ns);
+    record("request", context.started_ns, finished - context.started_ns);
+  }
+  context.active = 0;
+  context.sampled = 0;
+}
+
+uint64_t trace_begin(void) {
+  return context.sampled ? now_ns() : 0;
+}
+
+void trace_end(const char *name, uint64_t started_ns) {
+  if (started_ns != 0 && context.sampled) {
+    record(name, started_ns, now_ns() - started_ns);
+  }
+}
+
+void trace_elapsed(const char *name, uint64_t elapsed_ns) {
+  if (context.sampled) {
+    const uint64_t now = now_ns();
+    record(name, now - elapsed_ns, elapsed_ns);
+  }
+}
+
+int callback_trace_dump(const struct _u_request *request, struct _u_response *response, void *user_data) {
+  json_t *events = json_array();
+  const int pid = (int)getpid();
+  const uint64_t end = __atomic_load_n(&next_index, __ATOMIC_ACQUIRE);
+  const uint64_t start = end > capacity ? end - capacity : 0;
+
+  for (uint64_t index = start; index < end; index++) {
+    const trace_span *slot = &ring[index % capacity];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != index + 1) {
+      continue; // still being written, or already overwritten
+    }
+    trace_span span;
+    memcpy(&span, slot, sizeof(span));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != index + 1) {
+      continue;
+    }
+    span.request_id[TRACE_REQUEST_ID_SIZE - 1] = '\0';
+
+    // Complete ("X") events; timestamps are in microseconds
+    json_t *event = json_object();
+    json_object_set_new(event, "name", json_string(span.name));
+    json_object_set_new(event, "cat", json_string("request"));
+    json_object_set_new(event, "ph", json_string("X"));
+    json_object_set_new(event, "ts", json_real((double)span.start_ns / 1000.0));
+    json_object_set_new(event, "dur", json_real((double)span.duration_ns / 1000.0));
+    json_object_set_new(event, "pid", json_integer(pid));
+    json_object_set_new(event, "tid", json_integer(span.tid));
+    json_object_set_new(event, "args", json_pack("{ss}", "request_id", span.request_id));
+    json_array_append_new(events, event);
+  }
+
+  json_t *trace = json_object();
+  json_object_set_new(trace, "traceEvents", events);
+  json_object_set_new(trace, "displayTimeUnit", json_string("ms"));
+  ulfius_set_json_body_response(response, 200, trace);
+  json_decref(trace);
+  set_cors_headers(response);
+  return U_CALLBACK_CONTINUE;
+}
@@ -0,0 +1,45 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ulfius.h>
+
+// Per-request tracing. Every dispatched request gets an X-Request-Id (the
+// caller's, if it sent one). One request in HEALTH_TRACE_SAMPLE is sampled:
+// its phases (admission wait, body parse, prepare, step, serialize, CORS,
+// handler, send) are recorded as spans in a lock-free ring buffer, which
+// GET /admin/trace dumps in Chrome trace-event format (chrome://tracing,
+// Perfetto).
+
+// Allocates the ring (HEALTH_TRACE_BUFFER spans) and reads the sample rate
+int trace_init(void);
+void trace_close(void);
+
+// 1 if any request can be sampled (lets callers skip installing hooks)
+int trace_enabled(void);
+
+// Starts the request context on this thread and sets X-Request-Id
+void trace_request_begin(const struct _u_request *request, struct _u_response *response);
+
+// Marks the end of the handler; the time until trace_request_completed is "send"
+void trace_request_handled(void);
+
+// Called once libmicrohttpd has sent the response; closes the request span
+void trace_request_completed(void);
+
+// Span timing. trace_begin returns 0 when the current request is not
+// sampled, and trace_end then does nothing. name must be a string literal.
+uint64_t trace_begin(void);
+void trace_end(const char *name, uint64_t started_ns);
+
+// Records a span that ended now and lasted elapsed_ns (e.g. SQLite's profile time)
+void trace_elapsed(const char *name, uint64_t elapsed_ns);
+
+// Bytes held by the span buffer (memory.h)
+size_t trace_memory_bytes(void);
+
+// Handles GET /admin/trace: buffered spans as Chrome trace-event JSON
+int callback_trace_dump(const struct _u_request *request, struct _u_response *response, void *user_data);
+
+#endif // TRACE_H
@@ -0,0 +1,44 @@
+#include "txn_capture.h"
+
+#include <stdio.h>
+#include <string.h>
+
+int txn_capture_statement(txn_capture *capture, sqlite3_stmt *stmt, int record) {
+  if (capture->complete) {
+    byte_buffer_clear(&capture->sql);
+    capture->complete = 0;
+  }
+  if (record && !sqlite3_stmt_readonly(stmt)) {
+    char *sql = sqlite3_expanded_sql(stmt);
+    if (sql) {
+      byte_buffer_append(&capture->sql, sql, strlen(sql));
+      byte_buffer_append(&capture->sql, ";\n", 2);
+      sqlite3_free(sql);
+    } else {
+      fprintf(stderr, "Cannot capture statement: %s\n", sqlite3_sql(stmt));
+    }
+  }
+
+  // Back in autocommit mode: the transaction either committed or rolled back
+  if (!sqlite3_get_autocommit(sqlite3_db_handle(stmt))) {
+    return 0;
+  }
+  const int committed = capture->committed;
+  capture->committed = 0;
+  capture->complete = 1;
+  if (capture->sql.failed) {
+    fprintf(stderr, "Cannot capture transaction: out of memory\n");
+    return 0;
+  }
+  return committed && capture->sql.size > 0;
+}
+
+void txn_capture_commit(txn_capture *capture) {
+  capture->committed = 1;
+}
+
+void txn_capture_free(txn_capture *capture) {
+  byte_buffer_free(&capture->sql);
+  capture->committed = 0;
+  capture->complete = 0;
+}
@@ -0,0 +1,30 @@
+#ifndef TXN_CAPTURE_H
+#define TXN_CAPTURE_H
+
+#include "byte_buffer.h"
+
+#include <sqlite3.h>
+
+// Collects the write statements of one connection's transaction in progress
+// from the statement and commit hooks, so the in-memory store's journal and
+// the replication log can each keep committed transactions whole. Only
+// touched under that connection's mutex.
+
+typedef struct {
+  byte_buffer sql; // expanded statements, each followed by ";\n"
+  int committed;
+  int complete;
+} txn_capture;
+
+// Call after every statement on the connection; stmt is recorded if it
+// writes and record is set. Returns 1 when the connection is back in
+// autocommit mode after a commit that wrote something: capture->sql then
+// holds the whole transaction until the next call.
+int txn_capture_statement(txn_capture *capture, sqlite3_stmt *stmt, int record);
+
+// Call from the connection's commit hook
+void txn_capture_commit(txn_capture *capture);
+
+void txn_capture_free(txn_capture *capture);
+
+#endif // TXN_CAPTURE_H
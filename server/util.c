@@ -0,0 +1,22 @@
+#include "util.h"
+
+uint64_t hash_bytes(const void *data, size_t len) {
+  const unsigned char *bytes = (const unsigned char *)data;
+  uint64_t hash = 1469598103934665603ull;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ bytes[i]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+struct timespec deadline_after_ms(long ms) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += ms / 1000;
+  deadline.tv_nsec += (ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  return deadline;
+}
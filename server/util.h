@@ -0,0 +1,16 @@
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Small helpers shared across modules
+
+// 64-bit FNV-1a hash of len bytes
+uint64_t hash_bytes(const void *data, size_t len);
+
+// Absolute CLOCK_REALTIME time ms milliseconds from now, for pthread_cond_timedwait
+struct timespec deadline_after_ms(long ms);
+
+#endif // UTIL_H